@@ -0,0 +1,991 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#endif
+
+#include "afcfs.h"
+#include "transfer.h"
+#include "budget.h"
+
+#define MOUNT_POLL_MS 200
+#define MOUNT_POLL_TRIES 25
+
+/**
+ * Tray side: every mount runs as a child `iosindicator --mount` process so a
+ * stuck AFC call can never block the GTK main loop
+ */
+
+struct afcfs_session {
+    char udid[64];
+};
+
+struct mount {
+    char *udid;
+    GPid pid;
+};
+
+struct pending_open {
+    char *mountpoint;
+    int tries;
+};
+
+// Mount point -> struct mount, for every child still running
+static GHashTable *mounts = NULL;
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Session the tray actions apply to
+static afcfs_session_t *active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_mount(gpointer data) {
+    struct mount *mount = data;
+    g_free(mount->udid);
+    g_free(mount);
+}
+
+static bool is_mounted(const char *mountpoint) {
+    struct stat inner, outer;
+    char *parent = g_path_get_dirname(mountpoint);
+    bool mounted = stat(mountpoint, &inner) == 0 && stat(parent, &outer) == 0 && inner.st_dev != outer.st_dev;
+    g_free(parent);
+    return mounted;
+}
+
+// Opens the file manager once the child has the filesystem up
+static gboolean open_when_mounted(gpointer data) {
+    struct pending_open *pending = data;
+    if (is_mounted(pending->mountpoint)) {
+        GError *error = NULL;
+        char *uri = g_filename_to_uri(pending->mountpoint, NULL, NULL);
+        if (uri == NULL || !g_app_info_launch_default_for_uri(uri, NULL, &error)) {
+            fprintf(stderr, "[Mount] Failed to open %s: %s\n", pending->mountpoint, error ? error->message : "invalid path");
+            g_clear_error(&error);
+        }
+        g_free(uri);
+    } else {
+        pthread_mutex_lock(&mounts_lock);
+        bool running = mounts != NULL && g_hash_table_contains(mounts, pending->mountpoint);
+        pthread_mutex_unlock(&mounts_lock);
+        if (running && ++pending->tries < MOUNT_POLL_TRIES) {
+            return G_SOURCE_CONTINUE;
+        }
+        fprintf(stderr, "[Mount] %s did not come up\n", pending->mountpoint);
+    }
+
+    g_free(pending->mountpoint);
+    g_free(pending);
+    return G_SOURCE_REMOVE;
+}
+
+static void on_mount_exited(GPid pid, gint status, gpointer data) {
+    char *mountpoint = data;
+    printf("[Mount] %s unmounted (status %d)\n", mountpoint, status);
+    pthread_mutex_lock(&mounts_lock);
+    g_hash_table_remove(mounts, mountpoint);
+    pthread_mutex_unlock(&mounts_lock);
+    g_spawn_close_pid(pid);
+    g_free(mountpoint);
+}
+
+// Callback function for the mount menu items, data is a bundle id or NULL for the media root
+void on_menu_item_mount_clicked(GtkWidget *widget, gpointer data) {
+    const char *bundle_id = data;
+    char udid[64];
+
+    pthread_mutex_lock(&active_lock);
+    if (active == NULL) {
+        pthread_mutex_unlock(&active_lock);
+        return;
+    }
+    g_strlcpy(udid, active->udid, sizeof(udid));
+    pthread_mutex_unlock(&active_lock);
+
+    char *mountpoint = g_build_filename(g_get_user_runtime_dir(), "gnome-ios-appindicator", udid, bundle_id ? bundle_id : "Media", NULL);
+
+    pthread_mutex_lock(&mounts_lock);
+    if (mounts == NULL) {
+        mounts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_mount);
+    }
+    bool running = g_hash_table_contains(mounts, mountpoint);
+    if (!running) {
+        char *self = g_file_read_link("/proc/self/exe", NULL);
+        char *argv[] = {self, "--mount", udid, mountpoint, (char *)bundle_id, NULL};
+        GError *error = NULL;
+        GPid pid;
+
+        g_mkdir_with_parents(mountpoint, 0700);
+        if (self != NULL && g_spawn_async(NULL, argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &pid, &error)) {
+            struct mount *mount = g_new0(struct mount, 1);
+            mount->udid = g_strdup(udid);
+            mount->pid = pid;
+            g_hash_table_replace(mounts, g_strdup(mountpoint), mount);
+            g_child_watch_add(pid, on_mount_exited, g_strdup(mountpoint));
+            printf("[UDID=%s][Mount] Mounting %s at %s\n", udid, bundle_id ? bundle_id : "media", mountpoint);
+            running = true;
+        } else {
+            fprintf(stderr, "[UDID=%s][Mount] Failed to start mount: %s\n", udid, error ? error->message : "cannot locate executable");
+            g_clear_error(&error);
+        }
+        g_free(self);
+    }
+    pthread_mutex_unlock(&mounts_lock);
+
+    if (running) {
+        struct pending_open *pending = g_new0(struct pending_open, 1);
+        pending->mountpoint = mountpoint;
+        g_timeout_add(MOUNT_POLL_MS, open_when_mounted, pending);
+    } else {
+        g_free(mountpoint);
+    }
+}
+
+afcfs_session_t* afcfs_start(const char *udid) {
+    afcfs_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Mount] Failed to allocate memory for mount session\n", udid);
+        return NULL;
+    }
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+
+    pthread_mutex_lock(&active_lock);
+    active = session;
+    pthread_mutex_unlock(&active_lock);
+    return session;
+}
+
+void afcfs_stop(afcfs_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&active_lock);
+    if (active == session) {
+        active = NULL;
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    // FUSE unmounts cleanly on SIGTERM, the child watch then drops the entry
+    pthread_mutex_lock(&mounts_lock);
+    if (mounts != NULL) {
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, mounts);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            struct mount *mount = value;
+            if (strcmp(mount->udid, session->udid) == 0) {
+                kill(mount->pid, SIGTERM);
+            }
+        }
+    }
+    pthread_mutex_unlock(&mounts_lock);
+    free(session);
+}
+
+#ifdef HAVE_FUSE
+
+/**
+ * Filesystem side. Every AFC request is a USB round trip, so metadata is
+ * cached with a TTL, sequential reads fetch ahead and writes are batched
+ */
+
+#define AFCFS_CONNECTIONS 4              // AFC clients shared by all FUSE threads
+#define AFCFS_DEFAULT_TTL 5              // Seconds, IOSINDICATOR_FUSE_TTL
+#define AFCFS_DEFAULT_READAHEAD 1024     // KiB, IOSINDICATOR_FUSE_READAHEAD
+#define READAHEAD_START (128u << 10)     // First sequential fetch, doubled up to the window
+#define WRITEBACK_SIZE (4u << 20)        // Contiguous writes are sent in batches up to this
+#define AFC_IO_CHUNK (1u << 20)
+#define STAT_BATCH_PER_WORKER 32         // Listings smaller than this use fewer stat workers
+
+struct afcfs_conn {
+    afc_client_t afc;
+    house_arrest_client_t house_arrest;
+};
+
+// Cached result of afc_get_file_info, including misses
+struct attr_entry {
+    bool exists;
+    struct stat st;
+    gint64 expires;
+};
+
+struct dir_entry {
+    char **names;
+    gint64 expires;
+};
+
+// Per open file: read-ahead window and pending write batch
+struct afcfs_file {
+    char *path;
+    GMutex lock;
+    char *ahead;
+    uint64_t ahead_offset;
+    size_t ahead_length;
+    size_t window;
+    uint64_t next_offset; // Where a sequential reader continues
+    char *pending;
+    uint64_t pending_offset;
+    size_t pending_length;
+};
+
+// One readdir's worth of stats spread over the connection pool
+struct stat_batch {
+    const char *dir;
+    char **names;
+    gint count;
+    gint next;
+    gint workers;
+    GMutex lock;
+    GCond done;
+};
+
+static struct {
+    idevice_t device;
+    char *udid;
+    char *bundle_id;
+    GAsyncQueue *idle;
+    gint connections;
+    GThreadPool *stat_pool;
+    gint64 ttl_us;
+    size_t readahead;
+
+    GMutex cache_lock;
+    GHashTable *attrs;
+    GHashTable *dirs;
+} fs;
+
+static int afc_errno(afc_error_t error) {
+    switch (error) {
+        case AFC_E_SUCCESS: return 0;
+        case AFC_E_OBJECT_NOT_FOUND: return ENOENT;
+        case AFC_E_OBJECT_IS_DIR: return EISDIR;
+        case AFC_E_PERM_DENIED: return EACCES;
+        case AFC_E_OBJECT_EXISTS: return EEXIST;
+        case AFC_E_OBJECT_BUSY: return EBUSY;
+        case AFC_E_NO_SPACE_LEFT: return ENOSPC;
+        case AFC_E_DIR_NOT_EMPTY: return ENOTEMPTY;
+        case AFC_E_INVALID_ARG: return EINVAL;
+        case AFC_E_OP_NOT_SUPPORTED: return ENOTSUP;
+        case AFC_E_OP_TIMEOUT: return ETIMEDOUT;
+        case AFC_E_NO_MEM: return ENOMEM;
+        default: return EIO;
+    }
+}
+
+static struct afcfs_conn* borrow_conn(void) {
+    while (true) {
+        struct afcfs_conn *conn = g_async_queue_try_pop(fs.idle);
+        if (conn != NULL) {
+            return conn;
+        }
+
+        if (g_atomic_int_add(&fs.connections, 1) < AFCFS_CONNECTIONS) {
+            conn = g_new0(struct afcfs_conn, 1);
+            if (transfer_connect(fs.device, fs.bundle_id, &conn->afc, &conn->house_arrest)) {
+                return conn;
+            }
+            g_atomic_int_add(&fs.connections, -1);
+            g_free(conn);
+            fprintf(stderr, "[UDID=%s][Mount] Failed to open AFC connection\n", fs.udid);
+            return NULL;
+        }
+        g_atomic_int_add(&fs.connections, -1);
+
+        // Re-check now and then in case a broken connection was dropped meanwhile
+        conn = g_async_queue_timeout_pop(fs.idle, G_USEC_PER_SEC);
+        if (conn != NULL) {
+            return conn;
+        }
+    }
+}
+
+static void return_conn(struct afcfs_conn *conn, afc_error_t error) {
+    if (error == AFC_E_MUX_ERROR || error == AFC_E_SERVICE_NOT_CONNECTED) {
+        transfer_disconnect(conn->afc, conn->house_arrest);
+        g_free(conn);
+        g_atomic_int_add(&fs.connections, -1);
+        return;
+    }
+    g_async_queue_push(fs.idle, conn);
+}
+
+/**
+ * Metadata cache
+ */
+
+static void free_dir_entry(gpointer data) {
+    struct dir_entry *entry = data;
+    g_strfreev(entry->names);
+    g_free(entry);
+}
+
+static void fill_stat(char **info, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_blksize = 4096;
+    for (int i = 0; info[i] != NULL && info[i + 1] != NULL; i += 2) {
+        const char *key = info[i];
+        const char *value = info[i + 1];
+        if (strcmp(key, "st_size") == 0) {
+            st->st_size = g_ascii_strtoull(value, NULL, 10);
+        } else if (strcmp(key, "st_blocks") == 0) {
+            st->st_blocks = g_ascii_strtoull(value, NULL, 10);
+        } else if (strcmp(key, "st_nlink") == 0) {
+            st->st_nlink = g_ascii_strtoull(value, NULL, 10);
+        } else if (strcmp(key, "st_mtime") == 0) {
+            uint64_t ns = g_ascii_strtoull(value, NULL, 10);
+            st->st_mtim.tv_sec = ns / 1000000000ull;
+            st->st_mtim.tv_nsec = ns % 1000000000ull;
+            st->st_ctim = st->st_mtim;
+            st->st_atim = st->st_mtim;
+        } else if (strcmp(key, "st_ifmt") == 0) {
+            if (strcmp(value, "S_IFDIR") == 0) {
+                st->st_mode = S_IFDIR | 0755;
+            } else if (strcmp(value, "S_IFLNK") == 0) {
+                st->st_mode = S_IFLNK | 0777;
+            }
+        }
+    }
+}
+
+static void cache_attr(const char *path, bool exists, const struct stat *st) {
+    struct attr_entry *entry = g_new0(struct attr_entry, 1);
+    entry->exists = exists;
+    if (exists) {
+        entry->st = *st;
+    }
+    entry->expires = g_get_monotonic_time() + fs.ttl_us;
+    g_mutex_lock(&fs.cache_lock);
+    g_hash_table_replace(fs.attrs, g_strdup(path), entry);
+    g_mutex_unlock(&fs.cache_lock);
+}
+
+// Returns 1 on a hit with st filled, -ENOENT on a cached miss, 0 if unknown
+static int cached_attr(const char *path, struct stat *st) {
+    int result = 0;
+    g_mutex_lock(&fs.cache_lock);
+    struct attr_entry *entry = g_hash_table_lookup(fs.attrs, path);
+    if (entry != NULL && entry->expires > g_get_monotonic_time()) {
+        if (entry->exists) {
+            *st = entry->st;
+            result = 1;
+        } else {
+            result = -ENOENT;
+        }
+    }
+    g_mutex_unlock(&fs.cache_lock);
+    return result;
+}
+
+// Drops everything a local change to path can make stale
+static void invalidate(const char *path) {
+    char *parent = g_path_get_dirname(path);
+    g_mutex_lock(&fs.cache_lock);
+    g_hash_table_remove(fs.attrs, path);
+    g_hash_table_remove(fs.dirs, path);
+    g_hash_table_remove(fs.dirs, parent);
+    g_mutex_unlock(&fs.cache_lock);
+    g_free(parent);
+}
+
+static int fetch_attr(struct afcfs_conn *conn, const char *path, struct stat *st) {
+    char **info = NULL;
+    afc_error_t error = afc_get_file_info(conn->afc, path, &info);
+    if (error == AFC_E_SUCCESS && info != NULL) {
+        fill_stat(info, st);
+        afc_dictionary_free(info);
+        cache_attr(path, true, st);
+        return 0;
+    }
+    if (error == AFC_E_OBJECT_NOT_FOUND) {
+        cache_attr(path, false, NULL);
+    }
+    return -afc_errno(error == AFC_E_SUCCESS ? AFC_E_OBJECT_NOT_FOUND : error);
+}
+
+static void stat_worker(gpointer data, gpointer user_data) {
+    struct stat_batch *batch = data;
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn != NULL) {
+        gint index;
+        while ((index = g_atomic_int_add(&batch->next, 1)) < batch->count) {
+            struct stat st;
+            char *path = g_build_filename(batch->dir, batch->names[index], NULL);
+            if (cached_attr(path, &st) == 0) {
+                // Speculative, so charged to the budget unlike the stats the file manager asks for
+                budget_acquire(fs.udid);
+                gint64 started = g_get_monotonic_time();
+                fetch_attr(conn, path, &st);
+                budget_complete(fs.udid, 0, g_get_monotonic_time() - started);
+            }
+            g_free(path);
+        }
+        return_conn(conn, AFC_E_SUCCESS);
+    }
+
+    g_mutex_lock(&batch->lock);
+    if (--batch->workers == 0) {
+        g_cond_signal(&batch->done);
+    }
+    g_mutex_unlock(&batch->lock);
+}
+
+// Stats a whole listing over all connections instead of one call per getattr
+static void prefetch_attrs(const char *dir, char **names) {
+    struct stat_batch batch = {.dir = dir, .names = names, .count = g_strv_length(names)};
+    if (batch.count == 0) {
+        return;
+    }
+    batch.workers = MIN(AFCFS_CONNECTIONS, batch.count / STAT_BATCH_PER_WORKER + 1);
+    g_mutex_init(&batch.lock);
+    g_cond_init(&batch.done);
+
+    int workers = batch.workers;
+    for (int i = 0; i < workers; ++i) {
+        g_thread_pool_push(fs.stat_pool, &batch, NULL);
+    }
+    g_mutex_lock(&batch.lock);
+    while (batch.workers > 0) {
+        g_cond_wait(&batch.done, &batch.lock);
+    }
+    g_mutex_unlock(&batch.lock);
+    g_mutex_clear(&batch.lock);
+    g_cond_clear(&batch.done);
+}
+
+/**
+ * Data path
+ */
+
+static int fetch_range(const char *path, char *buffer, uint64_t offset, size_t length, size_t *fetched) {
+    *fetched = 0;
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+
+    uint64_t handle = 0;
+    afc_error_t error = afc_file_open(conn->afc, path, AFC_FOPEN_RDONLY, &handle);
+    if (error == AFC_E_SUCCESS) {
+        error = afc_file_seek(conn->afc, handle, offset, SEEK_SET);
+        while (error == AFC_E_SUCCESS && *fetched < length) {
+            uint32_t got = 0;
+            error = afc_file_read(conn->afc, handle, buffer + *fetched, MIN(length - *fetched, AFC_IO_CHUNK), &got);
+            if (got == 0) {
+                break;
+            }
+            *fetched += got;
+        }
+        afc_file_close(conn->afc, handle);
+    }
+    return_conn(conn, error);
+    return -afc_errno(error);
+}
+
+static int flush_pending(struct afcfs_file *file) {
+    if (file->pending_length == 0) {
+        return 0;
+    }
+
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+
+    uint64_t handle = 0;
+    size_t written = 0;
+    afc_error_t error = afc_file_open(conn->afc, file->path, AFC_FOPEN_RW, &handle);
+    if (error == AFC_E_SUCCESS) {
+        error = afc_file_seek(conn->afc, handle, file->pending_offset, SEEK_SET);
+        while (error == AFC_E_SUCCESS && written < file->pending_length) {
+            uint32_t sent = 0;
+            error = afc_file_write(conn->afc, handle, file->pending + written, MIN(file->pending_length - written, AFC_IO_CHUNK), &sent);
+            if (sent == 0 && error == AFC_E_SUCCESS) {
+                error = AFC_E_WRITE_ERROR;
+            }
+            written += sent;
+        }
+        afc_file_close(conn->afc, handle);
+    }
+    return_conn(conn, error);
+
+    file->pending_length = 0;
+    invalidate(file->path);
+    return -afc_errno(error);
+}
+
+static int op_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    int cached = cached_attr(path, st);
+    if (cached != 0) {
+        return cached < 0 ? cached : 0;
+    }
+
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    int result = fetch_attr(conn, path, st);
+    return_conn(conn, AFC_E_SUCCESS);
+    return result;
+}
+
+static int op_readlink(const char *path, char *buffer, size_t size) {
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+
+    char **info = NULL;
+    afc_error_t error = afc_get_file_info(conn->afc, path, &info);
+    return_conn(conn, error);
+    if (error != AFC_E_SUCCESS || info == NULL) {
+        return -afc_errno(error);
+    }
+
+    int result = -EINVAL;
+    for (int i = 0; info[i] != NULL && info[i + 1] != NULL; i += 2) {
+        if (strcmp(info[i], "LinkTarget") == 0) {
+            g_strlcpy(buffer, info[i + 1], size);
+            result = 0;
+        }
+    }
+    afc_dictionary_free(info);
+    return result;
+}
+
+static int op_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    char **names = NULL;
+
+    g_mutex_lock(&fs.cache_lock);
+    struct dir_entry *entry = g_hash_table_lookup(fs.dirs, path);
+    if (entry != NULL && entry->expires > g_get_monotonic_time()) {
+        names = g_strdupv(entry->names);
+    }
+    g_mutex_unlock(&fs.cache_lock);
+
+    if (names == NULL) {
+        struct afcfs_conn *conn = borrow_conn();
+        if (conn == NULL) {
+            return -EIO;
+        }
+        char **listing = NULL;
+        afc_error_t error = afc_read_directory(conn->afc, path, &listing);
+        return_conn(conn, error);
+        if (error != AFC_E_SUCCESS) {
+            return -afc_errno(error);
+        }
+
+        GPtrArray *kept = g_ptr_array_new();
+        for (int i = 0; listing != NULL && listing[i] != NULL; ++i) {
+            if (strcmp(listing[i], ".") != 0 && strcmp(listing[i], "..") != 0) {
+                g_ptr_array_add(kept, g_strdup(listing[i]));
+            }
+        }
+        g_ptr_array_add(kept, NULL);
+        names = (char **)g_ptr_array_free(kept, FALSE);
+        afc_dictionary_free(listing);
+
+        // Warm the attribute cache so the file manager's stat storm stays local
+        prefetch_attrs(path, names);
+
+        entry = g_new0(struct dir_entry, 1);
+        entry->names = g_strdupv(names);
+        entry->expires = g_get_monotonic_time() + fs.ttl_us;
+        g_mutex_lock(&fs.cache_lock);
+        g_hash_table_replace(fs.dirs, g_strdup(path), entry);
+        g_mutex_unlock(&fs.cache_lock);
+    }
+
+    filler(buffer, ".", NULL, 0, 0);
+    filler(buffer, "..", NULL, 0, 0);
+    for (int i = 0; names[i] != NULL; ++i) {
+        struct stat st;
+        char *child = g_build_filename(path, names[i], NULL);
+        bool known = cached_attr(child, &st) > 0;
+        g_free(child);
+        filler(buffer, names[i], known ? &st : NULL, 0, known ? FUSE_FILL_DIR_PLUS : 0);
+    }
+    g_strfreev(names);
+    return 0;
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi) {
+    struct afcfs_file *file = g_new0(struct afcfs_file, 1);
+    file->path = g_strdup(path);
+    file->window = MIN(READAHEAD_START, fs.readahead);
+    g_mutex_init(&file->lock);
+    fi->fh = (uint64_t)(uintptr_t)file;
+    return 0;
+}
+
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+
+    uint64_t handle = 0;
+    afc_error_t error = afc_file_open(conn->afc, path, AFC_FOPEN_WRONLY, &handle);
+    if (error == AFC_E_SUCCESS) {
+        afc_file_close(conn->afc, handle);
+    }
+    return_conn(conn, error);
+    invalidate(path);
+    return error == AFC_E_SUCCESS ? op_open(path, fi) : -afc_errno(error);
+}
+
+static int op_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct afcfs_file *file = (struct afcfs_file *)(uintptr_t)fi->fh;
+    int result;
+
+    g_mutex_lock(&file->lock);
+    if (file->pending_length > 0 && (result = flush_pending(file)) < 0) {
+        g_mutex_unlock(&file->lock);
+        return result;
+    }
+
+    uint64_t end = (uint64_t)offset + size;
+    if (file->ahead_length > 0 && (uint64_t)offset >= file->ahead_offset && end <= file->ahead_offset + file->ahead_length) {
+        memcpy(buffer, file->ahead + (offset - file->ahead_offset), size);
+        file->next_offset = end;
+        g_mutex_unlock(&file->lock);
+        return size;
+    }
+
+    // Only a reader that continues where it stopped gets a growing window
+    bool sequential = (uint64_t)offset == file->next_offset;
+    if (sequential) {
+        file->window = MIN(file->window * 2, fs.readahead);
+    } else {
+        file->window = MIN(READAHEAD_START, fs.readahead);
+    }
+
+    size_t fetched = 0;
+    if (sequential && file->window > size) {
+        file->ahead = g_realloc(file->ahead, file->window);
+        // The part past what was asked for is speculative, the whole window pays for it
+        budget_acquire(fs.udid);
+        result = fetch_range(path, file->ahead, offset, file->window, &fetched);
+        budget_complete(fs.udid, fetched, 0);
+        file->ahead_offset = offset;
+        file->ahead_length = result == 0 ? fetched : 0;
+        fetched = MIN(fetched, size);
+        memcpy(buffer, file->ahead, fetched);
+    } else {
+        result = fetch_range(path, buffer, offset, size, &fetched);
+    }
+    file->next_offset = offset + fetched;
+    g_mutex_unlock(&file->lock);
+    return result < 0 ? result : (int)fetched;
+}
+
+static int op_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct afcfs_file *file = (struct afcfs_file *)(uintptr_t)fi->fh;
+    int result = 0;
+
+    g_mutex_lock(&file->lock);
+    file->ahead_length = 0;
+    bool contiguous = file->pending_length > 0 && (uint64_t)offset == file->pending_offset + file->pending_length;
+    if (file->pending_length > 0 && (!contiguous || file->pending_length + size > WRITEBACK_SIZE)) {
+        result = flush_pending(file);
+    }
+    if (result == 0) {
+        if (file->pending == NULL) {
+            file->pending = g_malloc(WRITEBACK_SIZE);
+        }
+        if (size >= WRITEBACK_SIZE) {
+            // Too large to batch, send it through as its own flush
+            char *batch = file->pending;
+            file->pending = (char *)buffer;
+            file->pending_offset = offset;
+            file->pending_length = size;
+            result = flush_pending(file);
+            file->pending = batch;
+        } else {
+            if (file->pending_length == 0) {
+                file->pending_offset = offset;
+            }
+            memcpy(file->pending + file->pending_length, buffer, size);
+            file->pending_length += size;
+        }
+    }
+
+    // Keep a cached size in step with data that has not reached the device yet
+    g_mutex_lock(&fs.cache_lock);
+    struct attr_entry *entry = g_hash_table_lookup(fs.attrs, path);
+    if (entry != NULL && entry->exists && entry->st.st_size < offset + (off_t)size) {
+        entry->st.st_size = offset + size;
+    }
+    g_mutex_unlock(&fs.cache_lock);
+    g_mutex_unlock(&file->lock);
+    return result < 0 ? result : (int)size;
+}
+
+static int op_flush(const char *path, struct fuse_file_info *fi) {
+    struct afcfs_file *file = (struct afcfs_file *)(uintptr_t)fi->fh;
+    g_mutex_lock(&file->lock);
+    int result = flush_pending(file);
+    g_mutex_unlock(&file->lock);
+    return result;
+}
+
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    return op_flush(path, fi);
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi) {
+    struct afcfs_file *file = (struct afcfs_file *)(uintptr_t)fi->fh;
+    int result = op_flush(path, fi);
+    g_mutex_clear(&file->lock);
+    g_free(file->ahead);
+    g_free(file->pending);
+    g_free(file->path);
+    g_free(file);
+    return result;
+}
+
+// Runs a single-path AFC call and drops the cache around it
+static int simple_call(const char *path, afc_error_t (*call)(afc_client_t, const char *)) {
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    afc_error_t error = call(conn->afc, path);
+    return_conn(conn, error);
+    invalidate(path);
+    return -afc_errno(error);
+}
+
+static int op_mkdir(const char *path, mode_t mode) {
+    return simple_call(path, afc_make_directory);
+}
+
+static int op_unlink(const char *path) {
+    return simple_call(path, afc_remove_path);
+}
+
+static int op_rmdir(const char *path) {
+    return simple_call(path, afc_remove_path);
+}
+
+static int op_symlink(const char *target, const char *linkname) {
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    afc_error_t error = afc_make_link(conn->afc, AFC_SYMLINK, target, linkname);
+    return_conn(conn, error);
+    invalidate(linkname);
+    return -afc_errno(error);
+}
+
+static int op_rename(const char *from, const char *to, unsigned int flags) {
+    if (flags != 0) {
+        return -EINVAL;
+    }
+
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    afc_error_t error = afc_rename_path(conn->afc, from, to);
+    return_conn(conn, error);
+
+    // Cached children of a renamed directory would now be wrong, start over
+    g_mutex_lock(&fs.cache_lock);
+    g_hash_table_remove_all(fs.attrs);
+    g_hash_table_remove_all(fs.dirs);
+    g_mutex_unlock(&fs.cache_lock);
+    return -afc_errno(error);
+}
+
+static int op_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    if (fi != NULL) {
+        struct afcfs_file *file = (struct afcfs_file *)(uintptr_t)fi->fh;
+        g_mutex_lock(&file->lock);
+        flush_pending(file);
+        file->ahead_length = 0;
+        g_mutex_unlock(&file->lock);
+    }
+
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    afc_error_t error = afc_truncate(conn->afc, path, size);
+    return_conn(conn, error);
+    invalidate(path);
+    return -afc_errno(error);
+}
+
+static int op_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const struct timespec *mtime = (tv == NULL || tv[1].tv_nsec == UTIME_NOW) ? &now : &tv[1];
+    if (tv != NULL && tv[1].tv_nsec == UTIME_OMIT) {
+        return 0;
+    }
+
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+    afc_error_t error = afc_set_file_time(conn->afc, path, (uint64_t)mtime->tv_sec * 1000000000ull + mtime->tv_nsec);
+    return_conn(conn, error);
+    invalidate(path);
+    return -afc_errno(error);
+}
+
+// AFC has no ownership or permissions, accept them so copies do not fail
+static int op_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    return 0;
+}
+
+static int op_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    return 0;
+}
+
+static int op_statfs(const char *path, struct statvfs *st) {
+    struct afcfs_conn *conn = borrow_conn();
+    if (conn == NULL) {
+        return -EIO;
+    }
+
+    char **info = NULL;
+    afc_error_t error = afc_get_device_info(conn->afc, &info);
+    return_conn(conn, error);
+    if (error != AFC_E_SUCCESS || info == NULL) {
+        return -afc_errno(error);
+    }
+
+    uint64_t total = 0, free_bytes = 0, block = 4096;
+    for (int i = 0; info[i] != NULL && info[i + 1] != NULL; i += 2) {
+        if (strcmp(info[i], "FSTotalBytes") == 0) {
+            total = g_ascii_strtoull(info[i + 1], NULL, 10);
+        } else if (strcmp(info[i], "FSFreeBytes") == 0) {
+            free_bytes = g_ascii_strtoull(info[i + 1], NULL, 10);
+        } else if (strcmp(info[i], "FSBlockSize") == 0) {
+            block = MAX(g_ascii_strtoull(info[i + 1], NULL, 10), 1);
+        }
+    }
+    afc_dictionary_free(info);
+
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = block;
+    st->f_frsize = block;
+    st->f_blocks = total / block;
+    st->f_bfree = free_bytes / block;
+    st->f_bavail = free_bytes / block;
+    st->f_namemax = 255;
+    return 0;
+}
+
+static void* op_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    // Let the kernel reuse our TTL so cached entries are not even asked for
+    double ttl = fs.ttl_us / (double)G_USEC_PER_SEC;
+    cfg->attr_timeout = ttl;
+    cfg->entry_timeout = ttl;
+    cfg->negative_timeout = ttl;
+    return NULL;
+}
+
+static const struct fuse_operations afcfs_operations = {
+    .init = op_init,
+    .getattr = op_getattr,
+    .readlink = op_readlink,
+    .readdir = op_readdir,
+    .mkdir = op_mkdir,
+    .unlink = op_unlink,
+    .rmdir = op_rmdir,
+    .symlink = op_symlink,
+    .rename = op_rename,
+    .chmod = op_chmod,
+    .chown = op_chown,
+    .truncate = op_truncate,
+    .utimens = op_utimens,
+    .open = op_open,
+    .create = op_create,
+    .read = op_read,
+    .write = op_write,
+    .flush = op_flush,
+    .fsync = op_fsync,
+    .release = op_release,
+    .statfs = op_statfs,
+};
+
+static long env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+    long parsed = value ? strtol(value, NULL, 10) : 0;
+    return parsed > 0 ? parsed : fallback;
+}
+
+// Entry point of `iosindicator --mount <udid> <mountpoint> [bundle-id]`
+int afcfs_main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s --mount <udid> <mountpoint> [bundle-id]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    fs.udid = argv[2];
+    fs.bundle_id = argc > 4 ? argv[4] : NULL;
+    fs.ttl_us = env_long("IOSINDICATOR_FUSE_TTL", AFCFS_DEFAULT_TTL) * G_USEC_PER_SEC;
+    fs.readahead = (size_t)env_long("IOSINDICATOR_FUSE_READAHEAD", AFCFS_DEFAULT_READAHEAD) << 10;
+    if (idevice_new(&fs.device, fs.udid) != IDEVICE_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Mount] Device not found\n", fs.udid);
+        return EXIT_FAILURE;
+    }
+
+    // Fail before mounting when the root or the container cannot be opened
+    fs.idle = g_async_queue_new();
+    struct afcfs_conn *first = borrow_conn();
+    if (first == NULL) {
+        g_async_queue_unref(fs.idle);
+        idevice_free(fs.device);
+        return EXIT_FAILURE;
+    }
+    g_async_queue_push(fs.idle, first);
+    fs.stat_pool = g_thread_pool_new(stat_worker, NULL, AFCFS_CONNECTIONS, FALSE, NULL);
+    g_mutex_init(&fs.cache_lock);
+    fs.attrs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    fs.dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_dir_entry);
+
+    char *fsname = g_strdup_printf("fsname=iosindicator:%s", fs.udid);
+    char *fuse_argv[] = {argv[0], "-f", "-o", fsname, "-o", "subtype=afc", argv[3], NULL};
+    printf("[UDID=%s][Mount] Serving %s on %s\n", fs.udid, fs.bundle_id ? fs.bundle_id : "media", argv[3]);
+    int result = fuse_main(7, fuse_argv, &afcfs_operations, NULL);
+
+    g_thread_pool_free(fs.stat_pool, FALSE, TRUE);
+    struct afcfs_conn *conn;
+    while ((conn = g_async_queue_try_pop(fs.idle)) != NULL) {
+        transfer_disconnect(conn->afc, conn->house_arrest);
+        g_free(conn);
+    }
+    g_async_queue_unref(fs.idle);
+    g_hash_table_destroy(fs.attrs);
+    g_hash_table_destroy(fs.dirs);
+    g_mutex_clear(&fs.cache_lock);
+    g_free(fsname);
+    idevice_free(fs.device);
+    return result;
+}
+
+#else
+
+int afcfs_main(int argc, char *argv[]) {
+    fprintf(stderr, "%s was built without FUSE support\n", argv[0]);
+    return EXIT_FAILURE;
+}
+
+#endif // HAVE_FUSE
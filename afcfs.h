@@ -0,0 +1,15 @@
+#ifndef AFCFS_H
+#define AFCFS_H
+
+#include <gtk/gtk.h>
+
+// Opaque per-device handle for the mounts started from the tray
+typedef struct afcfs_session afcfs_session_t;
+
+// Function prototypes
+int afcfs_main(int argc, char *argv[]);
+afcfs_session_t* afcfs_start(const char *udid);
+void afcfs_stop(afcfs_session_t *session);
+void on_menu_item_mount_clicked(GtkWidget *widget, gpointer data);
+
+#endif // AFCFS_H
@@ -0,0 +1,561 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "apps.h"
+#include "icons.h"
+#include "afcfs.h"
+#include "budget.h"
+#include "tray.h" // To access the global indicator variable
+
+#define BROWSE_TIMEOUT_SECONDS 120
+
+// Messages for the inventory worker
+#define APPS_MSG_CHANGED GINT_TO_POINTER(1)
+#define APPS_MSG_STOP GINT_TO_POINTER(2)
+
+// One installed app, with only the attributes we display
+struct app_entry {
+    char *bundle_id;
+    char *name;
+    char *version;
+    char *build; // CFBundleVersion, used to notice upgrades
+    uint64_t disk_usage;
+};
+
+// State of one streaming browse
+struct browse_state {
+    GHashTable *apps;
+    GMutex mutex;
+    GCond cond;
+    bool done;
+    unsigned int pages;
+};
+
+struct apps_session {
+    char udid[64];
+    idevice_t device;
+    instproxy_client_t client;      // Worker thread only
+    struct browse_state *abandoned; // Timed out browse, still owned by the client's status thread
+    GThread *worker;
+    GAsyncQueue *queue;
+};
+
+// Inventory cache: UDID -> (bundle id -> struct app_entry), survives reconnects
+static GHashTable *inventory = NULL;
+static pthread_mutex_t inventory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Main loop only: bundle id -> menu items of the current Apps submenu, and the connected devices it lists
+static GHashTable *menu_items = NULL;
+static GHashTable *shown_udids = NULL;
+
+static void free_app_entry(gpointer data) {
+    struct app_entry *app = data;
+    free(app->bundle_id);
+    free(app->name);
+    free(app->version);
+    free(app->build);
+    free(app);
+}
+
+static char* dup_string_item(plist_t dict, const char *key) {
+    char *value = NULL;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node != NULL && plist_get_node_type(node) == PLIST_STRING) {
+        plist_get_string_val(node, &value);
+    }
+    return value;
+}
+
+static uint64_t uint_item(plist_t dict, const char *key) {
+    uint64_t value = 0;
+    plist_t node = plist_dict_get_item(dict, key);
+    if (node != NULL && plist_get_node_type(node) == PLIST_UINT) {
+        plist_get_uint_val(node, &value);
+    }
+    return value;
+}
+
+static struct app_entry* parse_app_entry(plist_t dict) {
+    char *bundle_id = dup_string_item(dict, "CFBundleIdentifier");
+    if (bundle_id == NULL) {
+        return NULL;
+    }
+
+    struct app_entry *app = calloc(1, sizeof(*app));
+    if (app == NULL) {
+        free(bundle_id);
+        return NULL;
+    }
+    app->bundle_id = bundle_id;
+    app->name = dup_string_item(dict, "CFBundleDisplayName");
+    if (app->name == NULL) {
+        app->name = dup_string_item(dict, "CFBundleName");
+    }
+    app->version = dup_string_item(dict, "CFBundleShortVersionString");
+    app->build = dup_string_item(dict, "CFBundleVersion");
+    app->disk_usage = uint_item(dict, "StaticDiskUsage") + uint_item(dict, "DynamicDiskUsage");
+    return app;
+}
+
+// Projection for the rows we display
+static plist_t display_options(void) {
+    plist_t options = instproxy_client_options_new();
+    instproxy_client_options_add(options, "ApplicationType", "User", NULL);
+    instproxy_client_options_set_return_attributes(options,
+        "CFBundleIdentifier", "CFBundleDisplayName", "CFBundleName",
+        "CFBundleShortVersionString", "CFBundleVersion",
+        "StaticDiskUsage", "DynamicDiskUsage", NULL);
+    return options;
+}
+
+// Projection used to diff against the cache: identity and build only
+static plist_t identity_options(void) {
+    plist_t options = instproxy_client_options_new();
+    instproxy_client_options_add(options, "ApplicationType", "User", NULL);
+    instproxy_client_options_set_return_attributes(options, "CFBundleIdentifier", "CFBundleVersion", NULL);
+    return options;
+}
+
+// Called once per page of the browse response
+static void on_browse_page(plist_t command, plist_t status, void *user_data) {
+    struct browse_state *state = user_data;
+    plist_t list = NULL;
+    uint64_t total = 0, current_index = 0, current_amount = 0;
+
+    instproxy_status_get_current_list(status, &total, &current_index, &current_amount, &list);
+    if (list != NULL) {
+        g_mutex_lock(&state->mutex);
+        for (uint32_t i = 0; i < plist_array_get_size(list); ++i) {
+            struct app_entry *app = parse_app_entry(plist_array_get_item(list, i));
+            if (app != NULL) {
+                g_hash_table_replace(state->apps, app->bundle_id, app);
+            }
+        }
+        state->pages++;
+        g_mutex_unlock(&state->mutex);
+        plist_free(list);
+    }
+
+    char *name = NULL;
+    char *error = NULL;
+    instproxy_status_get_name(status, &name);
+    instproxy_status_get_error(status, &error, NULL, NULL);
+    if (error != NULL || (name != NULL && strcmp(name, "Complete") == 0)) {
+        g_mutex_lock(&state->mutex);
+        state->done = true;
+        g_cond_signal(&state->cond);
+        g_mutex_unlock(&state->mutex);
+    }
+    free(name);
+    free(error);
+}
+
+static void free_browse_state(struct browse_state *state) {
+    g_hash_table_destroy(state->apps);
+    g_mutex_clear(&state->mutex);
+    g_cond_clear(&state->cond);
+    free(state);
+}
+
+// Streams a browse into a fresh bundle id -> entry table
+static GHashTable* browse(apps_session_t *session, plist_t options) {
+    const char *udid = session->udid;
+    struct browse_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        return NULL;
+    }
+    state->apps = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_app_entry);
+    g_mutex_init(&state->mutex);
+    g_cond_init(&state->cond);
+
+    // Background work, charged to the device's budget; the reply size varies too much for a latency sample
+    budget_acquire(udid);
+    bool ok = instproxy_browse_with_callback(session->client, options, on_browse_page, state) == INSTPROXY_E_SUCCESS;
+    bool timed_out = false;
+    if (ok) {
+        gint64 deadline = g_get_monotonic_time() + BROWSE_TIMEOUT_SECONDS * G_USEC_PER_SEC;
+        g_mutex_lock(&state->mutex);
+        while (!state->done) {
+            if (!g_cond_wait_until(&state->cond, &state->mutex, deadline)) {
+                timed_out = true;
+                break;
+            }
+        }
+        g_mutex_unlock(&state->mutex);
+    }
+    budget_complete(udid, 0, 0);
+
+    if (timed_out) {
+        // The status thread may still deliver pages, the state goes once reset_client has joined it
+        fprintf(stderr, "[UDID=%s][Apps] Browse timed out\n", udid);
+        session->abandoned = state;
+        return NULL;
+    }
+
+    GHashTable *apps = state->apps;
+    unsigned int pages = state->pages;
+    g_mutex_clear(&state->mutex);
+    g_cond_clear(&state->cond);
+    free(state);
+
+    if (!ok) {
+        fprintf(stderr, "[UDID=%s][Apps] Browse failed\n", udid);
+        g_hash_table_destroy(apps);
+        return NULL;
+    }
+    printf("[UDID=%s][Apps] Browsed %u apps in %u pages\n", udid, g_hash_table_size(apps), pages);
+    return apps;
+}
+
+// Drops the client after a timed out browse, freeing it joins the status thread still holding the state
+static void reset_client(apps_session_t *session) {
+    if (session->abandoned == NULL) {
+        return;
+    }
+    instproxy_client_free(session->client);
+    session->client = NULL;
+    free_browse_state(session->abandoned);
+    session->abandoned = NULL;
+    if (instproxy_client_start_service(session->device, &session->client, NULL) != INSTPROXY_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Apps] Failed to restart installation proxy\n", session->udid);
+    }
+}
+
+static void full_refresh(apps_session_t *session) {
+    const char *udid = session->udid;
+    plist_t options = display_options();
+    GHashTable *apps = browse(session, options);
+    instproxy_client_options_free(options);
+    if (apps == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&inventory_lock);
+    g_hash_table_replace(inventory, g_strdup(udid), apps);
+    pthread_mutex_unlock(&inventory_lock);
+}
+
+/**
+ * Brings the cached inventory up to date: a cheap identity browse tells us
+ * what was removed, added or upgraded, and only those entries are looked up.
+ */
+static void incremental_refresh(apps_session_t *session) {
+    const char *udid = session->udid;
+    plist_t options = identity_options();
+    GHashTable *current = browse(session, options);
+    instproxy_client_options_free(options);
+    if (current == NULL) {
+        return;
+    }
+
+    GPtrArray *stale = g_ptr_array_new_with_free_func(g_free);
+    unsigned int removed = 0;
+
+    pthread_mutex_lock(&inventory_lock);
+    GHashTable *apps = g_hash_table_lookup(inventory, udid);
+    if (apps == NULL) {
+        // Nothing to diff against yet
+        pthread_mutex_unlock(&inventory_lock);
+        g_hash_table_destroy(current);
+        g_ptr_array_free(stale, TRUE);
+        full_refresh(session);
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, apps);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!g_hash_table_contains(current, key)) {
+            g_hash_table_iter_remove(&iter);
+            removed++;
+        }
+    }
+
+    g_hash_table_iter_init(&iter, current);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct app_entry *seen = value;
+        struct app_entry *cached = g_hash_table_lookup(apps, key);
+        if (cached == NULL || g_strcmp0(cached->build, seen->build) != 0) {
+            g_ptr_array_add(stale, g_strdup(key));
+        }
+    }
+    pthread_mutex_unlock(&inventory_lock);
+    g_hash_table_destroy(current);
+
+    if (stale->len > 0) {
+        g_ptr_array_add(stale, NULL);
+        plist_t lookup = NULL;
+        options = display_options();
+        budget_acquire(udid);
+        instproxy_error_t looked_up = instproxy_lookup(session->client, (const char **)stale->pdata, options, &lookup);
+        budget_complete(udid, 0, 0);
+        if (looked_up == INSTPROXY_E_SUCCESS && lookup != NULL) {
+            plist_dict_iter it = NULL;
+            plist_dict_new_iter(lookup, &it);
+            pthread_mutex_lock(&inventory_lock);
+            apps = g_hash_table_lookup(inventory, udid);
+            while (it != NULL) {
+                char *id = NULL;
+                plist_t node = NULL;
+                plist_dict_next_item(lookup, it, &id, &node);
+                if (node == NULL) {
+                    break;
+                }
+                struct app_entry *app = parse_app_entry(node);
+                if (app != NULL) {
+                    g_hash_table_replace(apps, app->bundle_id, app);
+                }
+                free(id);
+            }
+            pthread_mutex_unlock(&inventory_lock);
+            free(it);
+            plist_free(lookup);
+        } else {
+            fprintf(stderr, "[UDID=%s][Apps] Lookup of %u changed apps failed\n", udid, stale->len - 1);
+        }
+        instproxy_client_options_free(options);
+    }
+
+    printf("[UDID=%s][Apps] Incremental refresh: %u changed, %u removed\n", udid, stale->len > 0 ? stale->len - 1 : 0, removed);
+    g_ptr_array_free(stale, TRUE);
+}
+
+static gint compare_app_names(gconstpointer a, gconstpointer b) {
+    const struct app_entry *x = a;
+    const struct app_entry *y = b;
+    return g_ascii_strcasecmp(x->name ? x->name : x->bundle_id, y->name ? y->name : y->bundle_id);
+}
+
+static void set_item_icon(GtkWidget *item, GdkPixbuf *pixbuf) {
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), gtk_image_new_from_pixbuf(pixbuf));
+    gtk_image_menu_item_set_always_show_image(GTK_IMAGE_MENU_ITEM(item), TRUE);
+    G_GNUC_END_IGNORE_DEPRECATIONS
+}
+
+// Icons that were not cached in memory arrive here once decoded, for every device listing the app
+static void on_icon_ready(const char *bundle_id, GdkPixbuf *pixbuf) {
+    GSList *items = menu_items ? g_hash_table_lookup(menu_items, bundle_id) : NULL;
+    for (GSList *iter = items; iter != NULL; iter = iter->next) {
+        set_item_icon(iter->data, pixbuf);
+    }
+}
+
+// Items of one device's apps, called with the inventory lock held
+static void append_device_apps(GtkWidget *submenu, const char *udid) {
+    GHashTable *apps = g_hash_table_lookup(inventory, udid);
+    GList *sorted = apps ? g_list_sort(g_hash_table_get_values(apps), compare_app_names) : NULL;
+    for (GList *iter = sorted; iter != NULL; iter = g_list_next(iter)) {
+        struct app_entry *app = iter->data;
+        char *label = g_strdup_printf("%s %s (%.1f MB)", app->name ? app->name : app->bundle_id, app->version ? app->version : "", app->disk_usage / 1000000.0);
+        G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+        GtkWidget *item = gtk_image_menu_item_new_with_label(label);
+        G_GNUC_END_IGNORE_DEPRECATIONS
+#ifdef HAVE_FUSE
+        // Clicking an app mounts its container
+        g_signal_connect_data(item, "activate", G_CALLBACK(on_menu_item_mount_clicked), g_strdup(app->bundle_id), (GClosureNotify)g_free, 0);
+#else
+        gtk_widget_set_sensitive(item, FALSE);
+#endif
+        gtk_menu_shell_append(GTK_MENU_SHELL(submenu), item);
+        gtk_widget_show(item);
+        GSList *items = g_hash_table_lookup(menu_items, app->bundle_id);
+        g_hash_table_steal(menu_items, app->bundle_id);
+        g_hash_table_insert(menu_items, g_strdup(app->bundle_id), g_slist_prepend(items, item));
+        g_free(label);
+
+        // Never blocks: either a ready pixbuf or a background load
+        GdkPixbuf *icon = icons_lookup(udid, app->bundle_id, app->build ? app->build : app->version);
+        if (icon != NULL) {
+            set_item_icon(item, icon);
+        }
+    }
+    g_list_free(sorted);
+}
+
+// Builds the Apps submenu items, only while the submenu is shown; one nested submenu per device once several are connected
+void apps_fill_menu(GtkWidget *submenu) {
+    if (menu_items == NULL) {
+        menu_items = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_slist_free);
+        icons_set_ready_callback(on_icon_ready);
+    }
+    if (shown_udids == NULL) {
+        return;
+    }
+
+    GList *udids = g_list_sort(g_hash_table_get_keys(shown_udids), (GCompareFunc)g_strcmp0);
+    bool nested = udids != NULL && udids->next != NULL;
+    pthread_mutex_lock(&inventory_lock);
+    for (GList *iter = udids; iter != NULL; iter = g_list_next(iter)) {
+        const char *udid = iter->data;
+        GtkWidget *menu = submenu;
+        if (nested) {
+            char *label = g_strdup_printf("📱 %.8s", udid);
+            GtkWidget *item = gtk_menu_item_new_with_label(label);
+            menu = gtk_menu_new();
+            gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), menu);
+            gtk_menu_shell_append(GTK_MENU_SHELL(submenu), item);
+            gtk_widget_show(item);
+            g_free(label);
+        }
+        append_device_apps(menu, udid);
+    }
+    pthread_mutex_unlock(&inventory_lock);
+    g_list_free(udids);
+}
+
+// The submenu is being emptied, its items are about to go away
+void apps_clear_menu(void) {
+    if (menu_items != NULL) {
+        g_hash_table_remove_all(menu_items);
+    }
+}
+
+// Relabels the Apps item after the connected devices or their inventories changed
+static void update_apps_item(void) {
+    unsigned int devices = g_hash_table_size(shown_udids);
+    if (devices == 0) {
+        gtk_widget_hide(tray->widgets->apps);
+        tray_invalidate_submenu(tray->widgets->apps);
+        return;
+    }
+
+    unsigned int count = 0;
+    GHashTableIter iter;
+    gpointer udid;
+    pthread_mutex_lock(&inventory_lock);
+    g_hash_table_iter_init(&iter, shown_udids);
+    while (g_hash_table_iter_next(&iter, &udid, NULL)) {
+        GHashTable *apps = g_hash_table_lookup(inventory, udid);
+        count += apps ? g_hash_table_size(apps) : 0;
+    }
+    pthread_mutex_unlock(&inventory_lock);
+
+    char *label = devices > 1 ? g_strdup_printf(" Apps: %u on %u devices", count, devices) : g_strdup_printf(" Apps: %u", count);
+    update_menu_item_label(GTK_MENU_ITEM(tray->widgets->apps), label);
+    gtk_widget_show(tray->widgets->apps);
+    g_free(label);
+    tray_invalidate_submenu(tray->widgets->apps);
+}
+
+// Records an inventory change on the GTK main loop; the submenu itself is only rebuilt if open
+static gboolean publish_inventory(gpointer data) {
+    char *udid = data;
+    if (tray == NULL || tray->widgets == NULL || tray->widgets->apps == NULL) {
+        g_free(udid);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (shown_udids == NULL) {
+        shown_udids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    g_hash_table_add(shown_udids, udid);
+    update_apps_item();
+    return G_SOURCE_REMOVE;
+}
+
+// The device went away, its cached inventory stays but leaves the submenu
+static gboolean withdraw_inventory(gpointer data) {
+    char *udid = data;
+    if (shown_udids != NULL && g_hash_table_remove(shown_udids, udid) && tray != NULL && tray->widgets != NULL && tray->widgets->apps != NULL) {
+        update_apps_item();
+    }
+    g_free(udid);
+    return G_SOURCE_REMOVE;
+}
+
+// Called from the notification proxy thread
+static void on_app_notification(const char *notification, void *user_data) {
+    apps_session_t *session = user_data;
+    g_async_queue_push(session->queue, APPS_MSG_CHANGED);
+}
+
+static gpointer apps_worker(gpointer data) {
+    apps_session_t *session = data;
+    np_client_t np = NULL;
+
+    if (instproxy_client_start_service(session->device, &session->client, NULL) != INSTPROXY_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Apps] Failed to start installation proxy\n", session->udid);
+        return NULL;
+    }
+
+    // Icons for the submenu are fetched over this device's springboard services
+    icons_session_t *icons = icons_start(session->device, session->udid);
+
+    pthread_mutex_lock(&inventory_lock);
+    bool cached = g_hash_table_contains(inventory, session->udid);
+    pthread_mutex_unlock(&inventory_lock);
+
+    if (cached) {
+        incremental_refresh(session);
+    } else {
+        full_refresh(session);
+    }
+    reset_client(session);
+    g_idle_add(publish_inventory, g_strdup(session->udid));
+
+    // Install and uninstall notifications keep the cache current
+    const char *notifications[] = {NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL};
+    if (np_client_start_service(session->device, &np, NULL) == NP_E_SUCCESS) {
+        np_set_notify_callback(np, on_app_notification, session);
+        np_observe_notifications(np, notifications);
+    } else {
+        fprintf(stderr, "[UDID=%s][Apps] Failed to start notification proxy\n", session->udid);
+    }
+
+    while (true) {
+        gpointer msg = g_async_queue_pop(session->queue);
+        // Coalesce bursts, an install usually posts several notifications
+        gpointer next;
+        while (msg != APPS_MSG_STOP && (next = g_async_queue_try_pop(session->queue)) != NULL) {
+            msg = next;
+        }
+        if (msg == APPS_MSG_STOP) {
+            break;
+        }
+        incremental_refresh(session);
+        reset_client(session);
+        g_idle_add(publish_inventory, g_strdup(session->udid));
+    }
+
+    if (np != NULL) np_client_free(np);
+    icons_stop(icons);
+    instproxy_client_free(session->client);
+    return NULL;
+}
+
+apps_session_t* apps_start(idevice_t device, const char *udid) {
+    pthread_mutex_lock(&inventory_lock);
+    if (inventory == NULL) {
+        inventory = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+    }
+    pthread_mutex_unlock(&inventory_lock);
+
+    apps_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Apps] Failed to allocate memory for apps session\n", udid);
+        return NULL;
+    }
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    session->queue = g_async_queue_new();
+    session->worker = g_thread_new("apps", apps_worker, session);
+    return session;
+}
+
+void apps_stop(apps_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    g_async_queue_push(session->queue, APPS_MSG_STOP);
+    g_thread_join(session->worker);
+    g_idle_add(withdraw_inventory, g_strdup(session->udid));
+    g_async_queue_unref(session->queue);
+    free(session);
+}
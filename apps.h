@@ -0,0 +1,19 @@
+#ifndef APPS_H
+#define APPS_H
+
+#include <stdint.h>
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/installation_proxy.h>
+#include <libimobiledevice/notification_proxy.h>
+
+// Opaque per-device inventory session
+typedef struct apps_session apps_session_t;
+
+// Function prototypes
+apps_session_t* apps_start(idevice_t device, const char *udid);
+void apps_stop(apps_session_t *session);
+void apps_fill_menu(GtkWidget *submenu);
+void apps_clear_menu(void);
+
+#endif // APPS_H
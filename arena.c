@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+/**
+ * Region allocator. Memory comes from a chain of blocks and is only given
+ * back in bulk: arena_reset() rewinds to the first block but keeps every
+ * block for reuse, so a region that is reset each tick stops calling
+ * malloc once it has grown to its working size, and arena_free() returns
+ * all of it at once. Not thread safe, each arena has a single owner.
+ */
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    max_align_t data[]; // Aligned start of the usable bytes
+};
+
+struct arena {
+    struct arena_block *first;
+    struct arena_block *current;
+    size_t block_size;
+    struct arena_stats stats;
+};
+
+static struct arena_block* new_block(arena_t *arena, size_t size) {
+    struct arena_block *block = malloc(sizeof(*block) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    arena->stats.heap_blocks++;
+    arena->stats.capacity += size;
+    return block;
+}
+
+arena_t* arena_new(size_t block_size) {
+    arena_t *arena = calloc(1, sizeof(*arena));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->block_size = block_size;
+    arena->first = arena->current = new_block(arena, block_size);
+    if (arena->first == NULL) {
+        free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+void* arena_alloc(arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_block *block = arena->current;
+    while (block->used + size > block->size) {
+        // Blocks kept from before a reset are reused in order before growing
+        if (block->next == NULL) {
+            block->next = new_block(arena, MAX(arena->block_size, size));
+            if (block->next == NULL) {
+                return NULL;
+            }
+        }
+        block = block->next;
+        block->used = 0;
+    }
+    arena->current = block;
+    void *p = (char *)block->data + block->used;
+    block->used += size;
+    arena->stats.used += size;
+    arena->stats.allocations++;
+    return p;
+}
+
+char* arena_strdup(arena_t *arena, const char *string) {
+    if (string == NULL) {
+        return NULL;
+    }
+    size_t length = strlen(string) + 1;
+    char *copy = arena_alloc(arena, length);
+    if (copy != NULL) {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+void arena_reset(arena_t *arena) {
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->stats.used = 0;
+    arena->stats.resets++;
+}
+
+void arena_free(arena_t *arena) {
+    if (arena == NULL) {
+        return;
+    }
+    struct arena_block *block = arena->first;
+    while (block != NULL) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+void arena_get_stats(arena_t *arena, struct arena_stats *stats) {
+    if (arena == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    *stats = arena->stats;
+}
@@ -0,0 +1,26 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <glib.h>
+
+// Region allocator; everything in it is released at once by arena_reset() or arena_free()
+typedef struct arena arena_t;
+
+struct arena_stats {
+    guint64 allocations; // arena_alloc() calls served
+    guint64 heap_blocks; // Blocks taken from malloc, flat once warmed up
+    guint64 resets;
+    size_t used;         // Bytes handed out since the last reset
+    size_t capacity;     // Bytes held in blocks
+};
+
+// Function prototypes
+arena_t* arena_new(size_t block_size);
+void* arena_alloc(arena_t *arena, size_t size);
+char* arena_strdup(arena_t *arena, const char *string);
+void arena_reset(arena_t *arena);
+void arena_free(arena_t *arena);
+void arena_get_stats(arena_t *arena, struct arena_stats *stats);
+
+#endif // ARENA_H
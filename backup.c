@@ -0,0 +1,1063 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <libimobiledevice/mobilebackup2.h>
+#include <libimobiledevice/notification_proxy.h>
+#include <libimobiledevice/afc.h>
+
+#include "backup.h"
+#include "hash.h"
+#include "heavy.h"
+#include "tray.h" // To access the global indicator variable
+
+#define CHUNK_MIN (16u << 10)           // Content-defined chunk bounds
+#define CHUNK_MAX (256u << 10)
+#define CHUNK_MASK 0xffffull            // Cut where the gear hash has 16 zero bits, ~64 KiB average
+#define CHUNK_BUFFERS 32                // Chunks in flight between the device link and the workers
+#define CHUNK_SEED_B 0x9e3779b97f4a7c15ull
+#define SEND_BLOCK (64u << 10)
+#define STAGING_SIZE (64u << 10)
+#define CATALOG_MAGIC "IOSBAK01"
+#define PROGRESS_INTERVAL_US G_USEC_PER_SEC
+#define APPLE_EPOCH_OFFSET 978307200    // 2001-01-01 in Unix time
+#define SYNC_LOCK_ATTEMPTS 50           // Same budget as idevicebackup2: 50 tries 200 ms apart
+#define SYNC_LOCK_WAIT_US 200000
+
+// Device link file stream codes
+#define CODE_SUCCESS 0x00
+#define CODE_ERROR_LOCAL 0x06
+#define CODE_ERROR_REMOTE 0x0b
+#define CODE_FILE_DATA 0x0c
+
+// Device link error codes for multi status replies
+#define DEVICE_ENOENT -6
+#define DEVICE_EIO -11
+
+/**
+ * Backups do not go to a backup folder. Every file the device uploads is cut
+ * into content-defined chunks, each chunk is stored once under its hash in a
+ * store shared by all devices, and a per-device catalog maps backup paths to
+ * chunk lists. The device link thread only reads and cuts; hashing,
+ * compression and writing run on a worker pool so they overlap the transfer.
+ */
+
+struct chunk_id {
+    uint64_t a;
+    uint64_t b;
+};
+
+// One path of the device's backup folder
+struct backup_file {
+    bool is_dir;
+    uint64_t size;
+    int64_t mtime;
+    GArray *chunks; // struct chunk_id, filled in by the workers
+    int pending;    // Chunks still with the workers, guarded by the session lock
+};
+
+struct chunk_job {
+    backup_session_t *session;
+    struct backup_file *file;
+    guint index;
+    uint32_t length;
+    uint8_t *data;
+    uint8_t *packed;
+    uLong packed_capacity;
+};
+
+// Cutting state for the file currently being received
+struct chunker {
+    struct chunk_job *job;
+    uint64_t gear;
+};
+
+struct backup_session {
+    char udid[64];
+    idevice_t device;
+    GThread *thread;
+    gint running;
+
+    GHashTable *catalog; // path -> struct backup_file, device link thread only
+    GThreadPool *workers;
+    GAsyncQueue *buffers;
+    struct chunk_job jobs[CHUNK_BUFFERS];
+
+    GMutex lock;
+    GCond settled;
+    uint64_t bytes_received;
+    uint64_t bytes_new;   // Compressed bytes added to the store
+    uint64_t bytes_known; // Received bytes whose chunk was already stored
+    gint64 last_progress;
+};
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+// Session the tray actions apply to
+static backup_session_t *active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fixed seed so every device and every run cuts identical content identically
+static void init_gear(void) {
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    for (int i = 0; i < 256; ++i) {
+        state += 0x9e3779b97f4a7c15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static char* store_dir(void) {
+    return g_build_filename(g_get_user_data_dir(), "gnome-ios-appindicator", "backup", NULL);
+}
+
+static char* chunk_path(const struct chunk_id *id) {
+    char name[33], prefix[3];
+    snprintf(name, sizeof(name), "%016llx%016llx", (unsigned long long)id->a, (unsigned long long)id->b);
+    memcpy(prefix, name, 2);
+    prefix[2] = '\0';
+    char *root = store_dir();
+    char *path = g_build_filename(root, "chunks", prefix, name, NULL);
+    g_free(root);
+    return path;
+}
+
+static char* catalog_path(const char *udid, const char *name) {
+    char *root = store_dir();
+    char *path = g_build_filename(root, "devices", udid, name, NULL);
+    g_free(root);
+    return path;
+}
+
+static void free_backup_file(gpointer data) {
+    struct backup_file *file = data;
+    if (file->chunks) {
+        g_array_unref(file->chunks);
+    }
+    g_free(file);
+}
+
+static struct backup_file* new_backup_file(bool is_dir) {
+    struct backup_file *file = g_new0(struct backup_file, 1);
+    file->is_dir = is_dir;
+    file->mtime = time(NULL);
+    file->chunks = g_array_new(FALSE, TRUE, sizeof(struct chunk_id));
+    return file;
+}
+
+/**
+ * Chunk store
+ */
+
+static bool write_chunk(const char *path, char type, const uint8_t *data, uint32_t stored, uint32_t length) {
+    char *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    char *partial = g_strdup_printf("%s/.chunk-XXXXXX", dir);
+    g_free(dir);
+
+    int fd = mkstemp(partial);
+    bool ok = fd >= 0;
+    if (ok) {
+        uint8_t header[5] = {type, length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, (length >> 24) & 0xff};
+        ok = write(fd, header, sizeof(header)) == sizeof(header) && write(fd, data, stored) == (ssize_t)stored;
+        ok = close(fd) == 0 && ok;
+        // Two workers storing the same chunk both rename a complete file, either wins
+        ok = ok && rename(partial, path) == 0;
+        if (!ok) {
+            unlink(partial);
+        }
+    }
+    g_free(partial);
+    return ok;
+}
+
+// Returns the chunk's raw bytes, or NULL if it is missing or damaged
+static uint8_t* read_chunk(const struct chunk_id *id, uint32_t *length) {
+    char *path = chunk_path(id);
+    char *contents = NULL;
+    gsize size = 0;
+    bool found = g_file_get_contents(path, &contents, &size, NULL);
+    g_free(path);
+    if (!found || size < 5) {
+        g_free(contents);
+        return NULL;
+    }
+
+    const uint8_t *header = (const uint8_t *)contents;
+    uLongf raw = header[1] | (header[2] << 8) | (header[3] << 16) | ((uint32_t)header[4] << 24);
+    uint8_t *data = g_malloc(raw ? raw : 1);
+    bool ok;
+    if (header[0] == 'Z') {
+        uLongf out = raw;
+        ok = uncompress(data, &out, header + 5, size - 5) == Z_OK && out == raw;
+    } else {
+        ok = size - 5 == raw;
+        memcpy(data, header + 5, size - 5 < raw ? size - 5 : raw);
+    }
+    g_free(contents);
+    if (!ok) {
+        g_free(data);
+        return NULL;
+    }
+    *length = raw;
+    return data;
+}
+
+// Worker pool: hash, skip if known, otherwise compress and store
+static void store_chunk(gpointer data, gpointer user_data) {
+    struct chunk_job *job = data;
+    backup_session_t *session = job->session;
+    struct chunk_id id = {
+        .a = hash64(job->data, job->length, 0),
+        .b = hash64(job->data, job->length, CHUNK_SEED_B),
+    };
+
+    char *path = chunk_path(&id);
+    bool known = g_file_test(path, G_FILE_TEST_EXISTS);
+    uint64_t stored = 0;
+    if (!known) {
+        uLongf packed = job->packed_capacity;
+        if (compress2(job->packed, &packed, job->data, job->length, 1) == Z_OK && packed < job->length) {
+            write_chunk(path, 'Z', job->packed, packed, job->length);
+            stored = packed;
+        } else {
+            write_chunk(path, 'R', job->data, job->length, job->length);
+            stored = job->length;
+        }
+    }
+    g_free(path);
+
+    g_mutex_lock(&session->lock);
+    g_array_index(job->file->chunks, struct chunk_id, job->index) = id;
+    if (--job->file->pending == 0) {
+        g_cond_broadcast(&session->settled);
+    }
+    if (known) {
+        session->bytes_known += job->length;
+    } else {
+        session->bytes_new += stored;
+    }
+    g_mutex_unlock(&session->lock);
+
+    g_async_queue_push(session->buffers, job);
+}
+
+static void dispatch_chunk(backup_session_t *session, struct backup_file *file, struct chunker *chunker) {
+    struct chunk_job *job = chunker->job;
+    g_mutex_lock(&session->lock);
+    job->index = file->chunks->len;
+    g_array_set_size(file->chunks, file->chunks->len + 1);
+    file->pending++;
+    g_mutex_unlock(&session->lock);
+
+    job->file = file;
+    file->size += job->length;
+    g_thread_pool_push(session->workers, job, NULL);
+    chunker->job = NULL;
+}
+
+// Gear-hash content-defined chunking, so an insertion only changes nearby chunks
+static void chunker_feed(backup_session_t *session, struct backup_file *file, struct chunker *chunker, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        if (chunker->job == NULL) {
+            // Blocks while the workers are behind, which keeps memory bounded
+            chunker->job = g_async_queue_pop(session->buffers);
+            chunker->job->length = 0;
+            chunker->gear = 0;
+        }
+
+        struct chunk_job *job = chunker->job;
+        size_t taken = 0;
+        bool cut = false;
+        while (taken < length && job->length < CHUNK_MAX) {
+            uint8_t byte = data[taken++];
+            job->data[job->length++] = byte;
+            chunker->gear = (chunker->gear << 1) + gear[byte];
+            if (job->length >= CHUNK_MIN && (chunker->gear & CHUNK_MASK) == 0) {
+                cut = true;
+                break;
+            }
+        }
+        if (cut || job->length == CHUNK_MAX) {
+            dispatch_chunk(session, file, chunker);
+        }
+        data += taken;
+        length -= taken;
+    }
+}
+
+static void wait_settled(backup_session_t *session, struct backup_file *file) {
+    g_mutex_lock(&session->lock);
+    while (file->pending > 0) {
+        g_cond_wait(&session->settled, &session->lock);
+    }
+    g_mutex_unlock(&session->lock);
+}
+
+/**
+ * Catalog
+ */
+
+static const char* parent_of(const char *path, char *buffer, size_t size) {
+    const char *slash = strrchr(path, '/');
+    size_t length = slash ? (size_t)(slash - path) : 0;
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(buffer, path, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+// Keys of path itself and everything below it
+static GPtrArray* subtree(GHashTable *catalog, const char *path) {
+    GPtrArray *keys = g_ptr_array_new_with_free_func(g_free);
+    size_t length = strlen(path);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, catalog);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const char *candidate = key;
+        if (strncmp(candidate, path, length) == 0 && (candidate[length] == '\0' || candidate[length] == '/')) {
+            g_ptr_array_add(keys, g_strdup(candidate));
+        }
+    }
+    return keys;
+}
+
+static void remove_subtree(backup_session_t *session, const char *path) {
+    GPtrArray *keys = subtree(session->catalog, path);
+    for (guint i = 0; i < keys->len; ++i) {
+        struct backup_file *file = g_hash_table_lookup(session->catalog, g_ptr_array_index(keys, i));
+        wait_settled(session, file);
+        g_hash_table_remove(session->catalog, g_ptr_array_index(keys, i));
+    }
+    g_ptr_array_unref(keys);
+}
+
+// Copies share chunks, so they cost nothing in the store
+static void copy_subtree(backup_session_t *session, const char *from, const char *to, bool move) {
+    GPtrArray *keys = subtree(session->catalog, from);
+    size_t length = strlen(from);
+    for (guint i = 0; i < keys->len; ++i) {
+        const char *key = g_ptr_array_index(keys, i);
+        struct backup_file *file = g_hash_table_lookup(session->catalog, key);
+        char *target = g_strconcat(to, key + length, NULL);
+        if (move) {
+            g_hash_table_steal(session->catalog, key);
+            g_hash_table_replace(session->catalog, target, file);
+        } else {
+            wait_settled(session, file);
+            struct backup_file *copy = new_backup_file(file->is_dir);
+            copy->size = file->size;
+            copy->mtime = file->mtime;
+            g_array_append_vals(copy->chunks, file->chunks->data, file->chunks->len);
+            g_hash_table_replace(session->catalog, target, copy);
+        }
+    }
+    g_ptr_array_unref(keys);
+}
+
+static bool catalog_save(GHashTable *catalog, const char *path) {
+    GString *out = g_string_new_len(CATALOG_MAGIC, 8);
+    uint32_t count = htole32(g_hash_table_size(catalog));
+    g_string_append_len(out, (const char *)&count, 4);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, catalog);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct backup_file *file = value;
+        uint32_t path_length = htole32(strlen(key));
+        uint8_t is_dir = file->is_dir;
+        uint64_t size = htole64(file->size);
+        uint64_t mtime = htole64((uint64_t)file->mtime);
+        uint32_t chunks = htole32(file->chunks->len);
+        g_string_append_len(out, (const char *)&path_length, 4);
+        g_string_append_len(out, key, strlen(key));
+        g_string_append_len(out, (const char *)&is_dir, 1);
+        g_string_append_len(out, (const char *)&size, 8);
+        g_string_append_len(out, (const char *)&mtime, 8);
+        g_string_append_len(out, (const char *)&chunks, 4);
+        for (guint i = 0; i < file->chunks->len; ++i) {
+            struct chunk_id id = g_array_index(file->chunks, struct chunk_id, i);
+            uint64_t a = htole64(id.a), b = htole64(id.b);
+            g_string_append_len(out, (const char *)&a, 8);
+            g_string_append_len(out, (const char *)&b, 8);
+        }
+    }
+
+    char *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    bool ok = g_file_set_contents(path, out->str, out->len, NULL);
+    g_string_free(out, TRUE);
+    return ok;
+}
+
+static GHashTable* catalog_load(const char *path) {
+    GHashTable *catalog = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_backup_file);
+    char *contents = NULL;
+    gsize size = 0;
+    if (!g_file_get_contents(path, &contents, &size, NULL)) {
+        return catalog;
+    }
+
+    const char *cursor = contents + 12;
+    const char *end = contents + size;
+    uint32_t count = 0;
+    if (size >= 12 && memcmp(contents, CATALOG_MAGIC, 8) == 0) {
+        memcpy(&count, contents + 8, 4);
+        count = le32toh(count);
+    }
+    for (uint32_t n = 0; n < count && end - cursor >= 4; ++n) {
+        uint32_t path_length, chunks;
+        uint64_t file_size, mtime;
+        memcpy(&path_length, cursor, 4);
+        path_length = le32toh(path_length);
+        if ((size_t)(end - cursor) < 4 + (size_t)path_length + 21) {
+            break;
+        }
+        char *key = g_strndup(cursor + 4, path_length);
+        cursor += 4 + path_length;
+        struct backup_file *file = new_backup_file(cursor[0] != 0);
+        memcpy(&file_size, cursor + 1, 8);
+        memcpy(&mtime, cursor + 9, 8);
+        memcpy(&chunks, cursor + 17, 4);
+        cursor += 21;
+        file->size = le64toh(file_size);
+        file->mtime = (int64_t)le64toh(mtime);
+        chunks = le32toh(chunks);
+        for (uint32_t i = 0; i < chunks && end - cursor >= 16; ++i) {
+            struct chunk_id id;
+            memcpy(&id.a, cursor, 8);
+            memcpy(&id.b, cursor + 8, 8);
+            id.a = le64toh(id.a);
+            id.b = le64toh(id.b);
+            g_array_append_val(file->chunks, id);
+            cursor += 16;
+        }
+        g_hash_table_replace(catalog, key, file);
+    }
+    g_free(contents);
+    return catalog;
+}
+
+/**
+ * Device link messages
+ */
+
+static bool receive_exact(mobilebackup2_client_t client, void *buffer, uint32_t length) {
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t got = 0;
+        if (mobilebackup2_receive_raw(client, (char *)buffer + done, length - done, &got) != MOBILEBACKUP2_E_SUCCESS || got == 0) {
+            return false;
+        }
+        done += got;
+    }
+    return true;
+}
+
+static bool send_exact(mobilebackup2_client_t client, const void *buffer, uint32_t length) {
+    uint32_t done = 0;
+    while (done < length) {
+        uint32_t sent = 0;
+        if (mobilebackup2_send_raw(client, (const char *)buffer + done, length - done, &sent) != MOBILEBACKUP2_E_SUCCESS || sent == 0) {
+            return false;
+        }
+        done += sent;
+    }
+    return true;
+}
+
+static char* receive_name(mobilebackup2_client_t client) {
+    uint32_t length = 0;
+    if (!receive_exact(client, &length, 4)) {
+        return NULL;
+    }
+    length = be32toh(length);
+    if (length == 0 || length > 4096) {
+        return NULL;
+    }
+    char *name = g_malloc(length + 1);
+    if (!receive_exact(client, name, length)) {
+        g_free(name);
+        return NULL;
+    }
+    name[length] = '\0';
+    return name;
+}
+
+static bool send_block(mobilebackup2_client_t client, uint8_t code, const void *data, uint32_t length) {
+    uint8_t header[5];
+    uint32_t size = htobe32(length + 1);
+    memcpy(header, &size, 4);
+    header[4] = code;
+    return send_exact(client, header, sizeof(header)) && (length == 0 || send_exact(client, data, length));
+}
+
+static gboolean publish_progress(gpointer data) {
+    char *label = data;
+    if (tray != NULL && tray->widgets != NULL && tray->widgets->backup != NULL) {
+        update_menu_item_label(GTK_MENU_ITEM(tray->widgets->backup), label);
+        gtk_widget_show(tray->widgets->backup);
+    }
+    g_free(label);
+    return G_SOURCE_REMOVE;
+}
+
+static void report_progress(backup_session_t *session, const char *state, bool force) {
+    gint64 now = g_get_monotonic_time();
+    if (!force && now - session->last_progress < PROGRESS_INTERVAL_US) {
+        return;
+    }
+    session->last_progress = now;
+
+    g_mutex_lock(&session->lock);
+    char *label = g_strdup_printf(" Backup %s: %.1f MB received, %.1f MB new", state,
+                                  session->bytes_received / 1000000.0, session->bytes_new / 1000000.0);
+    g_mutex_unlock(&session->lock);
+    g_idle_add(publish_progress, label);
+}
+
+// DLMessageUploadFiles: the device streams files into the backup
+static void handle_upload(backup_session_t *session, mobilebackup2_client_t client) {
+    uint8_t *staging = g_malloc(STAGING_SIZE);
+    while (true) {
+        char *device_name = receive_name(client);
+        char *path = device_name ? receive_name(client) : NULL;
+        g_free(device_name);
+        if (path == NULL) {
+            break;
+        }
+
+        uint32_t length = 0;
+        uint8_t code = 0;
+        if (!receive_exact(client, &length, 4) || (length = be32toh(length)) == 0 || !receive_exact(client, &code, 1)) {
+            g_free(path);
+            break;
+        }
+
+        // A re-uploaded path replaces the old entry once its chunks have landed
+        remove_subtree(session, path);
+        struct backup_file *file = new_backup_file(false);
+        g_hash_table_replace(session->catalog, g_strdup(path), file);
+        struct chunker chunker = {0};
+
+        while (code == CODE_FILE_DATA) {
+            uint32_t remaining = length - 1;
+            while (remaining > 0) {
+                uint32_t part = remaining < STAGING_SIZE ? remaining : STAGING_SIZE;
+                if (!receive_exact(client, staging, part)) {
+                    remaining = 0;
+                    length = 0;
+                    break;
+                }
+                chunker_feed(session, file, &chunker, staging, part);
+                remaining -= part;
+                g_mutex_lock(&session->lock);
+                session->bytes_received += part;
+                g_mutex_unlock(&session->lock);
+            }
+            if (length == 0 || !receive_exact(client, &length, 4) || (length = be32toh(length)) == 0
+                || !receive_exact(client, &code, 1)) {
+                length = 0;
+                break;
+            }
+        }
+        if (chunker.job != NULL) {
+            if (chunker.job->length > 0) {
+                dispatch_chunk(session, file, &chunker);
+            } else {
+                g_async_queue_push(session->buffers, chunker.job);
+            }
+        }
+
+        if (code == CODE_ERROR_REMOTE && length > 1) {
+            char *message = g_malloc0(length);
+            receive_exact(client, message, length - 1);
+            fprintf(stderr, "[UDID=%s][Backup] Device failed to send %s: %s\n", session->udid, path, message);
+            g_free(message);
+            remove_subtree(session, path);
+        }
+        g_free(path);
+        report_progress(session, "running", false);
+        if (length == 0) {
+            break;
+        }
+    }
+    g_free(staging);
+
+    plist_t empty = plist_new_dict();
+    mobilebackup2_send_status_response(client, 0, NULL, empty);
+    plist_free(empty);
+}
+
+static void add_file_error(plist_t *errors, const char *path, int code, const char *description) {
+    if (*errors == NULL) {
+        *errors = plist_new_dict();
+    }
+    plist_t entry = plist_new_dict();
+    plist_dict_set_item(entry, "DLFileErrorString", plist_new_string(description));
+    plist_dict_set_item(entry, "DLFileErrorCode", plist_new_uint(code));
+    plist_dict_set_item(*errors, path, entry);
+}
+
+// DLMessageDownloadFiles: the device reads back files of the previous backup
+static void handle_download(backup_session_t *session, mobilebackup2_client_t client, plist_t message) {
+    plist_t files = plist_array_get_item(message, 1);
+    plist_t errors = NULL;
+    uint32_t count = files ? plist_array_get_size(files) : 0;
+    bool ok = true;
+
+    for (uint32_t i = 0; ok && i < count; ++i) {
+        const char *path = plist_get_string_ptr(plist_array_get_item(files, i), NULL);
+        if (path == NULL) {
+            continue;
+        }
+        uint32_t path_length = strlen(path);
+        uint32_t size = htobe32(path_length);
+        ok = send_exact(client, &size, 4) && send_exact(client, path, path_length);
+
+        struct backup_file *file = g_hash_table_lookup(session->catalog, path);
+        const char *failure = file == NULL || file->is_dir ? "No such file or directory" : NULL;
+        if (ok && failure == NULL) {
+            wait_settled(session, file);
+            for (guint c = 0; ok && failure == NULL && c < file->chunks->len; ++c) {
+                uint32_t length = 0;
+                uint8_t *data = read_chunk(&g_array_index(file->chunks, struct chunk_id, c), &length);
+                if (data == NULL) {
+                    failure = "Backup chunk missing from the store";
+                    break;
+                }
+                for (uint32_t offset = 0; ok && offset < length; offset += SEND_BLOCK) {
+                    uint32_t part = length - offset < SEND_BLOCK ? length - offset : SEND_BLOCK;
+                    ok = send_block(client, CODE_FILE_DATA, data + offset, part);
+                }
+                g_free(data);
+            }
+        }
+        if (ok && failure == NULL) {
+            ok = send_block(client, CODE_SUCCESS, NULL, 0);
+        } else if (ok) {
+            add_file_error(&errors, path, file == NULL ? DEVICE_ENOENT : DEVICE_EIO, failure);
+            ok = send_block(client, CODE_ERROR_LOCAL, failure, strlen(failure));
+        }
+    }
+
+    uint32_t zero = 0;
+    send_exact(client, &zero, 4);
+    if (errors == NULL) {
+        plist_t empty = plist_new_dict();
+        mobilebackup2_send_status_response(client, 0, NULL, empty);
+        plist_free(empty);
+    } else {
+        mobilebackup2_send_status_response(client, -13, "Multi status", errors);
+        plist_free(errors);
+    }
+}
+
+static void handle_contents(backup_session_t *session, mobilebackup2_client_t client, plist_t message) {
+    const char *dir = plist_get_string_ptr(plist_array_get_item(message, 1), NULL);
+    plist_t listing = plist_new_dict();
+    char parent[1024];
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, session->catalog);
+    while (dir != NULL && g_hash_table_iter_next(&iter, &key, &value)) {
+        if (strcmp(parent_of(key, parent, sizeof(parent)), dir) != 0) {
+            continue;
+        }
+        struct backup_file *file = value;
+        const char *slash = strrchr(key, '/');
+        plist_t entry = plist_new_dict();
+        plist_dict_set_item(entry, "DLFileType", plist_new_string(file->is_dir ? "DLFileTypeDirectory" : "DLFileTypeRegular"));
+        plist_dict_set_item(entry, "DLFileSize", plist_new_uint(file->size));
+        plist_dict_set_item(entry, "DLFileModificationDate", plist_new_date(file->mtime - APPLE_EPOCH_OFFSET, 0));
+        plist_dict_set_item(listing, slash ? slash + 1 : key, entry);
+    }
+    mobilebackup2_send_status_response(client, 0, NULL, listing);
+    plist_free(listing);
+}
+
+static void handle_move(backup_session_t *session, mobilebackup2_client_t client, plist_t message) {
+    plist_t moves = plist_array_get_item(message, 1);
+    plist_dict_iter iter = NULL;
+    plist_dict_new_iter(moves, &iter);
+    while (iter != NULL) {
+        char *from = NULL;
+        plist_t node = NULL;
+        plist_dict_next_item(moves, iter, &from, &node);
+        if (from == NULL) {
+            break;
+        }
+        const char *to = plist_get_string_ptr(node, NULL);
+        if (to != NULL) {
+            remove_subtree(session, to);
+            copy_subtree(session, from, to, true);
+        }
+        free(from);
+    }
+    free(iter);
+
+    plist_t empty = plist_new_dict();
+    mobilebackup2_send_status_response(client, 0, NULL, empty);
+    plist_free(empty);
+}
+
+static void handle_remove(backup_session_t *session, mobilebackup2_client_t client, plist_t message) {
+    plist_t paths = plist_array_get_item(message, 1);
+    uint32_t count = paths ? plist_array_get_size(paths) : 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const char *path = plist_get_string_ptr(plist_array_get_item(paths, i), NULL);
+        if (path != NULL) {
+            remove_subtree(session, path);
+        }
+    }
+
+    plist_t empty = plist_new_dict();
+    mobilebackup2_send_status_response(client, 0, NULL, empty);
+    plist_free(empty);
+}
+
+// The sync lock keeps other hosts from syncing while the backup runs
+static bool acquire_sync_lock(backup_session_t *session, np_client_t *np, afc_client_t *afc, uint64_t *lock_file) {
+    *np = NULL;
+    *afc = NULL;
+    if (np_client_start_service(session->device, np, NULL) != NP_E_SUCCESS
+        || afc_client_start_service(session->device, afc, NULL) != AFC_E_SUCCESS) {
+        return false;
+    }
+    np_post_notification(*np, NP_SYNC_WILL_START);
+    if (afc_file_open(*afc, "/com.apple.itunes.lock_sync", AFC_FOPEN_RW, lock_file) != AFC_E_SUCCESS) {
+        return false;
+    }
+    // Another host may hold it for a while, try a bounded number of times instead of waiting on it
+    afc_error_t err = AFC_E_OP_WOULD_BLOCK;
+    for (int attempt = 0; attempt < SYNC_LOCK_ATTEMPTS && err == AFC_E_OP_WOULD_BLOCK; attempt++) {
+        if (attempt > 0) {
+            g_usleep(SYNC_LOCK_WAIT_US);
+        }
+        np_post_notification(*np, NP_SYNC_LOCK_REQUEST);
+        err = afc_file_lock(*afc, *lock_file, AFC_LOCK_EX); // Non-blocking, AFC_LOCK_EX carries LOCK_NB
+    }
+    if (err != AFC_E_SUCCESS) {
+        afc_file_close(*afc, *lock_file);
+        return false;
+    }
+    np_post_notification(*np, NP_SYNC_DID_START);
+    return true;
+}
+
+static void release_sync_lock(np_client_t np, afc_client_t afc, uint64_t lock_file, bool locked) {
+    if (locked) {
+        afc_file_lock(afc, lock_file, AFC_LOCK_UN);
+        afc_file_close(afc, lock_file);
+        np_post_notification(np, NP_SYNC_DID_FINISH);
+    }
+    if (afc) afc_client_free(afc);
+    if (np) np_client_free(np);
+}
+
+static bool run_backup(backup_session_t *session, mobilebackup2_client_t client) {
+    double versions[] = {2.0, 2.1};
+    double remote_version = 0.0;
+    if (mobilebackup2_version_exchange(client, versions, 2, &remote_version) != MOBILEBACKUP2_E_SUCCESS
+        || mobilebackup2_send_request(client, "Backup", session->udid, session->udid, NULL) != MOBILEBACKUP2_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Backup] Device refused the backup request\n", session->udid);
+        return false;
+    }
+
+    bool finished = false;
+    bool ok = false;
+    while (!finished) {
+        plist_t message = NULL;
+        char *name = NULL;
+        mobilebackup2_error_t error = mobilebackup2_receive_message(client, &message, &name);
+        if (error == MOBILEBACKUP2_E_RECEIVE_TIMEOUT) {
+            continue;
+        }
+        if (error != MOBILEBACKUP2_E_SUCCESS || name == NULL) {
+            fprintf(stderr, "[UDID=%s][Backup] Lost the device link (%d)\n", session->udid, error);
+            plist_free(message);
+            free(name);
+            break;
+        }
+
+        if (strcmp(name, "DLMessageUploadFiles") == 0) {
+            handle_upload(session, client);
+        } else if (strcmp(name, "DLMessageDownloadFiles") == 0) {
+            handle_download(session, client, message);
+        } else if (strcmp(name, "DLMessageGetFreeDiskSpace") == 0) {
+            struct statvfs fs;
+            char *root = store_dir();
+            g_mkdir_with_parents(root, 0700);
+            uint64_t space = statvfs(root, &fs) == 0 ? (uint64_t)fs.f_bavail * fs.f_frsize : 0;
+            g_free(root);
+            plist_t reply = plist_new_uint(space);
+            mobilebackup2_send_status_response(client, 0, NULL, reply);
+            plist_free(reply);
+        } else if (strcmp(name, "DLContentsOfDirectory") == 0 || strcmp(name, "DLMessageContentsOfDirectory") == 0) {
+            handle_contents(session, client, message);
+        } else if (strcmp(name, "DLMessageCreateDirectory") == 0) {
+            const char *path = plist_get_string_ptr(plist_array_get_item(message, 1), NULL);
+            if (path != NULL && !g_hash_table_contains(session->catalog, path)) {
+                g_hash_table_replace(session->catalog, g_strdup(path), new_backup_file(true));
+            }
+            plist_t empty = plist_new_dict();
+            mobilebackup2_send_status_response(client, 0, NULL, empty);
+            plist_free(empty);
+        } else if (strcmp(name, "DLMessageMoveFiles") == 0 || strcmp(name, "DLMessageMoveItems") == 0) {
+            handle_move(session, client, message);
+        } else if (strcmp(name, "DLMessageRemoveFiles") == 0 || strcmp(name, "DLMessageRemoveItems") == 0) {
+            handle_remove(session, client, message);
+        } else if (strcmp(name, "DLMessageCopyItem") == 0) {
+            const char *from = plist_get_string_ptr(plist_array_get_item(message, 1), NULL);
+            const char *to = plist_get_string_ptr(plist_array_get_item(message, 2), NULL);
+            if (from != NULL && to != NULL) {
+                remove_subtree(session, to);
+                copy_subtree(session, from, to, false);
+            }
+            plist_t empty = plist_new_dict();
+            mobilebackup2_send_status_response(client, 0, NULL, empty);
+            plist_free(empty);
+        } else if (strcmp(name, "DLMessageProcessMessage") == 0) {
+            plist_t result = plist_array_get_item(message, 1);
+            plist_t code = result ? plist_dict_get_item(result, "ErrorCode") : NULL;
+            uint64_t error_code = 0;
+            if (code != NULL) {
+                plist_get_uint_val(code, &error_code);
+            }
+            ok = error_code == 0;
+            if (!ok) {
+                plist_t description = plist_dict_get_item(result, "ErrorDescription");
+                fprintf(stderr, "[UDID=%s][Backup] Device reported error %llu: %s\n", session->udid, (unsigned long long)error_code,
+                        description ? plist_get_string_ptr(description, NULL) : "unknown");
+            }
+            finished = true;
+        } else if (strcmp(name, "DLMessageDisconnect") == 0) {
+            finished = true;
+        } else {
+            // Disk purging and anything newer is declined
+            plist_t empty = plist_new_dict();
+            mobilebackup2_send_status_response(client, -1, "Operation not supported", empty);
+            plist_free(empty);
+        }
+        plist_free(message);
+        free(name);
+    }
+    return ok;
+}
+
+// Chunk buffers only exist while a backup runs, most sessions never start one
+static void alloc_buffers(backup_session_t *session) {
+    for (int i = 0; i < CHUNK_BUFFERS; ++i) {
+        struct chunk_job *job = &session->jobs[i];
+        job->session = session;
+        job->data = g_malloc(CHUNK_MAX);
+        job->packed_capacity = compressBound(CHUNK_MAX);
+        job->packed = g_malloc(job->packed_capacity);
+        g_async_queue_push(session->buffers, job);
+    }
+}
+
+// Waits for every buffer to come back from the workers, then frees them
+static void free_buffers(backup_session_t *session) {
+    for (int i = 0; i < CHUNK_BUFFERS; ++i) {
+        struct chunk_job *job = g_async_queue_pop(session->buffers);
+        g_free(job->data);
+        g_free(job->packed);
+        job->data = NULL;
+        job->packed = NULL;
+    }
+}
+
+static gpointer backup_thread(gpointer data) {
+    backup_session_t *session = data;
+    gint64 started = g_get_monotonic_time();
+    printf("[UDID=%s][Backup] Starting backup\n", session->udid);
+
+    char *live = catalog_path(session->udid, "catalog");
+    session->catalog = catalog_load(live);
+    session->bytes_received = session->bytes_new = session->bytes_known = 0;
+    report_progress(session, "running", true);
+    heavy_acquire(session->udid, "backup");
+    alloc_buffers(session);
+
+    np_client_t np = NULL;
+    afc_client_t afc = NULL;
+    uint64_t lock_file = 0;
+    bool locked = acquire_sync_lock(session, &np, &afc, &lock_file);
+    if (!locked) {
+        fprintf(stderr, "[UDID=%s][Backup] Could not take the sync lock, continuing without it\n", session->udid);
+    }
+
+    bool ok = false;
+    mobilebackup2_client_t client = NULL;
+    if (mobilebackup2_client_start_service(session->device, &client, NULL) == MOBILEBACKUP2_E_SUCCESS) {
+        ok = run_backup(session, client);
+        mobilebackup2_client_free(client);
+    } else {
+        fprintf(stderr, "[UDID=%s][Backup] Failed to start mobilebackup2 service\n", session->udid);
+    }
+    release_sync_lock(np, afc, lock_file, locked);
+    heavy_release(session->udid);
+
+    // Every chunk must be on disk before a catalog may point at it
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, session->catalog);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        wait_settled(session, value);
+    }
+    free_buffers(session);
+
+    if (catalog_save(session->catalog, live) && ok) {
+        // Each successful run is kept as a generation, sharing chunks with the others
+        char stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S.catalog", localtime(&now));
+        char *generation = catalog_path(session->udid, "generations");
+        g_mkdir_with_parents(generation, 0700);
+        char *target = g_build_filename(generation, stamp, NULL);
+        if (link(live, target) != 0) {
+            fprintf(stderr, "[UDID=%s][Backup] Failed to record generation %s\n", session->udid, target);
+        }
+        g_free(target);
+        g_free(generation);
+    }
+
+    printf("[UDID=%s][Backup] %s: %.1f MB received, %.1f MB already stored, %.1f MB new in %.0fs\n",
+           session->udid, ok ? "Finished" : "Failed", session->bytes_received / 1000000.0,
+           session->bytes_known / 1000000.0, session->bytes_new / 1000000.0,
+           (g_get_monotonic_time() - started) / (double)G_USEC_PER_SEC);
+    report_progress(session, ok ? "done" : "failed", true);
+
+    g_hash_table_destroy(session->catalog);
+    session->catalog = NULL;
+    g_free(live);
+    g_atomic_int_set(&session->running, 0);
+    return NULL;
+}
+
+// Callback function for the backup menu item
+void on_menu_item_backup_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&active_lock);
+    if (active != NULL && g_atomic_int_compare_and_exchange(&active->running, 0, 1)) {
+        if (active->thread != NULL) {
+            g_thread_join(active->thread);
+        }
+        active->thread = g_thread_new("backup", backup_thread, active);
+    }
+    pthread_mutex_unlock(&active_lock);
+}
+
+backup_session_t* backup_start(idevice_t device, const char *udid) {
+    backup_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Backup] Failed to allocate memory for backup session\n", udid);
+        return NULL;
+    }
+    pthread_once(&gear_once, init_gear);
+
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    g_mutex_init(&session->lock);
+    g_cond_init(&session->settled);
+    session->buffers = g_async_queue_new();
+    session->workers = g_thread_pool_new(store_chunk, NULL, g_get_num_processors(), FALSE, NULL);
+
+    pthread_mutex_lock(&active_lock);
+    active = session;
+    pthread_mutex_unlock(&active_lock);
+    return session;
+}
+
+void backup_stop(backup_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&active_lock);
+    if (active == session) {
+        active = NULL;
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    // A running backup fails quickly once the device is gone
+    if (session->thread != NULL) {
+        g_thread_join(session->thread);
+    }
+    g_thread_pool_free(session->workers, FALSE, TRUE);
+    g_async_queue_unref(session->buffers);
+    g_mutex_clear(&session->lock);
+    g_cond_clear(&session->settled);
+    free(session);
+}
+
+// Entry point of `iosindicator --backup-export <udid> <dir> [generation]`, rebuilds a plain backup folder
+int backup_export_main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s --backup-export <udid> <dir> [generation]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *name = argc > 4 ? g_build_filename("generations", argv[4], NULL) : g_strdup("catalog");
+    char *path = catalog_path(argv[2], name);
+    GHashTable *catalog = catalog_load(path);
+    unsigned int failed = 0;
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, catalog);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct backup_file *file = value;
+        char *target = g_build_filename(argv[3], key, NULL);
+        if (file->is_dir) {
+            g_mkdir_with_parents(target, 0755);
+            g_free(target);
+            continue;
+        }
+
+        char *dir = g_path_get_dirname(target);
+        g_mkdir_with_parents(dir, 0755);
+        g_free(dir);
+        FILE *out = fopen(target, "wb");
+        bool ok = out != NULL;
+        for (guint i = 0; ok && i < file->chunks->len; ++i) {
+            uint32_t length = 0;
+            uint8_t *data = read_chunk(&g_array_index(file->chunks, struct chunk_id, i), &length);
+            ok = data != NULL && fwrite(data, 1, length, out) == length;
+            g_free(data);
+        }
+        if (out != NULL) {
+            ok = fclose(out) == 0 && ok;
+        }
+        if (!ok) {
+            fprintf(stderr, "[UDID=%s][Backup] Failed to export %s\n", argv[2], (const char *)key);
+            failed++;
+        }
+        g_free(target);
+    }
+
+    printf("[UDID=%s][Backup] Exported %u entries from %s to %s, %u failed\n", argv[2], g_hash_table_size(catalog), path, argv[3], failed);
+    g_hash_table_destroy(catalog);
+    g_free(path);
+    g_free(name);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
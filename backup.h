@@ -0,0 +1,16 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+// Opaque per-device backup engine
+typedef struct backup_session backup_session_t;
+
+// Function prototypes
+backup_session_t* backup_start(idevice_t device, const char *udid);
+void backup_stop(backup_session_t *session);
+int backup_export_main(int argc, char *argv[]);
+void on_menu_item_backup_clicked(GtkWidget *widget, gpointer data);
+
+#endif // BACKUP_H
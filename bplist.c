@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <plist/plist.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+#include "bplist.h"
+#include "pair.h"
+
+#define BPLIST_HEADER "bplist00"
+#define BPLIST_HEADER_SIZE 8
+#define BPLIST_TRAILER_SIZE 32
+#define BPLIST_MAX_KEYS 64
+#define BPLIST_BENCH_ITERATIONS 10000
+
+/**
+ * Binary plist view. Objects are found through the offset table and read in
+ * place: strings come back as pointers into the buffer, numbers are decoded
+ * on the fly, and a lookup walks the dict's key refs once for any number of
+ * wanted keys. Nothing is allocated, so it suits hot paths that only need a
+ * handful of fields from a large reply. Every offset is bounds checked, a
+ * malformed buffer yields missing values rather than a crash.
+ */
+
+static uint64_t read_be(const uint8_t *p, size_t n) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; i++) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+bool bplist_view_init(struct bplist_view *view, const void *data, size_t size) {
+    memset(view, 0, sizeof(*view));
+    if (data == NULL || size < BPLIST_HEADER_SIZE + BPLIST_TRAILER_SIZE || memcmp(data, BPLIST_HEADER, BPLIST_HEADER_SIZE) != 0) {
+        return false;
+    }
+    const uint8_t *trailer = (const uint8_t *)data + size - BPLIST_TRAILER_SIZE;
+    view->data = data;
+    view->size = size;
+    view->offset_size = trailer[6];
+    view->ref_size = trailer[7];
+    view->num_objects = read_be(trailer + 8, 8);
+    view->root = read_be(trailer + 16, 8);
+    view->offset_table = read_be(trailer + 24, 8);
+
+    if (view->offset_size < 1 || view->offset_size > 8 || view->ref_size < 1 || view->ref_size > 8
+        || view->root >= view->num_objects || view->offset_table < BPLIST_HEADER_SIZE
+        || view->offset_table > size - BPLIST_TRAILER_SIZE
+        || view->num_objects > (size - BPLIST_TRAILER_SIZE - view->offset_table) / view->offset_size) {
+        memset(view, 0, sizeof(*view));
+        return false;
+    }
+    return true;
+}
+
+static bool object_offset(const struct bplist_view *view, uint64_t object, uint64_t *offset) {
+    if (object >= view->num_objects) {
+        return false;
+    }
+    *offset = read_be(view->data + view->offset_table + object * view->offset_size, view->offset_size);
+    return *offset >= BPLIST_HEADER_SIZE && *offset < view->offset_table;
+}
+
+// Element count from the marker's low nibble, or from the int that follows it
+static bool read_count(const struct bplist_view *view, uint64_t offset, uint64_t *count, uint64_t *start) {
+    uint8_t low = view->data[offset] & 0x0F;
+    if (low != 0x0F) {
+        *count = low;
+        *start = offset + 1;
+        return true;
+    }
+    if (offset + 2 > view->offset_table || (view->data[offset + 1] & 0xF0) != 0x10) {
+        return false;
+    }
+    size_t bytes = (size_t)1 << (view->data[offset + 1] & 0x0F);
+    if (bytes > 8 || offset + 2 + bytes > view->offset_table) {
+        return false;
+    }
+    *count = read_be(view->data + offset + 2, bytes);
+    *start = offset + 2 + bytes;
+    return true;
+}
+
+static bool fits(const struct bplist_view *view, uint64_t start, uint64_t count, uint64_t width) {
+    return count <= (view->offset_table - start) / width;
+}
+
+static void decode(const struct bplist_view *view, uint64_t object, struct bplist_value *value) {
+    memset(value, 0, sizeof(*value));
+    value->type = BPLIST_MISSING;
+    uint64_t offset = 0, count = 0, start = 0;
+    if (!object_offset(view, object, &offset)) {
+        return;
+    }
+    uint8_t marker = view->data[offset];
+    size_t bytes = (size_t)1 << (marker & 0x0F);
+
+    switch (marker >> 4) {
+    case 0x0:
+        if (marker == 0x08 || marker == 0x09) {
+            value->type = BPLIST_BOOL;
+            value->integer = marker == 0x09;
+        } else if (marker == 0x00) {
+            value->type = BPLIST_NULL;
+        }
+        break;
+    case 0x1:
+        // 16-byte ints only occur for values past INT64_MAX, keep the low half
+        if (bytes <= 16 && offset + 1 + bytes <= view->offset_table) {
+            value->type = BPLIST_INT;
+            value->integer = (int64_t)read_be(view->data + offset + 1 + (bytes > 8 ? bytes - 8 : 0), MIN(bytes, 8));
+        }
+        break;
+    case 0x2:
+    case 0x3:
+        if ((bytes == 4 || bytes == 8) && offset + 1 + bytes <= view->offset_table) {
+            uint64_t bits = read_be(view->data + offset + 1, bytes);
+            if (bytes == 4) {
+                float f;
+                uint32_t b32 = (uint32_t)bits;
+                memcpy(&f, &b32, sizeof(f));
+                value->real = f;
+            } else {
+                memcpy(&value->real, &bits, sizeof(value->real));
+            }
+            value->type = (marker >> 4) == 0x2 ? BPLIST_REAL : BPLIST_DATE;
+        }
+        break;
+    case 0x4:
+    case 0x5:
+    case 0x6:
+        if (read_count(view, offset, &count, &start)) {
+            uint64_t width = (marker >> 4) == 0x6 ? 2 : 1;
+            if (fits(view, start, count, width)) {
+                value->type = (marker >> 4) == 0x4 ? BPLIST_DATA : (marker >> 4) == 0x5 ? BPLIST_ASCII : BPLIST_UTF16;
+                value->ptr = view->data + start;
+                value->len = count * width;
+            }
+        }
+        break;
+    case 0x8:
+        bytes = (marker & 0x0F) + 1;
+        if (offset + 1 + bytes <= view->offset_table) {
+            value->type = BPLIST_UID;
+            value->integer = (int64_t)read_be(view->data + offset + 1, bytes);
+        }
+        break;
+    case 0xA:
+    case 0xD:
+        if (read_count(view, offset, &count, &start)) {
+            value->type = (marker >> 4) == 0xA ? BPLIST_ARRAY : BPLIST_DICT;
+            value->object = object;
+            value->len = count;
+        }
+        break;
+    }
+}
+
+/**
+ * Fills values[i] for keys[i] from the dict object (view->root for the top
+ * level) and returns how many were found. Keys not present, or a dict that
+ * is not one, leave BPLIST_MISSING.
+ */
+size_t bplist_view_lookup(const struct bplist_view *view, uint64_t dict, const char *const *keys, size_t count, struct bplist_value *values) {
+    size_t lengths[BPLIST_MAX_KEYS];
+    count = MIN(count, BPLIST_MAX_KEYS);
+    for (size_t k = 0; k < count; k++) {
+        values[k].type = BPLIST_MISSING;
+        lengths[k] = strlen(keys[k]);
+    }
+
+    uint64_t offset = 0, entries = 0, start = 0;
+    if (view->data == NULL || !object_offset(view, dict, &offset) || (view->data[offset] & 0xF0) != 0xD0
+        || !read_count(view, offset, &entries, &start) || entries > (view->offset_table - start) / view->ref_size / 2) {
+        return 0;
+    }
+
+    size_t found = 0;
+    const uint8_t *key_refs = view->data + start;
+    const uint8_t *value_refs = key_refs + entries * view->ref_size;
+    for (uint64_t i = 0; i < entries && found < count; i++) {
+        uint64_t key_offset = 0, key_length = 0, key_start = 0;
+        uint64_t key_object = read_be(key_refs + i * view->ref_size, view->ref_size);
+        if (!object_offset(view, key_object, &key_offset) || (view->data[key_offset] & 0xF0) != 0x50
+            || !read_count(view, key_offset, &key_length, &key_start) || !fits(view, key_start, key_length, 1)) {
+            continue;
+        }
+        for (size_t k = 0; k < count; k++) {
+            if (values[k].type == BPLIST_MISSING && lengths[k] == key_length
+                && memcmp(view->data + key_start, keys[k], key_length) == 0) {
+                decode(view, read_be(value_refs + i * view->ref_size, view->ref_size), &values[k]);
+                found += values[k].type != BPLIST_MISSING;
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+/**
+ * Benchmark
+ */
+
+// The root-domain keys the device thread reads for the menu
+static const char *const bench_keys[] = {
+    "DeviceClass", "ProductName", "ProductVersion", "DeviceName", "MobileEquipmentIdentifier",
+    "InternationalMobileEquipmentIdentity", "DeviceColor", "PhoneNumber", "ActivationState", "PasswordProtected"
+};
+
+// Root-domain dump from the first attached device, serialized the way services send it
+static bool fetch_dump(char **bin, uint32_t *length) {
+    char **devices = NULL;
+    int count = 0;
+    if (idevice_get_device_list(&devices, &count) != IDEVICE_E_SUCCESS || count == 0) {
+        fprintf(stderr, "[Bench] No device attached, pass a plist file instead\n");
+        return false;
+    }
+    char *udid = g_strdup(devices[0]);
+    idevice_device_list_free(devices);
+
+    idevice_t device = NULL;
+    lockdownd_client_t client = NULL;
+    plist_t dump = NULL;
+    if (idevice_new(&device, udid) == IDEVICE_E_SUCCESS && pair_lockdown_client_new(device, udid, &client) == LOCKDOWN_E_SUCCESS) {
+        lockdownd_get_value(client, NULL, NULL, &dump);
+        lockdownd_client_free(client);
+    }
+    if (device != NULL) idevice_free(device);
+    if (dump != NULL) {
+        printf("[UDID=%s][Bench] Using the live root-domain dump\n", udid);
+        plist_to_bin(dump, bin, length);
+        plist_free(dump);
+    }
+    g_free(udid);
+    return *bin != NULL;
+}
+
+// Accepts binary or XML plists; XML is converted once up front
+static bool load_file(const char *path, char **bin, uint32_t *length) {
+    char *contents = NULL;
+    gsize size = 0;
+    if (!g_file_get_contents(path, &contents, &size, NULL)) {
+        fprintf(stderr, "[Bench] Failed to read %s\n", path);
+        return false;
+    }
+    plist_t root = NULL;
+    plist_from_memory(contents, (uint32_t)size, &root, NULL);
+    g_free(contents);
+    if (root == NULL) {
+        fprintf(stderr, "[Bench] %s is not a plist\n", path);
+        return false;
+    }
+    plist_to_bin(root, bin, length);
+    plist_free(root);
+    return *bin != NULL;
+}
+
+// Entry point of `iosindicator --plist-bench [plist-file] [iterations]`
+int bplist_bench_main(int argc, char *argv[]) {
+    char *bin = NULL;
+    uint32_t length = 0;
+    if (!(argc > 2 ? load_file(argv[2], &bin, &length) : fetch_dump(&bin, &length))) {
+        fprintf(stderr, "Usage: %s --plist-bench [plist-file] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    long iterations = argc > 3 ? strtol(argv[3], NULL, 10) : BPLIST_BENCH_ITERATIONS;
+    if (iterations <= 0) {
+        iterations = BPLIST_BENCH_ITERATIONS;
+    }
+    size_t key_count = G_N_ELEMENTS(bench_keys);
+    struct bplist_value values[G_N_ELEMENTS(bench_keys)];
+
+    // Same answers from both paths before timing anything
+    struct bplist_view view;
+    if (!bplist_view_init(&view, bin, length)) {
+        fprintf(stderr, "[Bench] Serialized dump did not parse as bplist00\n");
+        free(bin);
+        return EXIT_FAILURE;
+    }
+    plist_t tree = NULL;
+    plist_from_bin(bin, length, &tree);
+    bplist_view_lookup(&view, view.root, bench_keys, key_count, values);
+    for (size_t k = 0; k < key_count; k++) {
+        plist_t node = tree ? plist_dict_get_item(tree, bench_keys[k]) : NULL;
+        const char *expected = node && plist_get_node_type(node) == PLIST_STRING ? plist_get_string_ptr(node, NULL) : NULL;
+        if (expected != NULL && (values[k].type != BPLIST_ASCII || values[k].len != strlen(expected)
+                                 || memcmp(values[k].ptr, expected, values[k].len) != 0)) {
+            fprintf(stderr, "[Bench] View disagrees with libplist on %s\n", bench_keys[k]);
+        }
+    }
+    if (tree) plist_free(tree);
+
+    // libplist: full tree, one lookup and one string copy per key
+    size_t found = 0;
+    gint64 started = g_get_monotonic_time();
+    for (long i = 0; i < iterations; i++) {
+        plist_t root = NULL;
+        plist_from_bin(bin, length, &root);
+        for (size_t k = 0; k < key_count; k++) {
+            plist_t node = plist_dict_get_item(root, bench_keys[k]);
+            if (node != NULL && plist_get_node_type(node) == PLIST_STRING) {
+                char *value = NULL;
+                plist_get_string_val(node, &value);
+                free(value);
+                found++;
+            }
+        }
+        plist_free(root);
+    }
+    double tree_us = (g_get_monotonic_time() - started) / (double)iterations;
+    size_t tree_found = found / iterations;
+
+    // View: one pass over the root dict, string views into the buffer
+    found = 0;
+    started = g_get_monotonic_time();
+    for (long i = 0; i < iterations; i++) {
+        bplist_view_init(&view, bin, length);
+        bplist_view_lookup(&view, view.root, bench_keys, key_count, values);
+        for (size_t k = 0; k < key_count; k++) {
+            found += values[k].type == BPLIST_ASCII;
+        }
+    }
+    double view_us = (g_get_monotonic_time() - started) / (double)iterations;
+    size_t view_found = found / iterations;
+
+    printf("[Bench] %u byte dump, %zu keys, %ld iterations\n", length, key_count, iterations);
+    printf("[Bench] plist_from_bin + lookups: %.2f us per decode, %zu strings copied\n", tree_us, tree_found);
+    printf("[Bench] bplist view:              %.2f us per decode, %zu strings viewed, no allocations\n", view_us, view_found);
+    printf("[Bench] Speedup: %.1fx\n", view_us > 0 ? tree_us / view_us : 0);
+    free(bin);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+#ifndef BPLIST_H
+#define BPLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Read-only view over a bplist00 buffer; nothing is copied, the buffer must outlive it
+struct bplist_view {
+    const uint8_t *data;
+    size_t size;
+    uint8_t offset_size;
+    uint8_t ref_size;
+    uint64_t num_objects;
+    uint64_t root;
+    uint64_t offset_table;
+};
+
+typedef enum {
+    BPLIST_MISSING,
+    BPLIST_NULL,
+    BPLIST_BOOL,
+    BPLIST_INT,
+    BPLIST_REAL,
+    BPLIST_DATE,
+    BPLIST_DATA,
+    BPLIST_ASCII,   // ptr/len, not NUL-terminated
+    BPLIST_UTF16,   // ptr/len in bytes, big-endian code units
+    BPLIST_UID,
+    BPLIST_ARRAY,   // object/len, walk with bplist_view_lookup() only for dicts
+    BPLIST_DICT
+} bplist_type_t;
+
+struct bplist_value {
+    bplist_type_t type;
+    const uint8_t *ptr;
+    size_t len;
+    uint64_t object;  // For arrays and dicts, pass to bplist_view_lookup()
+    int64_t integer;  // Ints, UIDs and bools
+    double real;      // Reals and dates
+};
+
+// Function prototypes
+bool bplist_view_init(struct bplist_view *view, const void *data, size_t size);
+size_t bplist_view_lookup(const struct bplist_view *view, uint64_t dict, const char *const *keys, size_t count, struct bplist_value *values);
+int bplist_bench_main(int argc, char *argv[]);
+
+#endif // BPLIST_H
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "budget.h"
+
+#define BUDGET_DEFAULT_RPS 20        // Requests/s, overridden by IOSINDICATOR_BUDGET_RPS
+#define BUDGET_DEFAULT_KBPS 4096     // KiB/s, overridden by IOSINDICATOR_BUDGET_KBPS
+#define BUDGET_MIN_RPS 1.0
+#define BUDGET_BURST_SECONDS 2.0     // Bucket depth, in seconds of the current rate
+#define BUDGET_BUSY_FACTOR 3.0       // Latency over this many times the baseline means busy
+#define BUDGET_BUSY_FLOOR_US (50 * 1000)
+#define BUDGET_ADJUST_INTERVAL_US G_USEC_PER_SEC
+
+/**
+ * Token buckets, one per UDID and shared by every feature talking to that
+ * device. Each request takes a token and pays for the bytes it moved
+ * afterwards, so a large transfer leaves the byte bucket in debt and the
+ * next request waits it out. The request rate itself adapts: when replies
+ * get much slower than the device's usual latency it is halved, and it
+ * creeps back up by one request/s per healthy second.
+ */
+
+struct bucket {
+    double tokens;
+    double byte_tokens;
+    double rate;
+    double latency_us;  // Smoothed
+    double baseline_us; // Lowest recent latency, drifts up slowly
+    gint64 refilled;
+    gint64 adjusted;
+    struct budget_stats stats;
+};
+
+static GHashTable *buckets = NULL; // udid -> struct bucket
+static GMutex budget_lock;
+static double max_rate = 0;
+static double byte_rate = 0;
+
+static long env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+    long parsed = value ? strtol(value, NULL, 10) : 0;
+    return parsed > 0 ? parsed : fallback;
+}
+
+// Must be called with budget_lock held
+static struct bucket* get_bucket(const char *udid) {
+    if (buckets == NULL) {
+        buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        max_rate = env_long("IOSINDICATOR_BUDGET_RPS", BUDGET_DEFAULT_RPS);
+        byte_rate = env_long("IOSINDICATOR_BUDGET_KBPS", BUDGET_DEFAULT_KBPS) * 1024.0;
+    }
+    struct bucket *bucket = g_hash_table_lookup(buckets, udid);
+    if (bucket == NULL) {
+        bucket = g_new0(struct bucket, 1);
+        bucket->rate = max_rate;
+        bucket->tokens = max_rate * BUDGET_BURST_SECONDS;
+        bucket->byte_tokens = byte_rate * BUDGET_BURST_SECONDS;
+        bucket->refilled = bucket->adjusted = g_get_monotonic_time();
+        g_hash_table_replace(buckets, g_strdup(udid), bucket);
+    }
+    return bucket;
+}
+
+static void refill(struct bucket *bucket, gint64 now) {
+    double elapsed = (now - bucket->refilled) / (double)G_USEC_PER_SEC;
+    bucket->refilled = now;
+    bucket->tokens = MIN(bucket->tokens + elapsed * bucket->rate, bucket->rate * BUDGET_BURST_SECONDS);
+    bucket->byte_tokens = MIN(bucket->byte_tokens + elapsed * byte_rate, byte_rate * BUDGET_BURST_SECONDS);
+}
+
+// Blocks until the device has budget for one more request
+void budget_acquire(const char *udid) {
+    gint64 started = g_get_monotonic_time();
+    bool waited = false;
+
+    g_mutex_lock(&budget_lock);
+    while (true) {
+        gint64 now = g_get_monotonic_time();
+        struct bucket *bucket = get_bucket(udid);
+        refill(bucket, now);
+        if (bucket->tokens >= 1 && bucket->byte_tokens >= 0) {
+            bucket->tokens -= 1;
+            bucket->stats.requests++;
+            if (waited) {
+                bucket->stats.waits++;
+                bucket->stats.waited_us += now - started;
+            }
+            break;
+        }
+        double need = MAX(bucket->tokens < 1 ? (1 - bucket->tokens) / bucket->rate : 0,
+                          bucket->byte_tokens < 0 ? -bucket->byte_tokens / byte_rate : 0);
+        g_mutex_unlock(&budget_lock);
+        g_usleep(MAX((gulong)(need * G_USEC_PER_SEC), 1000));
+        waited = true;
+        g_mutex_lock(&budget_lock);
+    }
+    g_mutex_unlock(&budget_lock);
+}
+
+/**
+ * Charges bytes moved by a request and feeds its latency to the throttle.
+ * Transfers whose duration depends on their size pass 0 for latency so
+ * only short requests are taken as a sign of how busy the device is.
+ */
+void budget_complete(const char *udid, size_t bytes, gint64 latency_us) {
+    g_mutex_lock(&budget_lock);
+    gint64 now = g_get_monotonic_time();
+    struct bucket *bucket = get_bucket(udid);
+    bucket->byte_tokens -= bytes;
+    bucket->stats.bytes += bytes;
+    if (latency_us <= 0) {
+        g_mutex_unlock(&budget_lock);
+        return;
+    }
+
+    bucket->latency_us = bucket->latency_us > 0 ? bucket->latency_us * 0.8 + latency_us * 0.2 : latency_us;
+    if (bucket->baseline_us == 0 || latency_us < bucket->baseline_us) {
+        bucket->baseline_us = latency_us;
+    } else {
+        bucket->baseline_us += (latency_us - bucket->baseline_us) * 0.01;
+    }
+    if (now - bucket->adjusted < BUDGET_ADJUST_INTERVAL_US) {
+        g_mutex_unlock(&budget_lock);
+        return;
+    }
+    bucket->adjusted = now;
+
+    double busy_us = MAX(bucket->baseline_us * BUDGET_BUSY_FACTOR, BUDGET_BUSY_FLOOR_US);
+    if (bucket->latency_us > busy_us && bucket->rate > BUDGET_MIN_RPS) {
+        bucket->rate = MAX(bucket->rate / 2, BUDGET_MIN_RPS);
+        bucket->tokens = MIN(bucket->tokens, bucket->rate * BUDGET_BURST_SECONDS);
+        bucket->stats.throttle_events++;
+        fprintf(stderr, "[UDID=%s][Budget] Device busy (%.1f ms, baseline %.1f ms), throttling to %.1f req/s\n",
+                udid, bucket->latency_us / 1000.0, bucket->baseline_us / 1000.0, bucket->rate);
+    } else if (bucket->latency_us <= busy_us && bucket->rate < max_rate) {
+        bucket->rate = MIN(bucket->rate + 1, max_rate);
+        if (bucket->rate == max_rate) {
+            printf("[UDID=%s][Budget] Latency back to %.1f ms, throttle lifted\n", udid, bucket->latency_us / 1000.0);
+        }
+    }
+    g_mutex_unlock(&budget_lock);
+}
+
+void budget_get_stats(const char *udid, struct budget_stats *stats) {
+    g_mutex_lock(&budget_lock);
+    struct bucket *bucket = get_bucket(udid);
+    *stats = bucket->stats;
+    stats->rate = bucket->rate;
+    stats->latency_ms = bucket->latency_us / 1000.0;
+    g_mutex_unlock(&budget_lock);
+}
+
+// One-line summary for the diagnostics logs, free with g_free()
+char* budget_describe(const char *udid) {
+    struct budget_stats stats;
+    budget_get_stats(udid, &stats);
+    return g_strdup_printf("budget %.1f req/s, latency %.1f ms, %lu requests, %lu KiB, %lu throttled, %lu waits (%.1f ms)",
+                           stats.rate, stats.latency_ms, (unsigned long)stats.requests, (unsigned long)(stats.bytes / 1024),
+                           (unsigned long)stats.throttle_events, (unsigned long)stats.waits, stats.waited_us / 1000.0);
+}
@@ -0,0 +1,24 @@
+#ifndef BUDGET_H
+#define BUDGET_H
+
+#include <stddef.h>
+#include <glib.h>
+
+// Per-device request budget
+struct budget_stats {
+    double rate;             // Requests per second currently allowed
+    double latency_ms;       // Smoothed response latency
+    guint64 requests;
+    guint64 bytes;
+    guint64 throttle_events; // Times the rate was cut because the device looked busy
+    guint64 waits;           // Requests that had to wait for a token
+    gint64 waited_us;
+};
+
+// Function prototypes
+void budget_acquire(const char *udid);
+void budget_complete(const char *udid, size_t bytes, gint64 latency_us);
+void budget_get_stats(const char *udid, struct budget_stats *stats);
+char* budget_describe(const char *udid);
+
+#endif // BUDGET_H
@@ -1,7 +1,14 @@
 #!/bin/bash
 
 mkdir -p dist
-gcc -o ./dist/iosindicator main.c device.c tray.c \
+
+# The --mount filesystem is only built when libfuse3 is installed
+FUSE_FLAGS=""
+if pkg-config --exists fuse3; then
+    FUSE_FLAGS="-DHAVE_FUSE $(pkg-config --cflags --libs fuse3)"
+fi
+
+gcc -o ./dist/iosindicator main.c device.c tray.c crashwatch.c apps.c icons.c transfer.c import.c hash.c afcfs.c sync.c backup.c reports.c symbolicate.c screenshot.c fleet.c watches.c pair.c dispatch.c budget.c statusicon.c bplist.c fields.c arena.c snapshot.c heavy.c \
 -Wl,-Bstatic \
 ./lib/libimobiledevice.a \
 ./lib/libusbmuxd.a \
@@ -15,4 +22,6 @@ gcc -o ./dist/iosindicator main.c device.c tray.c \
 -Wl,-Bdynamic \
 -lgtk-3 \
 $(pkg-config --cflags --libs gtk+-3.0) \
+$FUSE_FLAGS \
+-lz \
 -lm
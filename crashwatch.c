@@ -0,0 +1,564 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <gio/gio.h>
+
+#include "crashwatch.h"
+#include "tray.h" // To access the global indicator variable
+
+#define LINE_MAX_LEN 1024
+#define NAME_MAX_LEN 48
+#define COUNTER_SLOTS 64 // Must be a power of two
+#define COUNTER_PROBES 8
+#define AC_MAX_STATES 512
+#define AC_MAX_CLASSES 64
+#define WATCHLIST_MAX 32
+#define CRASH_DEDUPE_US (5 * G_USEC_PER_SEC) // Lines about the same crash arrive within this window
+#define RECENT_CRASHES 8
+
+// Signatures recognized in a single pass over each syslog line
+static const struct {
+    const char *needle;
+    crashwatch_kind_t kind;
+} signatures[] = {
+    {"Formulating report for corpse", CRASHWATCH_CRASH},
+    {"' crashed.", CRASHWATCH_CRASH},
+    {"Terminating app due to uncaught exception", CRASHWATCH_CRASH},
+    {"EXC_BAD_ACCESS", CRASHWATCH_CRASH},
+    {"EXC_BAD_INSTRUCTION", CRASHWATCH_CRASH},
+    {"EXC_CRASH", CRASHWATCH_CRASH},
+    {"memorystatus: killing", CRASHWATCH_JETSAM},
+    {"killed by jetsam", CRASHWATCH_JETSAM},
+    {"per-process-limit", CRASHWATCH_JETSAM},
+    {"8badf00d", CRASHWATCH_WATCHDOG},
+    {"watchdog transgression", CRASHWATCH_WATCHDOG},
+    {"scene-create watchdog", CRASHWATCH_WATCHDOG},
+    {"failed to scene-update in time", CRASHWATCH_WATCHDOG},
+};
+
+static const char *kind_names[CRASHWATCH_KIND_COUNT] = {"crash", "jetsam", "watchdog"};
+
+/**
+ * Aho-Corasick automaton, compiled once and shared read-only by every device.
+ * Bytes that never occur in a signature collapse into class 0, which keeps the
+ * transition table small enough to stay in cache.
+ */
+static uint8_t ac_class[256];
+static uint16_t ac_next[AC_MAX_STATES][AC_MAX_CLASSES];
+static uint8_t ac_out[AC_MAX_STATES]; // Bitmask of crashwatch_kind_t
+static pthread_once_t ac_once = PTHREAD_ONCE_INIT;
+
+// Apps we care about, from IOSINDICATOR_CRASH_WATCH (comma separated)
+static char *watchlist[WATCHLIST_MAX];
+static unsigned int watchlist_len = 0;
+
+static gint total_crashes = 0;
+
+// Compact per-process counters, fixed size so memory stays constant
+struct crash_counter {
+    uint32_t hash;
+    uint32_t counts[CRASHWATCH_KIND_COUNT];
+    char name[NAME_MAX_LEN];
+};
+
+// A crash counted within the dedupe window, its lines name it by pid or by bundle id
+struct recent_crash {
+    gint64 seen;
+    crashwatch_kind_t kind;
+    long pid;     // 0 until a line carrying the pid arrived
+    bool pidless; // A line without a pid (SpringBoard's bundle id) was folded in
+    char name[NAME_MAX_LEN];
+};
+
+struct crashwatch {
+    char udid[64];
+    syslog_relay_client_t relay;
+    char line[LINE_MAX_LEN];
+    size_t line_len;
+    struct crash_counter counters[COUNTER_SLOTS];
+    struct recent_crash recent[RECENT_CRASHES];
+    unsigned int recent_next;
+};
+
+// Payload handed over to the GTK main loop
+struct crash_event {
+    char udid[64];
+    char name[NAME_MAX_LEN];
+    crashwatch_kind_t kind;
+    uint32_t count;
+    bool watched;
+};
+
+static void build_automaton(void) {
+    unsigned int classes = 1;
+    unsigned int states = 1;
+
+    // Assign alphabet classes
+    for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); ++i) {
+        for (const unsigned char *p = (const unsigned char *)signatures[i].needle; *p; ++p) {
+            if (ac_class[*p] == 0 && classes < AC_MAX_CLASSES) {
+                ac_class[*p] = classes++;
+            }
+        }
+    }
+
+    // Build the trie
+    for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); ++i) {
+        unsigned int state = 0;
+        for (const unsigned char *p = (const unsigned char *)signatures[i].needle; *p; ++p) {
+            uint8_t c = ac_class[*p];
+            if (ac_next[state][c] == 0) {
+                if (states >= AC_MAX_STATES) {
+                    fprintf(stderr, "[Crashwatch] Signature table too large\n");
+                    break;
+                }
+                ac_next[state][c] = states++;
+            }
+            state = ac_next[state][c];
+        }
+        ac_out[state] |= 1u << signatures[i].kind;
+    }
+
+    // Breadth-first pass folding failure links into the transition table
+    uint16_t queue[AC_MAX_STATES];
+    uint16_t fail[AC_MAX_STATES] = {0};
+    unsigned int head = 0, tail = 0;
+    for (unsigned int c = 0; c < classes; ++c) {
+        if (ac_next[0][c] != 0) {
+            queue[tail++] = ac_next[0][c];
+        }
+    }
+    while (head < tail) {
+        uint16_t s = queue[head++];
+        for (unsigned int c = 0; c < classes; ++c) {
+            uint16_t t = ac_next[s][c];
+            if (t != 0) {
+                fail[t] = ac_next[fail[s]][c];
+                ac_out[t] |= ac_out[fail[t]];
+                queue[tail++] = t;
+            } else {
+                ac_next[s][c] = ac_next[fail[s]][c];
+            }
+        }
+    }
+
+    // Parse the watchlist once as well
+    const char *env = getenv("IOSINDICATOR_CRASH_WATCH");
+    if (env != NULL) {
+        gchar **entries = g_strsplit(env, ",", -1);
+        for (gchar **e = entries; *e != NULL && watchlist_len < WATCHLIST_MAX; ++e) {
+            g_strstrip(*e);
+            if (**e != '\0') {
+                watchlist[watchlist_len++] = g_strdup(*e);
+            }
+        }
+        g_strfreev(entries);
+    }
+
+    printf("[Crashwatch] Compiled %u states over %u classes, watching %u apps\n", states, classes, watchlist_len);
+}
+
+static bool is_numeric_token(const char *s, size_t len) {
+    if (len > 2 && s[0] == '0' && s[1] == 'x') {
+        s += 2;
+        len -= 2;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (!isxdigit((unsigned char)s[i])) {
+            return false;
+        }
+    }
+    return len > 0;
+}
+
+// Decimal only, the hex tokens in SpringBoard lines are not pids
+static long parse_pid(const char *s, size_t len) {
+    long pid = 0;
+    for (size_t i = 0; i < len; ++i) {
+        if (!isdigit((unsigned char)s[i]) || pid > 99999999) {
+            return 0;
+        }
+        pid = pid * 10 + (s[i] - '0');
+    }
+    return pid;
+}
+
+static bool is_name_char(char c) {
+    return isalnum((unsigned char)c) || c == '.' || c == '-' || c == '_';
+}
+
+static void copy_token(char *out, const char *start, size_t len) {
+    if (len >= NAME_MAX_LEN) {
+        len = NAME_MAX_LEN - 1;
+    }
+    memcpy(out, start, len);
+    out[len] = '\0';
+}
+
+/**
+ * Work out which process a matched line is about: an explicit bundle id,
+ * a bracketed process name or a pid next to a name after the signature, or
+ * the logging process. pid is set when the line carries the one of the
+ * process, 0 otherwise.
+ */
+static bool extract_subject(const char *line, size_t len, size_t match_end, char *out, long *pid) {
+    const char *end = line + len;
+    *pid = 0;
+
+    const char *app = strstr(line, "UIKitApplication:");
+    if (app != NULL) {
+        app += strlen("UIKitApplication:");
+        const char *stop = app;
+        while (stop < end && *stop != '[' && *stop != '\'') stop++;
+        if (stop > app) {
+            copy_token(out, app, stop - app);
+            return true;
+        }
+    }
+
+    for (const char *p = line + match_end; p < end; ++p) {
+        if (*p != '[') continue;
+        const char *close = memchr(p + 1, ']', end - p - 1);
+        if (close == NULL) break;
+        if (!is_numeric_token(p + 1, close - p - 1)) {
+            copy_token(out, p + 1, close - p - 1);
+            return true;
+        }
+        // "EXC_BAD_ACCESS -> MyApp[123]" names the process right before the pid
+        const char *start = p;
+        while (start > line + match_end && is_name_char(start[-1])) start--;
+        if (start < p) {
+            copy_token(out, start, p - start);
+            *pid = parse_pid(p + 1, close - p - 1);
+            return true;
+        }
+        // "corpse[123] MyApp" names the process right after the pid
+        const char *word = close + 1;
+        while (word < end && *word == ' ') word++;
+        const char *stop = word;
+        while (stop < end && is_name_char(*stop)) stop++;
+        if (stop > word) {
+            copy_token(out, word, stop - word);
+            *pid = parse_pid(p + 1, close - p - 1);
+            return true;
+        }
+        p = close;
+    }
+
+    // Fall back to the process that logged the line: "Process(Lib)[pid] <Level>:"
+    const char *marker = strstr(line, "] <");
+    if (marker != NULL) {
+        const char *open = marker;
+        while (open > line && *open != '[') open--;
+        const char *start = open;
+        while (start > line && start[-1] != ' ') start--;
+        const char *stop = start;
+        while (stop < open && *stop != '(') stop++;
+        if (stop > start) {
+            copy_token(out, start, stop - start);
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static struct crash_counter* counter_for(crashwatch_t *watch, const char *name) {
+    uint32_t h = hash_name(name);
+    struct crash_counter *victim = NULL;
+    uint32_t victim_total = UINT32_MAX;
+
+    for (unsigned int i = 0; i < COUNTER_PROBES; ++i) {
+        struct crash_counter *slot = &watch->counters[(h + i) & (COUNTER_SLOTS - 1)];
+        if (slot->hash == h && strcmp(slot->name, name) == 0) {
+            return slot;
+        }
+        uint32_t total = slot->hash == 0 ? 0 : slot->counts[0] + slot->counts[1] + slot->counts[2];
+        if (total < victim_total) {
+            victim = slot;
+            victim_total = total;
+        }
+    }
+
+    // Reuse an empty slot or evict the least crashing process in the window
+    memset(victim, 0, sizeof(*victim));
+    victim->hash = h;
+    strncpy(victim->name, name, sizeof(victim->name) - 1);
+    return victim;
+}
+
+/**
+ * One crash is logged several times: ReportCrash and the kernel name the
+ * process and its pid, SpringBoard only the bundle id. Lines are matched
+ * on the pid; a line without one is folded into a crash of the same kind
+ * in the window that has none yet, and the other way round, whichever
+ * arrives first. Two apps crashing within the window can then be counted
+ * once, never one crash twice.
+ */
+static bool seen_recently(crashwatch_t *watch, crashwatch_kind_t kind, long pid, const char *name, gint64 now) {
+    struct recent_crash *fold = NULL;
+    for (unsigned int i = 0; i < RECENT_CRASHES; ++i) {
+        struct recent_crash *crash = &watch->recent[i];
+        if (crash->seen == 0 || crash->kind != kind || now - crash->seen >= CRASH_DEDUPE_US) {
+            continue;
+        }
+        if (pid != 0 ? crash->pid == pid : crash->pidless && strcmp(crash->name, name) == 0) {
+            return true;
+        }
+        if (fold == NULL && (pid != 0 ? crash->pid == 0 : !crash->pidless)) {
+            fold = crash;
+        }
+    }
+    if (fold != NULL) {
+        if (pid != 0) {
+            fold->pid = pid;
+        } else {
+            fold->pidless = true;
+        }
+        return true;
+    }
+
+    struct recent_crash *crash = &watch->recent[watch->recent_next++ % RECENT_CRASHES];
+    crash->seen = now;
+    crash->kind = kind;
+    crash->pid = pid;
+    crash->pidless = pid == 0;
+    copy_token(crash->name, name, strlen(name));
+    return false;
+}
+
+static bool is_watched(const char *name) {
+    for (unsigned int i = 0; i < watchlist_len; ++i) {
+        if (strcasecmp(watchlist[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void on_notification_sent(GObject *source, GAsyncResult *res, gpointer data) {
+    GError *error = NULL;
+    GVariant *result = g_dbus_connection_call_finish(G_DBUS_CONNECTION(source), res, &error);
+    if (result != NULL) {
+        g_variant_unref(result);
+    } else {
+        fprintf(stderr, "[Crashwatch] Failed to send notification: %s\n", error->message);
+        g_error_free(error);
+    }
+}
+
+static void send_notification(const char *summary, const char *body) {
+    static GDBusConnection *bus = NULL;
+    if (bus == NULL) {
+        GError *error = NULL;
+        bus = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+        if (bus == NULL) {
+            fprintf(stderr, "[Crashwatch] No session bus: %s\n", error->message);
+            g_error_free(error);
+            return;
+        }
+    }
+
+    g_dbus_connection_call(bus, "org.freedesktop.Notifications", "/org/freedesktop/Notifications",
+                           "org.freedesktop.Notifications", "Notify",
+                           g_variant_new("(susssasa{sv}i)", "iOS Indicator", 0, "dialog-warning", summary, body, NULL, NULL, -1),
+                           NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, on_notification_sent, NULL);
+}
+
+static gboolean publish_crash_event(gpointer data) {
+    struct crash_event *event = data;
+    if (tray == NULL || tray->widgets == NULL || tray->widgets->crashes == NULL) {
+        free(event);
+        return G_SOURCE_REMOVE;
+    }
+
+    char *label = g_strdup_printf("⚠ Crashes: %u (last: %s %s)", (unsigned int)g_atomic_int_get(&total_crashes), event->name, kind_names[event->kind]);
+    if (label != NULL) {
+        update_menu_item_label(GTK_MENU_ITEM(tray->widgets->crashes), label);
+        gtk_widget_show(tray->widgets->crashes);
+        g_free(label);
+    }
+
+    if (event->watched) {
+        app_indicator_set_status(tray->indicator, APP_INDICATOR_STATUS_ATTENTION);
+
+        char *summary = g_strdup_printf("%s: %s", event->name, kind_names[event->kind]);
+        char *body = g_strdup_printf("Seen %u times on %s", event->count, event->udid);
+        send_notification(summary, body);
+        g_free(summary);
+        g_free(body);
+    }
+
+    free(event);
+    return G_SOURCE_REMOVE;
+}
+
+static void analyze_line(crashwatch_t *watch) {
+    const unsigned char *line = (const unsigned char *)watch->line;
+    unsigned int state = 0;
+    uint8_t kinds = 0;
+    size_t first_end = 0;
+
+    for (size_t i = 0; i < watch->line_len; ++i) {
+        state = ac_next[state][ac_class[line[i]]];
+        if (ac_out[state] != 0) {
+            if (kinds == 0) first_end = i + 1;
+            kinds |= ac_out[state];
+        }
+    }
+    if (kinds == 0) {
+        return;
+    }
+
+    // A line may carry several signatures, the most specific one wins
+    crashwatch_kind_t kind = (kinds & (1u << CRASHWATCH_WATCHDOG)) ? CRASHWATCH_WATCHDOG
+                           : (kinds & (1u << CRASHWATCH_JETSAM)) ? CRASHWATCH_JETSAM
+                           : CRASHWATCH_CRASH;
+
+    char name[NAME_MAX_LEN];
+    long pid = 0;
+    if (!extract_subject(watch->line, watch->line_len, first_end, name, &pid)) {
+        return;
+    }
+
+    // ReportCrash, SpringBoard and the exception line all report the same crash, count it once
+    if (seen_recently(watch, kind, pid, name, g_get_monotonic_time())) {
+        return;
+    }
+    struct crash_counter *counter = counter_for(watch, name);
+    counter->counts[kind]++;
+    g_atomic_int_inc(&total_crashes);
+    printf("[UDID=%s][Crashwatch] %s: %s (count=%u)\n", watch->udid, kind_names[kind], name, counter->counts[kind]);
+
+    if (watch->relay == NULL) {
+        return; // Replayed from a file, no menu to update
+    }
+    struct crash_event *event = malloc(sizeof(*event));
+    if (event == NULL) {
+        return;
+    }
+    strncpy(event->udid, watch->udid, sizeof(event->udid));
+    strncpy(event->name, name, sizeof(event->name));
+    event->kind = kind;
+    event->count = counter->counts[kind];
+    event->watched = is_watched(name);
+    g_idle_add(publish_crash_event, event);
+}
+
+// Called by the relay thread for every received character
+static void on_syslog_char(char c, void *user_data) {
+    crashwatch_t *watch = user_data;
+
+    if (c == '\n' || c == '\0') {
+        if (watch->line_len > 0) {
+            watch->line[watch->line_len] = '\0';
+            analyze_line(watch);
+            watch->line_len = 0;
+        }
+        return;
+    }
+
+    // Overlong lines are truncated, the signatures live near the start
+    if (watch->line_len < LINE_MAX_LEN - 1) {
+        watch->line[watch->line_len++] = c;
+    }
+}
+
+crashwatch_t* crashwatch_start(idevice_t device, const char *udid) {
+    pthread_once(&ac_once, build_automaton);
+
+    crashwatch_t *watch = calloc(1, sizeof(*watch));
+    if (watch == NULL) {
+        fprintf(stderr, "[UDID=%s][Crashwatch] Failed to allocate memory for crashwatch\n", udid);
+        return NULL;
+    }
+    strncpy(watch->udid, udid, sizeof(watch->udid) - 1);
+
+    if (syslog_relay_client_start_service(device, &watch->relay, NULL) != SYSLOG_RELAY_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Crashwatch] Failed to start syslog relay\n", udid);
+        free(watch);
+        return NULL;
+    }
+
+    if (syslog_relay_start_capture(watch->relay, on_syslog_char, watch) != SYSLOG_RELAY_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Crashwatch] Failed to start syslog capture\n", udid);
+        syslog_relay_client_free(watch->relay);
+        free(watch);
+        return NULL;
+    }
+
+    printf("[UDID=%s][Crashwatch] Started\n", udid);
+    return watch;
+}
+
+void crashwatch_stop(crashwatch_t *watch) {
+    if (watch == NULL) {
+        return;
+    }
+
+    // Joins the relay thread, so no callback can run after this
+    syslog_relay_stop_capture(watch->relay);
+    syslog_relay_client_free(watch->relay);
+    printf("[UDID=%s][Crashwatch] Stopped\n", watch->udid);
+    free(watch);
+}
+
+// Entry point of `iosindicator --crashwatch-replay <syslog-file> [expected]`
+int crashwatch_replay_main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s --crashwatch-replay <syslog-file> [expected]\n", argv[0]);
+        return 1;
+    }
+    pthread_once(&ac_once, build_automaton);
+
+    gchar *contents = NULL;
+    gsize length = 0;
+    GError *error = NULL;
+    if (!g_file_get_contents(argv[2], &contents, &length, &error)) {
+        fprintf(stderr, "[Crashwatch] Failed to read %s: %s\n", argv[2], error->message);
+        g_error_free(error);
+        return 1;
+    }
+    crashwatch_t *watch = calloc(1, sizeof(*watch));
+    if (watch == NULL) {
+        g_free(contents);
+        return 1;
+    }
+    strncpy(watch->udid, "replay", sizeof(watch->udid) - 1);
+    for (gsize i = 0; i < length; ++i) {
+        on_syslog_char(contents[i], watch);
+    }
+    on_syslog_char('\n', watch);
+    g_free(contents);
+    free(watch);
+
+    unsigned int total = crashwatch_total();
+    printf("[Crashwatch] %u counted in %s\n", total, argv[2]);
+    if (argc > 3 && total != (unsigned int)atoi(argv[3])) {
+        fprintf(stderr, "[Crashwatch] Expected %s\n", argv[3]);
+        return 1;
+    }
+    return 0;
+}
+
+unsigned int crashwatch_total(void) {
+    return (unsigned int)g_atomic_int_get(&total_crashes);
+}
+
+void crashwatch_clear_badge(void) {
+    if (tray != NULL && tray->indicator != NULL && app_indicator_get_status(tray->indicator) == APP_INDICATOR_STATUS_ATTENTION) {
+        app_indicator_set_status(tray->indicator, APP_INDICATOR_STATUS_ACTIVE);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef CRASHWATCH_H
+#define CRASHWATCH_H
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/syslog_relay.h>
+
+// Kinds of termination recognized in the syslog stream
+typedef enum {
+    CRASHWATCH_CRASH = 0,
+    CRASHWATCH_JETSAM,
+    CRASHWATCH_WATCHDOG,
+    CRASHWATCH_KIND_COUNT
+} crashwatch_kind_t;
+
+// Opaque per-device analyzer
+typedef struct crashwatch crashwatch_t;
+
+// Function prototypes
+crashwatch_t* crashwatch_start(idevice_t device, const char *udid);
+void crashwatch_stop(crashwatch_t *watch);
+int crashwatch_replay_main(int argc, char *argv[]);
+unsigned int crashwatch_total(void);
+void crashwatch_clear_badge(void);
+
+#endif // CRASHWATCH_H
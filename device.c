@@ -1,10 +1,27 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <time.h>
+#include <libimobiledevice/heartbeat.h>
 
 #include "device.h"
+#include "crashwatch.h"
+#include "apps.h"
+#include "transfer.h"
+#include "import.h"
+#include "afcfs.h"
+#include "backup.h"
+#include "reports.h"
+#include "screenshot.h"
+#include "watches.h"
+#include "pair.h"
+#include "dispatch.h"
+#include "statusicon.h"
+#include "fields.h"
+#include "arena.h"
 #include "tray.h" // To access the global indicator variable
 
 // Struct to hold arguments for handle_device
@@ -12,303 +29,510 @@ struct device_args {
     char udid[64];
 };
 
-// Shared flag to signal handler to stop when needed
-const unsigned int REFRESH_INTERVAL = 5;
-volatile bool device_connected = true;
-pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Transports a device is currently reachable over, kept per UDID
+struct device_link {
+    bool usb;
+    bool network;
+    bool running; // A monitoring thread owns this UDID
+    bool refresh_requested; // The menu was opened, fields are shown greyed until re-read
+    bool redraw_requested;  // The device the menu showed left, this one draws all its fields instead
+};
 
-void* handle_device_thread(void *arg) {
-    struct device_args *args = (struct device_args *)arg;
-    idevice_t device = NULL;
-    lockdownd_client_t client = NULL;
-    plist_t device_info = NULL;
+// Per monitoring thread: what has been read so far, shared with its dispatch lanes
+struct device_state {
+    gint info_loaded; // Set from the bulk lane once the static fields are in the menu
+    GMutex fields_lock; // The bulk lane's info load and the polled refresh both write fields
+    struct field_state fields;
+    arena_t *scratch;  // Per-tick request arguments, rewound once the lanes are done with them
+    gint outstanding;  // Requests still holding scratch memory
+};
 
-    // Connect to the device
-    if (idevice_new(&device, args->udid) != IDEVICE_E_SUCCESS) {
-        fprintf(stderr, "[UDID=%s][Thread] Failed to connect to device.\n", args->udid);
-        free(args);
-        return NULL;
+#define SCRATCH_BLOCK_SIZE 1024
+
+struct refresh_args {
+    struct device_state *state;
+    gint64 deadline;
+    bool redraw;
+};
+
+// Sessions that hold a connection to the device and are rebuilt on failover
+struct device_services {
+    crashwatch_t *crashwatch;
+    reports_session_t *reports;
+    apps_session_t *apps;
+    watches_session_t *watches;
+    transfer_session_t *transfer;
+    import_session_t *import;
+    afcfs_session_t *mounts;
+    backup_session_t *backup;
+    screenshot_session_t *screenshots;
+};
+
+// Wi-Fi round trips are slower and cost radio time, so it is refreshed and timed out more leniently.
+// Fields are re-read whenever the menu opens, background polling only keeps them roughly current.
+const unsigned int REFRESH_INTERVAL = 60;
+const unsigned int NETWORK_REFRESH_INTERVAL = 180;
+const unsigned int REFRESH_DEADLINE_MS = 1500;
+const unsigned int NETWORK_REFRESH_DEADLINE_MS = 4000;
+const unsigned int HEARTBEAT_POLL_MS = 250;
+const unsigned int HEARTBEAT_SLACK_USB = 5;
+const unsigned int HEARTBEAT_SLACK_NETWORK = 20;
+const unsigned int RECONNECT_BACKOFF_MAX = 30;
+
+// Shared link table, signalled whenever a transport comes or goes
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t link_changed = PTHREAD_COND_INITIALIZER;
+static GHashTable *links = NULL;
+
+// Must be called with lock held
+static struct device_link* get_link(const char *udid) {
+    if (links == NULL) {
+        links = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    struct device_link *link = g_hash_table_lookup(links, udid);
+    if (link == NULL) {
+        link = g_new0(struct device_link, 1);
+        g_hash_table_replace(links, g_strdup(udid), link);
     }
+    return link;
+}
 
-    // Start lockdown service
-    if (lockdownd_client_new_with_handshake(device, &client, NULL) != LOCKDOWN_E_SUCCESS) {
-        fprintf(stderr, "[UDID=%s][Thread] Failed to start lockdown service for device.\n", args->udid);
-        idevice_free(device);
-        free(args);
-        return NULL;
+// Whether any device is still reachable, must be called with lock held
+static bool any_device_linked(void) {
+    if (links == NULL) {
+        return false;
+    }
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, links);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct device_link *link = value;
+        if (link->usb || link->network) {
+            return true;
+        }
     }
+    return false;
+}
 
-    // Get full device information
-    if (lockdownd_get_value(client, NULL, NULL, &device_info) != LOCKDOWN_E_SUCCESS || device_info == NULL) {
-        fprintf(stderr, "[UDID=%s][Thread] Failed to get device information for device.\n", args->udid);
-        lockdownd_client_free(client);
-        idevice_free(device);
-        free(args);
-        return NULL;
+// Waits up to seconds for a transport change, must be called with lock held
+static void wait_link_change(unsigned int seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_cond_timedwait(&link_changed, &lock, &deadline);
+}
+
+/**
+ * Widgets and the indicator belong to the GTK main loop; the monitoring
+ * threads and the usbmuxd event thread only queue these.
+ */
+static gboolean show_files_item(gpointer data) {
+    gtk_widget_show(tray->widgets->files);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean set_indicator_status(gpointer data) {
+    if (tray->indicator != NULL) {
+        app_indicator_set_status(tray->indicator, GPOINTER_TO_INT(data));
     }
+    return G_SOURCE_REMOVE;
+}
 
+static void start_services(idevice_t device, const char *udid, struct device_services *services) {
     /**
-     * Allocate and initialize device_info_params
+     * Crash detection over the syslog relay, runs on its own relay thread
      */
-    struct {
-        char *device_class;
-        char *product_name;
-        char *product_version;
-        char *device_name;
-        char *meid;
-        char *imei;
-        char *color;
-        char *msisdn;
-        char *is_activated;
-        uint8_t is_passwd;
-    } *device_info_params;
-
-    device_info_params = malloc(sizeof(*device_info_params));
-    if (device_info_params == NULL) {
-        fprintf(stderr, "[UDID=%s][Thread] Failed to allocate memory for device_info_params\n", args->udid);
-        plist_free(device_info);
-        lockdownd_client_free(client);
-        idevice_free(device);
-        free(args);
-        return NULL;
-    }
-    memset(device_info_params, 0, sizeof(*device_info_params)); // Initialize all pointers to NULL
+    services->crashwatch = crashwatch_start(device, udid);
 
     /**
-     * Extract device information
+     * Crash report collection, deferred and at low priority
      */
-    printf("[UDID=%s][Thread] Getting device info\n", args->udid);
-    plist_t node;
-    if ((node = plist_dict_get_item(device_info, "DeviceClass")) != NULL) 
-        plist_get_string_val(node, &device_info_params->device_class);
-    if ((node = plist_dict_get_item(device_info, "ProductName")) != NULL) 
-        plist_get_string_val(node, &device_info_params->product_name);
-    if ((node = plist_dict_get_item(device_info, "ProductVersion")) != NULL) 
-        plist_get_string_val(node, &device_info_params->product_version);
-    if ((node = plist_dict_get_item(device_info, "DeviceName")) != NULL) 
-        plist_get_string_val(node, &device_info_params->device_name);
-
-    if (device_info_params->device_name && device_info_params->product_version) {
-        char *info_label = g_strdup_printf("📱 %s (IOS %s)", device_info_params->device_name, device_info_params->product_version);
-        if (info_label != NULL) {
-            update_menu_item_label(GTK_MENU_ITEM(tray->widgets->info), info_label);
-            gtk_widget_show(tray->widgets->info);
-            g_free(info_label);
-        }
-    }
+    services->reports = reports_start(device, udid);
 
     /**
-     * Extract sub-properties
+     * Installed apps inventory, streamed and kept current in the background
      */
-    printf("[UDID=%s][Thread] Getting sub-device info\n", args->udid);
-
-    if ((node = plist_dict_get_item(device_info, "MobileEquipmentIdentifier")) != NULL) {
-        plist_get_string_val(node, &device_info_params->meid);
-        if (device_info_params->meid != NULL) {
-            char *meid_label = g_strdup_printf(" MEID: %s", device_info_params->meid);
-            if (meid_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->meid), meid_label);
-                gtk_widget_show(tray->widgets->meid);
-                g_free(meid_label);
-            } else {
-                gtk_widget_hide(tray->widgets->meid);
-            }
-        }
-    }
+    services->apps = apps_start(device, udid);
 
-    if ((node = plist_dict_get_item(device_info, "InternationalMobileEquipmentIdentity")) != NULL)  {
-        plist_get_string_val(node, &device_info_params->imei);
-        if (device_info_params->imei != NULL) {
-            char *imei_label = g_strdup_printf(" IMEI: %s", device_info_params->imei);
-            if (imei_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->imei), imei_label);
-                gtk_widget_show(tray->widgets->imei);
-                g_free(imei_label);
-            } else {
-                gtk_widget_hide(tray->widgets->imei);
-            }
-        }
-    }
+    /**
+     * Paired watches, pushed by the companion proxy
+     */
+    services->watches = watches_start(device, udid);
 
-    if ((node = plist_dict_get_item(device_info, "DeviceColor")) != NULL)  {
-        plist_get_string_val(node, &device_info_params->color);
-        if (device_info_params->color != NULL) {
-            char *color_label = g_strdup_printf(" Color: %s", device_info_params->color);
-            if (color_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->color), color_label);
-                gtk_widget_show(tray->widgets->color);
-                g_free(color_label);
-            } else {
-                gtk_widget_hide(tray->widgets->color);
+    /**
+     * File transfer engine behind the Files submenu
+     */
+    services->transfer = transfer_start(device, udid);
+    services->import = import_start(device, udid, services->transfer);
+    services->mounts = afcfs_start(udid);
+    services->backup = backup_start(device, udid);
+    services->screenshots = screenshot_start(device, udid);
+    g_idle_add(show_files_item, NULL);
+}
+
+static void stop_services(struct device_services *services) {
+    crashwatch_stop(services->crashwatch);
+    reports_stop(services->reports);
+    apps_stop(services->apps);
+    watches_stop(services->watches);
+    backup_stop(services->backup);
+    screenshot_stop(services->screenshots);
+    afcfs_stop(services->mounts);
+    import_stop(services->import);
+    transfer_stop(services->transfer);
+    memset(services, 0, sizeof(*services));
+}
+
+static void hide_device_widgets(void) {
+    gtk_widget_hide(tray->widgets->info);
+    gtk_widget_hide(tray->widgets->battery);
+    gtk_widget_hide(tray->widgets->storage);
+    gtk_widget_hide(tray->widgets->meid);
+    gtk_widget_hide(tray->widgets->imei);
+    gtk_widget_hide(tray->widgets->color);
+    gtk_widget_hide(tray->widgets->msisdn);
+    gtk_widget_hide(tray->widgets->is_activated);
+    gtk_widget_hide(tray->widgets->is_passwd);
+    gtk_widget_hide(tray->widgets->apps);
+    gtk_widget_hide(tray->widgets->watches);
+    gtk_widget_hide(tray->widgets->files);
+    gtk_widget_hide(tray->widgets->screenshot);
+}
+
+/**
+ * Monitoring of a device ended (main loop). When the menu showed its
+ * fields, another running device is asked to draw all of its own; the
+ * widgets are only hidden once the last device is gone.
+ */
+static gboolean release_device_widgets(gpointer data) {
+    char *udid = data;
+    bool shown = fields_release_device(udid);
+    pthread_mutex_lock(&lock);
+    bool linked = any_device_linked();
+    if (shown && linked) {
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, links);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            struct device_link *link = value;
+            if (link->running && (link->usb || link->network)) {
+                link->redraw_requested = true;
+                link->refresh_requested = true;
+                pthread_cond_broadcast(&link_changed);
+                break;
             }
         }
     }
+    pthread_mutex_unlock(&lock);
+    if (!linked) {
+        hide_device_widgets();
+    }
+    g_free(udid);
+    return G_SOURCE_REMOVE;
+}
 
-    if ((node = plist_dict_get_item(device_info, "PhoneNumber")) != NULL) {
-        plist_get_string_val(node, &device_info_params->msisdn);
-        if (device_info_params->msisdn != NULL) {
-            char *msisdn_label = g_strdup_printf(" Phone: %s", device_info_params->msisdn);
-            if (msisdn_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->msisdn), msisdn_label);
-                gtk_widget_show(tray->widgets->msisdn);
-                g_free(msisdn_label);
-            } else {
-                gtk_widget_hide(tray->widgets->msisdn);
-            }
-        }
+// Something the loop has to act on before its interval is up, must be called with lock held
+static bool link_needs_attention(struct device_link *link, bool on_usb) {
+    return link->refresh_requested || (on_usb ? !link->usb : !link->network) || (!on_usb && link->usb);
+}
+
+/**
+ * Bulk request: the full lockdown dump behind the static fields, read once
+ * per monitoring session and kept in the menu across USB/Wi-Fi failover
+ */
+static void load_info_request(lockdownd_client_t client, const char *udid, gpointer data) {
+    struct device_state *state = data;
+    plist_t device_info = NULL;
+    if (client == NULL || lockdownd_get_value(client, NULL, NULL, &device_info) != LOCKDOWN_E_SUCCESS || device_info == NULL) {
+        fprintf(stderr, "[UDID=%s][Thread] Failed to get device information for device.\n", udid);
+        return;
     }
+    printf("[UDID=%s][Thread] Getting device info\n", udid);
+    g_mutex_lock(&state->fields_lock);
+    fields_apply(&state->fields, udid, NULL, device_info, FIELD_ONCE);
+    g_mutex_unlock(&state->fields_lock);
+    plist_free(device_info);
+    g_atomic_int_set(&state->info_loaded, 1);
+}
 
-    if ((node = plist_dict_get_item(device_info, "ActivationState")) != NULL) {
-        plist_get_string_val(node, &device_info_params->is_activated);
-        if (device_info_params->is_activated != NULL) {
-            char *is_activated_label = g_strdup_printf(" Activation: %s", device_info_params->is_activated);
-            if (is_activated_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->is_activated), is_activated_label);
-                gtk_widget_show(tray->widgets->is_activated);
-                g_free(is_activated_label);
-            } else {
-                gtk_widget_hide(tray->widgets->is_activated);
-            }
-        }
+// free_data for requests whose arguments live in the scratch arena
+static void release_scratch(gpointer data) {
+    struct refresh_args *args = data;
+    g_atomic_int_add(&args->state->outstanding, -1);
+}
+
+static struct refresh_args* new_refresh_args(struct device_state *state) {
+    if (state->scratch == NULL) {
+        return NULL;
+    }
+    // Nothing queued still points into scratch, so the whole tick can be reused
+    if (g_atomic_int_get(&state->outstanding) == 0) {
+        arena_reset(state->scratch);
     }
+    struct refresh_args *args = arena_alloc(state->scratch, sizeof(*args));
+    if (args != NULL) {
+        g_atomic_int_inc(&state->outstanding);
+        args->state = state;
+    }
+    return args;
+}
 
-    // Cleanup
-    if (device_info_params->device_class) free(device_info_params->device_class);
-    if (device_info_params->product_name) free(device_info_params->product_name);
-    if (device_info_params->product_version) free(device_info_params->product_version);
-    if (device_info_params->device_name) free(device_info_params->device_name);
-    if (device_info_params->meid) free(device_info_params->meid);
-    if (device_info_params->imei) free(device_info_params->imei);
-    if (device_info_params->msisdn) free(device_info_params->msisdn);
-    if (device_info_params->is_activated) free(device_info_params->is_activated);
-    if (device_info_params->color) free(device_info_params->color);
-    if (device_info != NULL) {
-        plist_free(device_info);
-        node = NULL;
+// Status or interactive request: the polled fields, against the deadline when someone is looking; changes reach the panel through the field listeners
+static void refresh_request(lockdownd_client_t client, const char *udid, gpointer data) {
+    struct refresh_args *args = data;
+    if (client == NULL) {
+        return;
     }
+    g_mutex_lock(&args->state->fields_lock);
+    if (args->redraw) {
+        fields_redraw(&args->state->fields, udid);
+    }
+    fields_refresh(&args->state->fields, client, udid, args->deadline);
+    g_mutex_unlock(&args->state->fields_lock);
+}
 
-    /**
-     * Storage information
-     */
-    printf("[UDID=%s][Thread] Getting storage info\n", args->udid);
-    plist_t storage_info = NULL;
-    if (lockdownd_get_value(client, "com.apple.disk_usage", NULL, &storage_info) == LOCKDOWN_E_SUCCESS && storage_info != NULL) {
-        int64_t total_disk_capacity = 0;
-        int64_t amount_data_available = 0;
-        if ((node = plist_dict_get_item(storage_info, "TotalDiskCapacity")) != NULL) plist_get_int_val(node, &total_disk_capacity);
-        if ((node = plist_dict_get_item(storage_info, "AmountDataAvailable")) != NULL) plist_get_int_val(node, &amount_data_available);
-        if (total_disk_capacity > 0 && amount_data_available > 0) {
-            double storage_used =  (total_disk_capacity - amount_data_available) / 1000000000.0;
-            char *storage_label = g_strdup_printf(" Storage: %.1fGB / %ldGB used", storage_used, total_disk_capacity / 1000000000);
-            if (storage_label != NULL) {
-                update_menu_item_label(GTK_MENU_ITEM(tray->widgets->storage), storage_label);
-                g_free(storage_label);
+/**
+ * Liveness. The heartbeat service sends "Marco" every few seconds and
+ * expects "Polo" back; a missed beat means the link is gone, which on Wi-Fi
+ * is noticed long before a lockdown request would time out. Returns false
+ * once the device stops answering. The reply never changes, so it is built
+ * once per connection by the caller.
+ */
+static bool wait_heartbeat(heartbeat_client_t heartbeat, plist_t polo, struct device_link *link, bool on_usb, unsigned int seconds, unsigned int slack, gint64 *last_beat, uint64_t *interval) {
+    gint64 until = g_get_monotonic_time() + (gint64)seconds * G_USEC_PER_SEC;
+    gint64 now;
+    while ((now = g_get_monotonic_time()) < until) {
+        // Receive in short slices so a menu open or unplug is not held up by the interval
+        pthread_mutex_lock(&lock);
+        bool attention = link_needs_attention(link, on_usb);
+        pthread_mutex_unlock(&lock);
+        if (attention) {
+            break;
+        }
+        plist_t message = NULL;
+        uint32_t slice = MIN((uint32_t)((until - now) / 1000) + 1, HEARTBEAT_POLL_MS);
+        heartbeat_error_t err = heartbeat_receive_with_timeout(heartbeat, &message, slice);
+        if (err == HEARTBEAT_E_SUCCESS && message != NULL) {
+            plist_t node = plist_dict_get_item(message, "Interval");
+            if (node != NULL) {
+                plist_get_uint_val(node, interval);
             }
-        } else {
-            fprintf(stderr, "[UDID=%s][Thread] Total disk capacity is zero or invalid\n", args->udid);
+            heartbeat_send(heartbeat, polo);
+            plist_free(message);
+            *last_beat = g_get_monotonic_time();
+        } else if (err != HEARTBEAT_E_TIMEOUT) {
+            return false;
+        }
+        if (g_get_monotonic_time() - *last_beat > (gint64)(*interval + slack) * G_USEC_PER_SEC) {
+            return false;
         }
     }
-    if (storage_info != NULL) {
-        gtk_widget_show(tray->widgets->storage);
-        plist_free(storage_info);
-        node = NULL;
-    } else {
-        gtk_widget_hide(tray->widgets->storage);
-    }
+    return true;
+}
+
+void* handle_device_thread(void *arg) {
+    struct device_args *args = (struct device_args *)arg;
+    const char *udid = args->udid;
+    struct device_services services = {0};
+    struct device_state *state = g_new0(struct device_state, 1);
+    g_mutex_init(&state->fields_lock);
+    state->scratch = arena_new(SCRATCH_BLOCK_SIZE);
+    unsigned int backoff = 1;
 
-    /**
-     * Main loop for dynamic updates
-     */
-    printf("[UDID=%s][Thread] Monitoring started\n", args->udid);
     while (true) {
+        // Prefer USB whenever it is plugged in, fall back to Wi-Fi otherwise
         pthread_mutex_lock(&lock);
-        if (!device_connected) {
-        printf("[UDID=%s][Thread] Monitoring stopped\n", args->udid);
+        struct device_link *link = get_link(udid);
+        if (!link->usb && !link->network) {
+            link->running = false;
             pthread_mutex_unlock(&lock);
             break;
         }
+        bool on_usb = link->usb;
         pthread_mutex_unlock(&lock);
 
-        // Password protection status
-        if (lockdownd_get_value(client, NULL, NULL, &device_info) == LOCKDOWN_E_SUCCESS && device_info != NULL) {
-            if ((node = plist_dict_get_item(device_info, "PasswordProtected")) != NULL) {
-                plist_get_bool_val(node, &device_info_params->is_passwd);
-                char *passwd_label = g_strdup_printf(" Password Protected: %s", device_info_params->is_passwd == 1 ? "yes" : "no");
-                if (passwd_label != NULL) {
-                    update_menu_item_label(GTK_MENU_ITEM(tray->widgets->is_passwd), passwd_label);
-                    g_free(passwd_label);
-                }
-            }
-        } else {
-            fprintf(stderr, "[UDID=%s][Thread][Loop] Failed to get device information\n", args->udid);
+        idevice_t device = NULL;
+        lockdownd_client_t client = NULL;
+        enum idevice_options options = on_usb ? IDEVICE_LOOKUP_USBMUX : IDEVICE_LOOKUP_NETWORK;
+
+        // Connect to the device
+        if (idevice_new_with_options(&device, udid, options) != IDEVICE_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Thread] Failed to connect to device over %s.\n", udid, on_usb ? "USB" : "Wi-Fi");
+        } else if (pair_lockdown_client_new(device, udid, &client) != LOCKDOWN_E_SUCCESS) {
+            // Start lockdown service
+            fprintf(stderr, "[UDID=%s][Thread] Failed to start lockdown service for device.\n", udid);
+            client = NULL;
         }
 
-        if (device_info != NULL) {
-            gtk_widget_show(tray->widgets->is_passwd);
-            plist_free(device_info);
-            node = NULL;
-        } else {
-            gtk_widget_hide(tray->widgets->is_passwd);
+        if (client == NULL) {
+            if (device != NULL) idevice_free(device);
+            // Wi-Fi devices come and go with the radio, retry with backoff while a transport is listed
+            pthread_mutex_lock(&lock);
+            wait_link_change(backoff);
+            pthread_mutex_unlock(&lock);
+            backoff = MIN(backoff * 2, RECONNECT_BACKOFF_MAX);
+            continue;
         }
+        backoff = 1;
 
-        // Battery information
-        plist_t battery_info = NULL;
-        if (lockdownd_get_value(client, "com.apple.mobile.battery", NULL, &battery_info) == LOCKDOWN_E_SUCCESS && battery_info != NULL) {
-            int64_t battery_level = -1;
-            if ((node = plist_dict_get_item(battery_info, "BatteryCurrentCapacity")) != NULL) {
-                plist_get_int_val(node, &battery_level);
-                if (battery_level >= 0) {
-                    char *battery_label = g_strdup_printf(" Battery: %ld%%", battery_level);
-                    if (battery_label != NULL) {
-                        update_menu_item_label(GTK_MENU_ITEM(tray->widgets->battery), battery_label);
-                        g_free(battery_label);
-                    }
-                }
-            }
+        // Lockdown requests go through the session queue so slow ones never hold up the menu
+        dispatch_session_t *dispatch = dispatch_start(device, client, udid);
+        if (!g_atomic_int_get(&state->info_loaded)) {
+            dispatch_submit(dispatch, DISPATCH_BULK, "device-info", load_info_request, state, NULL);
         }
+        start_services(device, udid, &services);
 
-        if (battery_info != NULL) {
-            gtk_widget_show(tray->widgets->battery);
-            plist_free(battery_info);
-            node = NULL;
-        } else {
-            gtk_widget_hide(tray->widgets->battery);
+        heartbeat_client_t heartbeat = NULL;
+        if (heartbeat_client_start_service(device, &heartbeat, "iosindicator") != HEARTBEAT_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Thread] Heartbeat not available, relying on lockdown\n", udid);
+            heartbeat = NULL;
+        }
+        plist_t polo = NULL;
+        if (heartbeat != NULL) {
+            polo = plist_new_dict();
+            plist_dict_set_item(polo, "Command", plist_new_string("Polo"));
         }
+        unsigned int refresh = on_usb ? REFRESH_INTERVAL : NETWORK_REFRESH_INTERVAL;
+        unsigned int deadline_ms = on_usb ? REFRESH_DEADLINE_MS : NETWORK_REFRESH_DEADLINE_MS;
+        unsigned int slack = on_usb ? HEARTBEAT_SLACK_USB : HEARTBEAT_SLACK_NETWORK;
+        uint64_t beat_interval = refresh;
+        gint64 last_beat = g_get_monotonic_time();
+
+        /**
+         * Main loop for dynamic updates
+         */
+        printf("[UDID=%s][Thread] Monitoring started over %s\n", udid, on_usb ? "USB" : "Wi-Fi");
+        while (true) {
+            pthread_mutex_lock(&lock);
+            bool gone = on_usb ? !link->usb : !link->network;
+            bool upgrade = !on_usb && link->usb;
+            bool requested = link->refresh_requested;
+            bool redraw = link->redraw_requested;
+            link->refresh_requested = false;
+            link->redraw_requested = false;
+            pthread_mutex_unlock(&lock);
+            if (gone || upgrade) {
+                printf("[UDID=%s][Thread] %s\n", udid, upgrade ? "USB plugged in, switching over" : "Transport went away");
+                break;
+            }
 
-        sleep(REFRESH_INTERVAL);
+            // Someone is looking at the menu, so bound the refresh; background ones can take their time.
+            // Either way a newer refresh replaces a background one still waiting in the queue.
+            struct refresh_args *refresh_args = new_refresh_args(state);
+            if (refresh_args != NULL) {
+                refresh_args->deadline = requested ? g_get_monotonic_time() + (gint64)deadline_ms * 1000 : 0;
+                refresh_args->redraw = redraw;
+                dispatch_submit(dispatch, requested ? DISPATCH_INTERACTIVE : DISPATCH_STATUS, "fields", refresh_request, refresh_args, release_scratch);
+            }
+
+            // Watch battery rides on this loop instead of a poller per watch
+            watches_refresh(services.watches);
+
+            if (heartbeat != NULL) {
+                if (!wait_heartbeat(heartbeat, polo, link, on_usb, refresh, slack, &last_beat, &beat_interval)) {
+                    printf("[UDID=%s][Thread] Heartbeat lost\n", udid);
+                    break;
+                }
+            } else {
+                pthread_mutex_lock(&lock);
+                if (!link_needs_attention(link, on_usb)) {
+                    wait_link_change(refresh);
+                }
+                pthread_mutex_unlock(&lock);
+            }
+        }
+        struct arena_stats scratch;
+        arena_get_stats(state->scratch, &scratch);
+        printf("[UDID=%s][Thread] Monitoring stopped, %lu scratch allocations over %lu resets from %lu heap blocks\n", udid,
+               (unsigned long)scratch.allocations, (unsigned long)scratch.resets, (unsigned long)scratch.heap_blocks);
+        struct snapshot_stats *diffs = &state->fields.stats;
+        printf("[UDID=%s][Thread] %lu field groups compared, %lu unchanged, %lu change events\n", udid,
+               (unsigned long)diffs->diffs, (unsigned long)diffs->unchanged, (unsigned long)diffs->changes);
+
+        // Sessions reconnect on the next transport; UDID-keyed caches and the menu fields stay
+        if (heartbeat != NULL) heartbeat_client_free(heartbeat);
+        if (polo != NULL) plist_free(polo);
+        dispatch_stop(dispatch);
+        stop_services(&services);
+        lockdownd_client_free(client);
+        idevice_free(device);
     }
 
     /**
      * Cleanup
      */
-    gtk_widget_hide(tray->widgets->info);
-    gtk_widget_hide(tray->widgets->battery);
-    gtk_widget_hide(tray->widgets->storage);
-    gtk_widget_hide(tray->widgets->meid);
-    gtk_widget_hide(tray->widgets->imei);
-    gtk_widget_hide(tray->widgets->color);
-    gtk_widget_hide(tray->widgets->msisdn);
-    gtk_widget_hide(tray->widgets->is_activated);
-    gtk_widget_hide(tray->widgets->is_passwd);
-    if (device_info_params) free(device_info_params);
-    lockdownd_client_free(client);
-    idevice_free(device);
+    g_idle_add(release_device_widgets, g_strdup(udid));
+    statusicon_remove(udid);
+    arena_free(state->scratch);
+    g_mutex_clear(&state->fields_lock);
+    g_free(state);
     free(args);
     return NULL;
 }
 
+/**
+ * Menu opened (GTK main loop). Dynamic fields are greyed as stale and the
+ * thread of the device they show is woken to re-read them ahead of its
+ * next poll; the others keep their background interval. Before any device
+ * published, every one is asked. Panels can send several opens in a row,
+ * so they are coalesced.
+ */
+void device_request_refresh(void) {
+    static gint64 last_request = 0;
+    gint64 now = g_get_monotonic_time();
+    if (last_request != 0 && now - last_request < G_USEC_PER_SEC) {
+        return;
+    }
+    last_request = now;
+
+    fields_mark_stale();
+
+    const char *shown = fields_shown_device();
+    pthread_mutex_lock(&lock);
+    if (links != NULL) {
+        GHashTableIter iter;
+        gpointer key, value;
+        g_hash_table_iter_init(&iter, links);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct device_link *link = value;
+            if (link->running && (shown == NULL || strcmp(key, shown) == 0)) {
+                link->refresh_requested = true;
+            }
+        }
+    }
+    pthread_cond_broadcast(&link_changed);
+    pthread_mutex_unlock(&lock);
+}
+
 void device_event_callback(const idevice_event_t *event, void *user_data) {
+    bool network = event->conn_type == CONNECTION_NETWORK;
     if (event->event == IDEVICE_DEVICE_ADD) {
-        printf("[UDID=%s][MainCb] Device connected\n", event->udid);
+        printf("[UDID=%s][MainCb] Device connected over %s\n", event->udid, network ? "Wi-Fi" : "USB");
 
         pthread_mutex_lock(&lock);
-        device_connected = true;
+        struct device_link *link = get_link(event->udid);
+        if (network) {
+            link->network = true;
+        } else {
+            link->usb = true;
+        }
+        bool start = !link->running;
+        link->running = true;
+        pthread_cond_broadcast(&link_changed);
         pthread_mutex_unlock(&lock);
 
+        // A thread already monitoring this UDID picks the new transport up itself
+        if (!start) {
+            return;
+        }
+
         // Allocate memory for the struct
         struct device_args *args = (struct device_args *)malloc(sizeof(struct device_args));
         if (!args) {
             perror("Failed to allocate memory for device_args");
+            pthread_mutex_lock(&lock);
+            get_link(event->udid)->running = false;
+            pthread_mutex_unlock(&lock);
             return;
         }
 
@@ -321,26 +545,40 @@ void device_event_callback(const idevice_event_t *event, void *user_data) {
         if (pthread_create(&thread, NULL, handle_device_thread, args) != 0) {
             perror("Failed to create thread");
             free(args); // Free the memory if thread creation fails
+            pthread_mutex_lock(&lock);
+            get_link(event->udid)->running = false;
+            pthread_mutex_unlock(&lock);
         } else {
             pthread_detach(thread); // Detach the thread to avoid resource leaks
         }
 
         // Show the indicator
-        if (tray->indicator != NULL) {
-            app_indicator_set_status(tray->indicator, APP_INDICATOR_STATUS_ACTIVE);
-        }
+        g_idle_add(set_indicator_status, GINT_TO_POINTER(APP_INDICATOR_STATUS_ACTIVE));
 
     } else if (event->event == IDEVICE_DEVICE_REMOVE) {
-        printf("[UDID=%s][MainCb] Device disconnected\n", event->udid);
+        printf("[UDID=%s][MainCb] Device disconnected from %s\n", event->udid, network ? "Wi-Fi" : "USB");
 
-        // Hide the indicator
-        if (tray->indicator != NULL) {
-            app_indicator_set_status(tray->indicator, APP_INDICATOR_STATUS_PASSIVE);
-        }
-
-        // Signal the thread to stop as device is disconnected.
+        // Signal the thread to fail over, or to stop if no transport is left
         pthread_mutex_lock(&lock);
-        device_connected = false;
+        struct device_link *link = get_link(event->udid);
+        if (network) {
+            link->network = false;
+        } else {
+            link->usb = false;
+        }
+        bool last = !any_device_linked();
+        pthread_cond_broadcast(&link_changed);
         pthread_mutex_unlock(&lock);
+
+        // Hide the indicator once no device is left
+        if (last) {
+            g_idle_add(set_indicator_status, GINT_TO_POINTER(APP_INDICATOR_STATUS_PASSIVE));
+        }
+
+    } else if (event->event == IDEVICE_DEVICE_PAIRED) {
+        printf("[UDID=%s][MainCb] Device paired\n", event->udid);
+
+        // A new pair record replaces the cached host id
+        pair_cache_invalidate(event->udid);
     }
-}
\ No newline at end of file
+}
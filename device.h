@@ -7,5 +7,6 @@
 
 void* handle_device_thread(void *arg);
 void device_event_callback(const idevice_event_t *event, void *user_data);
+void device_request_refresh(void);
 
 #endif // DEVICE_H
\ No newline at end of file
@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "dispatch.h"
+#include "pair.h"
+#include "budget.h"
+#include "arena.h"
+
+#define DISPATCH_REPORT_INTERVAL_US (60 * G_USEC_PER_SEC)
+#define DISPATCH_KEY_SIZE 32
+#define DISPATCH_ARENA_BLOCK 4096
+
+/**
+ * Per-device request queue. Lockdown answers one request at a time per
+ * connection, so two lanes are kept: the interactive lane reuses the
+ * monitoring thread's client and never picks up bulk work, while the bulk
+ * lane opens its own session the first time bulk work arrives and runs
+ * nothing else, so the two never work on the same request class at once.
+ * On the interactive lane clicks and status polls share turns by weight, so
+ * polls still get through under a burst of clicks, and a slow dump only ever
+ * occupies the bulk lane.
+ * Requests, and the queue links inside them, are recycled through a free
+ * list carved from the session arena, so steady polling does not allocate.
+ */
+
+static const int class_weights[DISPATCH_CLASSES] = {8, 4, 1};
+static const char *class_names[DISPATCH_CLASSES] = {"interactive", "status", "bulk"};
+
+enum {
+    LANE_INTERACTIVE,
+    LANE_BULK,
+    LANES
+};
+
+struct dispatch_request {
+    GList link; // Queue link, data points back at the request
+    struct dispatch_request *next_free;
+    dispatch_class_t klass;
+    char key[DISPATCH_KEY_SIZE]; // Empty for none
+    dispatch_fn_t fn;
+    gpointer data;
+    GDestroyNotify free_data;
+    gint64 queued;
+};
+
+struct dispatch_session {
+    char udid[64];
+    idevice_t device;
+    lockdownd_client_t client; // Borrowed from the monitoring thread for the interactive lane
+    GMutex lock;
+    GCond wake;
+    GQueue pending[DISPATCH_CLASSES];
+    int credits[DISPATCH_CLASSES];
+    struct dispatch_stats stats[DISPATCH_CLASSES];
+    GThread *lanes[LANES];
+    bool stopping;
+    gint64 last_report;
+    arena_t *arena; // Requests live here until the session stops
+    struct dispatch_request *free_requests;
+};
+
+// Must be called with session->lock held
+static struct dispatch_request* take_request(dispatch_session_t *session) {
+    struct dispatch_request *request = session->free_requests;
+    if (request != NULL) {
+        session->free_requests = request->next_free;
+    } else {
+        request = arena_alloc(session->arena, sizeof(*request));
+    }
+    if (request != NULL) {
+        memset(request, 0, sizeof(*request));
+        request->link.data = request;
+    }
+    return request;
+}
+
+// Releases the caller's data and puts a chain of requests (linked by next_free) back on the free list
+static void release_requests(dispatch_session_t *session, struct dispatch_request *chain) {
+    struct dispatch_request *last = NULL;
+    for (struct dispatch_request *request = chain; request != NULL; request = request->next_free) {
+        if (request->free_data != NULL && request->data != NULL) {
+            request->free_data(request->data);
+        }
+        last = request;
+    }
+    if (last != NULL) {
+        g_mutex_lock(&session->lock);
+        last->next_free = session->free_requests;
+        session->free_requests = chain;
+        g_mutex_unlock(&session->lock);
+    }
+}
+
+// Must be called with session->lock held
+static struct dispatch_request* pick_request(dispatch_session_t *session, int lane) {
+    // The bulk lane only ever runs bulk work, in order; the weights are for the interactive lane
+    if (lane == LANE_BULK) {
+        if (g_queue_is_empty(&session->pending[DISPATCH_BULK])) {
+            return NULL;
+        }
+        session->stats[DISPATCH_BULK].depth--;
+        return g_queue_pop_head_link(&session->pending[DISPATCH_BULK])->data;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        bool waiting = false;
+        for (int k = 0; k < DISPATCH_CLASSES; k++) {
+            if (k == DISPATCH_BULK || g_queue_is_empty(&session->pending[k])) {
+                continue;
+            }
+            waiting = true;
+            if (session->credits[k] > 0) {
+                session->credits[k]--;
+                session->stats[k].depth--;
+                return g_queue_pop_head_link(&session->pending[k])->data;
+            }
+        }
+        if (!waiting) {
+            return NULL;
+        }
+        // Every class with work has used its share, start the next round
+        for (int k = 0; k < DISPATCH_CLASSES; k++) {
+            session->credits[k] = class_weights[k];
+        }
+    }
+    return NULL;
+}
+
+// Must be called with session->lock held
+static void report_stats(dispatch_session_t *session) {
+    GString *line = g_string_new(NULL);
+    for (int k = 0; k < DISPATCH_CLASSES; k++) {
+        struct dispatch_stats *stats = &session->stats[k];
+        double avg_ms = stats->dispatched ? stats->total_wait_us / 1000.0 / stats->dispatched : 0;
+        g_string_append_printf(line, "%s%s depth %u (max %u), %lu run, %lu cancelled, wait avg %.1f ms max %.1f ms",
+                               k ? "; " : "", class_names[k], stats->depth, stats->max_depth,
+                               (unsigned long)stats->dispatched, (unsigned long)stats->cancelled,
+                               avg_ms, stats->max_wait_us / 1000.0);
+    }
+    struct arena_stats arena;
+    arena_get_stats(session->arena, &arena);
+    char *budget = budget_describe(session->udid);
+    printf("[UDID=%s][Dispatch] %s; %s; %lu requests pooled in %lu blocks\n", session->udid, line->str, budget,
+           (unsigned long)arena.allocations, (unsigned long)arena.heap_blocks);
+    g_free(budget);
+    g_string_free(line, TRUE);
+    session->last_report = g_get_monotonic_time();
+}
+
+static void run_lane(dispatch_session_t *session, int lane) {
+    lockdownd_client_t client = session->client;
+    if (lane == LANE_BULK && pair_lockdown_client_new(session->device, session->udid, &client) != LOCKDOWN_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Dispatch] Failed to open a lockdown session for bulk requests\n", session->udid);
+        client = NULL;
+    }
+
+    g_mutex_lock(&session->lock);
+    while (true) {
+        struct dispatch_request *request = pick_request(session, lane);
+        if (request == NULL) {
+            if (session->stopping) {
+                break;
+            }
+            g_cond_wait(&session->wake, &session->lock);
+            continue;
+        }
+
+        struct dispatch_stats *stats = &session->stats[request->klass];
+        gint64 waited = g_get_monotonic_time() - request->queued;
+        stats->dispatched++;
+        stats->total_wait_us += waited;
+        stats->max_wait_us = MAX(stats->max_wait_us, waited);
+        g_mutex_unlock(&session->lock);
+
+        // Every lockdown request counts against the device budget. Only the short status and
+        // interactive reads steer the throttle, a full dump is slow by nature, not because the device is busy
+        budget_acquire(session->udid);
+        gint64 started = g_get_monotonic_time();
+        request->fn(client, session->udid, request->data);
+        gint64 latency = request->klass == DISPATCH_BULK ? 0 : g_get_monotonic_time() - started;
+        budget_complete(session->udid, 0, latency);
+        request->next_free = NULL;
+        release_requests(session, request);
+
+        g_mutex_lock(&session->lock);
+        if (g_get_monotonic_time() - session->last_report >= DISPATCH_REPORT_INTERVAL_US) {
+            report_stats(session);
+        }
+    }
+    g_mutex_unlock(&session->lock);
+
+    if (lane == LANE_BULK && client != NULL) {
+        lockdownd_client_free(client);
+    }
+}
+
+static gpointer interactive_lane_thread(gpointer data) {
+    run_lane(data, LANE_INTERACTIVE);
+    return NULL;
+}
+
+static gpointer bulk_lane_thread(gpointer data) {
+    run_lane(data, LANE_BULK);
+    return NULL;
+}
+
+dispatch_session_t* dispatch_start(idevice_t device, lockdownd_client_t client, const char *udid) {
+    dispatch_session_t *session = g_new0(dispatch_session_t, 1);
+    g_strlcpy(session->udid, udid, sizeof(session->udid));
+    session->device = device;
+    session->client = client;
+    g_mutex_init(&session->lock);
+    g_cond_init(&session->wake);
+    for (int k = 0; k < DISPATCH_CLASSES; k++) {
+        g_queue_init(&session->pending[k]);
+        session->credits[k] = class_weights[k];
+    }
+    session->last_report = g_get_monotonic_time();
+    session->arena = arena_new(DISPATCH_ARENA_BLOCK);
+    session->lanes[LANE_INTERACTIVE] = g_thread_new("dispatch", interactive_lane_thread, session);
+    return session;
+}
+
+/**
+ * Queues fn to run with a lockdown client. A key names what the request
+ * reads: pending status requests with the same key are dropped, since the
+ * new one will fetch newer values anyway.
+ */
+void dispatch_submit(dispatch_session_t *session, dispatch_class_t klass, const char *key, dispatch_fn_t fn, gpointer data, GDestroyNotify free_data) {
+    struct dispatch_request *superseded = NULL;
+    g_mutex_lock(&session->lock);
+    struct dispatch_request *request = session->stopping || session->arena == NULL ? NULL : take_request(session);
+    if (request == NULL) {
+        g_mutex_unlock(&session->lock);
+        if (free_data != NULL && data != NULL) {
+            free_data(data);
+        }
+        return;
+    }
+    request->klass = klass;
+    g_strlcpy(request->key, key ? key : "", sizeof(request->key));
+    request->fn = fn;
+    request->data = data;
+    request->free_data = free_data;
+    request->queued = g_get_monotonic_time();
+
+    if (request->key[0] != '\0') {
+        GQueue *status = &session->pending[DISPATCH_STATUS];
+        GList *node = status->head;
+        while (node != NULL) {
+            GList *next = node->next;
+            struct dispatch_request *queued = node->data;
+            if (strcmp(queued->key, request->key) == 0) {
+                g_queue_unlink(status, node);
+                queued->next_free = superseded;
+                superseded = queued;
+                session->stats[DISPATCH_STATUS].depth--;
+                session->stats[DISPATCH_STATUS].cancelled++;
+            }
+            node = next;
+        }
+    }
+    g_queue_push_tail_link(&session->pending[klass], &request->link);
+    struct dispatch_stats *stats = &session->stats[klass];
+    stats->depth++;
+    stats->max_depth = MAX(stats->max_depth, stats->depth);
+    if (klass == DISPATCH_BULK && session->lanes[LANE_BULK] == NULL) {
+        session->lanes[LANE_BULK] = g_thread_new("dispatch-bulk", bulk_lane_thread, session);
+    }
+    g_cond_broadcast(&session->wake);
+    g_mutex_unlock(&session->lock);
+
+    // Release superseded requests outside the lock, their data may be heavy
+    release_requests(session, superseded);
+}
+
+void dispatch_get_stats(dispatch_session_t *session, dispatch_class_t klass, struct dispatch_stats *stats) {
+    g_mutex_lock(&session->lock);
+    *stats = session->stats[klass];
+    g_mutex_unlock(&session->lock);
+}
+
+// Drops whatever has not started and waits for running requests to finish
+void dispatch_stop(dispatch_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+    struct dispatch_request *dropped = NULL;
+    g_mutex_lock(&session->lock);
+    session->stopping = true;
+    for (int k = 0; k < DISPATCH_CLASSES; k++) {
+        session->stats[k].cancelled += session->pending[k].length;
+        session->stats[k].depth = 0;
+        while (!g_queue_is_empty(&session->pending[k])) {
+            struct dispatch_request *request = g_queue_pop_head_link(&session->pending[k])->data;
+            request->next_free = dropped;
+            dropped = request;
+        }
+    }
+    g_cond_broadcast(&session->wake);
+    g_mutex_unlock(&session->lock);
+    release_requests(session, dropped);
+
+    for (int lane = 0; lane < LANES; lane++) {
+        if (session->lanes[lane] != NULL) {
+            g_thread_join(session->lanes[lane]);
+        }
+    }
+
+    g_mutex_lock(&session->lock);
+    report_stats(session);
+    g_mutex_unlock(&session->lock);
+
+    // Every request goes back with the arena, pooled or not
+    arena_free(session->arena);
+    g_cond_clear(&session->wake);
+    g_mutex_clear(&session->lock);
+    g_free(session);
+}
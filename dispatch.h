@@ -0,0 +1,38 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <glib.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+// Priority classes, highest first
+typedef enum {
+    DISPATCH_INTERACTIVE, // The user is waiting on it
+    DISPATCH_STATUS,      // Background polling, superseded by newer polls
+    DISPATCH_BULK,        // Large dumps and service calls, never run on the interactive lane
+    DISPATCH_CLASSES
+} dispatch_class_t;
+
+// Per-class queue metrics
+struct dispatch_stats {
+    unsigned int depth;
+    unsigned int max_depth;
+    guint64 dispatched;
+    guint64 cancelled;
+    gint64 total_wait_us;
+    gint64 max_wait_us;
+};
+
+// Runs on a dispatch worker; client is NULL when the worker could not open a lockdown session
+typedef void (*dispatch_fn_t)(lockdownd_client_t client, const char *udid, gpointer data);
+
+// Opaque per-device request queue
+typedef struct dispatch_session dispatch_session_t;
+
+// Function prototypes
+dispatch_session_t* dispatch_start(idevice_t device, lockdownd_client_t client, const char *udid);
+void dispatch_submit(dispatch_session_t *session, dispatch_class_t klass, const char *key, dispatch_fn_t fn, gpointer data, GDestroyNotify free_data);
+void dispatch_get_stats(dispatch_session_t *session, dispatch_class_t klass, struct dispatch_stats *stats);
+void dispatch_stop(dispatch_session_t *session);
+
+#endif // DISPATCH_H
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "fields.h"
+#include "tray.h" // Field labels live in the tray widgets
+
+#define FIELD_NO_WIDGET ((size_t)-1)
+#define FIELD_WIDGET(name) offsetof(TrayWidgets, name)
+#define FIELD_SLOTS 64               // Power of two, keep well above FIELD_COUNT
+#define FIELD_SEED_ATTEMPTS 100000
+#define FIELD_MAX_LISTENERS 4
+
+G_STATIC_ASSERT(FIELD_COUNT <= SNAPSHOT_MAX_FIELDS);
+
+/**
+ * Field schema. Each lockdown value the menu shows is one entry: where it
+ * lives, what type it has, how it is rendered and into which widget, and
+ * whether it is read once or on every refresh. Entries without a widget
+ * only feed another entry's formatter (the info line needs the name and
+ * the version, storage needs both disk figures), named by shown_in so a
+ * change to them redraws the right widget. Adding a field is adding an
+ * entry here and its id in fields.h.
+ */
+
+typedef bool (*field_format_t)(const struct field_value *values, char *buffer, size_t size);
+
+struct field {
+    const char *domain;   // NULL for the root domain
+    const char *key;
+    plist_type type;
+    const char *label;    // printf format for the value itself
+    field_format_t format; // Or a formatter for values made of several fields
+    size_t widget;
+    field_policy_t policy;
+    field_id_t shown_in;  // Entry whose widget displays this value, itself when it has one
+};
+
+static bool format_info(const struct field_value *values, char *buffer, size_t size) {
+    if (!values[FIELD_DEVICE_NAME].present || !values[FIELD_PRODUCT_VERSION].present) {
+        return false;
+    }
+    snprintf(buffer, size, "📱 %s (IOS %s)", values[FIELD_DEVICE_NAME].string, values[FIELD_PRODUCT_VERSION].string);
+    return true;
+}
+
+static bool format_storage(const struct field_value *values, char *buffer, size_t size) {
+    int64_t total = values[FIELD_DISK_TOTAL].integer;
+    int64_t available = values[FIELD_DISK_AVAILABLE].integer;
+    if (!values[FIELD_DISK_TOTAL].present || !values[FIELD_DISK_AVAILABLE].present || total <= 0 || available <= 0) {
+        return false;
+    }
+    snprintf(buffer, size, " Storage: %.1fGB / %ldGB used", (total - available) / 1000000000.0, (long)(total / 1000000000));
+    return true;
+}
+
+// Polled entries are refreshed in table order, the most looked-at first
+static const struct field schema[FIELD_COUNT] = {
+    [FIELD_DEVICE_NAME]        = {NULL, "DeviceName", PLIST_STRING, NULL, format_info, FIELD_WIDGET(info), FIELD_ONCE, FIELD_DEVICE_NAME},
+    [FIELD_PRODUCT_VERSION]    = {NULL, "ProductVersion", PLIST_STRING, NULL, NULL, FIELD_NO_WIDGET, FIELD_ONCE, FIELD_DEVICE_NAME},
+    [FIELD_MEID]               = {NULL, "MobileEquipmentIdentifier", PLIST_STRING, " MEID: %s", NULL, FIELD_WIDGET(meid), FIELD_ONCE, FIELD_MEID},
+    [FIELD_IMEI]               = {NULL, "InternationalMobileEquipmentIdentity", PLIST_STRING, " IMEI: %s", NULL, FIELD_WIDGET(imei), FIELD_ONCE, FIELD_IMEI},
+    [FIELD_COLOR]              = {NULL, "DeviceColor", PLIST_STRING, " Color: %s", NULL, FIELD_WIDGET(color), FIELD_ONCE, FIELD_COLOR},
+    [FIELD_MSISDN]             = {NULL, "PhoneNumber", PLIST_STRING, " Phone: %s", NULL, FIELD_WIDGET(msisdn), FIELD_ONCE, FIELD_MSISDN},
+    [FIELD_ACTIVATION]         = {NULL, "ActivationState", PLIST_STRING, " Activation: %s", NULL, FIELD_WIDGET(is_activated), FIELD_ONCE, FIELD_ACTIVATION},
+    [FIELD_BATTERY_LEVEL]      = {"com.apple.mobile.battery", "BatteryCurrentCapacity", PLIST_INT, " Battery: %ld%%", NULL, FIELD_WIDGET(battery), FIELD_POLLED, FIELD_BATTERY_LEVEL},
+    [FIELD_BATTERY_CHARGING]   = {"com.apple.mobile.battery", "BatteryIsCharging", PLIST_BOOLEAN, NULL, NULL, FIELD_NO_WIDGET, FIELD_POLLED, FIELD_BATTERY_CHARGING},
+    [FIELD_PASSWORD_PROTECTED] = {NULL, "PasswordProtected", PLIST_BOOLEAN, " Password Protected: %s", NULL, FIELD_WIDGET(is_passwd), FIELD_POLLED, FIELD_PASSWORD_PROTECTED},
+    [FIELD_DISK_TOTAL]         = {"com.apple.disk_usage", "TotalDiskCapacity", PLIST_INT, NULL, format_storage, FIELD_WIDGET(storage), FIELD_POLLED, FIELD_DISK_TOTAL},
+    [FIELD_DISK_AVAILABLE]     = {"com.apple.disk_usage", "AmountDataAvailable", PLIST_INT, NULL, NULL, FIELD_NO_WIDGET, FIELD_POLLED, FIELD_DISK_TOTAL},
+};
+
+/**
+ * Perfect hash from (domain, key) to schema entry. The seed is searched
+ * once so that no two entries share a slot; a lookup is then one hash, one
+ * slot and one compare to reject keys the schema does not know.
+ */
+static uint8_t slots[FIELD_SLOTS]; // Entry index + 1, 0 when empty
+static uint32_t seed = 0;
+static bool hashed = false;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t field_hash(uint32_t h, const char *domain, const char *key) {
+    for (const char *p = domain ? domain : ""; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    h = (h ^ '/') * 16777619u;
+    for (const char *p = key; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return h & (FIELD_SLOTS - 1);
+}
+
+static void build_hash(void) {
+    for (uint32_t candidate = 2166136261u; candidate < 2166136261u + FIELD_SEED_ATTEMPTS; candidate++) {
+        memset(slots, 0, sizeof(slots));
+        int i = 0;
+        for (; i < FIELD_COUNT; i++) {
+            uint32_t slot = field_hash(candidate, schema[i].domain, schema[i].key);
+            if (slots[slot] != 0) {
+                break;
+            }
+            slots[slot] = (uint8_t)(i + 1);
+        }
+        if (i == FIELD_COUNT) {
+            seed = candidate;
+            hashed = true;
+            return;
+        }
+    }
+    fprintf(stderr, "[Fields] No collision-free seed found, falling back to a linear scan\n");
+}
+
+static int find_field(const char *domain, const char *key) {
+    pthread_once(&hash_once, build_hash);
+    if (hashed) {
+        int i = slots[field_hash(seed, domain, key)] - 1;
+        return i >= 0 && g_strcmp0(schema[i].domain, domain) == 0 && strcmp(schema[i].key, key) == 0 ? i : -1;
+    }
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (g_strcmp0(schema[i].domain, domain) == 0 && strcmp(schema[i].key, key) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static GtkWidget* field_widget(const struct field *field) {
+    return *(GtkWidget **)((char *)tray->widgets + field->widget);
+}
+
+// Strings are copied into storage, the plist is freed once the walk is over
+static void read_value(const struct field *field, plist_t node, struct field_value *value, char *storage) {
+    if (plist_get_node_type(node) != field->type) {
+        return;
+    }
+    switch (field->type) {
+    case PLIST_STRING: {
+        const char *string = plist_get_string_ptr(node, NULL);
+        if (string != NULL) {
+            g_strlcpy(storage, string, FIELD_STRING_SIZE);
+            value->string = storage;
+            value->present = true;
+        }
+        break;
+    }
+    case PLIST_INT:
+        plist_get_int_val(node, &value->integer);
+        value->present = true;
+        break;
+    case PLIST_BOOLEAN:
+        plist_get_bool_val(node, &value->boolean);
+        value->present = true;
+        break;
+    default:
+        break;
+    }
+}
+
+static bool format_field(const struct field *field, const struct field_value *values, const struct field_value *value, char *buffer, size_t size) {
+    if (field->format != NULL) {
+        return field->format(values, buffer, size);
+    }
+    if (!value->present || field->label == NULL) {
+        return false;
+    }
+    switch (field->type) {
+    case PLIST_STRING:
+        snprintf(buffer, size, field->label, value->string);
+        break;
+    case PLIST_INT:
+        snprintf(buffer, size, field->label, (long)value->integer);
+        break;
+    case PLIST_BOOLEAN:
+        snprintf(buffer, size, field->label, value->boolean ? "yes" : "no");
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Menu updates and change events. Values are read, diffed and formatted on
+ * the dispatch lanes; the widgets and the listeners are only reached from
+ * the main loop, which gets the finished labels, which widgets to show,
+ * hide or draw normally again, and a copy of the changed values (the
+ * originals keep changing on the lanes). The widgets show one device, the
+ * first to publish or the one handed the menu by fields_redraw; every
+ * device still reaches the listeners.
+ */
+struct field_update {
+    bool claim;   // Makes udid the device the widgets show
+    guint shown;  // Widgets to draw with their label
+    guint hidden; // Widgets with nothing to show
+    guint fresh;  // Greyed widgets re-read unchanged, drawn normally again
+    char labels[FIELD_COUNT][FIELD_LABEL_SIZE];
+    char udid[64];
+    struct field_value values[FIELD_COUNT];       // Strings point into strings below
+    char strings[FIELD_COUNT][FIELD_STRING_SIZE];
+    struct field_change changes[FIELD_COUNT];     // Values point into values above
+    size_t count;
+};
+
+static guint greyed = 0; // Bit per widget greyed by fields_mark_stale, atomic
+static char shown_udid[64]; // Main loop only, empty until a device published
+
+// Formats one entry from state->values for its widget, off the main loop
+static void render_field(struct field_state *state, int i, struct field_update *update) {
+    const struct field *field = &schema[i];
+    if (field->widget == FIELD_NO_WIDGET) {
+        return;
+    }
+    if (format_field(field, state->values, &state->values[i], state->labels[i], FIELD_LABEL_SIZE)) {
+        memcpy(update->labels[i], state->labels[i], FIELD_LABEL_SIZE);
+        update->shown |= 1u << i;
+    } else {
+        update->hidden |= 1u << i;
+    }
+}
+
+static field_listener_t listeners[FIELD_MAX_LISTENERS];
+static size_t listener_count = 0;
+
+static gboolean apply_update(gpointer data) {
+    struct field_update *update = data;
+    if (update->claim || shown_udid[0] == '\0') {
+        g_strlcpy(shown_udid, update->udid, sizeof(shown_udid));
+    }
+    for (int i = 0; i < FIELD_COUNT && strcmp(shown_udid, update->udid) == 0; i++) {
+        guint bit = 1u << i;
+        if (!((update->shown | update->hidden | update->fresh) & bit)) {
+            continue;
+        }
+        GtkWidget *widget = field_widget(&schema[i]);
+        if (widget == NULL) {
+            continue;
+        }
+        if (update->shown & bit) {
+            update_menu_item_label(GTK_MENU_ITEM(widget), update->labels[i]);
+            gtk_widget_show(widget);
+        } else if (update->hidden & bit) {
+            gtk_widget_hide(widget);
+        }
+        if (schema[i].policy == FIELD_POLLED && (update->shown & bit || update->fresh & bit)) {
+            // A fresh value is drawn normally, a stale one greyed
+            g_atomic_int_and(&greyed, ~bit);
+            gtk_widget_set_sensitive(widget, TRUE);
+        }
+    }
+    if (update->count > 0) {
+        for (size_t l = 0; l < listener_count; l++) {
+            listeners[l](update->udid, update->values, update->changes, update->count);
+        }
+    }
+    g_free(update);
+    return G_SOURCE_REMOVE;
+}
+
+static bool in_group(int i, const char *domain, field_policy_t policy) {
+    return schema[i].policy == policy && g_strcmp0(schema[i].domain, domain) == 0;
+}
+
+/**
+ * Change detection. Values read in one go form a group that is diffed
+ * against the device's snapshot; only fields whose value moved reach the
+ * widgets, the log and the listeners, so an unchanged refresh redraws and
+ * sends nothing over dbusmenu.
+ */
+
+// Must be called before any device is monitored
+void fields_add_listener(field_listener_t listener) {
+    if (listener_count < FIELD_MAX_LISTENERS) {
+        listeners[listener_count++] = listener;
+    } else {
+        fprintf(stderr, "[Fields] Too many change listeners, ignoring one\n");
+    }
+}
+
+static uint64_t hash_field(const struct field *field, const struct field_value *value) {
+    if (!value->present) {
+        return 0;
+    }
+    switch (field->type) {
+    case PLIST_STRING:
+        return snapshot_hash(field->type, value->string, strlen(value->string));
+    case PLIST_INT:
+        return snapshot_hash(field->type, &value->integer, sizeof(value->integer));
+    case PLIST_BOOLEAN:
+        return snapshot_hash(field->type, &value->boolean, sizeof(value->boolean));
+    default:
+        return 0;
+    }
+}
+
+static void log_change(const char *udid, const struct field *field, const struct field_value *value) {
+    if (!value->present) {
+        printf("[UDID=%s][Fields] %s gone\n", udid, field->key);
+    } else if (field->type == PLIST_STRING) {
+        printf("[UDID=%s][Fields] %s: %s\n", udid, field->key, value->string);
+    } else if (field->type == PLIST_INT) {
+        printf("[UDID=%s][Fields] %s: %ld\n", udid, field->key, (long)value->integer);
+    } else {
+        printf("[UDID=%s][Fields] %s: %s\n", udid, field->key, value->boolean ? "yes" : "no");
+    }
+}
+
+// Diffs a group of freshly read values and hands on what changed
+static void publish(struct field_state *state, const char *udid, const int *members, size_t count) {
+    uint64_t hashes[FIELD_COUNT];
+    for (size_t k = 0; k < count; k++) {
+        hashes[k] = hash_field(&schema[members[k]], &state->values[members[k]]);
+    }
+    int changed[FIELD_COUNT];
+    size_t changes = snapshot_diff(&state->snapshot, &state->stats, members[0], members, hashes, count, changed);
+
+    guint touched = 0;
+    for (size_t k = 0; k < changes; k++) {
+        const struct field *field = &schema[changed[k]];
+        touched |= 1u << field->shown_in;
+        if (field->policy == FIELD_POLLED) {
+            // Identifiers read once stay out of the log
+            log_change(udid, field, &state->values[changed[k]]);
+        }
+    }
+    // A greyed field that was re-read unchanged only needs to look fresh again
+    guint fresh = 0;
+    for (size_t k = 0; k < count; k++) {
+        fresh |= g_atomic_int_get(&greyed) & (1u << members[k]) & ~touched;
+    }
+    if (touched == 0 && fresh == 0) {
+        return;
+    }
+    struct field_update *update = g_new0(struct field_update, 1);
+    g_strlcpy(update->udid, udid, sizeof(update->udid));
+    update->fresh = fresh;
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (touched & (1u << i)) {
+            render_field(state, i, update);
+        }
+    }
+    if (changes > 0) {
+        memcpy(update->values, state->values, sizeof(update->values));
+        for (int i = 0; i < FIELD_COUNT; i++) {
+            if (update->values[i].string != NULL) {
+                g_strlcpy(update->strings[i], update->values[i].string, FIELD_STRING_SIZE);
+                update->values[i].string = update->strings[i];
+            }
+        }
+        for (size_t k = 0; k < changes; k++) {
+            update->changes[k].field = (field_id_t)changed[k];
+            update->changes[k].value = &update->values[changed[k]];
+        }
+        update->count = changes;
+    }
+    g_idle_add(apply_update, update);
+}
+
+// Walks a domain dict once, picking out the schema entries of the given policy
+void fields_apply(struct field_state *state, const char *udid, const char *domain, plist_t dict, field_policy_t policy) {
+    int members[FIELD_COUNT];
+    size_t count = 0;
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (in_group(i, domain, policy)) {
+            memset(&state->values[i], 0, sizeof(state->values[i]));
+            members[count++] = i;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    if (dict != NULL && plist_get_node_type(dict) == PLIST_DICT) {
+        plist_dict_iter iter = NULL;
+        plist_dict_new_iter(dict, &iter);
+        plist_t node = NULL;
+        while (iter != NULL) {
+            node = NULL;
+            plist_dict_next_item(dict, iter, NULL, &node);
+            if (node == NULL) {
+                break;
+            }
+            const char *key = plist_get_string_ptr(plist_dict_item_get_key(node), NULL);
+            int i = key ? find_field(domain, key) : -1;
+            if (i >= 0 && schema[i].policy == policy) {
+                read_value(&schema[i], node, &state->values[i], state->strings[i]);
+            }
+        }
+        free(iter);
+    }
+
+    publish(state, udid, members, count);
+}
+
+/**
+ * Re-reads the polled entries, one lockdown request per domain. Root-domain
+ * entries are asked for by key since the whole root dump is large. Stops
+ * between requests once the deadline (0 for none) has passed, leaving the
+ * remaining fields greyed. Only fields whose value changed are redrawn and
+ * reported. Returns how many requests were answered.
+ */
+size_t fields_refresh(struct field_state *state, lockdownd_client_t client, const char *udid, gint64 deadline) {
+    bool done[FIELD_COUNT] = {false};
+    size_t answered = 0;
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        const struct field *field = &schema[i];
+        if (field->policy != FIELD_POLLED || done[i]) {
+            continue;
+        }
+        if (deadline > 0 && g_get_monotonic_time() > deadline) {
+            fprintf(stderr, "[UDID=%s][Thread][Loop] Refresh deadline passed, %s and later fields stay stale\n", udid, field->key);
+            break;
+        }
+
+        plist_t reply = NULL;
+        const char *key = field->domain == NULL ? field->key : NULL;
+        if (lockdownd_get_value(client, field->domain, key, &reply) != LOCKDOWN_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Thread][Loop] Failed to read %s\n", udid, field->domain ? field->domain : field->key);
+            reply = NULL;
+        } else {
+            answered++;
+        }
+
+        if (key != NULL) {
+            // A single root value comes back bare
+            memset(&state->values[i], 0, sizeof(state->values[i]));
+            if (reply != NULL) {
+                read_value(field, reply, &state->values[i], state->strings[i]);
+            }
+            publish(state, udid, &i, 1);
+            done[i] = true;
+        } else {
+            fields_apply(state, udid, field->domain, reply, FIELD_POLLED);
+            for (int j = i; j < FIELD_COUNT; j++) {
+                done[j] = done[j] || in_group(j, field->domain, FIELD_POLLED);
+            }
+        }
+        if (reply != NULL) {
+            plist_free(reply);
+        }
+    }
+    return answered;
+}
+
+// Draws every widget from the device's last values and makes it the one the menu shows
+void fields_redraw(struct field_state *state, const char *udid) {
+    struct field_update *update = g_new0(struct field_update, 1);
+    g_strlcpy(update->udid, udid, sizeof(update->udid));
+    update->claim = true;
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        render_field(state, i, update);
+    }
+    g_idle_add(apply_update, update);
+}
+
+// Device whose values the widgets show, NULL before any published; main loop only
+const char* fields_shown_device(void) {
+    return shown_udid[0] != '\0' ? shown_udid : NULL;
+}
+
+// Monitoring of udid ended; returns whether the widgets were showing it, they then wait for another device
+bool fields_release_device(const char *udid) {
+    if (strcmp(shown_udid, udid) != 0) {
+        return false;
+    }
+    shown_udid[0] = '\0';
+    return true;
+}
+
+// Menu opened: greys every polled field until its next fresh value lands
+void fields_mark_stale(void) {
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        if (schema[i].policy == FIELD_POLLED && schema[i].widget != FIELD_NO_WIDGET) {
+            GtkWidget *widget = field_widget(&schema[i]);
+            if (widget != NULL) {
+                gtk_widget_set_sensitive(widget, FALSE);
+                g_atomic_int_or(&greyed, 1u << i);
+            }
+        }
+    }
+}
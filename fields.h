@@ -0,0 +1,72 @@
+#ifndef FIELDS_H
+#define FIELDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <glib.h>
+#include <plist/plist.h>
+#include <libimobiledevice/lockdown.h>
+
+#include "snapshot.h"
+
+#define FIELD_LABEL_SIZE 96
+#define FIELD_STRING_SIZE 128
+
+// One per entry of the schema table in fields.c, in the same order
+typedef enum {
+    FIELD_DEVICE_NAME,
+    FIELD_PRODUCT_VERSION,
+    FIELD_MEID,
+    FIELD_IMEI,
+    FIELD_COLOR,
+    FIELD_MSISDN,
+    FIELD_ACTIVATION,
+    FIELD_BATTERY_LEVEL,
+    FIELD_BATTERY_CHARGING,
+    FIELD_PASSWORD_PROTECTED,
+    FIELD_DISK_TOTAL,
+    FIELD_DISK_AVAILABLE,
+    FIELD_COUNT
+} field_id_t;
+
+typedef enum {
+    FIELD_ONCE,   // Read from the full lockdown dump when monitoring starts
+    FIELD_POLLED  // Re-read on every refresh
+} field_policy_t;
+
+// Latest reading; strings point into the owner's own copy, longer values are truncated
+struct field_value {
+    bool present;
+    const char *string;
+    int64_t integer;
+    uint8_t boolean;
+};
+
+// Per-device extraction state, no heap behind it
+struct field_state {
+    struct field_value values[FIELD_COUNT];
+    char strings[FIELD_COUNT][FIELD_STRING_SIZE]; // Backing for values[].string, kept until the field is re-read
+    char labels[FIELD_COUNT][FIELD_LABEL_SIZE];
+    struct snapshot snapshot; // Hashes of the values last published
+    struct snapshot_stats stats;
+};
+
+// One field whose value differs from the last refresh; absent when it went away
+struct field_change {
+    field_id_t field;
+    const struct field_value *value;
+};
+
+// Called on the main loop with the changes of one group, values holds every field; strings are only valid during the call
+typedef void (*field_listener_t)(const char *udid, const struct field_value *values, const struct field_change *changes, size_t count);
+
+// Function prototypes
+void fields_add_listener(field_listener_t listener);
+void fields_apply(struct field_state *state, const char *udid, const char *domain, plist_t dict, field_policy_t policy);
+size_t fields_refresh(struct field_state *state, lockdownd_client_t client, const char *udid, gint64 deadline);
+void fields_redraw(struct field_state *state, const char *udid);
+void fields_mark_stale(void);
+const char* fields_shown_device(void);
+bool fields_release_device(const char *udid);
+
+#endif // FIELDS_H
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/diagnostics_relay.h>
+#include <libimobiledevice/installation_proxy.h>
+#include <libimobiledevice/screenshotr.h>
+#include <plist/plist.h>
+
+#include "fleet.h"
+#include "heavy.h"
+#include "tray.h" // To show aggregated progress
+
+#define FLEET_DEFAULT_JOBS 8      // Devices worked on at the same time, overridden by IOSINDICATOR_FLEET_JOBS
+#define FLEET_QUEUE_CAPACITY 256  // Tasks waiting for a worker before submitters block
+
+/**
+ * Fleet runner. An action is expanded into one task per attached device and
+ * fed through a bounded queue to a fixed set of workers. A worker only picks
+ * a task whose device is idle, so a phone never runs two fleet services at
+ * once while every other phone keeps going; a run takes about as long as
+ * its slowest device. A phone busy with a backup, import or screenshot is
+ * skipped and its task stays queued until the phone is released, so it
+ * never holds a worker meanwhile.
+ */
+
+struct fleet_action {
+    const char *name;
+    bool (*run)(idevice_t device, const char *udid, const char *dir);
+};
+
+struct fleet_task {
+    char udid[64];
+    struct fleet_run *run;
+};
+
+// One action over a set of devices
+struct fleet_run {
+    const struct fleet_action *action;
+    char *dir;
+    unsigned int total;
+    unsigned int done;   // Under fleet_lock
+    unsigned int failed; // Under fleet_lock
+    gint64 started;
+    bool detached;       // Freed by the worker that finishes it
+};
+
+static GMutex fleet_lock;
+static GCond fleet_changed;
+static GQueue pending = G_QUEUE_INIT;   // struct fleet_task, under fleet_lock
+static GHashTable *busy = NULL;         // UDIDs with a task running, under fleet_lock
+static GThread **workers = NULL;
+static int worker_count = 0;
+
+/**
+ * Actions
+ */
+
+static bool save_plist(plist_t node, const char *dir, const char *udid, const char *suffix) {
+    char *xml = NULL;
+    uint32_t length = 0;
+    plist_to_xml(node, &xml, &length);
+    char *name = g_strdup_printf("%s-%s.plist", udid, suffix);
+    char *path = g_build_filename(dir, name, NULL);
+    bool ok = xml != NULL && g_file_set_contents(path, xml, length, NULL);
+    g_free(path);
+    g_free(name);
+    free(xml);
+    return ok;
+}
+
+static bool action_diagnostics(idevice_t device, const char *udid, const char *dir) {
+    diagnostics_relay_client_t client = NULL;
+    if (diagnostics_relay_client_start_service(device, &client, "iosindicator") != DIAGNOSTICS_RELAY_E_SUCCESS) {
+        return false;
+    }
+    plist_t diagnostics = NULL;
+    bool ok = diagnostics_relay_request_diagnostics(client, "All", &diagnostics) == DIAGNOSTICS_RELAY_E_SUCCESS
+           && diagnostics != NULL && save_plist(diagnostics, dir, udid, "diagnostics");
+    if (diagnostics) plist_free(diagnostics);
+    diagnostics_relay_goodbye(client);
+    diagnostics_relay_client_free(client);
+    return ok;
+}
+
+static bool action_screenshot(idevice_t device, const char *udid, const char *dir) {
+    screenshotr_client_t client = NULL;
+    if (screenshotr_client_start_service(device, &client, "iosindicator") != SCREENSHOTR_E_SUCCESS) {
+        return false;
+    }
+    char *image = NULL;
+    uint64_t size = 0;
+    bool ok = false;
+    if (screenshotr_take_screenshot(client, &image, &size) == SCREENSHOTR_E_SUCCESS && image != NULL) {
+        const char *extension = size >= 4 && memcmp(image, "\x89PNG", 4) == 0 ? "png" : "tiff";
+        char *name = g_strdup_printf("%s.%s", udid, extension);
+        char *path = g_build_filename(dir, name, NULL);
+        ok = g_file_set_contents(path, image, size, NULL);
+        g_free(path);
+        g_free(name);
+    }
+    free(image);
+    screenshotr_client_free(client);
+    return ok;
+}
+
+static bool action_reboot(idevice_t device, const char *udid, const char *dir) {
+    diagnostics_relay_client_t client = NULL;
+    if (diagnostics_relay_client_start_service(device, &client, "iosindicator") != DIAGNOSTICS_RELAY_E_SUCCESS) {
+        return false;
+    }
+    bool ok = diagnostics_relay_restart(client, DIAGNOSTICS_RELAY_ACTION_FLAG_WAIT_FOR_DISCONNECT) == DIAGNOSTICS_RELAY_E_SUCCESS;
+    diagnostics_relay_goodbye(client);
+    diagnostics_relay_client_free(client);
+    return ok;
+}
+
+// One line per user app: bundle id, short version, build
+static bool action_versions(idevice_t device, const char *udid, const char *dir) {
+    instproxy_client_t client = NULL;
+    if (instproxy_client_start_service(device, &client, "iosindicator") != INSTPROXY_E_SUCCESS) {
+        return false;
+    }
+    plist_t options = instproxy_client_options_new();
+    instproxy_client_options_add(options, "ApplicationType", "User", NULL);
+    instproxy_client_options_set_return_attributes(options, "CFBundleIdentifier", "CFBundleShortVersionString", "CFBundleVersion", NULL);
+    plist_t apps = NULL;
+    bool ok = instproxy_browse(client, options, &apps) == INSTPROXY_E_SUCCESS && apps != NULL;
+    instproxy_client_options_free(options);
+    instproxy_client_free(client);
+    if (!ok) {
+        return false;
+    }
+
+    GString *out = g_string_new(NULL);
+    for (uint32_t i = 0; i < plist_array_get_size(apps); ++i) {
+        plist_t app = plist_array_get_item(apps, i);
+        const char *fields[] = {"CFBundleIdentifier", "CFBundleShortVersionString", "CFBundleVersion"};
+        for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); ++f) {
+            plist_t node = plist_dict_get_item(app, fields[f]);
+            const char *value = node ? plist_get_string_ptr(node, NULL) : NULL;
+            g_string_append(out, value ? value : "");
+            g_string_append_c(out, f + 1 < sizeof(fields) / sizeof(fields[0]) ? '\t' : '\n');
+        }
+    }
+    plist_free(apps);
+
+    char *name = g_strdup_printf("%s-versions.tsv", udid);
+    char *path = g_build_filename(dir, name, NULL);
+    ok = g_file_set_contents(path, out->str, out->len, NULL);
+    g_free(path);
+    g_free(name);
+    g_string_free(out, TRUE);
+    return ok;
+}
+
+static const struct fleet_action actions[] = {
+    {"diagnostics", action_diagnostics},
+    {"screenshot", action_screenshot},
+    {"reboot", action_reboot},
+    {"versions", action_versions},
+};
+
+static const struct fleet_action* find_action(const char *name) {
+    for (size_t i = 0; i < sizeof(actions) / sizeof(actions[0]); ++i) {
+        if (name != NULL && strcmp(actions[i].name, name) == 0) {
+            return &actions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Scheduler
+ */
+
+static gboolean publish_progress(gpointer data) {
+    char *label = data;
+    if (tray != NULL && tray->widgets != NULL && tray->widgets->fleet != NULL) {
+        update_menu_item_label(GTK_MENU_ITEM(tray->widgets->fleet), label);
+        gtk_widget_show(tray->widgets->fleet);
+    }
+    g_free(label);
+    return G_SOURCE_REMOVE;
+}
+
+// First queued task whose device is idle, or NULL; takes the device's heavy lock for it
+static struct fleet_task* take_runnable(void) {
+    for (GList *link = pending.head; link != NULL; link = link->next) {
+        struct fleet_task *task = link->data;
+        if (!g_hash_table_contains(busy, task->udid) && heavy_try_acquire(task->udid, task->run->action->name)) {
+            g_queue_delete_link(&pending, link);
+            g_hash_table_add(busy, g_strdup(task->udid));
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void run_task(struct fleet_task *task) {
+    struct fleet_run *run = task->run;
+    idevice_t device = NULL;
+    bool ok = false;
+    if (idevice_new(&device, task->udid) == IDEVICE_E_SUCCESS) {
+        ok = run->action->run(device, task->udid, run->dir);
+        idevice_free(device);
+    }
+    heavy_release(task->udid);
+    if (!ok) {
+        fprintf(stderr, "[UDID=%s][Fleet] %s failed\n", task->udid, run->action->name);
+    }
+
+    g_mutex_lock(&fleet_lock);
+    g_hash_table_remove(busy, task->udid);
+    run->done++;
+    run->failed += ok ? 0 : 1;
+    bool finished = run->done == run->total;
+    bool detached = run->detached;
+    char *label = g_strdup_printf(" Fleet %s: %u/%u done, %u failed", run->action->name, run->done, run->total, run->failed);
+    // Built before the broadcast, fleet_main frees its run as soon as it sees the last task done
+    char *summary = finished ? g_strdup_printf("[Fleet] %s finished on %u devices, %u failed in %.1fs, output in %s", run->action->name,
+                                               run->total, run->failed, (g_get_monotonic_time() - run->started) / (double)G_USEC_PER_SEC, run->dir) : NULL;
+    g_cond_broadcast(&fleet_changed);
+    g_mutex_unlock(&fleet_lock);
+    g_idle_add(publish_progress, label);
+
+    if (finished) {
+        printf("%s\n", summary);
+        g_free(summary);
+        if (detached) {
+            g_free(run->dir);
+            g_free(run);
+        }
+    }
+    g_free(task);
+}
+
+static gpointer worker_thread(gpointer data) {
+    for (;;) {
+        g_mutex_lock(&fleet_lock);
+        struct fleet_task *task;
+        while ((task = take_runnable()) == NULL) {
+            g_cond_wait(&fleet_changed, &fleet_lock);
+        }
+        // A slot in the queue opened up
+        g_cond_broadcast(&fleet_changed);
+        g_mutex_unlock(&fleet_lock);
+        run_task(task);
+    }
+    return NULL;
+}
+
+// A phone came free elsewhere, its queued task may run now
+static void on_heavy_released(void) {
+    g_mutex_lock(&fleet_lock);
+    g_cond_broadcast(&fleet_changed);
+    g_mutex_unlock(&fleet_lock);
+}
+
+static void start_workers(void) {
+    g_mutex_lock(&fleet_lock);
+    if (workers == NULL) {
+        heavy_set_release_callback(on_heavy_released);
+        const char *env = getenv("IOSINDICATOR_FLEET_JOBS");
+        worker_count = env && atoi(env) > 0 ? atoi(env) : FLEET_DEFAULT_JOBS;
+        busy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        workers = g_new0(GThread *, worker_count);
+        for (int i = 0; i < worker_count; ++i) {
+            workers[i] = g_thread_new("fleet", worker_thread, NULL);
+        }
+    }
+    g_mutex_unlock(&fleet_lock);
+}
+
+// Queues the action for every attached device, blocking while the queue is full
+static struct fleet_run* submit(const struct fleet_action *action, bool detached) {
+    char **devices = NULL;
+    int count = 0;
+    if (idevice_get_device_list(&devices, &count) != IDEVICE_E_SUCCESS || count == 0) {
+        fprintf(stderr, "[Fleet] No devices attached\n");
+        return NULL;
+    }
+    start_workers();
+
+    GDateTime *now = g_date_time_new_now_local();
+    char *stamp = g_date_time_format(now, "%Y%m%d-%H%M%S");
+    char *name = g_strdup_printf("%s-%s", action->name, stamp);
+    struct fleet_run *run = g_new0(struct fleet_run, 1);
+    run->action = action;
+    run->dir = g_build_filename(g_get_user_data_dir(), "gnome-ios-appindicator", "fleet", name, NULL);
+    run->started = g_get_monotonic_time();
+    run->detached = detached;
+    g_mkdir_with_parents(run->dir, 0700);
+    g_free(name);
+    g_free(stamp);
+    g_date_time_unref(now);
+
+    // A device reachable over USB and Wi-Fi is listed twice
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int i = 0; i < count; ++i) {
+        if (g_hash_table_contains(seen, devices[i])) {
+            continue;
+        }
+        g_hash_table_add(seen, devices[i]);
+        run->total++;
+    }
+    printf("[Fleet] Running %s on %u devices, %d at a time\n", action->name, run->total, worker_count);
+
+    g_hash_table_remove_all(seen);
+    for (int i = 0; i < count; ++i) {
+        if (g_hash_table_contains(seen, devices[i])) {
+            continue;
+        }
+        g_hash_table_add(seen, devices[i]);
+        struct fleet_task *task = g_new0(struct fleet_task, 1);
+        strncpy(task->udid, devices[i], sizeof(task->udid) - 1);
+        task->run = run;
+
+        g_mutex_lock(&fleet_lock);
+        while (g_queue_get_length(&pending) >= FLEET_QUEUE_CAPACITY) {
+            g_cond_wait(&fleet_changed, &fleet_lock);
+        }
+        g_queue_push_tail(&pending, task);
+        g_cond_broadcast(&fleet_changed);
+        g_mutex_unlock(&fleet_lock);
+    }
+    g_hash_table_destroy(seen);
+    idevice_device_list_free(devices);
+    return run;
+}
+
+static gpointer submit_thread(gpointer data) {
+    submit(data, true);
+    return NULL;
+}
+
+// Callback function for the fleet menu items, data is the action name
+void on_menu_item_fleet_clicked(GtkWidget *widget, gpointer data) {
+    const struct fleet_action *action = find_action(data);
+    if (action != NULL) {
+        // Listing devices and filling the queue may block, keep it off the GTK thread
+        g_thread_unref(g_thread_new("fleet-submit", submit_thread, (gpointer)action));
+    }
+}
+
+// Entry point of `iosindicator --fleet <action> [--jobs <n>]`
+int fleet_main(int argc, char *argv[]) {
+    const struct fleet_action *action = argc > 2 ? find_action(argv[2]) : NULL;
+    if (action == NULL) {
+        fprintf(stderr, "Usage: %s --fleet diagnostics|screenshot|reboot|versions [--jobs <n>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 4 && strcmp(argv[3], "--jobs") == 0) {
+        g_setenv("IOSINDICATOR_FLEET_JOBS", argv[4], TRUE);
+    }
+
+    struct fleet_run *run = submit(action, false);
+    if (run == NULL) {
+        return EXIT_FAILURE;
+    }
+    g_mutex_lock(&fleet_lock);
+    while (run->done < run->total) {
+        g_cond_wait(&fleet_changed, &fleet_lock);
+    }
+    bool ok = run->failed == 0;
+    g_mutex_unlock(&fleet_lock);
+    g_free(run->dir);
+    g_free(run);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,10 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <gtk/gtk.h>
+
+// Function prototypes
+int fleet_main(int argc, char *argv[]);
+void on_menu_item_fleet_clicked(GtkWidget *widget, gpointer data);
+
+#endif // FLEET_H
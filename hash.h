@@ -0,0 +1,11 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Function prototypes
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+uint64_t hash64_file(const char *path, uint64_t *size);
+
+#endif // HASH_H
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "heavy.h"
+
+/**
+ * Per-device lock for long-running services. A backup, a photo import, a
+ * timelapse frame and a fleet task each keep a device service busy, and two
+ * of them on the same phone at once only slow both down (or, for a reboot,
+ * cut the other one off). Whoever holds a phone is named so the waiter can
+ * say what it is waiting for.
+ */
+
+static GHashTable *holders = NULL; // udid -> what holds it
+static GMutex heavy_lock;
+static GCond heavy_released;
+static void (*release_callback)(void) = NULL; // Lets queued work elsewhere retry a busy phone
+
+// Blocks until no other heavy service runs on the device
+void heavy_acquire(const char *udid, const char *what) {
+    g_mutex_lock(&heavy_lock);
+    if (holders == NULL) {
+        holders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    const char *holder = g_hash_table_lookup(holders, udid);
+    if (holder != NULL) {
+        printf("[UDID=%s][Heavy] %s waiting for %s to finish\n", udid, what, holder);
+        while (g_hash_table_contains(holders, udid)) {
+            g_cond_wait(&heavy_released, &heavy_lock);
+        }
+    }
+    g_hash_table_insert(holders, g_strdup(udid), (gpointer)what);
+    g_mutex_unlock(&heavy_lock);
+}
+
+bool heavy_try_acquire(const char *udid, const char *what) {
+    g_mutex_lock(&heavy_lock);
+    if (holders == NULL) {
+        holders = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    bool acquired = !g_hash_table_contains(holders, udid);
+    if (acquired) {
+        g_hash_table_insert(holders, g_strdup(udid), (gpointer)what);
+    }
+    g_mutex_unlock(&heavy_lock);
+    return acquired;
+}
+
+void heavy_release(const char *udid) {
+    g_mutex_lock(&heavy_lock);
+    if (holders != NULL) {
+        g_hash_table_remove(holders, udid);
+    }
+    g_cond_broadcast(&heavy_released);
+    void (*callback)(void) = release_callback;
+    g_mutex_unlock(&heavy_lock);
+    if (callback != NULL) {
+        callback();
+    }
+}
+
+void heavy_set_release_callback(void (*callback)(void)) {
+    g_mutex_lock(&heavy_lock);
+    release_callback = callback;
+    g_mutex_unlock(&heavy_lock);
+}
@@ -0,0 +1,13 @@
+#ifndef HEAVY_H
+#define HEAVY_H
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Function prototypes
+void heavy_acquire(const char *udid, const char *what);
+bool heavy_try_acquire(const char *udid, const char *what);
+void heavy_release(const char *udid);
+void heavy_set_release_callback(void (*callback)(void));
+
+#endif // HEAVY_H
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "icons.h"
+#include "budget.h"
+
+#define ICON_SIZE 16
+#define ICON_FETCHERS 4       // sbservices connections per device
+#define ICON_DECODERS 2
+#define ICON_LRU_CAPACITY 256
+#define ICON_RETRY_US (10 * 60 * G_USEC_PER_SEC) // How long a failed fetch is not retried
+
+struct icons_session {
+    char udid[64];
+    idevice_t device;
+    GThreadPool *fetchers;
+    GAsyncQueue *connections; // Idle sbservices clients
+    gint opened;
+    gint stopping;
+};
+
+// One icon travelling through disk lookup, fetch and decode
+struct icon_job {
+    char udid[64];
+    char *bundle_id;
+    char *key;
+    char *png;
+    gsize png_len;
+    GdkPixbuf *pixbuf;
+    bool failed; // The device could not hand out the icon
+};
+
+// Ready pixbuf kept in the memory LRU
+struct lru_entry {
+    char *key;
+    GdkPixbuf *pixbuf;
+};
+
+// Sessions by UDID, so jobs can find a device to fetch from
+static GHashTable *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static GThreadPool *decoders = NULL;
+static char *cache_dir = NULL;
+static icons_ready_cb_t ready_callback = NULL;
+
+// Main loop only: LRU of decoded icons and keys currently in flight
+static GHashTable *lru_index = NULL; // key -> GList link in lru_order
+static GQueue lru_order = G_QUEUE_INIT;
+static GHashTable *pending = NULL;
+static GHashTable *failures = NULL; // key -> monotonic time after which it may be fetched again
+
+static void free_job(struct icon_job *job) {
+    g_free(job->bundle_id);
+    g_free(job->key);
+    free(job->png);
+    if (job->pixbuf != NULL) g_object_unref(job->pixbuf);
+    g_free(job);
+}
+
+// Content address of an icon: bundle id and version
+static char* icon_key(const char *bundle_id, const char *version) {
+    char *material = g_strdup_printf("%s\n%s", bundle_id, version ? version : "");
+    char *key = g_compute_checksum_for_string(G_CHECKSUM_SHA1, material, -1);
+    g_free(material);
+    return key;
+}
+
+static char* icon_path(const char *key) {
+    char *name = g_strdup_printf("%s.png", key);
+    char *path = g_build_filename(cache_dir, name, NULL);
+    g_free(name);
+    return path;
+}
+
+static gboolean deliver_icon(gpointer data) {
+    struct icon_job *job = data;
+    g_hash_table_remove(pending, job->key);
+    if (job->failed) {
+        // Remember the miss so lookups do not keep asking the device for it
+        gint64 *retry = g_new(gint64, 1);
+        *retry = g_get_monotonic_time() + ICON_RETRY_US;
+        g_hash_table_replace(failures, g_strdup(job->key), retry);
+    }
+
+    if (job->pixbuf != NULL) {
+        struct lru_entry *entry = g_new0(struct lru_entry, 1);
+        entry->key = g_strdup(job->key);
+        entry->pixbuf = g_object_ref(job->pixbuf);
+        g_queue_push_head(&lru_order, entry);
+        g_hash_table_replace(lru_index, entry->key, g_queue_peek_head_link(&lru_order));
+
+        while (g_queue_get_length(&lru_order) > ICON_LRU_CAPACITY) {
+            struct lru_entry *old = g_queue_pop_tail(&lru_order);
+            g_hash_table_remove(lru_index, old->key);
+            g_object_unref(old->pixbuf);
+            g_free(old->key);
+            g_free(old);
+        }
+
+        if (ready_callback != NULL) {
+            ready_callback(job->bundle_id, job->pixbuf);
+        }
+    }
+
+    free_job(job);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Decoder pool: serves icons from the disk cache, hands misses over to the
+ * device's fetchers and scales fetched PNG data, all off the GTK thread.
+ */
+static void decode_icon(gpointer data, gpointer user_data) {
+    struct icon_job *job = data;
+
+    if (job->png == NULL) {
+        char *path = icon_path(job->key);
+        gchar *contents = NULL;
+        gsize length = 0;
+        bool hit = g_file_get_contents(path, &contents, &length, NULL);
+        g_free(path);
+
+        if (!hit) {
+            pthread_mutex_lock(&sessions_lock);
+            icons_session_t *session = sessions ? g_hash_table_lookup(sessions, job->udid) : NULL;
+            if (session != NULL) {
+                g_thread_pool_push(session->fetchers, job, NULL);
+                job = NULL;
+            }
+            pthread_mutex_unlock(&sessions_lock);
+            if (job != NULL) {
+                g_idle_add(deliver_icon, job);
+            }
+            return;
+        }
+
+        job->png = malloc(length);
+        if (job->png != NULL) {
+            memcpy(job->png, contents, length);
+            job->png_len = length;
+        }
+        g_free(contents);
+    }
+
+    if (job->png != NULL) {
+        GInputStream *stream = g_memory_input_stream_new_from_data(job->png, job->png_len, NULL);
+        job->pixbuf = gdk_pixbuf_new_from_stream_at_scale(stream, ICON_SIZE, ICON_SIZE, TRUE, NULL, NULL);
+        g_object_unref(stream);
+    }
+    g_idle_add(deliver_icon, job);
+}
+
+static sbservices_client_t acquire_connection(icons_session_t *session) {
+    sbservices_client_t client = g_async_queue_try_pop(session->connections);
+    if (client != NULL) {
+        return client;
+    }
+
+    // Grow the pool up to its bound, then wait for a connection to free up
+    if (g_atomic_int_add(&session->opened, 1) < ICON_FETCHERS) {
+        if (sbservices_client_start_service(session->device, &client, NULL) == SBSERVICES_E_SUCCESS) {
+            return client;
+        }
+        g_atomic_int_add(&session->opened, -1);
+        fprintf(stderr, "[UDID=%s][Icons] Failed to start springboard services\n", session->udid);
+        return NULL;
+    }
+    g_atomic_int_add(&session->opened, -1);
+    return g_async_queue_pop(session->connections);
+}
+
+// Fetcher pool: one round trip per icon, up to ICON_FETCHERS in parallel
+static void fetch_icon(gpointer data, gpointer user_data) {
+    struct icon_job *job = data;
+    icons_session_t *session = user_data;
+
+    if (g_atomic_int_get(&session->stopping)) {
+        g_idle_add(deliver_icon, job);
+        return;
+    }
+
+    sbservices_client_t client = acquire_connection(session);
+    if (client == NULL) {
+        job->failed = true;
+        g_idle_add(deliver_icon, job);
+        return;
+    }
+
+    uint64_t size = 0;
+    budget_acquire(session->udid);
+    gint64 started = g_get_monotonic_time();
+    sbservices_error_t err = sbservices_get_icon_pngdata(client, job->bundle_id, &job->png, &size);
+    budget_complete(session->udid, size, g_get_monotonic_time() - started);
+    if (err != SBSERVICES_E_SUCCESS || job->png == NULL) {
+        // Back to the main loop directly, the decoder would only send it here again
+        fprintf(stderr, "[UDID=%s][Icons] Failed to fetch icon for %s\n", session->udid, job->bundle_id);
+        g_async_queue_push(session->connections, client);
+        free(job->png);
+        job->png = NULL;
+        job->failed = true;
+        g_idle_add(deliver_icon, job);
+        return;
+    }
+
+    job->png_len = size;
+    char *path = icon_path(job->key);
+    if (!g_file_set_contents(path, job->png, job->png_len, NULL)) {
+        fprintf(stderr, "[UDID=%s][Icons] Failed to write %s\n", session->udid, path);
+    }
+    g_free(path);
+    g_async_queue_push(session->connections, client);
+
+    g_thread_pool_push(decoders, job, NULL);
+}
+
+GdkPixbuf* icons_lookup(const char *udid, const char *bundle_id, const char *version) {
+    if (lru_index == NULL) {
+        lru_index = g_hash_table_new(g_str_hash, g_str_equal);
+        pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        failures = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+
+    char *key = icon_key(bundle_id, version);
+    GList *link = g_hash_table_lookup(lru_index, key);
+    if (link != NULL) {
+        // Move to the front
+        g_queue_unlink(&lru_order, link);
+        g_queue_push_head_link(&lru_order, link);
+        g_free(key);
+        return ((struct lru_entry *)link->data)->pixbuf;
+    }
+
+    gint64 *retry = g_hash_table_lookup(failures, key);
+    if (retry != NULL && g_get_monotonic_time() < *retry) {
+        g_free(key);
+        return NULL;
+    }
+    g_hash_table_remove(failures, key);
+
+    if (decoders == NULL || g_hash_table_contains(pending, key)) {
+        g_free(key);
+        return NULL;
+    }
+
+    struct icon_job *job = g_new0(struct icon_job, 1);
+    strncpy(job->udid, udid, sizeof(job->udid) - 1);
+    job->bundle_id = g_strdup(bundle_id);
+    job->key = key;
+    g_hash_table_add(pending, g_strdup(key));
+    g_thread_pool_push(decoders, job, NULL);
+    return NULL;
+}
+
+void icons_set_ready_callback(icons_ready_cb_t callback) {
+    ready_callback = callback;
+}
+
+icons_session_t* icons_start(idevice_t device, const char *udid) {
+    pthread_mutex_lock(&sessions_lock);
+    if (sessions == NULL) {
+        sessions = g_hash_table_new(g_str_hash, g_str_equal);
+        cache_dir = g_build_filename(g_get_user_cache_dir(), "gnome-ios-appindicator", "icons", NULL);
+        g_mkdir_with_parents(cache_dir, 0700);
+        decoders = g_thread_pool_new(decode_icon, NULL, ICON_DECODERS, FALSE, NULL);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    icons_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Icons] Failed to allocate memory for icons session\n", udid);
+        return NULL;
+    }
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    session->connections = g_async_queue_new();
+    session->fetchers = g_thread_pool_new(fetch_icon, session, ICON_FETCHERS, FALSE, NULL);
+
+    pthread_mutex_lock(&sessions_lock);
+    g_hash_table_replace(sessions, session->udid, session);
+    pthread_mutex_unlock(&sessions_lock);
+    return session;
+}
+
+void icons_stop(icons_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sessions_lock);
+    if (g_hash_table_lookup(sessions, session->udid) == session) {
+        g_hash_table_remove(sessions, session->udid);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    // Queued fetches drain without touching the device
+    g_atomic_int_set(&session->stopping, 1);
+    g_thread_pool_free(session->fetchers, FALSE, TRUE);
+
+    sbservices_client_t client;
+    while ((client = g_async_queue_try_pop(session->connections)) != NULL) {
+        sbservices_client_free(client);
+    }
+    g_async_queue_unref(session->connections);
+    free(session);
+}
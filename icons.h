@@ -0,0 +1,20 @@
+#ifndef ICONS_H
+#define ICONS_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/sbservices.h>
+
+// Opaque per-device icon fetcher
+typedef struct icons_session icons_session_t;
+
+// Invoked on the GTK main loop once an icon has been decoded
+typedef void (*icons_ready_cb_t)(const char *bundle_id, GdkPixbuf *pixbuf);
+
+// Function prototypes
+icons_session_t* icons_start(idevice_t device, const char *udid);
+void icons_stop(icons_session_t *session);
+void icons_set_ready_callback(icons_ready_cb_t callback);
+GdkPixbuf* icons_lookup(const char *udid, const char *bundle_id, const char *version);
+
+#endif // ICONS_H
@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "import.h"
+#include "hash.h"
+#include "heavy.h"
+
+#define IMPORT_ROOT "/DCIM"
+#define IMPORT_LISTERS 4 // Parallel directory listings, one AFC connection each
+#define INDEX_MAGIC "IOSIMP01"
+#define INDEX_MIN_CAPACITY 4096 // Must be a power of two
+#define INDEX_MAX_LOAD 0.7
+#define IMPORT_HASHERS 2 // Threads re-reading landed files, off the shared transfer writer
+
+/**
+ * The index is a memory-mapped open-addressing table keyed by the hash of
+ * the device path. An empty slot has path_hash 0.
+ */
+struct index_header {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t count;
+};
+
+struct index_record {
+    uint64_t path_hash;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t content_hash;
+};
+
+struct import_index {
+    char *path;
+    int fd;
+    size_t map_len;
+    struct index_header *header;
+    struct index_record *records;
+};
+
+struct import_session {
+    char udid[64];
+    idevice_t device;
+    transfer_session_t *transfer;
+    GThread *run;
+    volatile gint running;
+    volatile gint cancelled;
+};
+
+// State of one import run
+struct import_run {
+    import_session_t *session;
+    struct import_index index;
+    GHashTable *contents; // content hash -> size, for dedupe
+    GMutex lock;
+    GCond cond;
+    GAsyncQueue *dirs;
+    gint pending_dirs;
+    GPtrArray *candidates;
+    GThreadPool *hashers;
+    unsigned int scanned;
+    unsigned int pending_files;
+    unsigned int imported;
+    unsigned int duplicates;
+    unsigned int failed;
+};
+
+struct candidate {
+    struct import_run *run;
+    char *remote;
+    uint64_t size;
+    uint64_t mtime;
+};
+
+static import_session_t *active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t path_key(const char *path) {
+    uint64_t h = hash64(path, strlen(path), 0);
+    return h ? h : 1;
+}
+
+static size_t index_bytes(uint32_t capacity) {
+    return sizeof(struct index_header) + (size_t)capacity * sizeof(struct index_record);
+}
+
+static bool index_map(struct import_index *index, const char *path, uint32_t capacity) {
+    index->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (index->fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    fstat(index->fd, &st);
+    struct index_header header = {{0}, 0, 0};
+    bool valid = (size_t)st.st_size >= sizeof(header)
+        && pread(index->fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, INDEX_MAGIC, 8) == 0
+        && (size_t)st.st_size == index_bytes(header.capacity);
+
+    if (!valid) {
+        // Fresh (or unreadable) index: start empty
+        if (ftruncate(index->fd, 0) != 0 || ftruncate(index->fd, index_bytes(capacity)) != 0) {
+            close(index->fd);
+            return false;
+        }
+        memcpy(header.magic, INDEX_MAGIC, 8);
+        header.capacity = capacity;
+        header.count = 0;
+        if (pwrite(index->fd, &header, sizeof(header), 0) != sizeof(header)) {
+            close(index->fd);
+            return false;
+        }
+    }
+
+    index->map_len = index_bytes(header.capacity);
+    void *map = mmap(NULL, index->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, index->fd, 0);
+    if (map == MAP_FAILED) {
+        close(index->fd);
+        return false;
+    }
+    index->header = map;
+    index->records = (struct index_record *)(index->header + 1);
+    return true;
+}
+
+static void index_unmap(struct import_index *index) {
+    msync(index->header, index->map_len, MS_SYNC);
+    munmap(index->header, index->map_len);
+    close(index->fd);
+}
+
+// Returns the matching record, or the empty slot where it belongs
+static struct index_record* index_slot(struct import_index *index, uint64_t key) {
+    uint32_t mask = index->header->capacity - 1;
+    for (uint32_t i = key & mask;; i = (i + 1) & mask) {
+        struct index_record *record = &index->records[i];
+        if (record->path_hash == key || record->path_hash == 0) {
+            return record;
+        }
+    }
+}
+
+// Doubles the table into a new file and swaps it in atomically
+static bool index_grow(struct import_index *index) {
+    char *tmp = g_strdup_printf("%s.tmp", index->path);
+    unlink(tmp);
+    struct import_index grown = {0};
+    if (!index_map(&grown, tmp, index->header->capacity * 2)) {
+        g_free(tmp);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < index->header->capacity; ++i) {
+        if (index->records[i].path_hash != 0) {
+            *index_slot(&grown, index->records[i].path_hash) = index->records[i];
+        }
+    }
+    grown.header->count = index->header->count;
+
+    index_unmap(index);
+    msync(grown.header, grown.map_len, MS_SYNC);
+    rename(tmp, index->path);
+    grown.path = index->path;
+    *index = grown;
+    g_free(tmp);
+    return true;
+}
+
+static void index_put(struct import_index *index, uint64_t key, uint64_t size, uint64_t mtime, uint64_t content_hash) {
+    if (index->header->count + 1 > index->header->capacity * INDEX_MAX_LOAD
+        && !index_grow(index) && index->header->count + 1 >= index->header->capacity) {
+        return; // Full and cannot grow, the file is simply pulled again next time
+    }
+
+    struct index_record *record = index_slot(index, key);
+    if (record->path_hash == 0) {
+        index->header->count++;
+    }
+    record->path_hash = key;
+    record->size = size;
+    record->mtime = mtime;
+    record->content_hash = content_hash;
+}
+
+// A landed file waiting to be hashed
+struct hash_job {
+    struct candidate *candidate;
+    char *local;
+    bool ok;
+};
+
+// Hasher pool: reads the file back, dedupes and indexes it
+static void hash_imported(gpointer data, gpointer user_data) {
+    struct hash_job *job = data;
+    struct candidate *candidate = job->candidate;
+    struct import_run *run = candidate->run;
+    const char *local = job->local;
+
+    uint64_t size = 0;
+    uint64_t content = job->ok ? hash64_file(local, &size) : 0;
+    bool ok = job->ok && size == candidate->size;
+
+    g_mutex_lock(&run->lock);
+    if (ok) {
+        gpointer known_size = NULL;
+        if (g_hash_table_lookup_extended(run->contents, (gpointer)(uintptr_t)content, NULL, &known_size)
+            && (uint64_t)(uintptr_t)known_size == size) {
+            // Same bytes already imported under another name
+            unlink(local);
+            run->duplicates++;
+        } else {
+            g_hash_table_insert(run->contents, (gpointer)(uintptr_t)content, (gpointer)(uintptr_t)size);
+            run->imported++;
+        }
+        index_put(&run->index, path_key(candidate->remote), candidate->size, candidate->mtime, content);
+    } else {
+        unlink(local);
+        run->failed++;
+    }
+    run->pending_files--;
+    g_cond_signal(&run->cond);
+    g_mutex_unlock(&run->lock);
+    g_free(job->local);
+    g_free(job);
+}
+
+// Runs on the transfer writer thread once a file has landed; the hashing is handed off so the writer keeps recycling buffers
+static void on_file_imported(const char *remote, const char *local, bool ok, void *user_data) {
+    struct candidate *candidate = user_data;
+    struct hash_job *job = g_new(struct hash_job, 1);
+    job->candidate = candidate;
+    job->local = g_strdup(local);
+    job->ok = ok;
+    g_thread_pool_push(candidate->run->hashers, job, NULL);
+}
+
+static gpointer lister_thread(gpointer data) {
+    struct import_run *run = data;
+    import_session_t *session = run->session;
+    afc_client_t afc = NULL;
+
+    if (afc_client_start_service(session->device, &afc, NULL) != AFC_E_SUCCESS) {
+        afc = NULL;
+    }
+
+    while (g_atomic_int_get(&run->pending_dirs) > 0) {
+        char *dir = g_async_queue_timeout_pop(run->dirs, 50000);
+        if (dir == NULL) {
+            continue;
+        }
+
+        char **entries = NULL;
+        if (afc != NULL && !g_atomic_int_get(&session->cancelled)
+            && afc_read_directory(afc, dir, &entries) == AFC_E_SUCCESS && entries != NULL) {
+            for (int i = 0; entries[i] != NULL; ++i) {
+                if (strcmp(entries[i], ".") == 0 || strcmp(entries[i], "..") == 0) continue;
+
+                char *path = g_build_filename(dir, entries[i], NULL);
+                uint64_t size = 0, mtime = 0;
+                bool is_dir = false;
+                if (!transfer_stat(afc, path, &size, &mtime, &is_dir)) {
+                    g_free(path);
+                    continue;
+                }
+                if (is_dir) {
+                    g_atomic_int_inc(&run->pending_dirs);
+                    g_async_queue_push(run->dirs, path);
+                    continue;
+                }
+
+                g_mutex_lock(&run->lock);
+                run->scanned++;
+                struct index_record *record = index_slot(&run->index, path_key(path));
+                bool known = record->path_hash != 0 && record->size == size && record->mtime == mtime;
+                if (!known) {
+                    struct candidate *candidate = g_new0(struct candidate, 1);
+                    candidate->run = run;
+                    candidate->remote = path;
+                    candidate->size = size;
+                    candidate->mtime = mtime;
+                    g_ptr_array_add(run->candidates, candidate);
+                    path = NULL;
+                }
+                g_mutex_unlock(&run->lock);
+                g_free(path);
+            }
+            afc_dictionary_free(entries);
+        }
+        g_free(dir);
+        g_atomic_int_add(&run->pending_dirs, -1);
+    }
+
+    if (afc != NULL) afc_client_free(afc);
+    return NULL;
+}
+
+static void free_candidate(gpointer data) {
+    struct candidate *candidate = data;
+    g_free(candidate->remote);
+    g_free(candidate);
+}
+
+static gpointer import_thread(gpointer data) {
+    import_session_t *session = data;
+    struct import_run run = {0};
+    heavy_acquire(session->udid, "import");
+    gint64 start = g_get_monotonic_time();
+
+    char *index_dir = g_build_filename(g_get_user_data_dir(), "gnome-ios-appindicator", "import", NULL);
+    g_mkdir_with_parents(index_dir, 0700);
+    char *index_name = g_strdup_printf("%s.idx", session->udid);
+    run.index.path = g_build_filename(index_dir, index_name, NULL);
+    g_free(index_name);
+    g_free(index_dir);
+
+    if (!index_map(&run.index, run.index.path, INDEX_MIN_CAPACITY)) {
+        fprintf(stderr, "[UDID=%s][Import] Failed to open index %s\n", session->udid, run.index.path);
+        g_free(run.index.path);
+        heavy_release(session->udid);
+        g_atomic_int_set(&session->running, 0);
+        return NULL;
+    }
+
+    run.session = session;
+    g_mutex_init(&run.lock);
+    g_cond_init(&run.cond);
+    run.contents = g_hash_table_new(g_direct_hash, g_direct_equal);
+    run.candidates = g_ptr_array_new_with_free_func(free_candidate);
+    run.dirs = g_async_queue_new();
+    run.hashers = g_thread_pool_new(hash_imported, NULL, IMPORT_HASHERS, FALSE, NULL);
+    for (uint32_t i = 0; i < run.index.header->capacity; ++i) {
+        if (run.index.records[i].path_hash != 0) {
+            g_hash_table_insert(run.contents, (gpointer)(uintptr_t)run.index.records[i].content_hash, (gpointer)(uintptr_t)run.index.records[i].size);
+        }
+    }
+
+    /**
+     * Walk /DCIM with parallel listings, comparing size and mtime to the index
+     */
+    run.pending_dirs = 1;
+    g_async_queue_push(run.dirs, g_strdup(IMPORT_ROOT));
+    GThread *listers[IMPORT_LISTERS];
+    for (int i = 0; i < IMPORT_LISTERS; ++i) {
+        listers[i] = g_thread_new("import-list", lister_thread, &run);
+    }
+    for (int i = 0; i < IMPORT_LISTERS; ++i) {
+        g_thread_join(listers[i]);
+    }
+    printf("[UDID=%s][Import] Scanned %u files, %u new or changed (%.1fs)\n", session->udid, run.scanned, run.candidates->len, (g_get_monotonic_time() - start) / 1e6);
+
+    /**
+     * Pull only the candidates, each one is hashed and indexed when it lands
+     */
+    const char *pictures = g_get_user_special_dir(G_USER_DIRECTORY_PICTURES);
+    char *local_root = g_build_filename(pictures ? pictures : g_get_home_dir(), "iOS", session->udid, NULL);
+    for (guint i = 0; i < run.candidates->len && !g_atomic_int_get(&session->cancelled); ++i) {
+        struct candidate *candidate = g_ptr_array_index(run.candidates, i);
+        char *local = g_build_filename(local_root, candidate->remote + strlen(IMPORT_ROOT), NULL);
+        g_mutex_lock(&run.lock);
+        run.pending_files++;
+        g_mutex_unlock(&run.lock);
+        if (!transfer_pull_file(session->transfer, candidate->remote, local, on_file_imported, candidate)) {
+            g_mutex_lock(&run.lock);
+            run.pending_files--;
+            g_mutex_unlock(&run.lock);
+        }
+        g_free(local);
+    }
+    g_free(local_root);
+
+    g_mutex_lock(&run.lock);
+    while (run.pending_files > 0) {
+        g_cond_wait(&run.cond, &run.lock);
+    }
+    g_mutex_unlock(&run.lock);
+    g_thread_pool_free(run.hashers, FALSE, TRUE);
+
+    printf("[UDID=%s][Import] Done: %u imported, %u duplicates, %u failed, %u indexed (%.1fs)\n", session->udid,
+           run.imported, run.duplicates, run.failed, run.index.header->count, (g_get_monotonic_time() - start) / 1e6);
+
+    index_unmap(&run.index);
+    g_free(run.index.path);
+    g_ptr_array_free(run.candidates, TRUE);
+    g_hash_table_destroy(run.contents);
+    g_async_queue_unref(run.dirs);
+    g_mutex_clear(&run.lock);
+    g_cond_clear(&run.cond);
+    heavy_release(session->udid);
+    g_atomic_int_set(&session->running, 0);
+    return NULL;
+}
+
+// Callback function for the import menu item
+void on_menu_item_import_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&active_lock);
+    if (active != NULL && g_atomic_int_compare_and_exchange(&active->running, 0, 1)) {
+        printf("[UDID=%s][Import] Starting photo import\n", active->udid);
+        if (active->run != NULL) {
+            g_thread_join(active->run);
+        }
+        active->run = g_thread_new("import", import_thread, active);
+    }
+    pthread_mutex_unlock(&active_lock);
+}
+
+import_session_t* import_start(idevice_t device, const char *udid, transfer_session_t *transfer) {
+    import_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Import] Failed to allocate memory for import session\n", udid);
+        return NULL;
+    }
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    session->transfer = transfer;
+
+    pthread_mutex_lock(&active_lock);
+    active = session;
+    pthread_mutex_unlock(&active_lock);
+    return session;
+}
+
+void import_stop(import_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&active_lock);
+    if (active == session) {
+        active = NULL;
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    g_atomic_int_set(&session->cancelled, 1);
+    if (session->run != NULL) {
+        g_thread_join(session->run);
+    }
+    free(session);
+}
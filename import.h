@@ -0,0 +1,17 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "transfer.h"
+
+// Opaque per-device photo importer
+typedef struct import_session import_session_t;
+
+// Function prototypes
+import_session_t* import_start(idevice_t device, const char *udid, transfer_session_t *transfer);
+void import_stop(import_session_t *session);
+void on_menu_item_import_clicked(GtkWidget *widget, gpointer data);
+
+#endif // IMPORT_H
@@ -1,15 +1,60 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <libayatana-appindicator3-0.1/libayatana-appindicator/app-indicator.h>
 #include <gtk/gtk.h>
 #include "device.h"
 #include "tray.h"
+#include "afcfs.h"
+#include "sync.h"
+#include "backup.h"
+#include "symbolicate.h"
+#include "fleet.h"
+#include "statusicon.h"
+#include "bplist.h"
+#include "fields.h"
+#include "crashwatch.h"
 
 int main(int argc, char *argv[]) {
     // To flush buffer instantly
     setvbuf(stdout, NULL, _IONBF, 0);
 
+    // Headless filesystem mode, spawned by the tray for each mount
+    if (argc > 1 && strcmp(argv[1], "--mount") == 0) {
+        return afcfs_main(argc, argv);
+    }
+
+    // Headless container sync for one or many devices
+    if (argc > 1 && strcmp(argv[1], "--sync") == 0) {
+        return sync_main(argc, argv);
+    }
+
+    // Rebuilds a plain backup folder from the chunk store
+    if (argc > 1 && strcmp(argv[1], "--backup-export") == 0) {
+        return backup_export_main(argc, argv);
+    }
+
+    // Offline symbolication of collected crash reports
+    if (argc > 1 && strcmp(argv[1], "--symbolicate") == 0) {
+        return symbolicate_main(argc, argv);
+    }
+
+    // Runs one action on every attached device
+    if (argc > 1 && strcmp(argv[1], "--fleet") == 0) {
+        return fleet_main(argc, argv);
+    }
+
+    // Compares the in-place binary plist reader against libplist
+    if (argc > 1 && strcmp(argv[1], "--plist-bench") == 0) {
+        return bplist_bench_main(argc, argv);
+    }
+
+    // Feeds a saved syslog through the crash detector
+    if (argc > 1 && strcmp(argv[1], "--crashwatch-replay") == 0) {
+        return crashwatch_replay_main(argc, argv);
+    }
+
     // Initialize GTK
     gtk_init(&argc, &argv);
 
@@ -19,9 +64,19 @@ int main(int argc, char *argv[]) {
     // Create a new app indicator (tray icon)
     tray->indicator = app_indicator_new("com.exvous.apps.gnome-ios-appindicator", "phone-apple-iphone", APP_INDICATOR_CATEGORY_APPLICATION_STATUS);
 
+    // Icon shown while a watched app has crashed
+    app_indicator_set_attention_icon_full(tray->indicator, "dialog-warning", "Crash detected");
+
+    // Battery and lock state icons, drawn once and then switched by name
+    statusicon_init(tray->indicator);
+    fields_add_listener(statusicon_field_changes);
+
     // Initialize a dummy menu
     generate_menu();
 
+    // Re-read the device fields whenever the menu is opened
+    tray_set_open_callback(device_request_refresh);
+
     // Initially set the app indicator to hidden
     app_indicator_set_status(tray->indicator, APP_INDICATOR_STATUS_PASSIVE);
 
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <glib.h>
+#include <usbmuxd.h>
+#include <plist/plist.h>
+
+#include "pair.h"
+#include "bplist.h"
+
+#define PAIR_LABEL "iosindicator"
+
+/**
+ * Pair record cache. lockdownd_client_new_with_handshake() queries the
+ * lockdown type and product version, reads the pair record from usbmuxd and
+ * only then starts the TLS session. Once a device has been paired, the
+ * HostID from its record is all StartSession needs, so it is kept here per
+ * UDID and reconnects skip the QueryType and ProductVersion round trips.
+ * The usbmuxd record read is not saved: enabling SSL inside
+ * lockdownd_start_session() loads the record again for the certificates,
+ * and libimobiledevice offers no way to hand it a parsed one. The cache is
+ * dropped when usbmuxd reports a new pairing or a cached start fails.
+ */
+
+struct pair_stats {
+    unsigned int count;
+    gint64 total_us;
+};
+
+static GHashTable *host_ids = NULL; // udid -> HostID
+static struct pair_stats full_stats;
+static struct pair_stats cached_stats;
+static pthread_mutex_t pair_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char* lookup_host_id(const char *udid) {
+    pthread_mutex_lock(&pair_lock);
+    char *host_id = host_ids ? g_strdup(g_hash_table_lookup(host_ids, udid)) : NULL;
+    pthread_mutex_unlock(&pair_lock);
+    return host_id;
+}
+
+// Parses the record usbmuxd holds for udid and keeps its HostID
+static void remember_host_id(const char *udid) {
+    char *data = NULL;
+    uint32_t size = 0;
+    if (usbmuxd_read_pair_record(udid, &data, &size) < 0 || data == NULL) {
+        return;
+    }
+
+    // Binary records are read in place, XML ones need the full parse
+    char *host_id = NULL;
+    struct bplist_view view;
+    if (bplist_view_init(&view, data, size)) {
+        static const char *const keys[] = {"HostID"};
+        struct bplist_value value;
+        if (bplist_view_lookup(&view, view.root, keys, 1, &value) == 1 && value.type == BPLIST_ASCII) {
+            host_id = g_strndup((const char *)value.ptr, value.len);
+        }
+    } else {
+        plist_t record = NULL;
+        plist_from_memory(data, size, &record, NULL);
+        plist_t node = record ? plist_dict_get_item(record, "HostID") : NULL;
+        const char *string = node ? plist_get_string_ptr(node, NULL) : NULL;
+        host_id = g_strdup(string);
+        if (record) plist_free(record);
+    }
+    free(data);
+
+    if (host_id != NULL) {
+        pthread_mutex_lock(&pair_lock);
+        if (host_ids == NULL) {
+            host_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        }
+        g_hash_table_replace(host_ids, g_strdup(udid), host_id);
+        pthread_mutex_unlock(&pair_lock);
+    }
+}
+
+static void record_latency(const char *udid, struct pair_stats *stats, const char *path, gint64 elapsed) {
+    pthread_mutex_lock(&pair_lock);
+    stats->count++;
+    stats->total_us += elapsed;
+    double full_avg = full_stats.count ? full_stats.total_us / 1000.0 / full_stats.count : 0;
+    double cached_avg = cached_stats.count ? cached_stats.total_us / 1000.0 / cached_stats.count : 0;
+    unsigned int full_count = full_stats.count, cached_count = cached_stats.count;
+    pthread_mutex_unlock(&pair_lock);
+    printf("[UDID=%s][Pair] %s handshake %.1f ms (avg full %.1f ms over %u, cached %.1f ms over %u)\n",
+           udid, path, elapsed / 1000.0, full_avg, full_count, cached_avg, cached_count);
+}
+
+void pair_cache_invalidate(const char *udid) {
+    pthread_mutex_lock(&pair_lock);
+    if (host_ids != NULL) {
+        g_hash_table_remove(host_ids, udid);
+    }
+    pthread_mutex_unlock(&pair_lock);
+}
+
+// Drop-in for lockdownd_client_new_with_handshake() that skips the pairing round trips when it can
+lockdownd_error_t pair_lockdown_client_new(idevice_t device, const char *udid, lockdownd_client_t *client) {
+    gint64 started = g_get_monotonic_time();
+    char *host_id = lookup_host_id(udid);
+    if (host_id != NULL) {
+        lockdownd_client_t fast = NULL;
+        lockdownd_error_t err = lockdownd_client_new(device, &fast, PAIR_LABEL);
+        if (err == LOCKDOWN_E_SUCCESS) {
+            err = lockdownd_start_session(fast, host_id, NULL, NULL);
+            if (err == LOCKDOWN_E_SUCCESS) {
+                g_free(host_id);
+                *client = fast;
+                record_latency(udid, &cached_stats, "Cached", g_get_monotonic_time() - started);
+                return LOCKDOWN_E_SUCCESS;
+            }
+            lockdownd_client_free(fast);
+        }
+        // Stale or revoked record, take the full path and start over
+        fprintf(stderr, "[UDID=%s][Pair] Cached session start failed (%d), doing a full handshake\n", udid, err);
+        pair_cache_invalidate(udid);
+        g_free(host_id);
+        started = g_get_monotonic_time();
+    }
+
+    lockdownd_error_t err = lockdownd_client_new_with_handshake(device, client, PAIR_LABEL);
+    if (err == LOCKDOWN_E_SUCCESS) {
+        record_latency(udid, &full_stats, "Full", g_get_monotonic_time() - started);
+        remember_host_id(udid);
+    }
+    return err;
+}
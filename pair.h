@@ -0,0 +1,11 @@
+#ifndef PAIR_H
+#define PAIR_H
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+
+// Function prototypes
+lockdownd_error_t pair_lockdown_client_new(idevice_t device, const char *udid, lockdownd_client_t *client);
+void pair_cache_invalidate(const char *udid);
+
+#endif // PAIR_H
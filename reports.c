@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/service.h>
+#include <libimobiledevice/afc.h>
+
+#include "reports.h"
+#include "pair.h"
+#include "budget.h"
+
+#define REPORT_FETCHERS 2             // Parallel downloads, each on its own AFC connection
+#define REPORTS_START_DELAY 10        // Seconds, lets the status fields have the device first
+#define REPORTS_NICE 19
+#define MOVER_TIMEOUT_MS 10000
+#define REPORT_MAX_SIZE (16u << 20)
+
+struct report_job {
+    char *path;
+    uint64_t mtime;
+};
+
+struct reports_session {
+    char udid[64];
+    idevice_t device;
+    char *root;
+    GThread *lister;
+    GThread *fetchers[REPORT_FETCHERS];
+    GAsyncQueue *jobs;
+
+    GMutex lock;
+    GCond wake;
+    bool stopping;
+
+    // Reports already collected: device path -> mtime, mirrored in an append-only file
+    GHashTable *seen;
+    FILE *index;
+    unsigned int collected;
+    unsigned int known;  // Lister only
+    unsigned int queued; // Lister only
+};
+
+static struct report_job stop_job;
+
+// Session the tray actions apply to
+static reports_session_t *active = NULL;
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Collection is background work, keep it out of the way of everything else
+static void lower_priority(void) {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), REPORTS_NICE);
+}
+
+static bool is_stopping(reports_session_t *session) {
+    g_mutex_lock(&session->lock);
+    bool stopping = session->stopping;
+    g_mutex_unlock(&session->lock);
+    return stopping;
+}
+
+static afc_client_t open_copy_service(reports_session_t *session) {
+    lockdownd_client_t lockdown = NULL;
+    lockdownd_service_descriptor_t service = NULL;
+    afc_client_t afc = NULL;
+
+    if (pair_lockdown_client_new(session->device, session->udid, &lockdown) != LOCKDOWN_E_SUCCESS) {
+        return NULL;
+    }
+    if (lockdownd_start_service(lockdown, "com.apple.crashreportcopymobile", &service) == LOCKDOWN_E_SUCCESS) {
+        if (afc_client_new(session->device, service, &afc) != AFC_E_SUCCESS) {
+            afc = NULL;
+        }
+        lockdownd_service_descriptor_free(service);
+    }
+    lockdownd_client_free(lockdown);
+    return afc;
+}
+
+// Asks the device to move fresh reports into the copy service's folder
+static void run_mover(reports_session_t *session) {
+    service_client_t mover = NULL;
+    if (service_client_factory_start_service(session->device, "com.apple.crashreportmover", (void **)&mover, NULL,
+                                             SERVICE_CONSTRUCTOR(service_client_new), NULL) != SERVICE_E_SUCCESS) {
+        return;
+    }
+    char ping[4];
+    uint32_t received = 0, total = 0;
+    while (total < sizeof(ping) && service_receive_with_timeout(mover, ping + total, sizeof(ping) - total, &received, MOVER_TIMEOUT_MS) == SERVICE_E_SUCCESS && received > 0) {
+        total += received;
+    }
+    service_client_free(mover);
+}
+
+static void load_index(reports_session_t *session, const char *path) {
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        char line[4096];
+        while (fgets(line, sizeof(line), in) != NULL) {
+            char *tab = strchr(line, '\t');
+            if (tab == NULL) {
+                continue;
+            }
+            *tab = '\0';
+            tab[strcspn(tab + 1, "\n") + 1] = '\0';
+            g_hash_table_replace(session->seen, g_strdup(tab + 1), GSIZE_TO_POINTER(g_ascii_strtoull(line, NULL, 10) + 1));
+        }
+        fclose(in);
+    }
+    session->index = fopen(path, "a");
+}
+
+static void mark_seen(reports_session_t *session, const char *path, uint64_t mtime) {
+    g_mutex_lock(&session->lock);
+    g_hash_table_replace(session->seen, g_strdup(path), GSIZE_TO_POINTER(mtime + 1));
+    if (session->index != NULL) {
+        fprintf(session->index, "%llu\t%s\n", (unsigned long long)mtime, path);
+        fflush(session->index);
+    }
+    session->collected++;
+    g_mutex_unlock(&session->lock);
+}
+
+// Known reports are skipped by name, so a reconnect costs one listing per folder
+static void list_reports(reports_session_t *session, afc_client_t afc, const char *dir) {
+    char **names = NULL;
+    if (afc_read_directory(afc, dir, &names) != AFC_E_SUCCESS || names == NULL) {
+        return;
+    }
+
+    for (int i = 0; names[i] != NULL && !is_stopping(session); ++i) {
+        if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) {
+            continue;
+        }
+        char *path = g_build_filename(dir, names[i], NULL);
+        g_mutex_lock(&session->lock);
+        bool known = g_hash_table_contains(session->seen, path);
+        g_mutex_unlock(&session->lock);
+        if (known) {
+            session->known++;
+        }
+
+        uint64_t size = 0, mtime = 0;
+        bool is_dir = false;
+        char **info = NULL;
+        if (!known && afc_get_file_info(afc, path, &info) == AFC_E_SUCCESS && info != NULL) {
+            for (int j = 0; info[j] != NULL && info[j + 1] != NULL; j += 2) {
+                if (strcmp(info[j], "st_ifmt") == 0) {
+                    is_dir = strcmp(info[j + 1], "S_IFDIR") == 0;
+                } else if (strcmp(info[j], "st_mtime") == 0) {
+                    mtime = g_ascii_strtoull(info[j + 1], NULL, 10);
+                } else if (strcmp(info[j], "st_size") == 0) {
+                    size = g_ascii_strtoull(info[j + 1], NULL, 10);
+                }
+            }
+            afc_dictionary_free(info);
+
+            if (is_dir) {
+                list_reports(session, afc, path);
+            } else if (size > 0 && size <= REPORT_MAX_SIZE) {
+                struct report_job *job = g_new0(struct report_job, 1);
+                job->path = g_strdup(path);
+                job->mtime = mtime;
+                g_async_queue_push(session->jobs, job);
+                session->queued++;
+            }
+        }
+        g_free(path);
+    }
+    afc_dictionary_free(names);
+}
+
+static void copy_field(char *out, size_t size, const char *value, size_t length) {
+    size_t n = 0;
+    for (size_t i = 0; i < length && n + 1 < size; ++i) {
+        char c = value[i];
+        out[n++] = (c == '/' || c == '"' || (unsigned char)c < 0x20) ? '_' : c;
+    }
+    out[n] = '\0';
+    if (out[0] == '.') {
+        out[0] = '_'; // No hidden or parent directories
+    }
+}
+
+static bool json_field(const char *line, const char *end, const char *key, char *out, size_t size) {
+    char *needle = g_strdup_printf("\"%s\":\"", key);
+    const char *found = g_strstr_len(line, end - line, needle);
+    size_t skip = strlen(needle);
+    g_free(needle);
+    if (found == NULL) {
+        return false;
+    }
+    const char *value = found + skip;
+    const char *close = memchr(value, '"', end - value);
+    if (close == NULL || close == value) {
+        return false;
+    }
+    copy_field(out, size, value, close - value);
+    return true;
+}
+
+static bool header_field(const char *data, const char *end, const char *key, char *out, size_t size) {
+    const char *found = g_strstr_len(data, end - data, key);
+    if (found == NULL) {
+        return false;
+    }
+    const char *value = found + strlen(key);
+    while (value < end && *value == ' ') value++;
+    const char *stop = value;
+    while (stop < end && *stop != '\n' && *stop != '[' && *stop != '\r') stop++;
+    while (stop > value && stop[-1] == ' ') stop--;
+    if (stop == value) {
+        return false;
+    }
+    copy_field(out, size, value, stop - value);
+    return true;
+}
+
+// Works for both the JSON-headed .ips format and the older plain text reports
+static void parse_report(const char *data, size_t length, const char *path, char *app, size_t app_size, char *version, size_t version_size) {
+    const char *end = data + length;
+    const char *newline = memchr(data, '\n', length);
+    const char *first_end = newline ? newline : end;
+    bool found_app = false, found_version = false;
+
+    if (length > 0 && data[0] == '{') {
+        found_app = json_field(data, first_end, "app_name", app, app_size) || json_field(data, first_end, "name", app, app_size);
+        found_version = json_field(data, first_end, "app_version", version, version_size);
+    }
+    if (!found_app) {
+        found_app = header_field(data, end, "Process:", app, app_size);
+    }
+    if (!found_version) {
+        found_version = header_field(data, end, "Version:", version, version_size);
+    }
+    if (!found_app) {
+        char *base = g_path_get_basename(path);
+        copy_field(app, app_size, base, strcspn(base, "-."));
+        g_free(base);
+    }
+    if (!found_version) {
+        g_strlcpy(version, "unknown", version_size);
+    }
+}
+
+static char* read_report(afc_client_t afc, const char *path, size_t *length) {
+    uint64_t handle = 0;
+    if (afc_file_open(afc, path, AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+        return NULL;
+    }
+    GByteArray *data = g_byte_array_new();
+    char buffer[65536];
+    uint32_t got = 0;
+    while (afc_file_read(afc, handle, buffer, sizeof(buffer), &got) == AFC_E_SUCCESS && got > 0 && data->len < REPORT_MAX_SIZE) {
+        g_byte_array_append(data, (const guint8 *)buffer, got);
+    }
+    afc_file_close(afc, handle);
+    *length = data->len;
+    return (char *)g_byte_array_free(data, FALSE);
+}
+
+static bool store_report(reports_session_t *session, const char *path, const char *data, size_t length) {
+    char app[128], version[64];
+    parse_report(data, length, path, app, sizeof(app), version, sizeof(version));
+
+    char *base = g_path_get_basename(path);
+    char *dir = g_build_filename(session->root, app, version, NULL);
+    char *name = g_strconcat(base, ".gz", NULL);
+    char *target = g_build_filename(dir, name, NULL);
+    char *partial = g_strconcat(target, ".partial", NULL);
+    g_mkdir_with_parents(dir, 0700);
+
+    gzFile out = gzopen(partial, "wb6");
+    bool ok = out != NULL && gzwrite(out, data, length) == (int)length;
+    if (out != NULL) {
+        ok = gzclose(out) == Z_OK && ok;
+    }
+    ok = ok && rename(partial, target) == 0;
+    if (!ok) {
+        unlink(partial);
+        fprintf(stderr, "[UDID=%s][Reports] Failed to store %s\n", session->udid, target);
+    }
+
+    g_free(partial);
+    g_free(target);
+    g_free(name);
+    g_free(dir);
+    g_free(base);
+    return ok;
+}
+
+static gpointer fetcher_thread(gpointer data) {
+    reports_session_t *session = data;
+    afc_client_t afc = NULL;
+    lower_priority();
+
+    while (true) {
+        struct report_job *job = g_async_queue_pop(session->jobs);
+        if (job == &stop_job) {
+            break;
+        }
+
+        // Leftovers are dropped on disconnect and fetched next time
+        if (afc == NULL && !is_stopping(session)) {
+            afc = open_copy_service(session);
+        }
+        size_t length = 0;
+        char *report = NULL;
+        if (afc && !is_stopping(session)) {
+            budget_acquire(session->udid);
+            report = read_report(afc, job->path, &length);
+            budget_complete(session->udid, length, 0);
+        }
+        if (report != NULL && store_report(session, job->path, report, length)) {
+            mark_seen(session, job->path, job->mtime);
+        }
+        g_free(report);
+        g_free(job->path);
+        g_free(job);
+    }
+
+    if (afc != NULL) {
+        afc_client_free(afc);
+    }
+    return NULL;
+}
+
+static gpointer lister_thread(gpointer data) {
+    reports_session_t *session = data;
+    lower_priority();
+
+    // Wait out the initial burst of status queries, or leave early on disconnect
+    gint64 deadline = g_get_monotonic_time() + REPORTS_START_DELAY * G_USEC_PER_SEC;
+    g_mutex_lock(&session->lock);
+    while (!session->stopping && g_cond_wait_until(&session->wake, &session->lock, deadline));
+    bool stopping = session->stopping;
+    g_mutex_unlock(&session->lock);
+    if (stopping) {
+        return NULL;
+    }
+
+    gint64 started = g_get_monotonic_time();
+    run_mover(session);
+    afc_client_t afc = open_copy_service(session);
+    if (afc == NULL) {
+        fprintf(stderr, "[UDID=%s][Reports] Failed to start crash report copy service\n", session->udid);
+        return NULL;
+    }
+    list_reports(session, afc, "/");
+    afc_client_free(afc);
+    printf("[UDID=%s][Reports] Listed in %.1fs: %u new, %u already collected\n", session->udid,
+           (g_get_monotonic_time() - started) / (double)G_USEC_PER_SEC, session->queued, session->known);
+    return NULL;
+}
+
+// Callback function for the crash reports menu item
+void on_menu_item_reports_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&active_lock);
+    char *uri = active ? g_filename_to_uri(active->root, NULL, NULL) : NULL;
+    pthread_mutex_unlock(&active_lock);
+    if (uri != NULL) {
+        GError *error = NULL;
+        if (!g_app_info_launch_default_for_uri(uri, NULL, &error)) {
+            fprintf(stderr, "[Reports] Failed to open %s: %s\n", uri, error->message);
+            g_clear_error(&error);
+        }
+        g_free(uri);
+    }
+}
+
+reports_session_t* reports_start(idevice_t device, const char *udid) {
+    reports_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Reports] Failed to allocate memory for crash report session\n", udid);
+        return NULL;
+    }
+
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    session->root = g_build_filename(g_get_user_data_dir(), "gnome-ios-appindicator", "crashreports", udid, NULL);
+    g_mkdir_with_parents(session->root, 0700);
+    g_mutex_init(&session->lock);
+    g_cond_init(&session->wake);
+    session->jobs = g_async_queue_new();
+    session->seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    char *index = g_build_filename(session->root, ".collected", NULL);
+    load_index(session, index);
+    g_free(index);
+
+    session->lister = g_thread_new("reports-list", lister_thread, session);
+    for (int i = 0; i < REPORT_FETCHERS; ++i) {
+        session->fetchers[i] = g_thread_new("reports-fetch", fetcher_thread, session);
+    }
+
+    pthread_mutex_lock(&active_lock);
+    active = session;
+    pthread_mutex_unlock(&active_lock);
+    return session;
+}
+
+void reports_stop(reports_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&active_lock);
+    if (active == session) {
+        active = NULL;
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    g_mutex_lock(&session->lock);
+    session->stopping = true;
+    g_cond_signal(&session->wake);
+    g_mutex_unlock(&session->lock);
+    g_thread_join(session->lister);
+
+    // Queued downloads fail fast once the device is gone, then the stop markers arrive
+    for (int i = 0; i < REPORT_FETCHERS; ++i) {
+        g_async_queue_push(session->jobs, &stop_job);
+    }
+    for (int i = 0; i < REPORT_FETCHERS; ++i) {
+        g_thread_join(session->fetchers[i]);
+    }
+
+    if (session->collected > 0) {
+        printf("[UDID=%s][Reports] Collected %u new crash reports into %s\n", session->udid, session->collected, session->root);
+    }
+    if (session->index != NULL) {
+        fclose(session->index);
+    }
+    g_hash_table_destroy(session->seen);
+    g_async_queue_unref(session->jobs);
+    g_mutex_clear(&session->lock);
+    g_cond_clear(&session->wake);
+    g_free(session->root);
+    free(session);
+}
@@ -0,0 +1,15 @@
+#ifndef REPORTS_H
+#define REPORTS_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+// Opaque per-device crash report collector
+typedef struct reports_session reports_session_t;
+
+// Function prototypes
+reports_session_t* reports_start(idevice_t device, const char *udid);
+void reports_stop(reports_session_t *session);
+void on_menu_item_reports_clicked(GtkWidget *widget, gpointer data);
+
+#endif // REPORTS_H
@@ -0,0 +1,494 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <libimobiledevice/screenshotr.h>
+
+#include "screenshot.h"
+#include "budget.h"
+#include "heavy.h"
+#include "fields.h"
+#include "tray.h" // To show the latest capture
+
+#define THUMBNAIL_SIZE 128
+#define THUMBNAIL_LRU_CAPACITY 8    // Devices whose latest capture stays in memory
+#define DECODE_BACKLOG 4            // Timelapse frames waiting for decode before new ones are dropped
+#define TIMELAPSE_INTERVAL 2.0      // Seconds, overridden by IOSINDICATOR_TIMELAPSE_INTERVAL
+#define TIMELAPSE_DUPLICATE_BITS 3  // Frames this close to the last kept one are skipped
+
+struct screenshot_session {
+    char udid[64];
+    idevice_t device;
+    char *dir;
+    GThread *capture;
+    GThreadPool *decoder; // One thread, so timelapse frames are compared in order
+
+    GMutex lock;
+    GCond wake;
+    bool stopping;
+    int requested;        // Single shots waiting for the capture thread
+    bool timelapse;
+    char *timelapse_dir;
+    gint64 next_due;
+    gint64 interval;
+    bool reset_hash;
+
+    // Decoder only
+    uint64_t last_hash;
+    bool have_hash;
+    unsigned int frame;
+    unsigned int kept;
+    unsigned int skipped;
+
+    unsigned int dropped; // Capture thread only
+};
+
+// One capture on its way from the device to disk and the menu
+struct frame_job {
+    screenshot_session_t *session;
+    char *data;
+    uint64_t size;
+    bool single;
+    GDateTime *taken;
+};
+
+struct write_job {
+    char *path;
+    char *data;
+    uint64_t size;
+};
+
+// Main loop only: latest capture per device
+struct thumbnail {
+    char *udid;
+    char *path;
+    GdkPixbuf *pixbuf;
+};
+
+// Every running session, the most recently started first
+static GList *sessions = NULL;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static GThreadPool *writers = NULL;
+static pthread_once_t writers_once = PTHREAD_ONCE_INIT;
+static GQueue thumbnails = G_QUEUE_INIT;
+static GtkWidget *timelapse_item = NULL;
+
+static void free_thumbnail(struct thumbnail *entry) {
+    g_free(entry->udid);
+    g_free(entry->path);
+    g_object_unref(entry->pixbuf);
+    g_free(entry);
+}
+
+static struct thumbnail* find_thumbnail(const char *udid) {
+    for (GList *link = thumbnails.head; link != NULL; link = link->next) {
+        struct thumbnail *entry = link->data;
+        if (strcmp(entry->udid, udid) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Session the tray actions apply to: the device whose fields the menu
+ * shows, or the one connected last. Main loop only, must be called with
+ * sessions_lock held.
+ */
+static screenshot_session_t* target_session(void) {
+    const char *shown = fields_shown_device();
+    for (GList *link = sessions; link != NULL && shown != NULL; link = link->next) {
+        screenshot_session_t *session = link->data;
+        if (strcmp(session->udid, shown) == 0) {
+            return session;
+        }
+    }
+    return sessions != NULL ? sessions->data : NULL;
+}
+
+static bool is_target_udid(const char *udid) {
+    pthread_mutex_lock(&sessions_lock);
+    screenshot_session_t *target = target_session();
+    bool same = target != NULL && strcmp(target->udid, udid) == 0;
+    pthread_mutex_unlock(&sessions_lock);
+    return same;
+}
+
+static void show_thumbnail(const struct thumbnail *entry) {
+    if (tray == NULL || tray->widgets == NULL || tray->widgets->screenshot == NULL) {
+        return;
+    }
+    if (entry == NULL) {
+        gtk_widget_hide(tray->widgets->screenshot);
+        return;
+    }
+    char *name = g_path_get_basename(entry->path);
+    char *label = g_strdup_printf(" %s", name);
+    update_menu_item_label(GTK_MENU_ITEM(tray->widgets->screenshot), label);
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(tray->widgets->screenshot), gtk_image_new_from_pixbuf(entry->pixbuf));
+    gtk_image_menu_item_set_always_show_image(GTK_IMAGE_MENU_ITEM(tray->widgets->screenshot), TRUE);
+    G_GNUC_END_IGNORE_DEPRECATIONS
+    gtk_widget_show(tray->widgets->screenshot);
+    g_free(label);
+    g_free(name);
+}
+
+// Takes ownership of entry and moves it to the front of the LRU
+static gboolean deliver_thumbnail(gpointer data) {
+    struct thumbnail *entry = data;
+    struct thumbnail *old = find_thumbnail(entry->udid);
+    if (old != NULL) {
+        g_queue_remove(&thumbnails, old);
+        free_thumbnail(old);
+    }
+    g_queue_push_head(&thumbnails, entry);
+    while (g_queue_get_length(&thumbnails) > THUMBNAIL_LRU_CAPACITY) {
+        free_thumbnail(g_queue_pop_tail(&thumbnails));
+    }
+
+    if (is_target_udid(entry->udid)) {
+        show_thumbnail(entry);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// A device came or went: the menu shows the target's last capture, kept across reconnects, and its timelapse state
+static gboolean restore_thumbnail(gpointer data) {
+    char udid[64] = "";
+    bool timelapse = false;
+    pthread_mutex_lock(&sessions_lock);
+    screenshot_session_t *target = target_session();
+    if (target != NULL) {
+        g_strlcpy(udid, target->udid, sizeof(udid));
+        g_mutex_lock(&target->lock);
+        timelapse = target->timelapse;
+        g_mutex_unlock(&target->lock);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    show_thumbnail(udid[0] != '\0' ? find_thumbnail(udid) : NULL);
+    if (timelapse_item != NULL) {
+        update_menu_item_label(GTK_MENU_ITEM(timelapse_item), timelapse ? "Stop timelapse" : "Start timelapse");
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void write_frame(gpointer data, gpointer user_data) {
+    struct write_job *job = data;
+    char *dir = g_path_get_dirname(job->path);
+    g_mkdir_with_parents(dir, 0700);
+    if (!g_file_set_contents(job->path, job->data, job->size, NULL)) {
+        fprintf(stderr, "[Screenshot] Failed to write %s\n", job->path);
+    }
+    g_free(dir);
+    g_free(job->path);
+    free(job->data);
+    g_free(job);
+}
+
+static void init_writers(void) {
+    writers = g_thread_pool_new(write_frame, NULL, 1, FALSE, NULL);
+}
+
+// 64-bit difference hash of a 9x8 grayscale reduction
+static uint64_t difference_hash(GdkPixbuf *pixbuf) {
+    GdkPixbuf *small = gdk_pixbuf_scale_simple(pixbuf, 9, 8, GDK_INTERP_BILINEAR);
+    if (small == NULL) {
+        return 0;
+    }
+    const guchar *pixels = gdk_pixbuf_read_pixels(small);
+    int stride = gdk_pixbuf_get_rowstride(small);
+    int channels = gdk_pixbuf_get_n_channels(small);
+
+    uint8_t luma[8][9];
+    for (int y = 0; y < 8; ++y) {
+        const guchar *row = pixels + y * stride;
+        for (int x = 0; x < 9; ++x) {
+            const guchar *p = row + x * channels;
+            luma[y][x] = (uint8_t)((p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8);
+        }
+    }
+    g_object_unref(small);
+
+    uint64_t hash = 0;
+    for (int y = 0; y < 8; ++y) {
+        for (int x = 0; x < 8; ++x) {
+            hash = (hash << 1) | (luma[y][x] > luma[y][x + 1]);
+        }
+    }
+    return hash;
+}
+
+/**
+ * Decoder: turns the device's PNG/TIFF into a thumbnail and a perceptual
+ * hash, drops near-duplicate timelapse frames and hands the rest to the
+ * writer. The raw image is stored as captured, never re-encoded.
+ */
+static void decode_frame(gpointer data, gpointer user_data) {
+    struct frame_job *job = data;
+    screenshot_session_t *session = job->session;
+
+    GInputStream *stream = g_memory_input_stream_new_from_data(job->data, job->size, NULL);
+    GError *error = NULL;
+    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_stream_at_scale(stream, THUMBNAIL_SIZE, THUMBNAIL_SIZE, TRUE, NULL, &error);
+    g_object_unref(stream);
+    if (pixbuf == NULL) {
+        fprintf(stderr, "[UDID=%s][Screenshot] Failed to decode capture: %s\n", session->udid, error ? error->message : "unknown");
+        g_clear_error(&error);
+        free(job->data);
+        g_date_time_unref(job->taken);
+        g_free(job);
+        return;
+    }
+
+    g_mutex_lock(&session->lock);
+    char *timelapse_dir = g_strdup(session->timelapse_dir);
+    if (session->reset_hash) {
+        session->reset_hash = false;
+        session->have_hash = false;
+        session->frame = 0;
+    }
+    g_mutex_unlock(&session->lock);
+
+    uint64_t hash = difference_hash(pixbuf);
+    if (!job->single) {
+        if (session->have_hash && __builtin_popcountll(hash ^ session->last_hash) <= TIMELAPSE_DUPLICATE_BITS) {
+            session->skipped++;
+            g_object_unref(pixbuf);
+            g_free(timelapse_dir);
+            free(job->data);
+            g_date_time_unref(job->taken);
+            g_free(job);
+            return;
+        }
+        session->last_hash = hash;
+        session->have_hash = true;
+        session->kept++;
+    }
+
+    const char *extension = job->size >= 4 && memcmp(job->data, "\x89PNG", 4) == 0 ? "png" : "tiff";
+    char *stamp = g_date_time_format(job->taken, "%Y%m%d-%H%M%S");
+    char *name = job->single || timelapse_dir == NULL
+               ? g_strdup_printf("%s-%03d.%s", stamp, g_date_time_get_microsecond(job->taken) / 1000, extension)
+               : g_strdup_printf("frame-%06u.%s", session->frame++, extension);
+    char *path = g_build_filename(job->single || timelapse_dir == NULL ? session->dir : timelapse_dir, name, NULL);
+
+    struct write_job *write = g_new0(struct write_job, 1);
+    write->path = g_strdup(path);
+    write->data = job->data;
+    write->size = job->size;
+    g_thread_pool_push(writers, write, NULL);
+
+    struct thumbnail *entry = g_new0(struct thumbnail, 1);
+    entry->udid = g_strdup(session->udid);
+    entry->path = path;
+    entry->pixbuf = pixbuf;
+    g_idle_add(deliver_thumbnail, entry);
+
+    g_free(name);
+    g_free(stamp);
+    g_free(timelapse_dir);
+    g_date_time_unref(job->taken);
+    g_free(job);
+}
+
+// Waits for the next single shot or timelapse tick, returns false when stopping
+static bool wait_for_capture(screenshot_session_t *session, bool *single) {
+    g_mutex_lock(&session->lock);
+    for (;;) {
+        if (session->stopping) {
+            g_mutex_unlock(&session->lock);
+            return false;
+        }
+        if (session->requested > 0) {
+            session->requested--;
+            *single = true;
+            break;
+        }
+        gint64 now = g_get_monotonic_time();
+        if (session->timelapse && now >= session->next_due) {
+            session->next_due = MAX(session->next_due + session->interval, now);
+            *single = false;
+            break;
+        }
+        if (session->timelapse) {
+            g_cond_wait_until(&session->wake, &session->lock, session->next_due);
+        } else {
+            g_cond_wait(&session->wake, &session->lock);
+        }
+    }
+    g_mutex_unlock(&session->lock);
+    return true;
+}
+
+// Capture thread: owns the screenshotr connection, never decodes
+static gpointer capture_thread(gpointer data) {
+    screenshot_session_t *session = data;
+    screenshotr_client_t client = NULL;
+    bool single = false;
+
+    while (wait_for_capture(session, &single)) {
+        // Timelapse frames are dropped while the decoder is behind, single shots never are
+        if (!single && g_thread_pool_unprocessed(session->decoder) >= DECODE_BACKLOG) {
+            session->dropped++;
+            continue;
+        }
+        if (client == NULL && screenshotr_client_start_service(session->device, &client, "iosindicator") != SCREENSHOTR_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Screenshot] Failed to start screenshotr, is the developer disk image mounted?\n", session->udid);
+            client = NULL;
+            continue;
+        }
+
+        // Single shots wait for a backup or fleet task on the phone, timelapse frames are skipped meanwhile
+        if (single) {
+            heavy_acquire(session->udid, "screenshot");
+        } else if (!heavy_try_acquire(session->udid, "timelapse")) {
+            session->dropped++;
+            continue;
+        }
+        char *image = NULL;
+        uint64_t size = 0;
+        budget_acquire(session->udid);
+        screenshotr_error_t err = screenshotr_take_screenshot(client, &image, &size);
+        budget_complete(session->udid, size, 0);
+        heavy_release(session->udid);
+        if (err != SCREENSHOTR_E_SUCCESS || image == NULL) {
+            fprintf(stderr, "[UDID=%s][Screenshot] Failed to take screenshot\n", session->udid);
+            free(image);
+            screenshotr_client_free(client);
+            client = NULL;
+            continue;
+        }
+
+        struct frame_job *job = g_new0(struct frame_job, 1);
+        job->session = session;
+        job->data = image;
+        job->size = size;
+        job->single = single;
+        job->taken = g_date_time_new_now_local();
+        g_thread_pool_push(session->decoder, job, NULL);
+    }
+
+    if (client != NULL) {
+        screenshotr_client_free(client);
+    }
+    return NULL;
+}
+
+// Callback function for the take screenshot menu item
+void on_menu_item_screenshot_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&sessions_lock);
+    screenshot_session_t *target = target_session();
+    if (target != NULL) {
+        g_mutex_lock(&target->lock);
+        target->requested++;
+        g_cond_signal(&target->wake);
+        g_mutex_unlock(&target->lock);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// Callback function for the timelapse menu item, toggles capture on and off
+void on_menu_item_timelapse_clicked(GtkWidget *widget, gpointer data) {
+    timelapse_item = widget;
+    pthread_mutex_lock(&sessions_lock);
+    screenshot_session_t *target = target_session();
+    if (target != NULL) {
+        g_mutex_lock(&target->lock);
+        target->timelapse = !target->timelapse;
+        if (target->timelapse) {
+            GDateTime *now = g_date_time_new_now_local();
+            char *stamp = g_date_time_format(now, "timelapse-%Y%m%d-%H%M%S");
+            g_free(target->timelapse_dir);
+            target->timelapse_dir = g_build_filename(target->dir, stamp, NULL);
+            target->next_due = g_get_monotonic_time();
+            target->reset_hash = true;
+            printf("[UDID=%s][Screenshot] Timelapse into %s\n", target->udid, target->timelapse_dir);
+            g_free(stamp);
+            g_date_time_unref(now);
+        } else {
+            printf("[UDID=%s][Screenshot] Timelapse stopped, %u frames kept, %u near-duplicates skipped, %u dropped\n",
+                   target->udid, target->kept, target->skipped, target->dropped);
+        }
+        g_cond_signal(&target->wake);
+        update_menu_item_label(GTK_MENU_ITEM(widget), target->timelapse ? "Stop timelapse" : "Start timelapse");
+        g_mutex_unlock(&target->lock);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+}
+
+// Callback function for the latest screenshot menu item
+void on_menu_item_last_screenshot_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&sessions_lock);
+    screenshot_session_t *target = target_session();
+    struct thumbnail *entry = target ? find_thumbnail(target->udid) : NULL;
+    pthread_mutex_unlock(&sessions_lock);
+    char *uri = entry ? g_filename_to_uri(entry->path, NULL, NULL) : NULL;
+    if (uri != NULL) {
+        GError *error = NULL;
+        if (!g_app_info_launch_default_for_uri(uri, NULL, &error)) {
+            fprintf(stderr, "[Screenshot] Failed to open %s: %s\n", uri, error->message);
+            g_clear_error(&error);
+        }
+        g_free(uri);
+    }
+}
+
+screenshot_session_t* screenshot_start(idevice_t device, const char *udid) {
+    screenshot_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Screenshot] Failed to allocate memory for screenshot session\n", udid);
+        return NULL;
+    }
+    pthread_once(&writers_once, init_writers);
+
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    const char *pictures = g_get_user_special_dir(G_USER_DIRECTORY_PICTURES);
+    session->dir = g_build_filename(pictures ? pictures : g_get_home_dir(), "iOS Screenshots", udid, NULL);
+
+    const char *interval = getenv("IOSINDICATOR_TIMELAPSE_INTERVAL");
+    double seconds = interval ? g_ascii_strtod(interval, NULL) : 0;
+    session->interval = (gint64)((seconds > 0 ? seconds : TIMELAPSE_INTERVAL) * G_USEC_PER_SEC);
+
+    g_mutex_init(&session->lock);
+    g_cond_init(&session->wake);
+    session->decoder = g_thread_pool_new(decode_frame, NULL, 1, FALSE, NULL);
+    session->capture = g_thread_new("screenshot", capture_thread, session);
+
+    pthread_mutex_lock(&sessions_lock);
+    sessions = g_list_prepend(sessions, session);
+    pthread_mutex_unlock(&sessions_lock);
+    g_idle_add(restore_thumbnail, NULL);
+    return session;
+}
+
+void screenshot_stop(screenshot_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    // The actions move on to a remaining device
+    pthread_mutex_lock(&sessions_lock);
+    sessions = g_list_remove(sessions, session);
+    pthread_mutex_unlock(&sessions_lock);
+    g_idle_add(restore_thumbnail, NULL);
+
+    g_mutex_lock(&session->lock);
+    session->stopping = true;
+    g_cond_signal(&session->wake);
+    g_mutex_unlock(&session->lock);
+    g_thread_join(session->capture);
+
+    // Captures already taken are still decoded and written
+    g_thread_pool_free(session->decoder, FALSE, TRUE);
+    g_mutex_clear(&session->lock);
+    g_cond_clear(&session->wake);
+    g_free(session->timelapse_dir);
+    g_free(session->dir);
+    free(session);
+}
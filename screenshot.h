@@ -0,0 +1,17 @@
+#ifndef SCREENSHOT_H
+#define SCREENSHOT_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+// Opaque per-device screenshot and timelapse capture
+typedef struct screenshot_session screenshot_session_t;
+
+// Function prototypes
+screenshot_session_t* screenshot_start(idevice_t device, const char *udid);
+void screenshot_stop(screenshot_session_t *session);
+void on_menu_item_screenshot_clicked(GtkWidget *widget, gpointer data);
+void on_menu_item_timelapse_clicked(GtkWidget *widget, gpointer data);
+void on_menu_item_last_screenshot_clicked(GtkWidget *widget, gpointer data);
+
+#endif // SCREENSHOT_H
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define SNAPSHOT_FNV_OFFSET 14695981039346656037ull
+#define SNAPSHOT_FNV_PRIME 1099511628211ull
+
+/**
+ * Change detection. Every refresh hashes the fields it read into a typed
+ * snapshot; the differ compares a group's digest with the one kept from the
+ * previous refresh and only when that moved does it look at the fields one
+ * by one. An idle phone therefore costs one compare per group and produces
+ * no events, so nothing downstream is redrawn, sent or logged.
+ */
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ p[i]) * SNAPSHOT_FNV_PRIME;
+    }
+    return h;
+}
+
+// Hash of a typed value, data NULL when absent; never 0 for a present one so absent and empty stay apart
+uint64_t snapshot_hash(int type, const void *data, size_t size) {
+    if (data == NULL) {
+        return 0;
+    }
+    uint8_t tag = (uint8_t)type;
+    uint64_t h = hash_bytes(SNAPSHOT_FNV_OFFSET, &tag, sizeof(tag));
+    return hash_bytes(h, data, size) | 1;
+}
+
+/**
+ * Compares freshly read hashes for one group against the snapshot and
+ * records them. Writes the ids of the fields that changed to changed (room
+ * for count entries) and returns how many there are.
+ */
+size_t snapshot_diff(struct snapshot *snapshot, struct snapshot_stats *stats, int group, const int *fields, const uint64_t *hashes, size_t count, int *changed) {
+    uint64_t digest = SNAPSHOT_FNV_OFFSET;
+    for (size_t i = 0; i < count; i++) {
+        digest = hash_bytes(digest, &hashes[i], sizeof(hashes[i]));
+    }
+    stats->diffs++;
+    if (snapshot->digests[group] == digest) {
+        stats->unchanged++;
+        return 0;
+    }
+    snapshot->digests[group] = digest;
+
+    size_t changes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (snapshot->hashes[fields[i]] != hashes[i]) {
+            snapshot->hashes[fields[i]] = hashes[i];
+            changed[changes++] = fields[i];
+        }
+    }
+    stats->changes += changes;
+    return changes;
+}
@@ -0,0 +1,27 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <glib.h>
+
+#define SNAPSHOT_MAX_FIELDS 32
+
+// Compact typed copy of what a device reported last, one hash per field
+struct snapshot {
+    uint64_t hashes[SNAPSHOT_MAX_FIELDS];  // 0 while the field is absent
+    uint64_t digests[SNAPSHOT_MAX_FIELDS]; // Per group of fields read together, indexed by the group's first field
+};
+
+// Differ counters, per device
+struct snapshot_stats {
+    guint64 diffs;     // Groups compared
+    guint64 unchanged; // Groups skipped on the digest alone
+    guint64 changes;   // Change events emitted
+};
+
+// Function prototypes
+uint64_t snapshot_hash(int type, const void *data, size_t size);
+size_t snapshot_diff(struct snapshot *snapshot, struct snapshot_stats *stats, int group, const int *fields, const uint64_t *hashes, size_t count, int *changed);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,340 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include "statusicon.h"
+
+#define STATUSICON_SIZE 44           // Rendered once at 2x, the panel scales down
+#define STATUSICON_LEVELS 11         // 0%, 10%, ... 100%
+#define STATUSICON_VERSION 1         // Bump whenever the drawing changes so caches re-render
+#define STATUSICON_DEFAULT "phone-apple-iphone"
+#define STATUSICON_LABEL_SIZE 64
+#define STATUSICON_LOW_LEVEL 20      // Percent, counted as a warning in the fleet label
+#define STATUSICON_LABEL_INTERVAL_US G_USEC_PER_SEC
+#define STATUSICON_GUIDE_SINGLE "\U0001F50B100% \u26A1"
+#define STATUSICON_GUIDE_FLEET "99\U0001F4F1 99\u26A0"
+
+/**
+ * Panel icon and label. The indicator only takes icons by name, so every
+ * combination of battery level bucket, charging and lock state is drawn
+ * once into the cache directory and that directory is handed over as the
+ * icon theme path. After that an update is a bucket comparison and, when
+ * it moved, one app_indicator_set_icon_full() call on the main loop. The
+ * icon follows the device that reported last; the label sums up all of
+ * them.
+ */
+
+static AppIndicator *panel = NULL;
+static char *theme_dir = NULL;
+
+// Latest readings per device, written from device threads
+struct panel_device {
+    int level; // -1 until the battery has been read
+    bool charging;
+    bool locked;
+};
+
+static GMutex state_lock;
+static GHashTable *devices = NULL; // udid -> struct panel_device
+static char *current = NULL;       // Device the icon follows, the last one to report
+static int wanted = -1;            // Bucket for the current device, -1 for the stock icon
+static char wanted_label[STATUSICON_LABEL_SIZE] = "";
+static bool update_pending = false;
+static bool label_pending = false;
+
+// Main loop only
+static int shown = -1;
+static char shown_label[STATUSICON_LABEL_SIZE] = ""; // Compared against wanted_label under state_lock
+static gint64 label_changed = 0;
+
+static int bucket_for(int level, bool charging, bool locked) {
+    if (level < 0) {
+        return -1;
+    }
+    int step = (MIN(level, 100) + 5) / 10;
+    return step * 4 + (charging ? 2 : 0) + (locked ? 1 : 0);
+}
+
+static void icon_name(int bucket, char *name, size_t size) {
+    g_snprintf(name, size, "iosindicator-battery-%03d%s%s", (bucket / 4) * 10,
+               bucket & 2 ? "-charging" : "", bucket & 1 ? "-locked" : "");
+}
+
+static void rounded_rectangle(cairo_t *cr, double x, double y, double w, double h, double r) {
+    cairo_new_path(cr);
+    cairo_arc(cr, x + w - r, y + r, r, -M_PI / 2, 0);
+    cairo_arc(cr, x + w - r, y + h - r, r, 0, M_PI / 2);
+    cairo_arc(cr, x + r, y + h - r, r, M_PI / 2, M_PI);
+    cairo_arc(cr, x + r, y + r, r, M_PI, 3 * M_PI / 2);
+    cairo_close_path(cr);
+}
+
+static bool render_icon(const char *path, int bucket) {
+    int percent = (bucket / 4) * 10;
+    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, STATUSICON_SIZE, STATUSICON_SIZE);
+    cairo_t *cr = cairo_create(surface);
+
+    // Phone outline
+    cairo_set_line_width(cr, 2.5);
+    cairo_set_source_rgba(cr, 0.93, 0.93, 0.93, 1);
+    rounded_rectangle(cr, 11, 3, 22, 38, 5);
+    cairo_stroke(cr);
+
+    // Charge, filled from the bottom of the screen area
+    double fill = 30.0 * percent / 100.0;
+    if (bucket & 2) {
+        cairo_set_source_rgb(cr, 0.36, 0.82, 0.36);
+    } else if (percent <= 20) {
+        cairo_set_source_rgb(cr, 0.91, 0.26, 0.22);
+    } else {
+        cairo_set_source_rgb(cr, 0.93, 0.93, 0.93);
+    }
+    cairo_rectangle(cr, 15, 37 - fill, 14, fill);
+    cairo_fill(cr);
+
+    // Lightning bolt
+    if (bucket & 2) {
+        cairo_set_source_rgba(cr, 0.1, 0.1, 0.1, 0.85);
+        cairo_move_to(cr, 24, 10);
+        cairo_line_to(cr, 17, 23);
+        cairo_line_to(cr, 21.5, 23);
+        cairo_line_to(cr, 20, 34);
+        cairo_line_to(cr, 27, 20);
+        cairo_line_to(cr, 22.5, 20);
+        cairo_close_path(cr);
+        cairo_fill(cr);
+    }
+
+    // Padlock in the corner
+    if (bucket & 1) {
+        cairo_set_source_rgb(cr, 0.98, 0.78, 0.2);
+        cairo_set_line_width(cr, 2);
+        cairo_new_path(cr);
+        cairo_arc(cr, 36, 31, 4, M_PI, 2 * M_PI);
+        cairo_stroke(cr);
+        rounded_rectangle(cr, 30, 31, 12, 10, 1.5);
+        cairo_fill(cr);
+    }
+
+    cairo_destroy(cr);
+    bool ok = cairo_surface_write_to_png(surface, path) == CAIRO_STATUS_SUCCESS;
+    cairo_surface_destroy(surface);
+    return ok;
+}
+
+// Draws whatever the cache is missing and points the indicator at it
+void statusicon_init(AppIndicator *indicator) {
+    panel = indicator;
+    char *version = g_strdup_printf("panel-v%d", STATUSICON_VERSION);
+    theme_dir = g_build_filename(g_get_user_cache_dir(), "gnome-ios-appindicator", version, NULL);
+    g_free(version);
+    if (g_mkdir_with_parents(theme_dir, 0700) != 0) {
+        fprintf(stderr, "Failed to create panel icon cache %s\n", theme_dir);
+        return;
+    }
+
+    unsigned int rendered = 0;
+    for (int bucket = 0; bucket < STATUSICON_LEVELS * 4; bucket++) {
+        char name[64];
+        icon_name(bucket, name, sizeof(name));
+        char *file = g_strconcat(name, ".png", NULL);
+        char *path = g_build_filename(theme_dir, file, NULL);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            if (render_icon(path, bucket)) {
+                rendered++;
+            } else {
+                fprintf(stderr, "Failed to render panel icon %s\n", path);
+            }
+        }
+        g_free(path);
+        g_free(file);
+    }
+    if (rendered > 0) {
+        printf("Rendered %u panel icons into %s\n", rendered, theme_dir);
+    }
+    app_indicator_set_icon_theme_path(panel, theme_dir);
+}
+
+static gboolean apply_icon(gpointer data) {
+    g_mutex_lock(&state_lock);
+    int bucket = wanted;
+    update_pending = false;
+    g_mutex_unlock(&state_lock);
+
+    if (panel == NULL || bucket == shown) {
+        return G_SOURCE_REMOVE;
+    }
+    shown = bucket;
+    if (bucket < 0) {
+        app_indicator_set_icon_full(panel, STATUSICON_DEFAULT, "iPhone");
+        return G_SOURCE_REMOVE;
+    }
+    char name[64];
+    char *description = g_strdup_printf("Battery %d%%%s%s", (bucket / 4) * 10,
+                                        bucket & 2 ? ", charging" : "", bucket & 1 ? ", locked" : "");
+    icon_name(bucket, name, sizeof(name));
+    app_indicator_set_icon_full(panel, name, description);
+    g_free(description);
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * Panel label. Every change is a D-Bus signal and may relayout the panel,
+ * so the text is only sent when it differs from what is shown and at most
+ * once a second; the guide text keeps the panel width steady meanwhile.
+ */
+static gboolean apply_label(gpointer data) {
+    gint64 now = g_get_monotonic_time();
+    g_mutex_lock(&state_lock);
+    label_pending = false;
+    if (panel == NULL || strcmp(wanted_label, shown_label) == 0) {
+        g_mutex_unlock(&state_lock);
+        return G_SOURCE_REMOVE;
+    }
+    if (label_changed != 0 && now - label_changed < STATUSICON_LABEL_INTERVAL_US) {
+        // Try again when the interval is up and send whatever is newest then
+        label_pending = true;
+        g_mutex_unlock(&state_lock);
+        g_timeout_add((guint)((label_changed + STATUSICON_LABEL_INTERVAL_US - now) / 1000) + 1, apply_label, NULL);
+        return G_SOURCE_REMOVE;
+    }
+    char label[STATUSICON_LABEL_SIZE];
+    g_strlcpy(label, wanted_label, sizeof(label));
+    bool single = devices != NULL && g_hash_table_size(devices) == 1;
+    g_mutex_unlock(&state_lock);
+
+    app_indicator_set_label(panel, label, single ? STATUSICON_GUIDE_SINGLE : STATUSICON_GUIDE_FLEET);
+    label_changed = now;
+    g_strlcpy(shown_label, label, sizeof(shown_label));
+    return G_SOURCE_REMOVE;
+}
+
+// Renders into a fixed buffer so a reading that leaves the text unchanged costs no allocation; must be called with state_lock held
+static void render_label(char *label, size_t size) {
+    guint count = devices ? g_hash_table_size(devices) : 0;
+    label[0] = '\0';
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        struct panel_device *device = g_hash_table_lookup(devices, current);
+        if (device != NULL && device->level >= 0) {
+            g_snprintf(label, size, "\U0001F50B%d%%%s", device->level, device->charging ? " \u26A1" : "");
+        }
+        return;
+    }
+
+    // Several devices: how many, and how many are running low
+    guint low = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, devices);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct panel_device *device = value;
+        if (device->level >= 0 && device->level <= STATUSICON_LOW_LEVEL && !device->charging) {
+            low++;
+        }
+    }
+    if (low == 0) {
+        g_snprintf(label, size, "%u\U0001F4F1", count);
+    } else {
+        g_snprintf(label, size, "%u\U0001F4F1 %u\u26A0", count, low);
+    }
+}
+
+// Must be called with state_lock held
+static void schedule_update(void) {
+    struct panel_device *device = current && devices ? g_hash_table_lookup(devices, current) : NULL;
+    int bucket = theme_dir != NULL && device != NULL ? bucket_for(device->level, device->charging, device->locked) : -1;
+    if (bucket != wanted) {
+        wanted = bucket;
+        if (!update_pending) {
+            update_pending = true;
+            g_idle_add(apply_icon, NULL);
+        }
+    }
+
+    char label[STATUSICON_LABEL_SIZE];
+    render_label(label, sizeof(label));
+    if (strcmp(label, wanted_label) == 0) {
+        return;
+    }
+    g_strlcpy(wanted_label, label, sizeof(wanted_label));
+    if (!label_pending) {
+        label_pending = true;
+        g_idle_add(apply_label, NULL);
+    }
+}
+
+// Must be called with state_lock held
+static struct panel_device* get_device(const char *udid) {
+    if (devices == NULL) {
+        devices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    }
+    struct panel_device *device = g_hash_table_lookup(devices, udid);
+    if (device == NULL) {
+        device = g_new0(struct panel_device, 1);
+        device->level = -1;
+        g_hash_table_replace(devices, g_strdup(udid), device);
+    }
+    if (g_strcmp0(current, udid) != 0) {
+        g_free(current);
+        current = g_strdup(udid);
+    }
+    return device;
+}
+
+void statusicon_set_battery(const char *udid, int level, bool charging) {
+    g_mutex_lock(&state_lock);
+    struct panel_device *device = get_device(udid);
+    device->level = level;
+    device->charging = charging;
+    schedule_update();
+    g_mutex_unlock(&state_lock);
+}
+
+void statusicon_set_locked(const char *udid, bool locked) {
+    g_mutex_lock(&state_lock);
+    get_device(udid)->locked = locked;
+    schedule_update();
+    g_mutex_unlock(&state_lock);
+}
+
+// Field change listener: the icon and label only move when battery or lock state did
+void statusicon_field_changes(const char *udid, const struct field_value *values, const struct field_change *changes, size_t count) {
+    bool battery = false;
+    bool locked = false;
+    for (size_t i = 0; i < count; i++) {
+        battery = battery || changes[i].field == FIELD_BATTERY_LEVEL || changes[i].field == FIELD_BATTERY_CHARGING;
+        locked = locked || changes[i].field == FIELD_PASSWORD_PROTECTED;
+    }
+    if (battery && values[FIELD_BATTERY_LEVEL].present) {
+        statusicon_set_battery(udid, (int)values[FIELD_BATTERY_LEVEL].integer, values[FIELD_BATTERY_CHARGING].boolean == 1);
+    }
+    if (locked && values[FIELD_PASSWORD_PROTECTED].present) {
+        statusicon_set_locked(udid, values[FIELD_PASSWORD_PROTECTED].boolean == 1);
+    }
+}
+
+// Monitoring of udid stopped; the icon moves to another device or back to the stock phone
+void statusicon_remove(const char *udid) {
+    g_mutex_lock(&state_lock);
+    if (devices != NULL) {
+        g_hash_table_remove(devices, udid);
+    }
+    if (g_strcmp0(current, udid) == 0) {
+        g_free(current);
+        current = NULL;
+        GHashTableIter iter;
+        gpointer key;
+        g_hash_table_iter_init(&iter, devices);
+        if (g_hash_table_iter_next(&iter, &key, NULL)) {
+            current = g_strdup(key);
+        }
+    }
+    schedule_update();
+    g_mutex_unlock(&state_lock);
+}
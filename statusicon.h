@@ -0,0 +1,16 @@
+#ifndef STATUSICON_H
+#define STATUSICON_H
+
+#include <stdbool.h>
+#include <libayatana-appindicator3-0.1/libayatana-appindicator/app-indicator.h>
+
+#include "fields.h"
+
+// Function prototypes
+void statusicon_init(AppIndicator *indicator);
+void statusicon_set_battery(const char *udid, int level, bool charging);
+void statusicon_set_locked(const char *udid, bool locked);
+void statusicon_remove(const char *udid);
+void statusicon_field_changes(const char *udid, const struct field_value *values, const struct field_change *changes, size_t count);
+
+#endif // STATUSICON_H
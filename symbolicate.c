@@ -0,0 +1,778 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+#include "symbolicate.h"
+
+#define SYMTAB_MAGIC "IOSSYM01"
+#define SYMBOL_CATALOG_MAGIC "IOSSYMC1"
+#define SYMBOLICATED_SUFFIX ".symbolicated"
+
+// Mach-O constants, only what the symbol table needs
+#define MH_MAGIC_64 0xfeedfacfu
+#define FAT_MAGIC 0xcafebabeu
+#define LC_SYMTAB 0x2u
+#define LC_SEGMENT_64 0x19u
+#define LC_UUID 0x1bu
+#define N_STAB 0xe0u
+#define N_TYPE 0x0eu
+#define N_SECT 0x0eu
+
+/**
+ * Symbolication. Every Mach-O image under the symbols folder (dSYM DWARF
+ * companions, extracted system libraries) is indexed by UUID. The first time
+ * an image is needed its symbol table is turned into a sorted address index
+ * on disk; after that it is only ever mmapped, and frames resolve with a
+ * binary search. Reports are processed on a worker pool.
+ */
+
+struct symtab_header {
+    char magic[8];
+    uint64_t text_vmaddr;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t strings;
+};
+
+struct symtab_entry {
+    uint64_t address;
+    uint32_t name;
+    uint32_t reserved;
+};
+
+// A mapped index, or a placeholder while one thread builds it
+struct symtab {
+    bool ready;
+    bool missing;
+    void *map;
+    size_t size;
+    const struct symtab_header *header;
+    const struct symtab_entry *entries;
+    const char *strings;
+};
+
+// Where an image with a given UUID lives
+struct image_source {
+    char *path;
+    uint64_t offset; // Slice offset inside a fat file
+    int64_t size;
+    int64_t mtime;
+};
+
+struct report_image {
+    uint64_t base;
+    char uuid[33];
+};
+
+static char *cache_dir = NULL;
+static GHashTable *sources = NULL; // uuid -> struct image_source, read-only once workers start
+static GHashTable *symtabs = NULL; // uuid -> struct symtab
+static GMutex symtabs_lock;
+static GCond symtabs_ready;
+static gint reports_done = 0;
+static gint reports_failed = 0;
+static gint frames_resolved = 0;
+
+static void free_image_source(gpointer data) {
+    struct image_source *source = data;
+    g_free(source->path);
+    g_free(source);
+}
+
+// Report UUIDs come with or without dashes and in either case
+static void normalize_uuid(const char *in, char out[33]) {
+    int n = 0;
+    for (; *in && n < 32; ++in) {
+        if (isxdigit((unsigned char)*in)) {
+            out[n++] = tolower((unsigned char)*in);
+        }
+    }
+    out[n] = '\0';
+}
+
+/**
+ * Mach-O parsing
+ */
+
+static uint32_t rd32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return le32toh(v);
+}
+
+static uint64_t rd64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return le64toh(v);
+}
+
+static uint32_t rd32be(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+// Walks the load commands of one 64-bit slice
+static bool parse_slice(const uint8_t *base, size_t size, char uuid[33], uint64_t *text_vmaddr, const uint8_t **symtab_cmd) {
+    if (size < 32 || rd32(base) != MH_MAGIC_64) {
+        return false;
+    }
+    uint32_t ncmds = rd32(base + 16);
+    size_t offset = 32;
+    uuid[0] = '\0';
+    *text_vmaddr = 0;
+    *symtab_cmd = NULL;
+    for (uint32_t i = 0; i < ncmds && offset + 8 <= size; ++i) {
+        const uint8_t *cmd = base + offset;
+        uint32_t kind = rd32(cmd);
+        uint32_t length = rd32(cmd + 4);
+        if (length < 8 || offset + length > size) {
+            break;
+        }
+        if (kind == LC_UUID && length >= 24) {
+            for (int b = 0; b < 16; ++b) {
+                snprintf(uuid + b * 2, 3, "%02x", cmd[8 + b]);
+            }
+        } else if (kind == LC_SEGMENT_64 && length >= 32 && strncmp((const char *)cmd + 8, "__TEXT", 16) == 0) {
+            *text_vmaddr = rd64(cmd + 24);
+        } else if (kind == LC_SYMTAB && length >= 24) {
+            *symtab_cmd = cmd;
+        }
+        offset += length;
+    }
+    return uuid[0] != '\0';
+}
+
+// Calls found() for every 64-bit slice, thin or inside a fat file
+static void for_each_slice(const uint8_t *map, size_t size, void (*found)(const uint8_t *, size_t, uint64_t, void *), void *user_data) {
+    if (size >= 8 && rd32be(map) == FAT_MAGIC) {
+        uint32_t count = rd32be(map + 4);
+        for (uint32_t i = 0; i < count && 8 + (i + 1) * 20 <= size; ++i) {
+            const uint8_t *arch = map + 8 + i * 20;
+            uint64_t offset = rd32be(arch + 8);
+            uint64_t length = rd32be(arch + 12);
+            if (offset + length <= size) {
+                found(map + offset, length, offset, user_data);
+            }
+        }
+    } else {
+        found(map, size, 0, user_data);
+    }
+}
+
+struct discover_context {
+    const char *path;
+    int64_t size;
+    int64_t mtime;
+};
+
+static void register_slice(const uint8_t *slice, size_t size, uint64_t offset, void *user_data) {
+    struct discover_context *context = user_data;
+    char uuid[33];
+    uint64_t vmaddr;
+    const uint8_t *symtab;
+    if (parse_slice(slice, size, uuid, &vmaddr, &symtab) && symtab != NULL) {
+        struct image_source *source = g_new0(struct image_source, 1);
+        source->path = g_strdup(context->path);
+        source->offset = offset;
+        source->size = context->size;
+        source->mtime = context->mtime;
+        g_hash_table_replace(sources, g_strdup(uuid), source);
+    }
+}
+
+// Remembers path, size and mtime so unchanged files are not reopened on the next run
+static GHashTable* load_source_catalog(const char *path) {
+    GHashTable *known = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_strfreev);
+    char *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return known;
+    }
+    char **lines = g_strsplit(contents, "\n", -1);
+    if (lines[0] != NULL && strcmp(lines[0], SYMBOL_CATALOG_MAGIC) == 0) {
+        for (int i = 1; lines[i] != NULL; ++i) {
+            // uuid, slice offset, size, mtime, path
+            char **fields = g_strsplit(lines[i], "\t", 5);
+            if (g_strv_length(fields) == 5) {
+                char *key = g_strdup_printf("%s\t%s\t%s", fields[4], fields[2], fields[3]);
+                char **list = g_hash_table_lookup(known, key);
+                char *entry = g_strdup_printf("%s\t%s", fields[0], fields[1]);
+                guint length = list ? g_strv_length(list) : 0;
+                char **grown = g_new0(char *, length + 2);
+                for (guint n = 0; n < length; ++n) {
+                    grown[n] = g_strdup(list[n]);
+                }
+                grown[length] = entry;
+                g_hash_table_replace(known, key, grown);
+            }
+            g_strfreev(fields);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return known;
+}
+
+static void save_source_catalog(const char *path) {
+    GString *out = g_string_new(SYMBOL_CATALOG_MAGIC "\n");
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, sources);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct image_source *source = value;
+        g_string_append_printf(out, "%s\t%llu\t%lld\t%lld\t%s\n", (const char *)key, (unsigned long long)source->offset,
+                               (long long)source->size, (long long)source->mtime, source->path);
+    }
+    g_file_set_contents(path, out->str, out->len, NULL);
+    g_string_free(out, TRUE);
+}
+
+static void discover(const char *dir, GHashTable *known, unsigned int *opened) {
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    if (handle == NULL) {
+        return;
+    }
+
+    const char *name;
+    while ((name = g_dir_read_name(handle)) != NULL) {
+        char *path = g_build_filename(dir, name, NULL);
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            g_free(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            discover(path, known, opened);
+            g_free(path);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size < 4096) {
+            g_free(path);
+            continue;
+        }
+
+        char *key = g_strdup_printf("%s\t%lld\t%lld", path, (long long)st.st_size, (long long)st.st_mtime);
+        char **cached = g_hash_table_lookup(known, key);
+        g_free(key);
+        if (cached != NULL) {
+            for (int i = 0; cached[i] != NULL; ++i) {
+                char **fields = g_strsplit(cached[i], "\t", 2);
+                struct image_source *source = g_new0(struct image_source, 1);
+                source->path = g_strdup(path);
+                source->offset = g_ascii_strtoull(fields[1], NULL, 10);
+                source->size = st.st_size;
+                source->mtime = st.st_mtime;
+                g_hash_table_replace(sources, g_strdup(fields[0]), source);
+                g_strfreev(fields);
+            }
+            g_free(path);
+            continue;
+        }
+
+        int fd = open(path, O_RDONLY);
+        uint8_t magic[4];
+        if (fd >= 0 && read(fd, magic, 4) == 4 && (rd32(magic) == MH_MAGIC_64 || rd32be(magic) == FAT_MAGIC)) {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                struct discover_context context = {path, st.st_size, st.st_mtime};
+                for_each_slice(map, st.st_size, register_slice, &context);
+                munmap(map, st.st_size);
+                (*opened)++;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_free(path);
+    }
+    g_dir_close(handle);
+}
+
+/**
+ * Sorted symbol index
+ */
+
+static int compare_entries(const void *a, const void *b) {
+    const struct symtab_entry *x = a;
+    const struct symtab_entry *y = b;
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+struct build_context {
+    const char *uuid;
+    GString *out;
+};
+
+static void build_slice(const uint8_t *slice, size_t size, uint64_t offset, void *user_data) {
+    struct build_context *context = user_data;
+    char uuid[33];
+    uint64_t vmaddr;
+    const uint8_t *symtab;
+    if (context->out != NULL || !parse_slice(slice, size, uuid, &vmaddr, &symtab) || symtab == NULL || strcmp(uuid, context->uuid) != 0) {
+        return;
+    }
+
+    uint32_t symoff = rd32(symtab + 8), nsyms = rd32(symtab + 12);
+    uint32_t stroff = rd32(symtab + 16), strsize = rd32(symtab + 20);
+    if ((uint64_t)symoff + (uint64_t)nsyms * 16 > size || (uint64_t)stroff + strsize > size) {
+        return;
+    }
+
+    GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct symtab_entry));
+    GString *strings = g_string_new(NULL);
+    for (uint32_t i = 0; i < nsyms; ++i) {
+        const uint8_t *nlist = slice + symoff + (size_t)i * 16;
+        uint32_t strx = rd32(nlist);
+        uint8_t type = nlist[4];
+        uint64_t value = rd64(nlist + 8);
+        if ((type & N_STAB) || (type & N_TYPE) != N_SECT || value == 0 || strx >= strsize) {
+            continue;
+        }
+        const char *name = (const char *)slice + stroff + strx;
+        size_t length = strnlen(name, strsize - strx);
+        struct symtab_entry entry = {.address = value, .name = strings->len};
+        // Mach-O C symbols carry a leading underscore
+        if (length > 1 && name[0] == '_') {
+            name++;
+            length--;
+        }
+        g_string_append_len(strings, name, length);
+        g_string_append_c(strings, '\0');
+        g_array_append_val(entries, entry);
+    }
+    qsort(entries->data, entries->len, sizeof(struct symtab_entry), compare_entries);
+
+    struct symtab_header header = {.text_vmaddr = htole64(vmaddr), .count = htole32(entries->len)};
+    memcpy(header.magic, SYMTAB_MAGIC, 8);
+    header.strings = htole64(sizeof(header) + (uint64_t)entries->len * sizeof(struct symtab_entry));
+    context->out = g_string_new_len((const char *)&header, sizeof(header));
+    for (guint i = 0; i < entries->len; ++i) {
+        struct symtab_entry entry = g_array_index(entries, struct symtab_entry, i);
+        entry.address = htole64(entry.address);
+        entry.name = htole32(entry.name);
+        g_string_append_len(context->out, (const char *)&entry, sizeof(entry));
+    }
+    g_string_append_len(context->out, strings->str, strings->len);
+    g_array_unref(entries);
+    g_string_free(strings, TRUE);
+}
+
+static bool build_index(const char *uuid, const char *index_path) {
+    struct image_source *source = g_hash_table_lookup(sources, uuid);
+    if (source == NULL) {
+        return false;
+    }
+
+    int fd = open(source->path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    struct build_context context = {.uuid = uuid};
+    for_each_slice(map, st.st_size, build_slice, &context);
+    munmap(map, st.st_size);
+    if (context.out == NULL) {
+        return false;
+    }
+    bool ok = g_file_set_contents(index_path, context.out->str, context.out->len, NULL);
+    g_string_free(context.out, TRUE);
+    return ok;
+}
+
+static bool map_index(const char *path, struct symtab *table) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct symtab_header)) {
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    const struct symtab_header *header = map;
+    uint64_t strings = le64toh(header->strings);
+    uint32_t count = le32toh(header->count);
+    if (memcmp(header->magic, SYMTAB_MAGIC, 8) != 0 || strings > (uint64_t)st.st_size
+        || sizeof(*header) + (uint64_t)count * sizeof(struct symtab_entry) > strings) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    table->map = map;
+    table->size = st.st_size;
+    table->header = header;
+    table->entries = (const struct symtab_entry *)(header + 1);
+    table->strings = (const char *)map + strings;
+    return true;
+}
+
+// Returns the mapped index for uuid, building it once if needed
+static struct symtab* get_symtab(const char *uuid) {
+    g_mutex_lock(&symtabs_lock);
+    struct symtab *table = g_hash_table_lookup(symtabs, uuid);
+    if (table != NULL) {
+        while (!table->ready) {
+            g_cond_wait(&symtabs_ready, &symtabs_lock);
+        }
+        g_mutex_unlock(&symtabs_lock);
+        return table->missing ? NULL : table;
+    }
+    table = g_new0(struct symtab, 1);
+    g_hash_table_replace(symtabs, g_strdup(uuid), table);
+    g_mutex_unlock(&symtabs_lock);
+
+    char *name = g_strconcat(uuid, ".idx", NULL);
+    char *path = g_build_filename(cache_dir, name, NULL);
+    bool mapped = map_index(path, table) || (build_index(uuid, path) && map_index(path, table));
+    g_free(path);
+    g_free(name);
+
+    g_mutex_lock(&symtabs_lock);
+    table->missing = !mapped;
+    table->ready = true;
+    g_cond_broadcast(&symtabs_ready);
+    g_mutex_unlock(&symtabs_lock);
+    return mapped ? table : NULL;
+}
+
+// Binary search for the symbol containing image_offset
+static const char* lookup_symbol(const struct symtab *table, uint64_t image_offset, uint64_t *distance) {
+    uint64_t address = le64toh(table->header->text_vmaddr) + image_offset;
+    uint32_t low = 0, high = le32toh(table->header->count);
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (le64toh(table->entries[mid].address) <= address) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    const struct symtab_entry *entry = &table->entries[low - 1];
+    *distance = address - le64toh(entry->address);
+    return table->strings + le32toh(entry->name);
+}
+
+/**
+ * Report formats
+ */
+
+static const char* resolve(const char *uuid, uint64_t offset, uint64_t *distance) {
+    struct symtab *table = uuid[0] ? get_symtab(uuid) : NULL;
+    const char *symbol = table ? lookup_symbol(table, offset, distance) : NULL;
+    if (symbol != NULL) {
+        g_atomic_int_inc(&frames_resolved);
+    }
+    return symbol;
+}
+
+// Classic text reports: "Binary Images:" lines map load addresses to UUIDs
+static GString* symbolicate_text(char *report) {
+    GArray *images = g_array_new(FALSE, TRUE, sizeof(struct report_image));
+    char **lines = g_strsplit(report, "\n", -1);
+    bool in_images = false;
+    for (int i = 0; lines[i] != NULL; ++i) {
+        const char *line = lines[i];
+        if (g_str_has_prefix(line, "Binary Images:")) {
+            in_images = true;
+            continue;
+        }
+        const char *open = in_images ? strchr(line, '<') : NULL;
+        const char *close = open ? strchr(open, '>') : NULL;
+        unsigned long long base = 0;
+        if (close != NULL && sscanf(line, " 0x%llx", &base) == 1) {
+            struct report_image image = {.base = base};
+            char *raw = g_strndup(open + 1, close - open - 1);
+            normalize_uuid(raw, image.uuid);
+            g_free(raw);
+            g_array_append_val(images, image);
+        }
+    }
+
+    GString *out = g_string_new(NULL);
+    for (int i = 0; lines[i] != NULL; ++i) {
+        char *line = lines[i];
+        char *plus = strstr(line, " + ");
+        unsigned long long load = 0, offset = 0;
+        // Frames end in "<load address> + <offset>"
+        char *hex = plus;
+        while (hex != NULL && hex > line && hex[-1] != ' ') {
+            hex--;
+        }
+        if (hex != NULL && hex > line && g_str_has_prefix(hex, "0x") && sscanf(hex, "0x%llx + %llu", &load, &offset) == 2) {
+            const char *uuid = "";
+            for (guint n = 0; n < images->len; ++n) {
+                if (g_array_index(images, struct report_image, n).base == load) {
+                    uuid = g_array_index(images, struct report_image, n).uuid;
+                    break;
+                }
+            }
+            uint64_t distance = 0;
+            const char *symbol = resolve(uuid, offset, &distance);
+            if (symbol != NULL) {
+                g_string_append_len(out, line, hex - line);
+                g_string_append_printf(out, "%s + %llu", symbol, (unsigned long long)distance);
+                g_string_append_c(out, '\n');
+                continue;
+            }
+        }
+        g_string_append(out, line);
+        if (lines[i + 1] != NULL) {
+            g_string_append_c(out, '\n');
+        }
+    }
+    g_strfreev(lines);
+    g_array_unref(images);
+    return out;
+}
+
+// Finds the end of the JSON object that starts at open
+static const char* object_end(const char *open) {
+    int depth = 0;
+    bool quoted = false;
+    for (const char *p = open; *p; ++p) {
+        if (quoted) {
+            if (*p == '\\' && p[1]) p++;
+            else if (*p == '"') quoted = false;
+        } else if (*p == '"') {
+            quoted = true;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if ((*p == '}' || *p == ']') && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static bool json_number(const char *from, const char *to, const char *key, unsigned long long *value) {
+    char *needle = g_strdup_printf("\"%s\":", key);
+    const char *found = g_strstr_len(from, to - from, needle);
+    size_t skip = strlen(needle);
+    g_free(needle);
+    return found != NULL && sscanf(found + skip, " %llu", value) == 1;
+}
+
+static void json_escape(GString *out, const char *text) {
+    for (; *text; ++text) {
+        if (*text == '"' || *text == '\\') {
+            g_string_append_c(out, '\\');
+        }
+        g_string_append_c(out, *text);
+    }
+}
+
+// JSON .ips reports: frames reference usedImages by index, symbols are added in place
+static GString* symbolicate_ips(const char *report) {
+    GArray *images = g_array_new(FALSE, TRUE, sizeof(struct report_image));
+    const char *used = strstr(report, "\"usedImages\"");
+    const char *array = used ? strchr(used, '[') : NULL;
+    const char *array_end = array ? object_end(array) : NULL;
+    for (const char *p = array ? array + 1 : NULL; p != NULL && p < array_end; ) {
+        const char *open = strchr(p, '{');
+        const char *close = open && open < array_end ? object_end(open) : NULL;
+        if (close == NULL) {
+            break;
+        }
+        struct report_image image = {0};
+        unsigned long long base = 0;
+        json_number(open, close, "base", &base);
+        image.base = base;
+        const char *uuid = g_strstr_len(open, close - open, "\"uuid\"");
+        const char *value = uuid ? strchr(uuid + 6, '"') : NULL;
+        if (value != NULL && value < close) {
+            char *raw = g_strndup(value + 1, strcspn(value + 1, "\""));
+            normalize_uuid(raw, image.uuid);
+            g_free(raw);
+        }
+        g_array_append_val(images, image);
+        p = close + 1;
+    }
+
+    GString *out = g_string_new(NULL);
+    const char *cursor = report;
+    const char *frame;
+    while ((frame = strstr(cursor, "\"imageOffset\"")) != NULL) {
+        const char *open = frame;
+        while (open > cursor && *open != '{') open--;
+        const char *close = *open == '{' ? object_end(open) : NULL;
+        unsigned long long offset = 0, index = 0;
+        if (close == NULL || g_strstr_len(open, close - open, "\"symbol\"") != NULL
+            || !json_number(open, close, "imageOffset", &offset) || !json_number(open, close, "imageIndex", &index)
+            || index >= images->len) {
+            g_string_append_len(out, cursor, frame + 13 - cursor);
+            cursor = frame + 13;
+            continue;
+        }
+
+        uint64_t distance = 0;
+        const char *symbol = resolve(g_array_index(images, struct report_image, index).uuid, offset, &distance);
+        g_string_append_len(out, cursor, open + 1 - cursor);
+        if (symbol != NULL) {
+            g_string_append(out, "\"symbol\":\"");
+            json_escape(out, symbol);
+            g_string_append_printf(out, "\",\"symbolLocation\":%llu,", (unsigned long long)distance);
+        }
+        cursor = open + 1;
+        g_string_append_len(out, cursor, close + 1 - cursor);
+        cursor = close + 1;
+    }
+    g_string_append(out, cursor);
+    g_array_unref(images);
+    return out;
+}
+
+static char* read_report(const char *path) {
+    // gzread passes plain files through unchanged
+    gzFile in = gzopen(path, "rb");
+    if (in == NULL) {
+        return NULL;
+    }
+    GString *data = g_string_new(NULL);
+    char buffer[65536];
+    int got;
+    while ((got = gzread(in, buffer, sizeof(buffer))) > 0) {
+        g_string_append_len(data, buffer, got);
+    }
+    gzclose(in);
+    return g_string_free(data, got < 0);
+}
+
+static void symbolicate_report(gpointer data, gpointer user_data) {
+    char *path = data;
+    char *report = read_report(path);
+    if (report == NULL) {
+        g_atomic_int_inc(&reports_failed);
+        g_free(path);
+        return;
+    }
+
+    const char *start = report;
+    while (isspace((unsigned char)*start)) start++;
+    GString *result;
+    if (*start == '{') {
+        // The first line is a separate JSON header, frames live in the body
+        const char *body = strchr(start, '\n');
+        GString *rest = symbolicate_ips(body ? body : "");
+        result = g_string_new_len(report, body ? body - report : (gssize)strlen(report));
+        g_string_append_len(result, rest->str, rest->len);
+        g_string_free(rest, TRUE);
+    } else {
+        result = symbolicate_text(report);
+    }
+
+    char *base = g_str_has_suffix(path, ".gz") ? g_strndup(path, strlen(path) - 3) : g_strdup(path);
+    char *target = g_strconcat(base, SYMBOLICATED_SUFFIX, NULL);
+    if (g_file_set_contents(target, result->str, result->len, NULL)) {
+        g_atomic_int_inc(&reports_done);
+    } else {
+        fprintf(stderr, "[Symbolicate] Failed to write %s\n", target);
+        g_atomic_int_inc(&reports_failed);
+    }
+    g_free(target);
+    g_free(base);
+    g_string_free(result, TRUE);
+    g_free(report);
+    g_free(path);
+}
+
+// Reports whose output is already newer than the input are left alone
+static void collect_reports(const char *dir, GPtrArray *reports) {
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    if (handle == NULL) {
+        return;
+    }
+    const char *name;
+    while ((name = g_dir_read_name(handle)) != NULL) {
+        char *path = g_build_filename(dir, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            collect_reports(path, reports);
+            g_free(path);
+            continue;
+        }
+        bool candidate = g_str_has_suffix(name, ".ips") || g_str_has_suffix(name, ".crash")
+                      || g_str_has_suffix(name, ".ips.gz") || g_str_has_suffix(name, ".crash.gz");
+        if (candidate) {
+            char *base = g_str_has_suffix(path, ".gz") ? g_strndup(path, strlen(path) - 3) : g_strdup(path);
+            char *target = g_strconcat(base, SYMBOLICATED_SUFFIX, NULL);
+            struct stat in, out;
+            bool fresh = stat(target, &out) == 0 && stat(path, &in) == 0 && out.st_mtime >= in.st_mtime;
+            g_free(target);
+            g_free(base);
+            if (!fresh) {
+                g_ptr_array_add(reports, path);
+                continue;
+            }
+        }
+        g_free(path);
+    }
+    g_dir_close(handle);
+}
+
+// Entry point of `iosindicator --symbolicate <reports-dir> [symbols-dir] [--jobs <n>]`
+int symbolicate_main(int argc, char *argv[]) {
+    const char *reports_dir = argc > 2 ? argv[2] : NULL;
+    const char *symbols_dir = getenv("IOSINDICATOR_SYMBOLS");
+    int jobs = g_get_num_processors();
+    for (int i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = MAX(atoi(argv[++i]), 1);
+        } else {
+            symbols_dir = argv[i];
+        }
+    }
+    if (reports_dir == NULL || symbols_dir == NULL) {
+        fprintf(stderr, "Usage: %s --symbolicate <reports-dir> [symbols-dir] [--jobs <n>]\n", argv[0]);
+        fprintf(stderr, "The symbols folder can also be set with IOSINDICATOR_SYMBOLS.\n");
+        return EXIT_FAILURE;
+    }
+
+    gint64 started = g_get_monotonic_time();
+    cache_dir = g_build_filename(g_get_user_cache_dir(), "gnome-ios-appindicator", "symbols", NULL);
+    g_mkdir_with_parents(cache_dir, 0700);
+    sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_image_source);
+    symtabs = g_hash_table_new(g_str_hash, g_str_equal);
+
+    char *catalog = g_build_filename(cache_dir, "sources", NULL);
+    GHashTable *known = load_source_catalog(catalog);
+    unsigned int opened = 0;
+    discover(symbols_dir, known, &opened);
+    save_source_catalog(catalog);
+    g_hash_table_destroy(known);
+    g_free(catalog);
+    printf("[Symbolicate] %u images with symbols, %u files inspected\n", g_hash_table_size(sources), opened);
+
+    GPtrArray *reports = g_ptr_array_new();
+    collect_reports(reports_dir, reports);
+    GThreadPool *pool = g_thread_pool_new(symbolicate_report, NULL, jobs, TRUE, NULL);
+    for (guint i = 0; i < reports->len; ++i) {
+        g_thread_pool_push(pool, g_ptr_array_index(reports, i), NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    printf("[Symbolicate] %d reports written, %d failed, %d frames resolved in %.1fs\n", reports_done, reports_failed,
+           frames_resolved, (g_get_monotonic_time() - started) / (double)G_USEC_PER_SEC);
+    g_ptr_array_unref(reports);
+    return reports_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,7 @@
+#ifndef SYMBOLICATE_H
+#define SYMBOLICATE_H
+
+// Function prototypes
+int symbolicate_main(int argc, char *argv[]);
+
+#endif // SYMBOLICATE_H
@@ -0,0 +1,543 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "sync.h"
+#include "transfer.h"
+#include "hash.h"
+
+#define SYNC_BLOCK_SIZE (1u << 20)     // Unit of the block manifest and of delta pushes
+#define SYNC_DEFAULT_JOBS 4            // Devices synced at the same time
+#define SYNC_DEFAULT_REMOTE "/Documents"
+#define MANIFEST_MAGIC "IOSSYNC1"
+
+/**
+ * Container sync. A manifest per device, app and local folder remembers the
+ * state both sides agreed on after the last run: the remote size and mtime,
+ * the local size and mtime and a hash of every block. Files unchanged on both
+ * sides are skipped, and a push of a file the device has not touched since
+ * only writes the blocks whose hash moved.
+ */
+
+struct sync_options {
+    bool push;
+    const char *bundle_id;
+    const char *local_root;
+    const char *remote_root;
+};
+
+struct sync_entry {
+    uint64_t remote_size;
+    uint64_t remote_mtime;
+    uint64_t local_size;
+    uint64_t local_mtime;
+    GArray *hashes; // uint64_t per SYNC_BLOCK_SIZE block
+};
+
+struct remote_file {
+    uint64_t size;
+    uint64_t mtime;
+};
+
+struct sync_job {
+    char udid[64];
+    const struct sync_options *options;
+    bool ok;
+};
+
+struct sync_stats {
+    unsigned int copied;
+    unsigned int patched;
+    unsigned int skipped;
+    unsigned int failed;
+    uint64_t bytes;
+};
+
+static void free_sync_entry(gpointer data) {
+    struct sync_entry *entry = data;
+    if (entry->hashes) {
+        g_array_unref(entry->hashes);
+    }
+    g_free(entry);
+}
+
+static char* manifest_path(const char *udid, const char *bundle_id, const char *local_root) {
+    char *name = g_strdup_printf("%s-%016llx.manifest", bundle_id, (unsigned long long)hash64(local_root, strlen(local_root), 0));
+    char *path = g_build_filename(g_get_user_data_dir(), "gnome-ios-appindicator", "sync", udid, name, NULL);
+    g_free(name);
+    return path;
+}
+
+// Manifest lines: escaped path, remote size, remote mtime, local size, local mtime, block hashes
+static GHashTable* manifest_load(const char *path) {
+    GHashTable *manifest = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free_sync_entry);
+    char *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return manifest;
+    }
+
+    char **lines = g_strsplit(contents, "\n", -1);
+    if (lines[0] == NULL || strcmp(lines[0], MANIFEST_MAGIC) != 0) {
+        fprintf(stderr, "[Sync] Ignoring manifest %s with unknown format\n", path);
+    } else {
+        for (int i = 1; lines[i] != NULL; ++i) {
+            char **fields = g_strsplit(lines[i], "\t", 6);
+            if (g_strv_length(fields) == 6) {
+                struct sync_entry *entry = g_new0(struct sync_entry, 1);
+                entry->remote_size = g_ascii_strtoull(fields[1], NULL, 10);
+                entry->remote_mtime = g_ascii_strtoull(fields[2], NULL, 10);
+                entry->local_size = g_ascii_strtoull(fields[3], NULL, 10);
+                entry->local_mtime = g_ascii_strtoull(fields[4], NULL, 10);
+                entry->hashes = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+                for (const char *hex = fields[5]; strlen(hex) >= 16; hex += 16) {
+                    char digits[17];
+                    memcpy(digits, hex, 16);
+                    digits[16] = '\0';
+                    uint64_t hash = g_ascii_strtoull(digits, NULL, 16);
+                    g_array_append_val(entry->hashes, hash);
+                }
+                g_hash_table_replace(manifest, g_strcompress(fields[0]), entry);
+            }
+            g_strfreev(fields);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return manifest;
+}
+
+static bool manifest_save(const char *path, GHashTable *manifest) {
+    GString *out = g_string_new(MANIFEST_MAGIC "\n");
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, manifest);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        struct sync_entry *entry = value;
+        char *escaped = g_strescape(key, NULL);
+        g_string_append_printf(out, "%s\t%llu\t%llu\t%llu\t%llu\t", escaped,
+                               (unsigned long long)entry->remote_size, (unsigned long long)entry->remote_mtime,
+                               (unsigned long long)entry->local_size, (unsigned long long)entry->local_mtime);
+        for (guint i = 0; entry->hashes && i < entry->hashes->len; ++i) {
+            g_string_append_printf(out, "%016llx", (unsigned long long)g_array_index(entry->hashes, uint64_t, i));
+        }
+        g_string_append_c(out, '\n');
+        g_free(escaped);
+    }
+
+    char *dir = g_path_get_dirname(path);
+    g_mkdir_with_parents(dir, 0700);
+    g_free(dir);
+    // g_file_set_contents writes a temporary file and renames it over the old one
+    bool ok = g_file_set_contents(path, out->str, out->len, NULL);
+    g_string_free(out, TRUE);
+    return ok;
+}
+
+static bool local_stat(const char *path, uint64_t *size, uint64_t *mtime) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    *size = st.st_size;
+    *mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    return true;
+}
+
+static GArray* hash_blocks(const char *data, uint64_t size) {
+    GArray *hashes = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    for (uint64_t offset = 0; offset < size; offset += SYNC_BLOCK_SIZE) {
+        uint64_t hash = hash64(data + offset, MIN(SYNC_BLOCK_SIZE, size - offset), 0);
+        g_array_append_val(hashes, hash);
+    }
+    return hashes;
+}
+
+static void walk_remote(afc_client_t afc, const char *root, const char *rel, GHashTable *files) {
+    char *dir = rel[0] ? g_build_filename(root, rel, NULL) : g_strdup(root);
+    char **names = NULL;
+    if (afc_read_directory(afc, dir, &names) != AFC_E_SUCCESS || names == NULL) {
+        g_free(dir);
+        return;
+    }
+
+    for (int i = 0; names[i] != NULL; ++i) {
+        if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) {
+            continue;
+        }
+        char *child_rel = rel[0] ? g_build_filename(rel, names[i], NULL) : g_strdup(names[i]);
+        char *child = g_build_filename(dir, names[i], NULL);
+        struct remote_file file;
+        bool is_dir = false;
+        if (transfer_stat(afc, child, &file.size, &file.mtime, &is_dir)) {
+            if (is_dir) {
+                walk_remote(afc, root, child_rel, files);
+            } else {
+                struct remote_file *copy = g_new(struct remote_file, 1);
+                *copy = file;
+                g_hash_table_replace(files, g_strdup(child_rel), copy);
+            }
+        }
+        g_free(child);
+        g_free(child_rel);
+    }
+    afc_dictionary_free(names);
+    g_free(dir);
+}
+
+static void walk_local(const char *root, const char *rel, GPtrArray *files) {
+    char *dir = rel[0] ? g_build_filename(root, rel, NULL) : g_strdup(root);
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    if (handle == NULL) {
+        g_free(dir);
+        return;
+    }
+
+    const char *name;
+    while ((name = g_dir_read_name(handle)) != NULL) {
+        char *child_rel = rel[0] ? g_build_filename(rel, name, NULL) : g_strdup(name);
+        char *child = g_build_filename(dir, name, NULL);
+        if (g_file_test(child, G_FILE_TEST_IS_DIR)) {
+            walk_local(root, child_rel, files);
+            g_free(child_rel);
+        } else if (g_file_test(child, G_FILE_TEST_IS_REGULAR)) {
+            g_ptr_array_add(files, child_rel);
+        } else {
+            g_free(child_rel);
+        }
+        g_free(child);
+    }
+    g_dir_close(handle);
+    g_free(dir);
+}
+
+// Streams one remote file into place, hashing blocks on the way
+static bool pull_file(afc_client_t afc, const char *remote, const char *local, struct sync_entry *entry, struct sync_stats *stats) {
+    uint64_t handle = 0;
+    if (afc_file_open(afc, remote, AFC_FOPEN_RDONLY, &handle) != AFC_E_SUCCESS) {
+        return false;
+    }
+
+    char *dir = g_path_get_dirname(local);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+    char *partial = g_strconcat(local, ".partial", NULL);
+    int fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    char *block = g_malloc(SYNC_BLOCK_SIZE);
+    GArray *hashes = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+    bool ok = fd >= 0;
+    while (ok) {
+        // Fill a whole block so the hashes line up with SYNC_BLOCK_SIZE
+        uint32_t filled = 0;
+        while (filled < SYNC_BLOCK_SIZE) {
+            uint32_t got = 0;
+            if (afc_file_read(afc, handle, block + filled, SYNC_BLOCK_SIZE - filled, &got) != AFC_E_SUCCESS) {
+                ok = false;
+                break;
+            }
+            if (got == 0) {
+                break;
+            }
+            filled += got;
+        }
+        if (!ok || filled == 0) {
+            break;
+        }
+        uint64_t hash = hash64(block, filled, 0);
+        g_array_append_val(hashes, hash);
+        ok = write(fd, block, filled) == (ssize_t)filled;
+        stats->bytes += filled;
+        if (filled < SYNC_BLOCK_SIZE) {
+            break;
+        }
+    }
+    afc_file_close(afc, handle);
+    g_free(block);
+
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    ok = ok && rename(partial, local) == 0 && local_stat(local, &entry->local_size, &entry->local_mtime);
+    if (!ok) {
+        unlink(partial);
+        g_array_unref(hashes);
+    } else {
+        entry->hashes = hashes;
+    }
+    g_free(partial);
+    return ok;
+}
+
+// Sends a local file; with a trusted previous entry only changed blocks go over the wire
+static bool push_file(afc_client_t afc, const char *local, const char *remote, const struct sync_entry *previous, struct sync_entry *entry, struct sync_stats *stats) {
+    int fd = open(local, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    uint64_t size = st.st_size;
+    const char *data = "";
+    void *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = map;
+    }
+    close(fd);
+
+    entry->local_size = size;
+    entry->local_mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    entry->hashes = hash_blocks(data, size);
+
+    char *dir = g_path_get_dirname(remote);
+    afc_make_directory(afc, dir);
+    g_free(dir);
+
+    uint64_t handle = 0;
+    bool delta = previous != NULL && previous->hashes != NULL;
+    bool opened = afc_file_open(afc, remote, delta ? AFC_FOPEN_RW : AFC_FOPEN_WRONLY, &handle) == AFC_E_SUCCESS;
+    bool ok = opened;
+    for (guint i = 0; ok && i < entry->hashes->len; ++i) {
+        uint64_t hash = g_array_index(entry->hashes, uint64_t, i);
+        if (delta && i < previous->hashes->len && g_array_index(previous->hashes, uint64_t, i) == hash) {
+            continue;
+        }
+
+        uint64_t offset = (uint64_t)i * SYNC_BLOCK_SIZE;
+        uint32_t length = MIN(SYNC_BLOCK_SIZE, size - offset);
+        uint32_t written = 0;
+        ok = afc_file_seek(afc, handle, offset, SEEK_SET) == AFC_E_SUCCESS;
+        while (ok && written < length) {
+            uint32_t sent = 0;
+            ok = afc_file_write(afc, handle, data + offset + written, length - written, &sent) == AFC_E_SUCCESS && sent > 0;
+            written += sent;
+        }
+        stats->bytes += written;
+    }
+    if (ok && delta) {
+        ok = afc_file_truncate(afc, handle, size) == AFC_E_SUCCESS;
+    }
+    if (opened) {
+        afc_file_close(afc, handle);
+    }
+    if (map != NULL) {
+        munmap(map, size);
+    }
+
+    // The device picks its own mtime, record what it reports
+    return ok && transfer_stat(afc, remote, &entry->remote_size, &entry->remote_mtime, NULL);
+}
+
+static bool remote_unchanged(const struct sync_entry *entry, const struct remote_file *file) {
+    return entry != NULL && file != NULL && entry->remote_size == file->size && entry->remote_mtime == file->mtime;
+}
+
+static bool local_unchanged(const struct sync_entry *entry, const char *local) {
+    uint64_t size, mtime;
+    return entry != NULL && local_stat(local, &size, &mtime) && entry->local_size == size && entry->local_mtime == mtime;
+}
+
+static void sync_pull(afc_client_t afc, const struct sync_options *options, const char *local_root, GHashTable *manifest, GHashTable *remote_files, struct sync_stats *stats) {
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, remote_files);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char *rel = key;
+        const struct remote_file *file = value;
+        char *local = g_build_filename(local_root, rel, NULL);
+        struct sync_entry *previous = g_hash_table_lookup(manifest, rel);
+
+        if (remote_unchanged(previous, file) && local_unchanged(previous, local)) {
+            stats->skipped++;
+        } else {
+            // AFC cannot hash on the device, so a changed remote file is read in full
+            char *remote = g_build_filename(options->remote_root, rel, NULL);
+            struct sync_entry *entry = g_new0(struct sync_entry, 1);
+            entry->remote_size = file->size;
+            entry->remote_mtime = file->mtime;
+            if (pull_file(afc, remote, local, entry, stats)) {
+                g_hash_table_replace(manifest, g_strdup(rel), entry);
+                stats->copied++;
+            } else {
+                fprintf(stderr, "[Sync] Failed to pull %s\n", remote);
+                free_sync_entry(entry);
+                stats->failed++;
+            }
+            g_free(remote);
+        }
+        g_free(local);
+    }
+}
+
+static void sync_push(afc_client_t afc, const struct sync_options *options, const char *local_root, GHashTable *manifest, GHashTable *remote_files, struct sync_stats *stats) {
+    GPtrArray *local_files = g_ptr_array_new_with_free_func(g_free);
+    walk_local(local_root, "", local_files);
+
+    for (guint i = 0; i < local_files->len; ++i) {
+        const char *rel = g_ptr_array_index(local_files, i);
+        char *local = g_build_filename(local_root, rel, NULL);
+        struct sync_entry *previous = g_hash_table_lookup(manifest, rel);
+        const struct remote_file *file = g_hash_table_lookup(remote_files, rel);
+
+        if (remote_unchanged(previous, file) && local_unchanged(previous, local)) {
+            stats->skipped++;
+        } else {
+            // Block deltas are only safe when the device copy is the one we recorded
+            const struct sync_entry *base = remote_unchanged(previous, file) ? previous : NULL;
+            char *remote = g_build_filename(options->remote_root, rel, NULL);
+            struct sync_entry *entry = g_new0(struct sync_entry, 1);
+            if (push_file(afc, local, remote, base, entry, stats)) {
+                g_hash_table_replace(manifest, g_strdup(rel), entry);
+                if (base != NULL) {
+                    stats->patched++;
+                } else {
+                    stats->copied++;
+                }
+            } else {
+                fprintf(stderr, "[Sync] Failed to push %s\n", local);
+                free_sync_entry(entry);
+                stats->failed++;
+            }
+            g_free(remote);
+        }
+        g_free(local);
+    }
+    g_ptr_array_unref(local_files);
+}
+
+static void sync_device(gpointer data, gpointer user_data) {
+    struct sync_job *job = data;
+    const struct sync_options *options = job->options;
+    idevice_t device = NULL;
+    afc_client_t afc = NULL;
+    house_arrest_client_t house_arrest = NULL;
+
+    if (idevice_new(&device, job->udid) != IDEVICE_E_SUCCESS) {
+        fprintf(stderr, "[UDID=%s][Sync] Device not found\n", job->udid);
+        return;
+    }
+    if (!transfer_connect(device, options->bundle_id, &afc, &house_arrest)) {
+        fprintf(stderr, "[UDID=%s][Sync] Cannot open the container of %s\n", job->udid, options->bundle_id);
+        idevice_free(device);
+        return;
+    }
+
+    // Pulls from many devices land side by side, pushes fan one folder out
+    char *local_root = options->push ? g_strdup(options->local_root) : g_build_filename(options->local_root, job->udid, NULL);
+    char *manifest_file = manifest_path(job->udid, options->bundle_id, local_root);
+    GHashTable *manifest = manifest_load(manifest_file);
+    GHashTable *remote_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    struct sync_stats stats = {0};
+    gint64 started = g_get_monotonic_time();
+
+    walk_remote(afc, options->remote_root, "", remote_files);
+    if (options->push) {
+        sync_push(afc, options, local_root, manifest, remote_files, &stats);
+    } else {
+        sync_pull(afc, options, local_root, manifest, remote_files, &stats);
+    }
+
+    if (!manifest_save(manifest_file, manifest)) {
+        fprintf(stderr, "[UDID=%s][Sync] Failed to save manifest %s\n", job->udid, manifest_file);
+    }
+    printf("[UDID=%s][Sync] %s %s: %u copied, %u patched, %u unchanged, %u failed, %.1f MB in %.1fs\n",
+           job->udid, options->push ? "Pushed" : "Pulled", options->bundle_id, stats.copied, stats.patched, stats.skipped,
+           stats.failed, stats.bytes / 1000000.0, (g_get_monotonic_time() - started) / (double)G_USEC_PER_SEC);
+    job->ok = stats.failed == 0;
+
+    g_hash_table_destroy(remote_files);
+    g_hash_table_destroy(manifest);
+    g_free(manifest_file);
+    g_free(local_root);
+    transfer_disconnect(afc, house_arrest);
+    idevice_free(device);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s --sync pull|push <bundle-id> <local-dir> [--remote <dir>] [--jobs <n>] [udid...]\n", name);
+    fprintf(stderr, "Without UDIDs every connected device is synced. Pulls go to <local-dir>/<udid>.\n");
+}
+
+// Entry point of `iosindicator --sync`
+int sync_main(int argc, char *argv[]) {
+    if (argc < 5 || (strcmp(argv[2], "pull") != 0 && strcmp(argv[2], "push") != 0)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sync_options options = {
+        .push = strcmp(argv[2], "push") == 0,
+        .bundle_id = argv[3],
+        .local_root = argv[4],
+        .remote_root = SYNC_DEFAULT_REMOTE,
+    };
+    int jobs = SYNC_DEFAULT_JOBS;
+    GPtrArray *udids = g_ptr_array_new_with_free_func(g_free);
+    for (int i = 5; i < argc; ++i) {
+        if (strcmp(argv[i], "--remote") == 0 && i + 1 < argc) {
+            options.remote_root = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            jobs = MAX(atoi(argv[++i]), 1);
+        } else {
+            g_ptr_array_add(udids, g_strdup(argv[i]));
+        }
+    }
+
+    if (udids->len == 0) {
+        char **devices = NULL;
+        int count = 0;
+        if (idevice_get_device_list(&devices, &count) == IDEVICE_E_SUCCESS) {
+            for (int i = 0; i < count; ++i) {
+                bool seen = false;
+                for (guint j = 0; j < udids->len; ++j) {
+                    seen = seen || strcmp(g_ptr_array_index(udids, j), devices[i]) == 0;
+                }
+                if (!seen) {
+                    g_ptr_array_add(udids, g_strdup(devices[i]));
+                }
+            }
+            idevice_device_list_free(devices);
+        }
+    }
+    if (udids->len == 0) {
+        fprintf(stderr, "[Sync] No devices connected\n");
+        g_ptr_array_unref(udids);
+        return EXIT_FAILURE;
+    }
+
+    // The pool size is the global limit on devices being synced at once
+    struct sync_job *queue = g_new0(struct sync_job, udids->len);
+    GThreadPool *pool = g_thread_pool_new(sync_device, NULL, jobs, TRUE, NULL);
+    for (guint i = 0; i < udids->len; ++i) {
+        g_strlcpy(queue[i].udid, g_ptr_array_index(udids, i), sizeof(queue[i].udid));
+        queue[i].options = &options;
+        g_thread_pool_push(pool, &queue[i], NULL);
+    }
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    int failures = 0;
+    for (guint i = 0; i < udids->len; ++i) {
+        failures += !queue[i].ok;
+    }
+    printf("[Sync] %u device(s), %d failed\n", udids->len, failures);
+    g_free(queue);
+    g_ptr_array_unref(udids);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,7 @@
+#ifndef SYNC_H
+#define SYNC_H
+
+// Function prototypes
+int sync_main(int argc, char *argv[]);
+
+#endif // SYNC_H
@@ -0,0 +1,797 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "transfer.h"
+#include "tray.h" // To access the global indicator variable
+
+#define TRANSFER_STREAMS 4            // Parallel AFC connections per device
+#define SEGMENT_SIZE (32ull << 20)    // Large files are split across streams
+#define CHUNK_MIN (64u << 10)
+#define CHUNK_START (256u << 10)
+#define CHUNK_MAX (4u << 20)
+#define CHUNK_FAST_US 40000           // Grow the chunk while reads finish faster than this
+#define CHUNK_SLOW_US 400000          // Shrink it when they take longer
+#define WRITE_BUFFERS (TRANSFER_STREAMS * 2)
+#define ENGINE_IDLE_US (30 * G_USEC_PER_SEC) // Threads and buffers are released after this long without work
+
+enum job_kind {
+    JOB_PULL_TREE,
+    JOB_PULL_FILE,
+    JOB_PUSH,
+    JOB_STOP
+};
+
+struct transfer_job {
+    enum job_kind kind;
+    char *source;
+    char *dest;
+    transfer_done_cb_t callback;
+    void *user_data;
+};
+
+// One file being moved, shared by all of its segments
+struct transfer_file {
+    char *remote;
+    char *local;
+    int fd;
+    bool push;
+    bool failed;
+    uint64_t remaining; // Bytes not yet landed, guarded by the session lock
+    transfer_done_cb_t callback;
+    void *user_data;
+};
+
+// A segment of a file, handled by one stream
+struct transfer_unit {
+    struct transfer_file *file;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Preallocated buffer travelling between a stream and the writer
+struct write_request {
+    struct transfer_file *file;
+    uint64_t offset;
+    uint32_t length;
+    bool failed;
+    char *buffer;
+};
+
+struct transfer_session {
+    char udid[64];
+    idevice_t device;
+    GThread *planner;
+    GThread *writer;
+    GThread *streams[TRANSFER_STREAMS];
+    GAsyncQueue *jobs;
+    GAsyncQueue *units;
+    GAsyncQueue *writes;
+    GAsyncQueue *buffers;
+    struct write_request requests[WRITE_BUFFERS];
+    char *buffer_pool;
+
+    GMutex lock;
+    GCond idle;
+    bool engine;              // Threads and buffers are up, started by the first job after an idle period
+    unsigned int outstanding; // Jobs and files not finished yet
+    uint64_t bytes_total;
+    uint64_t bytes_done;
+    unsigned int files_total;
+    unsigned int files_done;
+    unsigned int files_failed;
+
+    // Main loop only: progress rate shown for this device
+    uint64_t last_done;
+    double rate;
+};
+
+static struct transfer_unit stop_unit;
+static struct write_request stop_request;
+
+// Session the tray actions apply to, and every session for progress by UDID
+static transfer_session_t *active = NULL;
+static GHashTable *sessions = NULL; // udid -> transfer_session_t, under active_lock
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static guint progress_source = 0;
+
+// Opens the AFC root, or the container of bundle_id when one is given
+bool transfer_connect(idevice_t device, const char *bundle_id, afc_client_t *afc, house_arrest_client_t *house_arrest) {
+    *afc = NULL;
+    *house_arrest = NULL;
+    if (bundle_id == NULL) {
+        return afc_client_start_service(device, afc, NULL) == AFC_E_SUCCESS;
+    }
+
+    if (house_arrest_client_start_service(device, house_arrest, NULL) != HOUSE_ARREST_E_SUCCESS) {
+        return false;
+    }
+
+    plist_t result = NULL;
+    bool vended = house_arrest_send_command(*house_arrest, "VendContainer", bundle_id) == HOUSE_ARREST_E_SUCCESS
+                  && house_arrest_get_result(*house_arrest, &result) == HOUSE_ARREST_E_SUCCESS;
+    plist_t error = result ? plist_dict_get_item(result, "Error") : NULL;
+    if (error != NULL) {
+        const char *reason = plist_get_string_ptr(error, NULL);
+        fprintf(stderr, "[Transfer] Cannot vend container of %s: %s\n", bundle_id, reason ? reason : "unknown error");
+        vended = false;
+    }
+    plist_free(result);
+
+    if (!vended || afc_client_new_from_house_arrest_client(*house_arrest, afc) != AFC_E_SUCCESS) {
+        house_arrest_client_free(*house_arrest);
+        *house_arrest = NULL;
+        *afc = NULL;
+        return false;
+    }
+    return true;
+}
+
+void transfer_disconnect(afc_client_t afc, house_arrest_client_t house_arrest) {
+    // The AFC client rides on the house_arrest connection, so it goes first
+    if (afc != NULL) {
+        afc_client_free(afc);
+    }
+    if (house_arrest != NULL) {
+        house_arrest_client_free(house_arrest);
+    }
+}
+
+bool transfer_stat(afc_client_t afc, const char *path, uint64_t *size, uint64_t *mtime, bool *is_dir) {
+    char **info = NULL;
+    if (afc_get_file_info(afc, path, &info) != AFC_E_SUCCESS || info == NULL) {
+        return false;
+    }
+
+    if (size) *size = 0;
+    if (mtime) *mtime = 0;
+    if (is_dir) *is_dir = false;
+    for (int i = 0; info[i] != NULL && info[i + 1] != NULL; i += 2) {
+        if (size && strcmp(info[i], "st_size") == 0) {
+            *size = g_ascii_strtoull(info[i + 1], NULL, 10);
+        } else if (mtime && strcmp(info[i], "st_mtime") == 0) {
+            *mtime = g_ascii_strtoull(info[i + 1], NULL, 10);
+        } else if (is_dir && strcmp(info[i], "st_ifmt") == 0) {
+            *is_dir = strcmp(info[i + 1], "S_IFDIR") == 0;
+        }
+    }
+    afc_dictionary_free(info);
+    return true;
+}
+
+static void finish_file(transfer_session_t *session, struct transfer_file *file) {
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+    if (file->failed) {
+        fprintf(stderr, "[UDID=%s][Transfer] Failed: %s\n", session->udid, file->remote);
+    }
+    if (file->callback != NULL) {
+        file->callback(file->remote, file->local, !file->failed, file->user_data);
+    }
+
+    g_mutex_lock(&session->lock);
+    if (file->failed) session->files_failed++;
+    else session->files_done++;
+    if (--session->outstanding == 0) {
+        g_cond_broadcast(&session->idle);
+    }
+    g_mutex_unlock(&session->lock);
+
+    g_free(file->remote);
+    g_free(file->local);
+    g_free(file);
+}
+
+// Accounts landed (or abandoned) bytes and finishes the file with its last byte
+static void settle_bytes(transfer_session_t *session, struct transfer_file *file, uint64_t length, bool failed) {
+    bool done;
+    g_mutex_lock(&session->lock);
+    if (failed) file->failed = true;
+    else session->bytes_done += length;
+    file->remaining -= length;
+    done = file->remaining == 0;
+    g_mutex_unlock(&session->lock);
+
+    if (done) {
+        finish_file(session, file);
+    }
+}
+
+static void enqueue_file(transfer_session_t *session, struct transfer_file *file, uint64_t size) {
+    g_mutex_lock(&session->lock);
+    session->outstanding++;
+    session->files_total++;
+    session->bytes_total += size;
+    file->remaining = size;
+    g_mutex_unlock(&session->lock);
+
+    if (size == 0) {
+        finish_file(session, file);
+        return;
+    }
+
+    for (uint64_t offset = 0; offset < size; offset += SEGMENT_SIZE) {
+        struct transfer_unit *unit = g_new(struct transfer_unit, 1);
+        unit->file = file;
+        unit->offset = offset;
+        unit->length = MIN(SEGMENT_SIZE, size - offset);
+        g_async_queue_push(session->units, unit);
+    }
+}
+
+static void plan_pull(transfer_session_t *session, afc_client_t afc, const char *remote, const char *local, transfer_done_cb_t callback, void *user_data) {
+    uint64_t size = 0;
+    bool is_dir = false;
+    struct transfer_file *file = g_new0(struct transfer_file, 1);
+    file->remote = g_strdup(remote);
+    file->local = g_strdup(local);
+    file->callback = callback;
+    file->user_data = user_data;
+    file->fd = -1;
+
+    char *dir = g_path_get_dirname(local);
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    if (!transfer_stat(afc, remote, &size, NULL, &is_dir) || is_dir
+        || (file->fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        file->failed = true;
+        enqueue_file(session, file, 0);
+        return;
+    }
+
+    // Size the file up front so segments can land at their offsets in any order
+    if (size > 0 && posix_fallocate(file->fd, 0, size) != 0 && ftruncate(file->fd, size) != 0) {
+        fprintf(stderr, "[UDID=%s][Transfer] Failed to preallocate %s\n", session->udid, local);
+    }
+    enqueue_file(session, file, size);
+}
+
+static void plan_pull_tree(transfer_session_t *session, afc_client_t afc, const char *remote, const char *local) {
+    bool is_dir = false;
+    if (!transfer_stat(afc, remote, NULL, NULL, &is_dir)) {
+        fprintf(stderr, "[UDID=%s][Transfer] No such path: %s\n", session->udid, remote);
+        return;
+    }
+    if (!is_dir) {
+        plan_pull(session, afc, remote, local, NULL, NULL);
+        return;
+    }
+
+    char **entries = NULL;
+    if (afc_read_directory(afc, remote, &entries) != AFC_E_SUCCESS || entries == NULL) {
+        return;
+    }
+    for (int i = 0; entries[i] != NULL; ++i) {
+        if (strcmp(entries[i], ".") == 0 || strcmp(entries[i], "..") == 0) continue;
+        char *child_remote = g_build_filename(remote, entries[i], NULL);
+        char *child_local = g_build_filename(local, entries[i], NULL);
+        plan_pull_tree(session, afc, child_remote, child_local);
+        g_free(child_remote);
+        g_free(child_local);
+    }
+    afc_dictionary_free(entries);
+}
+
+static void plan_push(transfer_session_t *session, afc_client_t afc, const char *local, const char *remote) {
+    struct stat st;
+    if (stat(local, &st) != 0) {
+        fprintf(stderr, "[UDID=%s][Transfer] No such file: %s\n", session->udid, local);
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        afc_make_directory(afc, remote);
+        GDir *dir = g_dir_open(local, 0, NULL);
+        if (dir == NULL) return;
+        const char *name;
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            char *child_local = g_build_filename(local, name, NULL);
+            char *child_remote = g_build_filename(remote, name, NULL);
+            plan_push(session, afc, child_local, child_remote);
+            g_free(child_local);
+            g_free(child_remote);
+        }
+        g_dir_close(dir);
+        return;
+    }
+
+    struct transfer_file *file = g_new0(struct transfer_file, 1);
+    file->remote = g_strdup(remote);
+    file->local = g_strdup(local);
+    file->push = true;
+    file->fd = open(local, O_RDONLY);
+
+    // Create or truncate once, the segments then open it read-write
+    uint64_t handle = 0;
+    if (file->fd < 0 || afc_file_open(afc, remote, AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS) {
+        file->failed = true;
+        enqueue_file(session, file, 0);
+        return;
+    }
+    afc_file_close(afc, handle);
+    enqueue_file(session, file, st.st_size);
+}
+
+static gpointer stream_thread(gpointer data);
+static gpointer writer_thread(gpointer data);
+
+/**
+ * Engine lifecycle. Most devices never transfer anything, so the buffer
+ * pool, the writer and the streams are only brought up by the first job
+ * and the planner takes them down again once the session has been idle
+ * for ENGINE_IDLE_US (or on stop).
+ */
+static void start_engine(transfer_session_t *session) {
+    session->buffer_pool = g_malloc((size_t)WRITE_BUFFERS * CHUNK_MAX);
+    for (int i = 0; i < WRITE_BUFFERS; ++i) {
+        session->requests[i].buffer = session->buffer_pool + (size_t)i * CHUNK_MAX;
+        g_async_queue_push(session->buffers, &session->requests[i]);
+    }
+    session->writer = g_thread_new("transfer-write", writer_thread, session);
+    for (int i = 0; i < TRANSFER_STREAMS; ++i) {
+        session->streams[i] = g_thread_new("transfer-stream", stream_thread, session);
+    }
+}
+
+// Planner thread only, once nothing is queued behind it: stop in pipeline order so every queued segment is settled
+static void stop_engine(transfer_session_t *session) {
+    for (int i = 0; i < TRANSFER_STREAMS; ++i) {
+        g_async_queue_push(session->units, &stop_unit);
+    }
+    for (int i = 0; i < TRANSFER_STREAMS; ++i) {
+        g_thread_join(session->streams[i]);
+        session->streams[i] = NULL;
+    }
+    g_async_queue_push(session->writes, &stop_request);
+    g_thread_join(session->writer);
+    session->writer = NULL;
+
+    while (g_async_queue_try_pop(session->buffers) != NULL) {
+    }
+    g_free(session->buffer_pool);
+    session->buffer_pool = NULL;
+}
+
+static gpointer planner_thread(gpointer data) {
+    transfer_session_t *session = data;
+    afc_client_t afc = NULL;
+
+    while (true) {
+        struct transfer_job *job = g_async_queue_timeout_pop(session->jobs, ENGINE_IDLE_US);
+        if (job == NULL) {
+            // Idle: retire unless a job slipped in, submit_job starts a new engine afterwards
+            g_mutex_lock(&session->lock);
+            bool idle = session->outstanding == 0;
+            if (idle) {
+                session->engine = false;
+            }
+            g_mutex_unlock(&session->lock);
+            if (idle) {
+                break;
+            }
+            continue;
+        }
+        if (job->kind == JOB_STOP) {
+            g_free(job);
+            break;
+        }
+
+        if (afc == NULL && afc_client_start_service(session->device, &afc, NULL) != AFC_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Transfer] Failed to start AFC service\n", session->udid);
+            afc = NULL;
+        }
+
+        if (afc != NULL) {
+            if (job->kind == JOB_PULL_TREE) {
+                char *base = g_path_get_basename(job->source);
+                char *local = g_build_filename(job->dest, base, NULL);
+                plan_pull_tree(session, afc, job->source, local);
+                g_free(local);
+                g_free(base);
+            } else if (job->kind == JOB_PULL_FILE) {
+                plan_pull(session, afc, job->source, job->dest, job->callback, job->user_data);
+            } else if (job->kind == JOB_PUSH) {
+                char *base = g_path_get_basename(job->source);
+                char *remote = g_build_filename(job->dest, base, NULL);
+                plan_push(session, afc, job->source, remote);
+                g_free(remote);
+                g_free(base);
+            }
+        } else if (job->callback != NULL) {
+            job->callback(job->source, job->dest, false, job->user_data);
+        }
+
+        g_mutex_lock(&session->lock);
+        if (--session->outstanding == 0) {
+            g_cond_broadcast(&session->idle);
+        }
+        g_mutex_unlock(&session->lock);
+
+        g_free(job->source);
+        g_free(job->dest);
+        g_free(job);
+    }
+
+    if (afc != NULL) afc_client_free(afc);
+    stop_engine(session);
+    return NULL;
+}
+
+static void adapt_chunk(uint32_t *chunk, gint64 elapsed_us) {
+    if (elapsed_us < CHUNK_FAST_US && *chunk < CHUNK_MAX) {
+        *chunk *= 2;
+    } else if (elapsed_us > CHUNK_SLOW_US && *chunk > CHUNK_MIN) {
+        *chunk /= 2;
+    }
+}
+
+static void pull_unit(transfer_session_t *session, afc_client_t afc, struct transfer_unit *unit, uint32_t *chunk) {
+    struct transfer_file *file = unit->file;
+    uint64_t done = 0;
+    uint64_t handle = 0;
+    bool opened = afc != NULL && afc_file_open(afc, file->remote, AFC_FOPEN_RDONLY, &handle) == AFC_E_SUCCESS;
+
+    if (opened && afc_file_seek(afc, handle, unit->offset, SEEK_SET) == AFC_E_SUCCESS) {
+        while (done < unit->length) {
+            struct write_request *request = g_async_queue_pop(session->buffers);
+            uint32_t want = MIN(*chunk, unit->length - done);
+            uint32_t got = 0;
+
+            gint64 start = g_get_monotonic_time();
+            while (got < want) {
+                uint32_t n = 0;
+                if (afc_file_read(afc, handle, request->buffer + got, want - got, &n) != AFC_E_SUCCESS || n == 0) break;
+                got += n;
+            }
+            if (got == want) {
+                adapt_chunk(chunk, g_get_monotonic_time() - start);
+            }
+            if (got == 0) {
+                g_async_queue_push(session->buffers, request);
+                break;
+            }
+
+            request->file = file;
+            request->offset = unit->offset + done;
+            request->length = got;
+            request->failed = false;
+            g_async_queue_push(session->writes, request);
+            done += got;
+        }
+    }
+    if (opened) {
+        afc_file_close(afc, handle);
+    }
+
+    // Whatever could not be read still has to be settled by the writer
+    if (done < unit->length) {
+        struct write_request *request = g_async_queue_pop(session->buffers);
+        request->file = file;
+        request->offset = unit->offset + done;
+        request->length = unit->length - done;
+        request->failed = true;
+        g_async_queue_push(session->writes, request);
+    }
+}
+
+static void push_unit(transfer_session_t *session, afc_client_t afc, struct transfer_unit *unit, uint32_t *chunk) {
+    struct transfer_file *file = unit->file;
+    uint64_t done = 0;
+    uint64_t handle = 0;
+    bool opened = afc != NULL && afc_file_open(afc, file->remote, AFC_FOPEN_RW, &handle) == AFC_E_SUCCESS;
+
+    if (opened && afc_file_seek(afc, handle, unit->offset, SEEK_SET) == AFC_E_SUCCESS) {
+        struct write_request *request = g_async_queue_pop(session->buffers);
+        while (done < unit->length) {
+            uint32_t want = MIN(*chunk, unit->length - done);
+            ssize_t n = pread(file->fd, request->buffer, want, unit->offset + done);
+            if (n <= 0) break;
+
+            gint64 start = g_get_monotonic_time();
+            uint32_t sent = 0;
+            while (sent < (uint32_t)n) {
+                uint32_t written = 0;
+                if (afc_file_write(afc, handle, request->buffer + sent, n - sent, &written) != AFC_E_SUCCESS || written == 0) break;
+                sent += written;
+            }
+            if (sent < (uint32_t)n) break;
+            adapt_chunk(chunk, g_get_monotonic_time() - start);
+
+            settle_bytes(session, file, sent, false);
+            done += sent;
+        }
+        g_async_queue_push(session->buffers, request);
+    }
+    if (opened) {
+        afc_file_close(afc, handle);
+    }
+
+    if (done < unit->length) {
+        settle_bytes(session, file, unit->length - done, true);
+    }
+}
+
+// Each stream owns one AFC connection and works through segments
+static gpointer stream_thread(gpointer data) {
+    transfer_session_t *session = data;
+    afc_client_t afc = NULL;
+    uint32_t chunk = CHUNK_START;
+
+    while (true) {
+        struct transfer_unit *unit = g_async_queue_pop(session->units);
+        if (unit == &stop_unit) {
+            break;
+        }
+
+        if (afc == NULL && afc_client_start_service(session->device, &afc, NULL) != AFC_E_SUCCESS) {
+            afc = NULL;
+        }
+
+        if (unit->file->push) {
+            push_unit(session, afc, unit, &chunk);
+        } else {
+            pull_unit(session, afc, unit, &chunk);
+        }
+        g_free(unit);
+    }
+
+    if (afc != NULL) afc_client_free(afc);
+    return NULL;
+}
+
+// Dedicated writer: streams never wait on the local disk
+static gpointer writer_thread(gpointer data) {
+    transfer_session_t *session = data;
+
+    while (true) {
+        struct write_request *request = g_async_queue_pop(session->writes);
+        if (request == &stop_request) {
+            break;
+        }
+
+        struct transfer_file *file = request->file;
+        bool failed = request->failed;
+        uint32_t written = 0;
+        while (!failed && written < request->length) {
+            ssize_t n = pwrite(file->fd, request->buffer + written, request->length - written, request->offset + written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                fprintf(stderr, "[UDID=%s][Transfer] Write to %s failed: %s\n", session->udid, file->local, strerror(errno));
+                failed = true;
+                break;
+            }
+            written += n;
+        }
+        uint32_t length = request->length;
+        g_async_queue_push(session->buffers, request);
+
+        settle_bytes(session, file, length, failed);
+    }
+    return NULL;
+}
+
+static bool submit_job(transfer_session_t *session, enum job_kind kind, const char *source, const char *dest, transfer_done_cb_t callback, void *user_data) {
+    if (session == NULL) {
+        return false;
+    }
+
+    struct transfer_job *job = g_new0(struct transfer_job, 1);
+    job->kind = kind;
+    job->source = g_strdup(source);
+    job->dest = g_strdup(dest);
+    job->callback = callback;
+    job->user_data = user_data;
+
+    g_mutex_lock(&session->lock);
+    // A new batch after an idle period starts fresh totals
+    if (session->outstanding == 0) {
+        session->bytes_total = session->bytes_done = 0;
+        session->files_total = session->files_done = session->files_failed = 0;
+    }
+    session->outstanding++;
+    bool start = !session->engine;
+    session->engine = true;
+    g_mutex_unlock(&session->lock);
+
+    if (start) {
+        // The previous planner has retired, wait for it to finish taking its engine down
+        if (session->planner != NULL) {
+            g_thread_join(session->planner);
+        }
+        start_engine(session);
+        session->planner = g_thread_new("transfer-plan", planner_thread, session);
+    }
+    g_async_queue_push(session->jobs, job);
+    return true;
+}
+
+bool transfer_pull(transfer_session_t *session, const char *remote, const char *local_dir) {
+    return submit_job(session, JOB_PULL_TREE, remote, local_dir, NULL, NULL);
+}
+
+bool transfer_pull_file(transfer_session_t *session, const char *remote, const char *local, transfer_done_cb_t callback, void *user_data) {
+    return submit_job(session, JOB_PULL_FILE, remote, local, callback, user_data);
+}
+
+bool transfer_push(transfer_session_t *session, const char *local, const char *remote_dir) {
+    return submit_job(session, JOB_PUSH, local, remote_dir, NULL, NULL);
+}
+
+void transfer_wait_idle(transfer_session_t *session) {
+    g_mutex_lock(&session->lock);
+    while (session->outstanding > 0) {
+        g_cond_wait(&session->idle, &session->lock);
+    }
+    g_mutex_unlock(&session->lock);
+}
+
+// One device's progress, or NULL when it has nothing to show; main loop only
+static char* describe_progress(transfer_session_t *session) {
+    g_mutex_lock(&session->lock);
+    unsigned int outstanding = session->outstanding;
+    uint64_t total = session->bytes_total, done = session->bytes_done;
+    unsigned int files_total = session->files_total, files_done = session->files_done, files_failed = session->files_failed;
+    g_mutex_unlock(&session->lock);
+
+    if (files_total == 0) {
+        return NULL;
+    }
+
+    double delta = done >= session->last_done ? (double)(done - session->last_done) : 0;
+    session->rate = session->rate * 0.7 + delta * 0.3;
+    session->last_done = done;
+
+    if (outstanding > 0) {
+        return g_strdup_printf(" Transfer %.8s: %.1f / %.1f MB (%u/%u files) @ %.1f MB/s", session->udid, done / 1e6, total / 1e6,
+                               files_done + files_failed, files_total, session->rate / 1e6);
+    }
+    session->rate = 0;
+    return g_strdup_printf(" Transfer %.8s: done, %.1f MB in %u files (%u failed)", session->udid, done / 1e6, files_done, files_failed);
+}
+
+// Refreshes the progress row once a second on the GTK main loop, one line per device
+static gboolean update_progress(gpointer data) {
+    if (tray == NULL || tray->widgets == NULL || tray->widgets->transfer == NULL) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    GString *label = g_string_new(NULL);
+    pthread_mutex_lock(&active_lock);
+    if (sessions != NULL) {
+        GHashTableIter iter;
+        gpointer value;
+        g_hash_table_iter_init(&iter, sessions);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            char *line = describe_progress(value);
+            if (line != NULL) {
+                g_string_append_printf(label, "%s%s", label->len ? "\n" : "", line);
+                g_free(line);
+            }
+        }
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    if (label->len == 0) {
+        gtk_widget_hide(tray->widgets->transfer);
+    } else {
+        update_menu_item_label(GTK_MENU_ITEM(tray->widgets->transfer), label->str);
+        gtk_widget_show(tray->widgets->transfer);
+    }
+    g_string_free(label, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+static char* default_local_dir(const char *udid) {
+    const char *downloads = g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD);
+    return g_build_filename(downloads ? downloads : g_get_home_dir(), "iOS", udid, NULL);
+}
+
+// Callback function for the pull menu items, data is the remote path
+void on_menu_item_pull_clicked(GtkWidget *widget, gpointer data) {
+    pthread_mutex_lock(&active_lock);
+    if (active != NULL) {
+        char *local_dir = default_local_dir(active->udid);
+        printf("[UDID=%s][Transfer] Pulling %s to %s\n", active->udid, (const char *)data, local_dir);
+        transfer_pull(active, data, local_dir);
+        g_free(local_dir);
+    }
+    pthread_mutex_unlock(&active_lock);
+}
+
+// Callback function for the push menu item, data is the remote directory
+void on_menu_item_push_clicked(GtkWidget *widget, gpointer data) {
+    GtkWidget *dialog = gtk_file_chooser_dialog_new("Push to device", NULL, GTK_FILE_CHOOSER_ACTION_OPEN,
+                                                    "_Cancel", GTK_RESPONSE_CANCEL, "_Push", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_select_multiple(GTK_FILE_CHOOSER(dialog), TRUE);
+    if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        GSList *files = gtk_file_chooser_get_filenames(GTK_FILE_CHOOSER(dialog));
+        pthread_mutex_lock(&active_lock);
+        for (GSList *iter = files; iter != NULL && active != NULL; iter = iter->next) {
+            transfer_push(active, iter->data, data);
+        }
+        pthread_mutex_unlock(&active_lock);
+        g_slist_free_full(files, g_free);
+    }
+    gtk_widget_destroy(dialog);
+}
+
+transfer_session_t* transfer_start(idevice_t device, const char *udid) {
+    transfer_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Transfer] Failed to allocate memory for transfer session\n", udid);
+        return NULL;
+    }
+
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    g_mutex_init(&session->lock);
+    g_cond_init(&session->idle);
+    session->jobs = g_async_queue_new();
+    session->units = g_async_queue_new();
+    session->writes = g_async_queue_new();
+    session->buffers = g_async_queue_new();
+
+    pthread_mutex_lock(&active_lock);
+    active = session;
+    if (sessions == NULL) {
+        sessions = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    g_hash_table_replace(sessions, session->udid, session);
+    if (progress_source == 0) {
+        progress_source = g_timeout_add_seconds(1, update_progress, NULL);
+    }
+    pthread_mutex_unlock(&active_lock);
+    return session;
+}
+
+void transfer_stop(transfer_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&active_lock);
+    if (active == session) {
+        active = NULL;
+    }
+    if (sessions != NULL && g_hash_table_lookup(sessions, session->udid) == session) {
+        g_hash_table_remove(sessions, session->udid);
+    }
+    pthread_mutex_unlock(&active_lock);
+
+    // A running planner drains its queue and takes the engine down; a retired one only needs joining
+    g_mutex_lock(&session->lock);
+    bool running = session->engine;
+    session->engine = false;
+    g_mutex_unlock(&session->lock);
+    if (running) {
+        struct transfer_job *stop = g_new0(struct transfer_job, 1);
+        stop->kind = JOB_STOP;
+        g_async_queue_push(session->jobs, stop);
+    }
+    if (session->planner != NULL) {
+        g_thread_join(session->planner);
+    }
+    // A stop can cross an idle retirement and be left behind
+    struct transfer_job *left;
+    while ((left = g_async_queue_try_pop(session->jobs)) != NULL) {
+        g_free(left->source);
+        g_free(left->dest);
+        g_free(left);
+    }
+
+    g_async_queue_unref(session->jobs);
+    g_async_queue_unref(session->units);
+    g_async_queue_unref(session->writes);
+    g_async_queue_unref(session->buffers);
+    g_mutex_clear(&session->lock);
+    g_cond_clear(&session->idle);
+    free(session);
+}
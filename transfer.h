@@ -0,0 +1,30 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/house_arrest.h>
+
+// Opaque per-device transfer engine
+typedef struct transfer_session transfer_session_t;
+
+// Invoked from an engine thread once a file has fully landed (or failed)
+typedef void (*transfer_done_cb_t)(const char *remote, const char *local, bool ok, void *user_data);
+
+// Function prototypes
+transfer_session_t* transfer_start(idevice_t device, const char *udid);
+void transfer_stop(transfer_session_t *session);
+bool transfer_pull(transfer_session_t *session, const char *remote, const char *local_dir);
+bool transfer_pull_file(transfer_session_t *session, const char *remote, const char *local, transfer_done_cb_t callback, void *user_data);
+bool transfer_push(transfer_session_t *session, const char *local, const char *remote_dir);
+void transfer_wait_idle(transfer_session_t *session);
+bool transfer_connect(idevice_t device, const char *bundle_id, afc_client_t *afc, house_arrest_client_t *house_arrest);
+void transfer_disconnect(afc_client_t afc, house_arrest_client_t house_arrest);
+bool transfer_stat(afc_client_t afc, const char *path, uint64_t *size, uint64_t *mtime, bool *is_dir);
+void on_menu_item_pull_clicked(GtkWidget *widget, gpointer data);
+void on_menu_item_push_clicked(GtkWidget *widget, gpointer data);
+
+#endif // TRANSFER_H
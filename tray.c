@@ -1,5 +1,16 @@
 #include "tray.h"
+#include "crashwatch.h"
+#include "transfer.h"
+#include "import.h"
+#include "afcfs.h"
+#include "backup.h"
+#include "reports.h"
+#include "screenshot.h"
+#include "fleet.h"
+#include "apps.h"
+#include "watches.h"
 #include <stdlib.h>
+#include <stdbool.h>
 
 // Define the global tray variable
 Tray *tray = NULL;
@@ -21,6 +32,192 @@ void update_menu_item_label(GtkMenuItem *menu_item, const char *new_label) {
     }
 }
 
+/**
+ * Lazy submenus. Large submenus are only filled while the panel shows them:
+ * every exported item travels over dbusmenu and every change re-sends the
+ * layout. While closed, changes only mark the submenu dirty, and a submenu
+ * that stays closed for a while is emptied again.
+ *
+ * GTK says when it shows and hides the submenu. A panel talking dbusmenu
+ * only sends about-to-show, which reaches us as the item's activate, and
+ * its close never comes back as a GTK hide. So an about-to-show fills the
+ * submenu and keeps it live for a lease; after that it is frozen again
+ * and the next about-to-show refills it if anything changed.
+ */
+#define LAZY_TEARDOWN_SECONDS 30
+#define LAZY_LEASE_SECONDS 10
+
+struct lazy_submenu {
+    GtkWidget *submenu;
+    tray_fill_cb_t fill;
+    tray_clear_cb_t clear;
+    bool shown;   // Between GTK show and hide
+    bool filled;
+    bool dirty;
+    guint lease;  // Live after a dbusmenu about-to-show until this fires
+    guint teardown;
+};
+
+static bool lazy_live(const struct lazy_submenu *lazy) {
+    return lazy->shown || lazy->lease != 0;
+}
+
+static void lazy_empty(struct lazy_submenu *lazy) {
+    if (lazy->clear != NULL) {
+        lazy->clear();
+    }
+    GList *children = gtk_container_get_children(GTK_CONTAINER(lazy->submenu));
+    for (GList *iter = children; iter != NULL; iter = g_list_next(iter)) {
+        gtk_widget_destroy(GTK_WIDGET(iter->data));
+    }
+    g_list_free(children);
+    lazy->filled = false;
+}
+
+static void lazy_materialize(struct lazy_submenu *lazy) {
+    if (lazy->filled && !lazy->dirty) {
+        return;
+    }
+    if (lazy->filled) {
+        lazy_empty(lazy);
+    }
+    lazy->fill(lazy->submenu);
+    lazy->filled = true;
+    lazy->dirty = false;
+}
+
+static gboolean lazy_teardown(gpointer data) {
+    struct lazy_submenu *lazy = data;
+    lazy->teardown = 0;
+    if (!lazy_live(lazy) && lazy->filled) {
+        lazy_empty(lazy);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+static void lazy_closed(struct lazy_submenu *lazy) {
+    if (!lazy_live(lazy) && lazy->teardown == 0) {
+        lazy->teardown = g_timeout_add_seconds(LAZY_TEARDOWN_SECONDS, lazy_teardown, lazy);
+    }
+}
+
+static void lazy_open(struct lazy_submenu *lazy) {
+    if (lazy->teardown != 0) {
+        g_source_remove(lazy->teardown);
+        lazy->teardown = 0;
+    }
+    lazy_materialize(lazy);
+}
+
+static gboolean lazy_lease_expired(gpointer data) {
+    struct lazy_submenu *lazy = data;
+    lazy->lease = 0;
+    lazy_closed(lazy);
+    return G_SOURCE_REMOVE;
+}
+
+// The panel asked for the submenu (dbusmenu about-to-show), each one renews the lease
+static void on_lazy_submenu_requested(GtkWidget *widget, gpointer data) {
+    struct lazy_submenu *lazy = data;
+    if (lazy->lease != 0) {
+        g_source_remove(lazy->lease);
+    }
+    lazy->lease = g_timeout_add_seconds(LAZY_LEASE_SECONDS, lazy_lease_expired, lazy);
+    lazy_open(lazy);
+}
+
+static void on_lazy_submenu_shown(GtkWidget *widget, gpointer data) {
+    struct lazy_submenu *lazy = data;
+    lazy->shown = true;
+    lazy_open(lazy);
+}
+
+static void on_lazy_submenu_hidden(GtkWidget *widget, gpointer data) {
+    struct lazy_submenu *lazy = data;
+    lazy->shown = false;
+    lazy_closed(lazy);
+}
+
+static void free_lazy_submenu(gpointer data) {
+    struct lazy_submenu *lazy = data;
+    if (lazy->lease != 0) {
+        g_source_remove(lazy->lease);
+    }
+    if (lazy->teardown != 0) {
+        g_source_remove(lazy->teardown);
+    }
+    g_free(lazy);
+}
+
+void tray_set_lazy_submenu(GtkWidget *item, tray_fill_cb_t fill, tray_clear_cb_t clear) {
+    struct lazy_submenu *lazy = g_new0(struct lazy_submenu, 1);
+    lazy->submenu = gtk_menu_new();
+    lazy->fill = fill;
+    lazy->clear = clear;
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), lazy->submenu);
+    g_object_set_data_full(G_OBJECT(item), "lazy-submenu", lazy, free_lazy_submenu);
+    g_signal_connect(item, "activate", G_CALLBACK(on_lazy_submenu_requested), lazy);
+    g_signal_connect(lazy->submenu, "show", G_CALLBACK(on_lazy_submenu_shown), lazy);
+    g_signal_connect(lazy->submenu, "hide", G_CALLBACK(on_lazy_submenu_hidden), lazy);
+}
+
+// The model behind a lazy submenu changed: refill it while live, otherwise only remember
+void tray_invalidate_submenu(GtkWidget *item) {
+    struct lazy_submenu *lazy = item ? g_object_get_data(G_OBJECT(item), "lazy-submenu") : NULL;
+    if (lazy == NULL) {
+        return;
+    }
+    lazy->dirty = true;
+    if (lazy_live(lazy)) {
+        lazy_materialize(lazy);
+    } else if (lazy->filled && lazy->teardown == 0) {
+        lazy_empty(lazy);
+    }
+}
+
+/**
+ * Root menu opening. Panels talking dbusmenu send about-to-show for the root
+ * node before they draw it; hosts that render the GtkMenu themselves show it
+ * instead. Either one tells the owner the user is about to read the fields.
+ */
+static tray_open_cb_t open_callback = NULL;
+
+static void on_tray_menu_shown(GtkWidget *widget, gpointer data) {
+    if (open_callback != NULL) {
+        open_callback();
+    }
+}
+
+static gboolean on_tray_root_about_to_show(GObject *root, gpointer data) {
+    on_tray_menu_shown(NULL, data);
+    return FALSE;
+}
+
+void tray_set_open_callback(tray_open_cb_t callback) {
+    open_callback = callback;
+}
+
+// The dbusmenu root is rebuilt by every app_indicator_set_menu() call
+static void watch_root_menu() {
+    GObject *server = NULL;
+    GObject *root = NULL;
+    g_object_get(tray->indicator, "dbus-menu-server", &server, NULL);
+    if (server == NULL) {
+        return;
+    }
+    g_object_get(server, "root-node", &root, NULL);
+    if (root != NULL) {
+        g_signal_connect(root, "about-to-show", G_CALLBACK(on_tray_root_about_to_show), NULL);
+        g_object_unref(root);
+    }
+    g_object_unref(server);
+}
+
+// Callback function for the crash badge menu item
+static void on_menu_item_crashes_clicked(GtkWidget *widget, gpointer data) {
+    crashwatch_clear_badge();
+}
+
 // Function to update the menu
 void generate_menu() {
     g_return_if_fail(tray != NULL);
@@ -96,6 +293,152 @@ void generate_menu() {
         gtk_widget_hide(*menu_items[i].widget);
     }
 
+    /**
+     * Apps Menu Item, filled from the per-device inventory when opened
+     */
+    tray->widgets->apps = gtk_menu_item_new_with_label("apps");
+    if (tray->widgets->apps == NULL) {
+        fprintf(stderr, "Failed to create apps menu item\n");
+        return;
+    }
+    tray_set_lazy_submenu(tray->widgets->apps, apps_fill_menu, apps_clear_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->apps);
+    gtk_widget_hide(tray->widgets->apps);
+
+    /**
+     * Watches Menu Item, one nested entry per paired watch
+     */
+    tray->widgets->watches = gtk_menu_item_new_with_label("watches");
+    if (tray->widgets->watches == NULL) {
+        fprintf(stderr, "Failed to create watches menu item\n");
+        return;
+    }
+    tray_set_lazy_submenu(tray->widgets->watches, watches_fill_menu, NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->watches);
+    gtk_widget_hide(tray->widgets->watches);
+
+    /**
+     * Files Menu Item, actions for the transfer engine
+     */
+    tray->widgets->files = gtk_menu_item_new_with_label(" Files");
+    if (tray->widgets->files == NULL) {
+        fprintf(stderr, "Failed to create files menu item\n");
+        return;
+    }
+    GtkWidget *files_menu = gtk_menu_new();
+    struct {
+        const char *label;
+        GCallback callback;
+        const char *path;
+    } file_actions[] = {
+#ifdef HAVE_FUSE
+        {"Browse device…", G_CALLBACK(on_menu_item_mount_clicked), NULL},
+#endif
+        {"Import new photos", G_CALLBACK(on_menu_item_import_clicked), NULL},
+        {"Pull DCIM", G_CALLBACK(on_menu_item_pull_clicked), "/DCIM"},
+        {"Pull Downloads", G_CALLBACK(on_menu_item_pull_clicked), "/Downloads"},
+        {"Push to Downloads…", G_CALLBACK(on_menu_item_push_clicked), "/Downloads"},
+        {"Take screenshot", G_CALLBACK(on_menu_item_screenshot_clicked), NULL},
+        {"Start timelapse", G_CALLBACK(on_menu_item_timelapse_clicked), NULL},
+        {"Back up now", G_CALLBACK(on_menu_item_backup_clicked), NULL},
+        {"Open crash reports", G_CALLBACK(on_menu_item_reports_clicked), NULL}
+    };
+    for (size_t i = 0; i < sizeof(file_actions) / sizeof(file_actions[0]); ++i) {
+        GtkWidget *item = gtk_menu_item_new_with_label(file_actions[i].label);
+        g_signal_connect(item, "activate", file_actions[i].callback, (gpointer)file_actions[i].path);
+        gtk_menu_shell_append(GTK_MENU_SHELL(files_menu), item);
+        gtk_widget_show(item);
+    }
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(tray->widgets->files), files_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->files);
+    gtk_widget_hide(tray->widgets->files);
+
+    /**
+     * Transfer progress Menu Item
+     */
+    tray->widgets->transfer = gtk_menu_item_new_with_label("transfer");
+    if (tray->widgets->transfer == NULL) {
+        fprintf(stderr, "Failed to create transfer menu item\n");
+        return;
+    }
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->transfer);
+    gtk_widget_set_sensitive(tray->widgets->transfer, FALSE);
+    gtk_widget_hide(tray->widgets->transfer);
+
+    /**
+     * Backup progress Menu Item
+     */
+    tray->widgets->backup = gtk_menu_item_new_with_label("backup");
+    if (tray->widgets->backup == NULL) {
+        fprintf(stderr, "Failed to create backup menu item\n");
+        return;
+    }
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->backup);
+    gtk_widget_set_sensitive(tray->widgets->backup, FALSE);
+    gtk_widget_hide(tray->widgets->backup);
+
+    /**
+     * Fleet Menu Item, actions for every attached device
+     */
+    GtkWidget *fleet = gtk_menu_item_new_with_label(" All devices");
+    GtkWidget *fleet_menu = gtk_menu_new();
+    struct {
+        const char *label;
+        const char *action;
+    } fleet_actions[] = {
+        {"Collect diagnostics", "diagnostics"},
+        {"Take screenshots", "screenshot"},
+        {"Dump app versions", "versions"},
+        {"Reboot", "reboot"}
+    };
+    for (size_t i = 0; i < sizeof(fleet_actions) / sizeof(fleet_actions[0]); ++i) {
+        GtkWidget *item = gtk_menu_item_new_with_label(fleet_actions[i].label);
+        g_signal_connect(item, "activate", G_CALLBACK(on_menu_item_fleet_clicked), (gpointer)fleet_actions[i].action);
+        gtk_menu_shell_append(GTK_MENU_SHELL(fleet_menu), item);
+        gtk_widget_show(item);
+    }
+    gtk_menu_item_set_submenu(GTK_MENU_ITEM(fleet), fleet_menu);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), fleet);
+    gtk_widget_show(fleet);
+
+    /**
+     * Fleet progress Menu Item
+     */
+    tray->widgets->fleet = gtk_menu_item_new_with_label("fleet");
+    if (tray->widgets->fleet == NULL) {
+        fprintf(stderr, "Failed to create fleet menu item\n");
+        return;
+    }
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->fleet);
+    gtk_widget_set_sensitive(tray->widgets->fleet, FALSE);
+    gtk_widget_hide(tray->widgets->fleet);
+
+    /**
+     * Latest screenshot Menu Item, shows a thumbnail of the last capture
+     */
+    G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+    tray->widgets->screenshot = gtk_image_menu_item_new_with_label("screenshot");
+    G_GNUC_END_IGNORE_DEPRECATIONS
+    if (tray->widgets->screenshot == NULL) {
+        fprintf(stderr, "Failed to create screenshot menu item\n");
+        return;
+    }
+    g_signal_connect(tray->widgets->screenshot, "activate", G_CALLBACK(on_menu_item_last_screenshot_clicked), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->screenshot);
+    gtk_widget_hide(tray->widgets->screenshot);
+
+    /**
+     * Crash badge Menu Item
+     */
+    tray->widgets->crashes = gtk_menu_item_new_with_label("crashes");
+    if (tray->widgets->crashes == NULL) {
+        fprintf(stderr, "Failed to create crashes menu item\n");
+        return;
+    }
+    g_signal_connect(tray->widgets->crashes, "activate", G_CALLBACK(on_menu_item_crashes_clicked), NULL);
+    gtk_menu_shell_append(GTK_MENU_SHELL(tray->menu), tray->widgets->crashes);
+    gtk_widget_hide(tray->widgets->crashes);
+
     /**
      * Quit Menu Item
      */
@@ -110,6 +453,7 @@ void generate_menu() {
 
     // Set the updated menu to the app indicator
     app_indicator_set_menu(tray->indicator, tray->menu);
+    watch_root_menu();
 }
 
 void initialize_tray() {
@@ -132,6 +476,7 @@ void initialize_tray() {
         free(tray);
         exit(EXIT_FAILURE);
     }
+    g_signal_connect(tray->menu, "show", G_CALLBACK(on_tray_menu_shown), NULL);
 
     // Allocate memory for TrayWidgets
     tray->widgets = (TrayWidgets *)malloc(sizeof(TrayWidgets));
@@ -152,6 +497,14 @@ void initialize_tray() {
     tray->widgets->msisdn = NULL;
     tray->widgets->is_activated = NULL;
     tray->widgets->is_passwd = NULL;
+    tray->widgets->apps = NULL;
+    tray->widgets->watches = NULL;
+    tray->widgets->files = NULL;
+    tray->widgets->transfer = NULL;
+    tray->widgets->backup = NULL;
+    tray->widgets->screenshot = NULL;
+    tray->widgets->fleet = NULL;
+    tray->widgets->crashes = NULL;
     tray->widgets->quit = NULL;
 }
 
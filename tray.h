@@ -16,6 +16,14 @@ typedef struct {
     GtkWidget *msisdn;
     GtkWidget *is_activated;
     GtkWidget *is_passwd;
+    GtkWidget *apps;
+    GtkWidget *watches;
+    GtkWidget *files;
+    GtkWidget *transfer;
+    GtkWidget *backup;
+    GtkWidget *screenshot;
+    GtkWidget *fleet;
+    GtkWidget *crashes;
     GtkWidget *quit;
 } TrayWidgets;
 
@@ -26,11 +34,21 @@ typedef struct {
     TrayWidgets *widgets;    // Pointer to TrayWidgets
 } Tray;
 
+// Fills a lazily built submenu on the GTK main loop, and forgets its items when it is torn down
+typedef void (*tray_fill_cb_t)(GtkWidget *submenu);
+typedef void (*tray_clear_cb_t)(void);
+
+// Runs on the GTK main loop each time the panel opens the root menu
+typedef void (*tray_open_cb_t)(void);
+
 // Declare the global tray variable as extern
 extern Tray *tray;
 
 // Function prototypes
 void update_menu_item_label(GtkMenuItem *menu_item, const char *new_label);
+void tray_set_lazy_submenu(GtkWidget *item, tray_fill_cb_t fill, tray_clear_cb_t clear);
+void tray_invalidate_submenu(GtkWidget *item);
+void tray_set_open_callback(tray_open_cb_t callback);
 void initialize_tray();
 void free_tray();
 void generate_menu();
@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <libimobiledevice/companion_proxy.h>
+#include <plist/plist.h>
+
+#include "watches.h"
+#include "budget.h"
+#include "tray.h" // To show watches under the phone
+
+#define WATCH_REFRESH_INTERVAL_US (60 * G_USEC_PER_SEC) // Battery drifts slowly, piggybacks on the phone loop
+
+// Messages for the watches thread
+#define WATCHES_MSG_CHANGED GINT_TO_POINTER(1)
+#define WATCHES_MSG_REFRESH GINT_TO_POINTER(2)
+#define WATCHES_MSG_STOP GINT_TO_POINTER(3)
+
+struct watch {
+    char *udid;
+    char *name;
+    char *product;
+    char *version;
+    int64_t battery; // -1 when unknown
+    bool charging;
+};
+
+struct watches_session {
+    char udid[64];
+    idevice_t device;
+    GThread *thread;
+    GAsyncQueue *queue;
+    gint64 last_refresh; // Phone loop only
+};
+
+// Snapshot of one phone's watches handed to the main loop
+struct watches_update {
+    char udid[64];
+    GPtrArray *watches; // NULL once the phone went away
+};
+
+// Main loop only: phone UDID -> sorted snapshot of its watches, the submenu is built from these
+static GHashTable *shown = NULL;
+
+static void free_watch(gpointer data) {
+    struct watch *watch = data;
+    g_free(watch->udid);
+    g_free(watch->name);
+    g_free(watch->product);
+    g_free(watch->version);
+    g_free(watch);
+}
+
+static struct watch* copy_watch(const struct watch *watch) {
+    struct watch *copy = g_new0(struct watch, 1);
+    copy->udid = g_strdup(watch->udid);
+    copy->name = g_strdup(watch->name);
+    copy->product = g_strdup(watch->product);
+    copy->version = g_strdup(watch->version);
+    copy->battery = watch->battery;
+    copy->charging = watch->charging;
+    return copy;
+}
+
+static gint compare_watch_names(gconstpointer a, gconstpointer b) {
+    const struct watch *x = *(struct watch *const *)a;
+    const struct watch *y = *(struct watch *const *)b;
+    return g_strcmp0(x->name ? x->name : x->udid, y->name ? y->name : y->udid);
+}
+
+static void append_info_item(GtkWidget *menu, const char *label) {
+    GtkWidget *item = gtk_menu_item_new_with_label(label);
+    gtk_widget_set_sensitive(item, FALSE);
+    gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+    gtk_widget_show(item);
+}
+
+static void append_phone_watches(GtkWidget *submenu, GPtrArray *watches) {
+    for (guint i = 0; i < watches->len; ++i) {
+        struct watch *watch = g_ptr_array_index(watches, i);
+        char *battery = watch->battery >= 0 ? g_strdup_printf("%lld%%%s", (long long)watch->battery, watch->charging ? " charging" : "")
+                                            : g_strdup("unknown");
+        char *label = g_strdup_printf("%s (%s)", watch->name ? watch->name : watch->udid, battery);
+        GtkWidget *item = gtk_menu_item_new_with_label(label);
+        GtkWidget *details = gtk_menu_new();
+
+        char *line = g_strdup_printf(" Battery: %s", battery);
+        append_info_item(details, line);
+        g_free(line);
+        line = g_strdup_printf(" watchOS: %s", watch->version ? watch->version : "unknown");
+        append_info_item(details, line);
+        g_free(line);
+        line = g_strdup_printf(" Model: %s", watch->product ? watch->product : "unknown");
+        append_info_item(details, line);
+        g_free(line);
+        line = g_strdup_printf(" UDID: %s", watch->udid);
+        append_info_item(details, line);
+        g_free(line);
+
+        gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), details);
+        gtk_menu_shell_append(GTK_MENU_SHELL(submenu), item);
+        gtk_widget_show(item);
+        g_free(label);
+        g_free(battery);
+    }
+}
+
+// Builds the Watches submenu from the latest snapshots, only while it is shown; one nested entry per phone once several have watches
+void watches_fill_menu(GtkWidget *submenu) {
+    if (shown == NULL) {
+        return;
+    }
+    GList *phones = g_list_sort(g_hash_table_get_keys(shown), (GCompareFunc)g_strcmp0);
+    bool nested = phones != NULL && phones->next != NULL;
+    for (GList *iter = phones; iter != NULL; iter = g_list_next(iter)) {
+        GPtrArray *watches = g_hash_table_lookup(shown, iter->data);
+        if (!nested) {
+            append_phone_watches(submenu, watches);
+            continue;
+        }
+        char *label = g_strdup_printf("📱 %.8s", (const char *)iter->data);
+        GtkWidget *item = gtk_menu_item_new_with_label(label);
+        GtkWidget *menu = gtk_menu_new();
+        append_phone_watches(menu, watches);
+        gtk_menu_item_set_submenu(GTK_MENU_ITEM(item), menu);
+        gtk_menu_shell_append(GTK_MENU_SHELL(submenu), item);
+        gtk_widget_show(item);
+        g_free(label);
+    }
+    g_list_free(phones);
+}
+
+// Takes over a phone's snapshot on the GTK main loop; the submenu itself is only rebuilt if open
+static gboolean publish_watches(gpointer data) {
+    struct watches_update *update = data;
+    if (tray == NULL || tray->widgets == NULL || tray->widgets->watches == NULL) {
+        if (update->watches != NULL) {
+            g_ptr_array_unref(update->watches);
+        }
+        g_free(update);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (shown == NULL) {
+        shown = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_ptr_array_unref);
+    }
+    if (update->watches != NULL && update->watches->len > 0) {
+        g_ptr_array_sort(update->watches, compare_watch_names);
+        g_hash_table_replace(shown, g_strdup(update->udid), update->watches);
+    } else {
+        // Phones without watches stay out of the submenu
+        g_hash_table_remove(shown, update->udid);
+        if (update->watches != NULL) {
+            g_ptr_array_unref(update->watches);
+        }
+    }
+    g_free(update);
+
+    unsigned int count = 0;
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, shown);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        count += ((GPtrArray *)value)->len;
+    }
+    char *label = g_strdup_printf(" Watches (%u)", count);
+    update_menu_item_label(GTK_MENU_ITEM(tray->widgets->watches), label);
+    g_free(label);
+    if (count > 0) {
+        gtk_widget_show(tray->widgets->watches);
+    } else {
+        gtk_widget_hide(tray->widgets->watches);
+    }
+    tray_invalidate_submenu(tray->widgets->watches);
+    return G_SOURCE_REMOVE;
+}
+
+static void publish(watches_session_t *session, GHashTable *watches) {
+    struct watches_update *update = g_new0(struct watches_update, 1);
+    g_strlcpy(update->udid, session->udid, sizeof(update->udid));
+    update->watches = g_ptr_array_new_with_free_func(free_watch);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, watches);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(update->watches, copy_watch(value));
+    }
+    g_idle_add(publish_watches, update);
+}
+
+static char* registry_string(companion_proxy_client_t client, const char *watch, const char *key) {
+    plist_t value = NULL;
+    char *result = NULL;
+    if (companion_proxy_get_value_from_registry(client, watch, key, &value) == COMPANION_PROXY_E_SUCCESS && value != NULL) {
+        if (plist_get_node_type(value) == PLIST_STRING) {
+            result = g_strdup(plist_get_string_ptr(value, NULL));
+        }
+        plist_free(value);
+    }
+    return result;
+}
+
+static void read_battery(companion_proxy_client_t client, struct watch *watch) {
+    plist_t value = NULL;
+    watch->battery = -1;
+    if (companion_proxy_get_value_from_registry(client, watch->udid, "BatteryCurrentCapacity", &value) == COMPANION_PROXY_E_SUCCESS && value != NULL) {
+        uint64_t capacity = 0;
+        if (plist_get_node_type(value) == PLIST_UINT) {
+            plist_get_uint_val(value, &capacity);
+            watch->battery = (int64_t)capacity;
+        }
+        plist_free(value);
+    }
+    value = NULL;
+    if (companion_proxy_get_value_from_registry(client, watch->udid, "BatteryIsCharging", &value) == COMPANION_PROXY_E_SUCCESS && value != NULL) {
+        uint8_t charging = 0;
+        if (plist_get_node_type(value) == PLIST_BOOLEAN) {
+            plist_get_bool_val(value, &charging);
+        }
+        watch->charging = charging;
+        plist_free(value);
+    }
+}
+
+// Brings the watch table in line with the registry, only new watches are queried in full
+static bool sync_registry(watches_session_t *session, companion_proxy_client_t client, GHashTable *watches) {
+    plist_t registry = NULL;
+    companion_proxy_error_t err = companion_proxy_get_device_registry(client, &registry);
+    if (err == COMPANION_PROXY_E_NO_DEVICES) {
+        bool changed = g_hash_table_size(watches) > 0;
+        g_hash_table_remove_all(watches);
+        return changed;
+    }
+    if (err != COMPANION_PROXY_E_SUCCESS || registry == NULL || plist_get_node_type(registry) != PLIST_ARRAY) {
+        fprintf(stderr, "[UDID=%s][Watches] Failed to read the companion registry\n", session->udid);
+        if (registry) plist_free(registry);
+        return false;
+    }
+
+    bool changed = false;
+    GHashTable *present = g_hash_table_new(g_str_hash, g_str_equal);
+    for (uint32_t i = 0; i < plist_array_get_size(registry); ++i) {
+        plist_t node = plist_array_get_item(registry, i);
+        const char *udid = plist_get_node_type(node) == PLIST_STRING ? plist_get_string_ptr(node, NULL) : NULL;
+        if (udid == NULL) {
+            continue;
+        }
+        g_hash_table_add(present, (gpointer)udid);
+        if (g_hash_table_contains(watches, udid)) {
+            continue;
+        }
+
+        struct watch *watch = g_new0(struct watch, 1);
+        watch->udid = g_strdup(udid);
+        watch->name = registry_string(client, udid, "DeviceName");
+        watch->product = registry_string(client, udid, "ProductType");
+        watch->version = registry_string(client, udid, "ProductVersion");
+        read_battery(client, watch);
+        g_hash_table_replace(watches, watch->udid, watch);
+        printf("[UDID=%s][Watches] Paired watch %s (%s)\n", session->udid, watch->name ? watch->name : udid, udid);
+        changed = true;
+    }
+
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, watches);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(present, key)) {
+            printf("[UDID=%s][Watches] Watch %s went away\n", session->udid, (const char *)key);
+            g_hash_table_iter_remove(&iter);
+            changed = true;
+        }
+    }
+    g_hash_table_destroy(present);
+    plist_free(registry);
+    return changed;
+}
+
+// Runs on the listener's own thread for every add/remove event
+static void on_device_event(plist_t event, void *user_data) {
+    watches_session_t *session = user_data;
+    g_async_queue_push(session->queue, WATCHES_MSG_CHANGED);
+}
+
+/**
+ * Watches thread: one client answers registry queries, a second one only
+ * listens for add/remove events. Nothing here polls; battery refreshes ride
+ * on the phone's own monitoring loop through watches_refresh().
+ */
+static gpointer watches_thread(gpointer data) {
+    watches_session_t *session = data;
+    companion_proxy_client_t client = NULL;
+    companion_proxy_client_t listener = NULL;
+    GHashTable *watches = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_watch);
+
+    if (companion_proxy_client_start_service(session->device, &client, "iosindicator") != COMPANION_PROXY_E_SUCCESS) {
+        // Phones that never had a watch paired may not run the service at all
+        printf("[UDID=%s][Watches] Companion proxy not available\n", session->udid);
+        client = NULL;
+    } else {
+        sync_registry(session, client, watches);
+        publish(session, watches);
+        if (companion_proxy_client_start_service(session->device, &listener, "iosindicator") != COMPANION_PROXY_E_SUCCESS
+            || companion_proxy_start_listening_for_devices(listener, on_device_event, session) != COMPANION_PROXY_E_SUCCESS) {
+            fprintf(stderr, "[UDID=%s][Watches] Failed to listen for watch events\n", session->udid);
+        }
+    }
+
+    while (true) {
+        gpointer msg = g_async_queue_pop(session->queue);
+        // Coalesce bursts, pairing usually posts several events
+        bool stop = msg == WATCHES_MSG_STOP;
+        bool changed = msg == WATCHES_MSG_CHANGED;
+        gpointer next;
+        while (!stop && (next = g_async_queue_try_pop(session->queue)) != NULL) {
+            stop = next == WATCHES_MSG_STOP;
+            changed = changed || next == WATCHES_MSG_CHANGED;
+        }
+        if (stop) {
+            break;
+        }
+        if (client == NULL) {
+            continue;
+        }
+
+        if (changed) {
+            if (sync_registry(session, client, watches)) {
+                publish(session, watches);
+            }
+        } else if (g_hash_table_size(watches) > 0) {
+            GHashTableIter iter;
+            gpointer value;
+            g_hash_table_iter_init(&iter, watches);
+            while (g_hash_table_iter_next(&iter, NULL, &value)) {
+                budget_acquire(session->udid);
+                gint64 started = g_get_monotonic_time();
+                read_battery(client, value);
+                budget_complete(session->udid, 0, g_get_monotonic_time() - started);
+            }
+            publish(session, watches);
+        }
+    }
+
+    if (listener != NULL) {
+        companion_proxy_stop_listening_for_devices(listener);
+        companion_proxy_client_free(listener);
+    }
+    if (client != NULL) {
+        companion_proxy_client_free(client);
+    }
+    g_hash_table_destroy(watches);
+    return NULL;
+}
+
+// Called from the phone's monitoring loop, refreshes battery at most once a minute
+void watches_refresh(watches_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    if (now - session->last_refresh >= WATCH_REFRESH_INTERVAL_US) {
+        session->last_refresh = now;
+        g_async_queue_push(session->queue, WATCHES_MSG_REFRESH);
+    }
+}
+
+watches_session_t* watches_start(idevice_t device, const char *udid) {
+    watches_session_t *session = calloc(1, sizeof(*session));
+    if (session == NULL) {
+        fprintf(stderr, "[UDID=%s][Watches] Failed to allocate memory for watches session\n", udid);
+        return NULL;
+    }
+    strncpy(session->udid, udid, sizeof(session->udid) - 1);
+    session->device = device;
+    session->queue = g_async_queue_new();
+    session->last_refresh = g_get_monotonic_time();
+    session->thread = g_thread_new("watches", watches_thread, session);
+    return session;
+}
+
+void watches_stop(watches_session_t *session) {
+    if (session == NULL) {
+        return;
+    }
+    g_async_queue_push(session->queue, WATCHES_MSG_STOP);
+    g_thread_join(session->thread);
+
+    // The phone's watches leave the submenu with it
+    struct watches_update *update = g_new0(struct watches_update, 1);
+    g_strlcpy(update->udid, session->udid, sizeof(update->udid));
+    g_idle_add(publish_watches, update);
+
+    g_async_queue_unref(session->queue);
+    free(session);
+}
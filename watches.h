@@ -0,0 +1,16 @@
+#ifndef WATCHES_H
+#define WATCHES_H
+
+#include <gtk/gtk.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+// Opaque per-phone paired watch tracker
+typedef struct watches_session watches_session_t;
+
+// Function prototypes
+watches_session_t* watches_start(idevice_t device, const char *udid);
+void watches_refresh(watches_session_t *session);
+void watches_stop(watches_session_t *session);
+void watches_fill_menu(GtkWidget *submenu);
+
+#endif // WATCHES_H